@@ -0,0 +1,118 @@
+#include <sodium.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define OTRV4_ALLOC_PRIVATE
+
+#include "alloc.h"
+
+/* Every allocation is aligned to this, which is enough for any type */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(otrv4_arena_chunk_t))
+
+tstatic void *default_alloc(size_t size, void *ctx) {
+  (void)ctx;
+  return malloc(size);
+}
+
+tstatic void default_dealloc(void *ptr, void *ctx) {
+  (void)ctx;
+  free(ptr);
+}
+
+static otrv4_allocator_t allocator = {default_alloc, default_dealloc, NULL};
+
+API void otrv4_allocator_set(const otrv4_allocator_t *new_allocator) {
+  if (!new_allocator) {
+    allocator.alloc = default_alloc;
+    allocator.dealloc = default_dealloc;
+    allocator.ctx = NULL;
+    return;
+  }
+
+  allocator = *new_allocator;
+}
+
+INTERNAL void *otrv4_alloc(size_t size) {
+  return allocator.alloc(size, allocator.ctx);
+}
+
+INTERNAL void otrv4_dealloc(void *ptr) {
+  if (ptr)
+    allocator.dealloc(ptr, allocator.ctx);
+}
+
+tstatic otrv4_arena_chunk_t *arena_chunk_new(size_t size) {
+  if (size < OTRV4_ARENA_CHUNK_SIZE)
+    size = OTRV4_ARENA_CHUNK_SIZE;
+
+  otrv4_arena_chunk_t *chunk = otrv4_alloc(ARENA_HEADER + size);
+  if (!chunk)
+    return NULL;
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+tstatic void arena_chunks_free(otrv4_arena_chunk_t *chunk) {
+  while (chunk) {
+    otrv4_arena_chunk_t *next = chunk->next;
+    sodium_memzero((uint8_t *)chunk + ARENA_HEADER, chunk->used);
+    otrv4_dealloc(chunk);
+    chunk = next;
+  }
+}
+
+INTERNAL void otrv4_arena_init(otrv4_arena_t *arena) {
+  arena->chunks = NULL;
+  arena->used = 0;
+}
+
+INTERNAL void *otrv4_arena_alloc(otrv4_arena_t *arena, size_t size) {
+  otrv4_arena_chunk_t *chunk = arena->chunks;
+
+  size = ARENA_ROUND(size ? size : 1);
+
+  if (!chunk || chunk->size - chunk->used < size) {
+    chunk = arena_chunk_new(size);
+    if (!chunk)
+      return NULL;
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  void *ptr = (uint8_t *)chunk + ARENA_HEADER + chunk->used;
+  chunk->used += size;
+  arena->used += size;
+
+  return ptr;
+}
+
+INTERNAL void otrv4_arena_reset(otrv4_arena_t *arena) {
+  otrv4_arena_chunk_t *chunk = arena->chunks;
+
+  if (!chunk)
+    return;
+
+  if (!chunk->next) {
+    sodium_memzero((uint8_t *)chunk + ARENA_HEADER, chunk->used);
+    chunk->used = 0;
+    arena->used = 0;
+    return;
+  }
+
+  arena_chunks_free(chunk);
+  arena->chunks = arena_chunk_new(arena->used);
+  arena->used = 0;
+}
+
+INTERNAL void otrv4_arena_destroy(otrv4_arena_t *arena) {
+  arena_chunks_free(arena->chunks);
+  arena->chunks = NULL;
+  arena->used = 0;
+}
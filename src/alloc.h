@@ -0,0 +1,58 @@
+#ifndef OTRV4_ALLOC_H
+#define OTRV4_ALLOC_H
+
+#include <stddef.h>
+
+#include "include/libotrv4.h"
+#include "shared.h"
+
+/*
+ * Scratch memory for the objects that only live while a call on a
+ * connection is processed (the TLVs of a received message, for example).
+ * Allocation bumps a pointer and nothing is freed individually: a reset wipes
+ * everything that was used and makes it available again.
+ */
+typedef struct otrv4_arena_chunk_s {
+  struct otrv4_arena_chunk_s *next;
+  size_t size;
+  size_t used;
+} otrv4_arena_chunk_t;
+
+typedef struct {
+  otrv4_arena_chunk_t *chunks; /* The one in use comes first */
+  size_t used;                 /* Bytes allocated since the last reset */
+} otrv4_arena_t;
+
+/* Smallest chunk an arena asks the allocator for */
+#define OTRV4_ARENA_CHUNK_SIZE 4096
+
+INTERNAL void *otrv4_alloc(size_t size);
+
+INTERNAL void otrv4_dealloc(void *ptr);
+
+INTERNAL void otrv4_arena_init(otrv4_arena_t *arena);
+
+INTERNAL void *otrv4_arena_alloc(otrv4_arena_t *arena, size_t size);
+
+/*
+ * Wipes the memory allocated since the last reset. If it took more than one
+ * chunk, they are replaced by a single one big enough for all of it, so that
+ * a steady workload stops reaching the allocator.
+ */
+INTERNAL void otrv4_arena_reset(otrv4_arena_t *arena);
+
+INTERNAL void otrv4_arena_destroy(otrv4_arena_t *arena);
+
+#ifdef OTRV4_ALLOC_PRIVATE
+
+tstatic void *default_alloc(size_t size, void *ctx);
+
+tstatic void default_dealloc(void *ptr, void *ctx);
+
+tstatic otrv4_arena_chunk_t *arena_chunk_new(size_t size);
+
+tstatic void arena_chunks_free(otrv4_arena_chunk_t *chunk);
+
+#endif
+
+#endif
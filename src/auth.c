@@ -1,14 +1,18 @@
+#include <sodium.h>
+#include <string.h>
+
 #define OTRV4_AUTH_PRIVATE
 
 #include "auth.h"
 #include "constants.h"
 #include "random.h"
 #include "shake.h"
+#include "stats.h"
 
 INTERNAL void otrv4_generate_keypair(snizkpk_pubkey_t pub,
                                      snizkpk_privkey_t priv) {
   ed448_random_scalar(priv);
-  decaf_448_point_scalarmul(pub, decaf_448_point_base, priv);
+  decaf_448_precomputed_scalarmul(pub, decaf_448_precomputed_base, priv);
 }
 
 INTERNAL void otrv4_snizkpk_keypair_generate(snizkpk_keypair_t *pair) {
@@ -32,33 +36,51 @@ const unsigned char prime_order_bytes_dup[ED448_SCALAR_BYTES] = {
     0x23, 0x78, 0xc2, 0x92, 0xab, 0x58, 0x44, 0xf3,
 };
 
-INTERNAL void
-otrv4_snizkpk_authenticate(snizkpk_proof_t *dst, const snizkpk_keypair_t *pair1,
-                           const snizkpk_pubkey_t A2, const snizkpk_pubkey_t A3,
-                           const unsigned char *msg, size_t msglen) {
+INTERNAL void otrv4_snizkpk_nonces_generate(snizkpk_nonces_t *dst) {
+  snizkpk_pubkey_t T1;
+  OTRV4_STATS_TIMER_START(start);
+
+  otrv4_generate_keypair(T1, dst->t1);
+  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(dst->T1, T1);
+  otrv4_ec_point_destroy(T1);
+
+  otrv4_generate_keypair(dst->Gr2, dst->r2);
+  ed448_random_scalar(dst->c2);
+
+  otrv4_generate_keypair(dst->Gr3, dst->r3);
+  ed448_random_scalar(dst->c3);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_SNIZKPK);
+}
+
+INTERNAL void otrv4_snizkpk_nonces_destroy(snizkpk_nonces_t *nonces) {
+  sodium_memzero(nonces, sizeof(snizkpk_nonces_t));
+}
+
+INTERNAL void otrv4_snizkpk_authenticate_with_nonces(
+    snizkpk_proof_t *dst, snizkpk_nonces_t *nonces,
+    const snizkpk_keypair_t *pair1, const snizkpk_pubkey_t A2,
+    const snizkpk_pubkey_t A3, const unsigned char *msg, size_t msglen) {
 
   decaf_shake256_ctx_t hd;
   uint8_t hash[HASH_BYTES];
   unsigned char point_buff[ED448_POINT_BYTES];
 
-  snizkpk_privkey_t t1;
-  snizkpk_pubkey_t T1, T2, T3, A2c2, A3c3;
+  snizkpk_pubkey_t T2, T3;
+  OTRV4_STATS_TIMER_START(start);
 
-  otrv4_generate_keypair(T1, t1);
+  /* Ti = G*ri + Ai*ci, where G*ri is already known */
+  decaf_448_point_scalarmul(T2, A2, nonces->c2);
+  decaf_448_point_add(T2, T2, nonces->Gr2);
 
-  otrv4_generate_keypair(T2, dst->r2);
-  ed448_random_scalar(dst->c2);
-  decaf_448_point_scalarmul(A2c2, A2, dst->c2);
-  decaf_448_point_add(T2, T2, A2c2);
+  decaf_448_point_scalarmul(T3, A3, nonces->c3);
+  decaf_448_point_add(T3, T3, nonces->Gr3);
 
-  otrv4_generate_keypair(T3, dst->r3);
-  ed448_random_scalar(dst->c3);
-  decaf_448_point_scalarmul(A3c3, A3, dst->c3);
-  decaf_448_point_add(T3, T3, A3c3);
+  otrv4_ec_scalar_copy(dst->r2, nonces->r2);
+  otrv4_ec_scalar_copy(dst->c2, nonces->c2);
+  otrv4_ec_scalar_copy(dst->r3, nonces->r3);
+  otrv4_ec_scalar_copy(dst->c3, nonces->c3);
 
-  hash_init_with_dom(hd);
-  hash_update(hd, base_point_bytes_dup, ED448_POINT_BYTES);
-  hash_update(hd, prime_order_bytes_dup, ED448_SCALAR_BYTES);
+  snizkpk_hash_prefix(hd);
 
   decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, pair1->pub);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
@@ -69,8 +91,7 @@ otrv4_snizkpk_authenticate(snizkpk_proof_t *dst, const snizkpk_keypair_t *pair1,
   decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, A3);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
 
-  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, T1);
-  hash_update(hd, point_buff, ED448_POINT_BYTES);
+  hash_update(hd, nonces->T1, ED448_POINT_BYTES);
 
   decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, T2);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
@@ -90,38 +111,50 @@ otrv4_snizkpk_authenticate(snizkpk_proof_t *dst, const snizkpk_keypair_t *pair1,
   decaf_448_scalar_sub(dst->c1, dst->c1, dst->c3);
 
   decaf_448_scalar_mul(c1a1, dst->c1, pair1->priv);
-  decaf_448_scalar_sub(dst->r1, t1, c1a1);
+  decaf_448_scalar_sub(dst->r1, nonces->t1, c1a1);
+
+  otrv4_ec_scalar_destroy(c1a1);
+  otrv4_snizkpk_nonces_destroy(nonces);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_SNIZKPK);
 }
 
-INTERNAL otrv4_bool_t otrv4_snizkpk_verify(const snizkpk_proof_t *src,
-                                           const snizkpk_pubkey_t A1,
-                                           const snizkpk_pubkey_t A2,
-                                           const snizkpk_pubkey_t A3,
-                                           const unsigned char *msg,
-                                           size_t msglen) {
+INTERNAL void
+otrv4_snizkpk_authenticate(snizkpk_proof_t *dst, const snizkpk_keypair_t *pair1,
+                           const snizkpk_pubkey_t A2, const snizkpk_pubkey_t A3,
+                           const unsigned char *msg, size_t msglen) {
+  snizkpk_nonces_t nonces[1];
 
-  decaf_shake256_ctx_t hd;
-  uint8_t hash[HASH_BYTES];
-  unsigned char point_buff[ED448_POINT_BYTES];
+  otrv4_snizkpk_nonces_generate(nonces);
+  otrv4_snizkpk_authenticate_with_nonces(dst, nonces, pair1, A2, A3, msg,
+                                         msglen);
+}
 
+/* Absorbs the parts of the challenge that are the same for every proof */
+tstatic void snizkpk_hash_prefix(decaf_shake256_ctx_t hd) {
   hash_init_with_dom(hd);
-
-  snizkpk_pubkey_t gr1, gr2, gr3, A1c1, A2c2, A3c3;
-
-  decaf_448_point_scalarmul(gr1, decaf_448_point_base, src->r1);
-  decaf_448_point_scalarmul(gr2, decaf_448_point_base, src->r2);
-  decaf_448_point_scalarmul(gr3, decaf_448_point_base, src->r3);
-
-  decaf_448_point_scalarmul(A1c1, A1, src->c1);
-  decaf_448_point_scalarmul(A2c2, A2, src->c2);
-  decaf_448_point_scalarmul(A3c3, A3, src->c3);
-
-  decaf_448_point_add(A1c1, A1c1, gr1);
-  decaf_448_point_add(A2c2, A2c2, gr2);
-  decaf_448_point_add(A3c3, A3c3, gr3);
-
   hash_update(hd, base_point_bytes_dup, ED448_POINT_BYTES);
   hash_update(hd, prime_order_bytes_dup, ED448_SCALAR_BYTES);
+}
+
+/* Verifies the proof, continuing from the prefix. The points are public, so
+ * G*ri + Ai*ci is computed in variable time, with a single double scalar
+ * multiplication that uses the precomputed table for G. */
+tstatic otrv4_bool_t snizkpk_verify_from(decaf_shake256_ctx_t hd,
+                                         const snizkpk_proof_t *src,
+                                         const snizkpk_pubkey_t A1,
+                                         const snizkpk_pubkey_t A2,
+                                         const snizkpk_pubkey_t A3,
+                                         const unsigned char *msg,
+                                         size_t msglen) {
+  uint8_t hash[HASH_BYTES];
+  unsigned char point_buff[ED448_POINT_BYTES];
+  snizkpk_pubkey_t T1, T2, T3;
+  otrv4_bool_t valid = otrv4_false;
+  OTRV4_STATS_TIMER_START(start);
+
+  decaf_448_base_double_scalarmul_non_secret(T1, src->r1, A1, src->c1);
+  decaf_448_base_double_scalarmul_non_secret(T2, src->r2, A2, src->c2);
+  decaf_448_base_double_scalarmul_non_secret(T3, src->r3, A3, src->c3);
 
   decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, A1);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
@@ -132,13 +165,13 @@ INTERNAL otrv4_bool_t otrv4_snizkpk_verify(const snizkpk_proof_t *src,
   decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, A3);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
 
-  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, A1c1);
+  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, T1);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
 
-  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, A2c2);
+  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, T2);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
 
-  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, A3c3);
+  decaf_448_point_mul_by_cofactor_and_encode_like_eddsa(point_buff, T3);
   hash_update(hd, point_buff, ED448_POINT_BYTES);
 
   hash_update(hd, msg, msglen);
@@ -153,9 +186,50 @@ INTERNAL otrv4_bool_t otrv4_snizkpk_verify(const snizkpk_proof_t *src,
   decaf_448_scalar_add(c1c2c3, c1c2c3, src->c3);
 
   if (DECAF_TRUE == decaf_448_scalar_eq(c, c1c2c3))
-    return otrv4_true;
+    valid = otrv4_true;
+
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_SNIZKPK);
+  return valid;
+}
+
+INTERNAL otrv4_bool_t otrv4_snizkpk_verify(const snizkpk_proof_t *src,
+                                           const snizkpk_pubkey_t A1,
+                                           const snizkpk_pubkey_t A2,
+                                           const snizkpk_pubkey_t A3,
+                                           const unsigned char *msg,
+                                           size_t msglen) {
+  decaf_shake256_ctx_t hd;
+
+  snizkpk_hash_prefix(hd);
+  return snizkpk_verify_from(hd, src, A1, A2, A3, msg, msglen);
+}
+
+INTERNAL otrv4_bool_t
+otrv4_snizkpk_verify_batch(otrv4_bool_t *results,
+                           const snizkpk_verification_t *items, size_t count) {
+  decaf_shake256_ctx_t prefix, hd;
+  otrv4_bool_t all = otrv4_true;
+  size_t i;
+
+  snizkpk_hash_prefix(prefix);
+
+  for (i = 0; i < count; i++) {
+    const snizkpk_verification_t *item = &items[i];
+
+    memcpy(hd, prefix, sizeof(decaf_shake256_ctx_t));
+    otrv4_bool_t valid = snizkpk_verify_from(hd, item->proof, item->A1,
+                                             item->A2, item->A3, item->msg,
+                                             item->msglen);
+    if (results)
+      results[i] = valid;
+
+    if (valid == otrv4_false)
+      all = otrv4_false;
+  }
+
+  hash_destroy(prefix);
 
-  return otrv4_false;
+  return all;
 }
 
 INTERNAL void otrv4_snizkpk_proof_destroy(snizkpk_proof_t *src) {
@@ -1,6 +1,7 @@
 #ifndef OTRV4_AUTH_H
 #define OTRV4_AUTH_H
 
+#include <decaf/shake.h>
 #include <stddef.h>
 
 #include "ed448.h"
@@ -22,8 +23,30 @@ typedef struct {
   ec_scalar_t r3;
 } snizkpk_proof_t;
 
+/* The parts of a proof that do not depend on the keys of the ring, so they
+ * can be computed ahead of time: t1 with T1 = G*t1 (already encoded), and
+ * the simulated r2, c2, r3 and c3 with G*r2 and G*r3. They must never be
+ * used for more than one proof. */
+typedef struct {
+  snizkpk_privkey_t t1;
+  uint8_t T1[ED448_POINT_BYTES];
+  snizkpk_privkey_t r2, c2, r3, c3;
+  snizkpk_pubkey_t Gr2, Gr3;
+} snizkpk_nonces_t;
+
 INTERNAL void otrv4_snizkpk_keypair_generate(snizkpk_keypair_t *pair);
 
+INTERNAL void otrv4_snizkpk_nonces_generate(snizkpk_nonces_t *dst);
+
+INTERNAL void otrv4_snizkpk_nonces_destroy(snizkpk_nonces_t *nonces);
+
+/* Like otrv4_snizkpk_authenticate(), using (and destroying) nonces computed
+ * beforehand. */
+INTERNAL void otrv4_snizkpk_authenticate_with_nonces(
+    snizkpk_proof_t *dst, snizkpk_nonces_t *nonces,
+    const snizkpk_keypair_t *pair1, const snizkpk_pubkey_t A2,
+    const snizkpk_pubkey_t A3, const unsigned char *msg, size_t msglen);
+
 INTERNAL void
 otrv4_snizkpk_authenticate(snizkpk_proof_t *dst, const snizkpk_keypair_t *pair1,
                            const snizkpk_pubkey_t A2, const snizkpk_pubkey_t A3,
@@ -36,12 +59,38 @@ INTERNAL otrv4_bool_t otrv4_snizkpk_verify(const snizkpk_proof_t *src,
                                            const unsigned char *msg,
                                            size_t msglen);
 
+typedef struct {
+  const snizkpk_proof_t *proof;
+  snizkpk_pubkey_t A1;
+  snizkpk_pubkey_t A2;
+  snizkpk_pubkey_t A3;
+  const unsigned char *msg;
+  size_t msglen;
+} snizkpk_verification_t;
+
+/* Verifies count proofs and, if results is not NULL, sets results[i] for
+ * items[i]. Returns otrv4_true if every proof is valid. */
+INTERNAL otrv4_bool_t
+otrv4_snizkpk_verify_batch(otrv4_bool_t *results,
+                           const snizkpk_verification_t *items, size_t count);
+
 INTERNAL void otrv4_generate_keypair(snizkpk_pubkey_t pub,
                                      snizkpk_privkey_t priv);
 
 INTERNAL void otrv4_snizkpk_proof_destroy(snizkpk_proof_t *src);
 
 #ifdef OTRV4_AUTH_PRIVATE
+
+tstatic void snizkpk_hash_prefix(decaf_shake256_ctx_t hd);
+
+tstatic otrv4_bool_t snizkpk_verify_from(decaf_shake256_ctx_t hd,
+                                         const snizkpk_proof_t *src,
+                                         const snizkpk_pubkey_t A1,
+                                         const snizkpk_pubkey_t A2,
+                                         const snizkpk_pubkey_t A3,
+                                         const unsigned char *msg,
+                                         size_t msglen);
+
 #endif
 
 #endif
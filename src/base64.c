@@ -0,0 +1,208 @@
+#include <string.h>
+
+#include "base64.h"
+
+static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* The value of each character of the alphabet, 0x80 for the others */
+static const uint8_t decode_table[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,
+    0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,
+    0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80,
+};
+
+/* The whole group is read before anything is written, for in place use */
+static inline void encode_group(char *dst, const uint8_t *src) {
+  uint32_t group = src[0] << 16 | src[1] << 8 | src[2];
+
+  dst[0] = alphabet[(group >> 18) & 0x3f];
+  dst[1] = alphabet[(group >> 12) & 0x3f];
+  dst[2] = alphabet[(group >> 6) & 0x3f];
+  dst[3] = alphabet[group & 0x3f];
+}
+
+INTERNAL void otrv4_base64_encoder_init(otrv4_base64_encoder_t *encoder) {
+  encoder->pending_len = 0;
+}
+
+INTERNAL size_t otrv4_base64_encode_update(char *dst,
+                                           otrv4_base64_encoder_t *encoder,
+                                           const uint8_t *src, size_t len) {
+  char *out = dst;
+
+  /* Completes the group kept from the last call */
+  while (encoder->pending_len && len) {
+    encoder->pending[encoder->pending_len++] = *src++;
+    len--;
+
+    if (encoder->pending_len == 3) {
+      encode_group(out, encoder->pending);
+      out += 4;
+      encoder->pending_len = 0;
+    }
+  }
+
+  for (; len >= 3; src += 3, len -= 3, out += 4)
+    encode_group(out, src);
+
+  memcpy(encoder->pending + encoder->pending_len, src, len);
+  encoder->pending_len += len;
+
+  return out - dst;
+}
+
+INTERNAL size_t otrv4_base64_encode_final(char *dst,
+                                          otrv4_base64_encoder_t *encoder) {
+  const uint8_t *pending = encoder->pending;
+
+  if (!encoder->pending_len)
+    return 0;
+
+  uint32_t group =
+      pending[0] << 16 | (encoder->pending_len > 1 ? pending[1] << 8 : 0);
+  dst[0] = alphabet[(group >> 18) & 0x3f];
+  dst[1] = alphabet[(group >> 12) & 0x3f];
+  dst[2] = encoder->pending_len > 1 ? alphabet[(group >> 6) & 0x3f] : '=';
+  dst[3] = '=';
+
+  encoder->pending_len = 0;
+  return 4;
+}
+
+INTERNAL size_t otrv4_base64_encode(char *dst, const uint8_t *src,
+                                    size_t len) {
+  otrv4_base64_encoder_t encoder[1];
+  size_t written;
+
+  otrv4_base64_encoder_init(encoder);
+  written = otrv4_base64_encode_update(dst, encoder, src, len);
+  written += otrv4_base64_encode_final(dst + written, encoder);
+
+  return written;
+}
+
+INTERNAL size_t otrv4_otr_encode(char *dst, const uint8_t *src, size_t len) {
+  char *out = dst;
+
+  /* src starts after the header, even when it is at the end of dst */
+  memcpy(out, "?OTR:", 5);
+  out += 5;
+  out += otrv4_base64_encode(out, src, len);
+  *out++ = '.';
+  *out = '\0';
+
+  return out - dst;
+}
+
+INTERNAL void otrv4_base64_decoder_init(otrv4_base64_decoder_t *decoder) {
+  decoder->bits = 0;
+  decoder->bits_len = 0;
+  decoder->padding = 0;
+}
+
+INTERNAL otrv4_err_t otrv4_base64_decode_update(uint8_t *dst, size_t *written,
+                                                otrv4_base64_decoder_t *decoder,
+                                                const char *src, size_t len) {
+  const uint8_t *in = (const uint8_t *)src;
+  uint8_t *out = dst;
+  size_t i = 0;
+
+  *written = 0;
+
+  while (i < len) {
+    /* Whole groups are decoded at once while nothing is kept. A group with
+     * any character outside of the alphabet is left to the loop below. */
+    if (decoder->bits_len == 0 && decoder->padding == 0) {
+      for (; i + 4 <= len; i += 4, out += 3) {
+        uint32_t a = decode_table[in[i]];
+        uint32_t b = decode_table[in[i + 1]];
+        uint32_t c = decode_table[in[i + 2]];
+        uint32_t d = decode_table[in[i + 3]];
+        if ((a | b | c | d) & 0x80)
+          break;
+
+        uint32_t group = a << 18 | b << 12 | c << 6 | d;
+        out[0] = group >> 16;
+        out[1] = group >> 8;
+        out[2] = group;
+      }
+
+      if (i == len)
+        break;
+    }
+
+    /* Nothing may follow the padding */
+    if (decoder->padding && decoder->bits_len == 0)
+      return ERROR;
+
+    uint8_t c = in[i++];
+    uint32_t sextet = 0;
+    if (c == '=') {
+      /* Only the last two characters of a group may be padding */
+      if (decoder->bits_len < 2)
+        return ERROR;
+
+      decoder->padding++;
+    } else {
+      sextet = decode_table[c];
+      if ((sextet & 0x80) || decoder->padding)
+        return ERROR;
+    }
+
+    decoder->bits = decoder->bits << 6 | sextet;
+    if (++decoder->bits_len < 4)
+      continue;
+
+    out[0] = decoder->bits >> 16;
+    if (decoder->padding < 2)
+      out[1] = decoder->bits >> 8;
+    if (decoder->padding < 1)
+      out[2] = decoder->bits;
+
+    out += 3 - decoder->padding;
+    decoder->bits = 0;
+    decoder->bits_len = 0;
+  }
+
+  *written = out - dst;
+  return SUCCESS;
+}
+
+INTERNAL otrv4_err_t
+otrv4_base64_decode_final(const otrv4_base64_decoder_t *decoder) {
+  if (decoder->bits_len)
+    return ERROR;
+
+  return SUCCESS;
+}
+
+INTERNAL otrv4_err_t otrv4_base64_decode(uint8_t *dst, size_t *written,
+                                         const char *src, size_t len) {
+  otrv4_base64_decoder_t decoder[1];
+
+  otrv4_base64_decoder_init(decoder);
+  if (otrv4_base64_decode_update(dst, written, decoder, src, len))
+    return ERROR;
+
+  return otrv4_base64_decode_final(decoder);
+}
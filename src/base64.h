@@ -0,0 +1,86 @@
+#ifndef OTRV4_BASE64_H
+#define OTRV4_BASE64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "shared.h"
+
+/*
+ * Base64 (RFC 4648, with padding) that writes into buffers given by the
+ * caller. The encoder and the decoder may be fed in chunks of any size: they
+ * keep the bytes of an incomplete group until the next call.
+ */
+
+/* Output of encoding len bytes */
+#define OTRV4_BASE64_ENCODE_LEN(len) (((len) + 2) / 3 * 4)
+
+/* Upper bound for the output of decoding len characters */
+#define OTRV4_BASE64_DECODE_LEN(len) (((len) + 3) / 4 * 3)
+
+/* "?OTR:" + base64 + "." + NUL */
+#define OTRV4_OTR_ENCODED_LEN(len) (5 + OTRV4_BASE64_ENCODE_LEN(len) + 2)
+
+typedef struct {
+  uint8_t pending[3];
+  size_t pending_len;
+} otrv4_base64_encoder_t;
+
+typedef struct {
+  uint32_t bits;   /* Sextets of the incomplete group */
+  size_t bits_len; /* How many */
+  size_t padding;  /* '=' read in the current or the last group */
+} otrv4_base64_decoder_t;
+
+INTERNAL void otrv4_base64_encoder_init(otrv4_base64_encoder_t *encoder);
+
+/*
+ * Encodes len bytes of src, after the ones kept from previous calls, and
+ * keeps what does not complete a group. dst must have room for
+ * OTRV4_BASE64_ENCODE_LEN(len + 2). Returns the number of characters written.
+ */
+INTERNAL size_t otrv4_base64_encode_update(char *dst,
+                                           otrv4_base64_encoder_t *encoder,
+                                           const uint8_t *src, size_t len);
+
+/* Writes the last group, padded, if any. dst must have room for 4 characters.
+ * Returns the number of characters written. */
+INTERNAL size_t otrv4_base64_encode_final(char *dst,
+                                          otrv4_base64_encoder_t *encoder);
+
+/*
+ * Encodes len bytes of src into dst, which has room for
+ * OTRV4_BASE64_ENCODE_LEN(len). src may be the last len bytes of dst: every
+ * 3 bytes read produce 4 characters, so the output never reaches what has
+ * not been read yet. Returns the number of characters written.
+ */
+INTERNAL size_t otrv4_base64_encode(char *dst, const uint8_t *src, size_t len);
+
+/* Encodes len bytes of src as a NUL terminated OTR message into dst, which
+ * has room for OTRV4_OTR_ENCODED_LEN(len). As above, src may be the last len
+ * bytes of dst. Returns the length of the message. */
+INTERNAL size_t otrv4_otr_encode(char *dst, const uint8_t *src, size_t len);
+
+INTERNAL void otrv4_base64_decoder_init(otrv4_base64_decoder_t *decoder);
+
+/*
+ * Decodes len characters of src, after the ones kept from previous calls,
+ * into dst, which must have room for OTRV4_BASE64_DECODE_LEN(len + 3). The
+ * number of bytes written is stored in written. Characters outside of the
+ * alphabet, and anything after the padding, are an error.
+ */
+INTERNAL otrv4_err_t otrv4_base64_decode_update(uint8_t *dst, size_t *written,
+                                                otrv4_base64_decoder_t *decoder,
+                                                const char *src, size_t len);
+
+/* Fails if the input read ended in the middle of a group */
+INTERNAL otrv4_err_t
+otrv4_base64_decode_final(const otrv4_base64_decoder_t *decoder);
+
+/* Decodes the len characters of src into dst, which has room for
+ * OTRV4_BASE64_DECODE_LEN(len) */
+INTERNAL otrv4_err_t otrv4_base64_decode(uint8_t *dst, size_t *written,
+                                         const char *src, size_t len);
+
+#endif
@@ -1,4 +1,7 @@
 #include <libotr/privkey.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
 
 #define OTRV4_CLIENT_PRIVATE
@@ -7,8 +10,6 @@
 #include "serialize.h"
 #include "str.h"
 
-#define CONV(c) ((otrv4_conversation_t *)c)
-
 tstatic otrv4_conversation_t *new_conversation_with(const char *recipient,
                                                     otrv4_t *conn) {
   otrv4_conversation_t *conv = malloc(sizeof(otrv4_conversation_t));
@@ -19,6 +20,7 @@ tstatic otrv4_conversation_t *new_conversation_with(const char *recipient,
 
   conv->recipient = otrv4_strdup(recipient);
   conv->conn = conn;
+  conv->refs = 1;
 
   return conv;
 }
@@ -36,13 +38,19 @@ tstatic void conversation_free(void *data) {
   conv = NULL;
 }
 
+tstatic void conversation_release(otrv4_conversation_t *conv) {
+  if (__atomic_sub_fetch(&conv->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    conversation_free(conv);
+}
+
 API otrv4_client_t *otrv4_client_new(otrv4_client_state_t *state) {
   otrv4_client_t *client = malloc(sizeof(otrv4_client_t));
   if (!client)
     return NULL;
 
   client->state = state;
-  client->conversations = NULL;
+  otrv4_sharded_table_init(client->conversations, otrv4_hash_string,
+                           otrv4_hash_string_eq);
 
   return client;
 }
@@ -53,8 +61,7 @@ API void otrv4_client_free(otrv4_client_t *client) {
 
   client->state = NULL;
 
-  otrv4_list_free(client->conversations, conversation_free);
-  client->conversations = NULL;
+  otrv4_sharded_table_destroy(client->conversations, conversation_free);
 
   free(client);
   client = NULL;
@@ -63,17 +70,16 @@ API void otrv4_client_free(otrv4_client_t *client) {
 // TODO: There may be multiple conversations with the same recipient if they
 // uses multiple instance tags. We are not allowing this yet.
 tstatic otrv4_conversation_t *
-get_conversation_with(const char *recipient, list_element_t *conversations) {
-  const list_element_t *el = NULL;
-  otrv4_conversation_t *conv = NULL;
+get_conversation_with(const char *recipient,
+                      otrv4_sharded_table_t *conversations) {
+  hashtable_shard_t *shard =
+      otrv4_sharded_table_shard(conversations, recipient);
 
-  for (el = conversations; el; el = el->next) {
-    conv = CONV(el->data);
-    if (!strcmp(conv->recipient, recipient))
-      return conv;
-  }
+  pthread_mutex_lock(&shard->lock);
+  otrv4_conversation_t *conv = otrv4_hashtable_get(shard->table, recipient);
+  pthread_mutex_unlock(&shard->lock);
 
-  return NULL;
+  return conv;
 }
 
 tstatic otrv4_policy_t get_policy_for(const char *recipient) {
@@ -143,23 +149,67 @@ tstatic otrv4_t *create_connection_for(const char *recipient,
 }
 
 tstatic otrv4_conversation_t *
-get_or_create_conversation_with(const char *recipient, otrv4_client_t *client) {
-  otrv4_conversation_t *conv = NULL;
-  otrv4_t *conn = NULL;
+create_conversation_with(const char *recipient, otrv4_client_t *client) {
+  otrv4_t *conn = create_connection_for(recipient, client);
+  if (!conn)
+    return NULL;
 
-  conv = get_conversation_with(recipient, client->conversations);
+  return new_conversation_with(recipient, conn);
+}
+
+/*
+ * Creating the connection takes the lock of the client state, so it is done
+ * without holding the shard lock. If another thread added a conversation with
+ * the same recipient meanwhile, that one is kept and ours is dropped.
+ */
+tstatic otrv4_conversation_t *
+get_or_create_conversation_with(const char *recipient, otrv4_client_t *client) {
+  otrv4_conversation_t *conv =
+      get_conversation_with(recipient, client->conversations);
   if (conv)
     return conv;
 
-  conn = create_connection_for(recipient, client);
-  if (!conn)
+  otrv4_conversation_t *created = create_conversation_with(recipient, client);
+  if (!created)
     return NULL;
 
-  conv = new_conversation_with(recipient, conn);
-  if (!conv)
+  hashtable_shard_t *shard =
+      otrv4_sharded_table_shard(client->conversations, recipient);
+
+  pthread_mutex_lock(&shard->lock);
+  conv = otrv4_hashtable_get(shard->table, recipient);
+  if (!conv &&
+      !otrv4_hashtable_put(shard->table, created->recipient, created)) {
+    conv = created;
+    created = NULL;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (created)
+    conversation_free(created);
+
+  return conv;
+}
+
+/*
+ * As get_or_create_conversation_with(), but the conversation is referenced
+ * while the shard is locked, so it is not freed until conversation_release()
+ * even if it is disconnected meanwhile. Returns NULL if it was disconnected
+ * before.
+ */
+tstatic otrv4_conversation_t *hold_conversation_with(const char *recipient,
+                                                     otrv4_client_t *client) {
+  if (!get_or_create_conversation_with(recipient, client))
     return NULL;
 
-  client->conversations = otrv4_list_add(conv, client->conversations);
+  hashtable_shard_t *shard =
+      otrv4_sharded_table_shard(client->conversations, recipient);
+
+  pthread_mutex_lock(&shard->lock);
+  otrv4_conversation_t *conv = otrv4_hashtable_get(shard->table, recipient);
+  if (conv)
+    __atomic_add_fetch(&conv->refs, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&shard->lock);
 
   return conv;
 }
@@ -182,8 +232,10 @@ tstatic int send_message(char **newmsg, const char *message,
   if (!conv)
     return 1;
 
+  pthread_mutex_lock(&conv->conn->lock);
   otrv4_err_t error =
       otrv4_prepare_to_send_message(newmsg, message, &tlv, 0, conv->conn);
+  pthread_mutex_unlock(&conv->conn->lock);
   otrv4_tlv_free(tlv);
 
   if (error == STATE_NOT_ENCRYPTED)
@@ -199,6 +251,45 @@ API int otrv4_client_send(char **newmessage, const char *message,
   return send_message(newmessage, message, recipient, client);
 }
 
+API int otrv4_client_send_batch(char ***newmessages, size_t *sent,
+                                const char **messages, size_t count,
+                                const char *recipient, otrv4_client_t *client) {
+  otrv4_conversation_t *conv = NULL;
+  otrv4_err_t error = ERROR;
+
+  if (!newmessages || !sent)
+    return 1;
+
+  *newmessages = NULL;
+  *sent = 0;
+  if (!count)
+    return 0;
+
+  conv = get_or_create_conversation_with(recipient, client);
+  if (!conv)
+    return 1;
+
+  pthread_mutex_lock(&conv->conn->lock);
+  size_t len = otrv4_prepare_to_send_messages_len(messages, count, conv->conn);
+  char **to_send = malloc(count * sizeof(char *) + len);
+  if (to_send)
+    error = otrv4_prepare_to_send_messages_into(
+        (char *)(to_send + count), len, to_send, sent, messages, count, 0,
+        conv->conn);
+  pthread_mutex_unlock(&conv->conn->lock);
+
+  /* Messages that were written must be sent, even if the rest failed */
+  if (*sent)
+    *newmessages = to_send;
+  else
+    free(to_send);
+
+  if (error)
+    return error == STATE_NOT_ENCRYPTED ? CLIENT_ERROR_NOT_ENCRYPTED : 1;
+
+  return 0;
+}
+
 API int otrv4_client_send_fragment(otrv4_message_to_send_t **newmessage,
                                    const char *message, int mms,
                                    const char *recipient,
@@ -261,43 +352,39 @@ tstatic int unfragment(char **unfragmented, const char *received,
   return err != SUCCESS || ctx->status == FRAGMENT_INCOMPLETE;
 }
 
-API int otrv4_client_receive(char **newmessage, char **todisplay,
-                             const char *message, const char *recipient,
-                             otrv4_client_t *client) {
+tstatic int receive_message(char **newmessage, char **todisplay,
+                            const char *message, otrv4_conversation_t *conv) {
   otrv4_err_t error = ERROR;
   char *unfrag_msg = NULL;
   int should_ignore = 1;
   otrv4_response_t *response = NULL;
-  otrv4_conversation_t *conv = NULL;
-
-  if (!newmessage)
-    return error;
-
-  *newmessage = NULL;
-
-  conv = get_or_create_conversation_with(recipient, client);
-  if (!conv)
-    return should_ignore;
+  const tlv_t *tlvs = NULL; /* Not used by the client */
 
   if (unfragment(&unfrag_msg, message, conv->conn->frag_ctx,
                  conv->conn->our_instance_tag))
     return should_ignore;
 
   response = otrv4_response_new();
-  error = otrv4_receive_message(response, unfrag_msg, conv->conn);
-  if (error == MSG_NOT_VALID)
-    return CLIENT_ERROR_MSG_NOT_VALID;
-
+  error = otrv4_receive_message_borrowing_tlvs(response, &tlvs, unfrag_msg,
+                                               conv->conn);
   free(unfrag_msg);
   unfrag_msg = NULL;
 
-  if (response->to_send)
-    *newmessage = otrv4_strdup(response->to_send);
+  if (error == MSG_NOT_VALID) {
+    otrv4_response_free(response);
+    return CLIENT_ERROR_MSG_NOT_VALID;
+  }
+
+  /* The strings are handed over, rather than copied */
+  if (response->to_send) {
+    *newmessage = response->to_send;
+    response->to_send = NULL;
+  }
 
   *todisplay = NULL;
   if (response->to_display) {
-    char *plain = otrv4_strdup(response->to_display);
-    *todisplay = plain;
+    *todisplay = response->to_display;
+    response->to_display = NULL;
     otrv4_response_free(response);
     return !should_ignore;
   }
@@ -311,6 +398,139 @@ API int otrv4_client_receive(char **newmessage, char **todisplay,
   return should_ignore;
 }
 
+API int otrv4_client_receive(char **newmessage, char **todisplay,
+                             const char *message, const char *recipient,
+                             otrv4_client_t *client) {
+  otrv4_conversation_t *conv = NULL;
+  int should_ignore = 1;
+
+  if (!newmessage)
+    return ERROR;
+
+  *newmessage = NULL;
+
+  conv = get_or_create_conversation_with(recipient, client);
+  if (!conv)
+    return should_ignore;
+
+  pthread_mutex_lock(&conv->conn->lock);
+  int ret = receive_message(newmessage, todisplay, message, conv);
+  pthread_mutex_unlock(&conv->conn->lock);
+
+  return ret;
+}
+
+/* Keeps the arrival order of the messages for each conversation */
+tstatic int batch_item_cmp(const void *a, const void *b) {
+  const batch_item_t *x = a, *y = b;
+
+  if (x->conv != y->conv)
+    return (uintptr_t)x->conv < (uintptr_t)y->conv ? -1 : 1;
+
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+tstatic void receive_group(receive_batch_t *batch, size_t group) {
+  const batch_item_t *item = batch->items + batch->groups[group];
+  const batch_item_t *end = batch->items + batch->groups[group + 1];
+  otrv4_conversation_t *conv = item->conv;
+
+  pthread_mutex_lock(&conv->conn->lock);
+  for (; item < end; item++) {
+    otrv4_client_received_t *result = &batch->results[item->index];
+    result->ignore =
+        receive_message(&result->to_send, &result->to_display,
+                        batch->messages[item->index].message, conv);
+  }
+  pthread_mutex_unlock(&conv->conn->lock);
+}
+
+tstatic void receive_batch_worker(void *data) {
+  receive_batch_t *batch = data;
+
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    size_t group = batch->next_group++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (group >= batch->num_groups)
+      return;
+
+    receive_group(batch, group);
+  }
+}
+
+API int otrv4_client_receive_batch(otrv4_client_received_t *results,
+                                   const otrv4_client_inbound_t *messages,
+                                   size_t count, unsigned int workers,
+                                   otrv4_client_t *client) {
+  receive_batch_t batch[1];
+  otrv4_workers_job_t job[1] = {{receive_batch_worker, batch}};
+  otrv4_conversation_t *conv = NULL;
+  size_t i, n = 0;
+
+  if (!results || (count && !messages))
+    return 1;
+
+  batch->items = malloc((count + 1) * sizeof(batch_item_t));
+  batch->groups = malloc((count + 1) * sizeof(size_t));
+  if (!batch->items || !batch->groups) {
+    free(batch->items);
+    free(batch->groups);
+    return 1;
+  }
+
+  for (i = 0; i < count; i++) {
+    results[i].to_send = NULL;
+    results[i].to_display = NULL;
+    results[i].ignore = 1;
+
+    if (!messages[i].message || !messages[i].recipient)
+      continue;
+
+    /* Bursts usually come from the same recipient. Each item holds its own
+     * reference, so the one of the previous item can be taken again. */
+    if (conv && !strcmp(conv->recipient, messages[i].recipient))
+      __atomic_add_fetch(&conv->refs, 1, __ATOMIC_RELAXED);
+    else
+      conv = hold_conversation_with(messages[i].recipient, client);
+
+    if (!conv)
+      continue;
+
+    batch->items[n].conv = conv;
+    batch->items[n].index = i;
+    n++;
+  }
+
+  qsort(batch->items, n, sizeof(batch_item_t), batch_item_cmp);
+
+  batch->num_groups = 0;
+  for (i = 0; i < n; i++)
+    if (i == 0 || batch->items[i].conv != batch->items[i - 1].conv)
+      batch->groups[batch->num_groups++] = i;
+  batch->groups[batch->num_groups] = n;
+
+  batch->messages = messages;
+  batch->results = results;
+  batch->next_group = 0;
+  pthread_mutex_init(&batch->lock, NULL);
+
+  if (workers > batch->num_groups)
+    workers = batch->num_groups;
+
+  otrv4_workers_run(job, workers);
+
+  for (i = 0; i < n; i++)
+    conversation_release(batch->items[i].conv);
+
+  pthread_mutex_destroy(&batch->lock);
+  free(batch->items);
+  free(batch->groups);
+
+  return 0;
+}
+
 API char *otrv4_client_query_message(const char *recipient, const char *message,
                                      otrv4_client_t *client,
                                      OtrlPolicy policy) {
@@ -324,20 +544,18 @@ API char *otrv4_client_query_message(const char *recipient, const char *message,
   // TODO: add name
   ret = "Failed to start an Off-the-Record private conversation.";
 
+  pthread_mutex_lock(&conv->conn->lock);
   conv->conn->supported_versions = policy;
   // TODO: implement policy
-  if (otrv4_build_query_message(&ret, message, conv->conn))
-    return ret;
+  otrv4_build_query_message(&ret, message, conv->conn);
+  pthread_mutex_unlock(&conv->conn->lock);
 
   return ret;
 }
 
 tstatic void destroy_client_conversation(const otrv4_conversation_t *conv,
                                          otrv4_client_t *client) {
-  list_element_t *elem = otrv4_list_get_by_value(conv, client->conversations);
-  client->conversations =
-      otrv4_list_remove_element(elem, client->conversations);
-  otrv4_list_free_nodes(elem);
+  otrv4_sharded_table_remove(client->conversations, conv->recipient);
 }
 
 API int otrv4_client_disconnect(char **newmsg, const char *recipient,
@@ -348,11 +566,16 @@ API int otrv4_client_disconnect(char **newmsg, const char *recipient,
   if (!conv)
     return 1;
 
-  if (otrv4_close(newmsg, conv->conn))
+  pthread_mutex_lock(&conv->conn->lock);
+  otrv4_err_t err = otrv4_close(newmsg, conv->conn);
+  pthread_mutex_unlock(&conv->conn->lock);
+
+  if (err)
     return 2;
 
+  /* A batch may still be receiving for it */
   destroy_client_conversation(conv, client);
-  conversation_free(conv);
+  conversation_release(conv);
 
   return 0;
 }
@@ -391,6 +614,17 @@ API int otrv4_client_get_our_fingerprint(otrv4_fingerprint_t fp,
   return otrv4_serialize_fingerprint(fp, client->state->keypair->pub);
 }
 
+API int otrv4_client_precompute_auth(otrv4_client_t *client) {
+  return otrv4_client_state_precompute_auth(client->state);
+}
+
+API int otrv4_client_refresh_profile(otrv4_client_t *client) {
+  if (otrv4_client_state_refresh_user_profile(client->state))
+    return -1;
+
+  return 0;
+}
+
 // TODO: Read privkeys, fingerprints, instance tags for OTRv3
 /*
  *To read stored private keys:
@@ -8,9 +8,12 @@
 #include <libotr/context.h>
 
 #include "client_state.h"
+#include "hashtable.h"
+#include "include/libotrv4.h"
 #include "list.h"
 #include "otrv4.h"
 #include "shared.h"
+#include "workers.h"
 
 // TODO: REMOVE
 typedef struct {
@@ -21,13 +24,24 @@ typedef struct {
 
   char *recipient;
   otrv4_t *conn;
+
+  /* The table of the client holds one, and each batch receiving for it
+   * another. The conversation is freed when the last one is released. */
+  int refs;
 } otrv4_conversation_t;
 
-/* A client handle messages from/to a sender to/from multiple recipients. */
-typedef struct {
+/*
+ * A client handle messages from/to a sender to/from multiple recipients.
+ *
+ * Messages for different recipients can be sent and received from different
+ * threads at the same time. Calls for the same recipient wait for each other.
+ * A conversation must not be disconnected while another thread uses it,
+ * except by otrv4_client_receive_batch(), which holds a reference to it.
+ */
+struct otrv4_client_t {
   otrv4_client_state_t *state;
-  list_element_t *conversations;
-} otrv4_client_t;
+  otrv4_sharded_table_t conversations[1]; /* by recipient */
+};
 
 API otrv4_client_t *otrv4_client_new(otrv4_client_state_t *);
 
@@ -81,6 +95,37 @@ API int otrv4_client_get_our_fingerprint(otrv4_fingerprint_t fp,
 /* tstatic int otr3_instag_generate(otrv4_client_t *client, FILE *privf); */
 
 #ifdef OTRV4_CLIENT_PRIVATE
+
+typedef struct {
+  otrv4_conversation_t *conv;
+  size_t index; /* in the messages of the batch */
+} batch_item_t;
+
+typedef struct {
+  const otrv4_client_inbound_t *messages;
+  otrv4_client_received_t *results;
+
+  /* Sorted by conversation. Group i is items[groups[i]] to
+   * items[groups[i + 1]] */
+  batch_item_t *items;
+  size_t *groups;
+  size_t num_groups;
+
+  size_t next_group;
+  pthread_mutex_t lock;
+} receive_batch_t;
+
+tstatic otrv4_conversation_t *hold_conversation_with(const char *recipient,
+                                                     otrv4_client_t *client);
+
+tstatic void conversation_release(otrv4_conversation_t *conv);
+
+tstatic int batch_item_cmp(const void *a, const void *b);
+
+tstatic void receive_group(receive_batch_t *batch, size_t group);
+
+tstatic void receive_batch_worker(void *data);
+
 #endif
 
 #endif
@@ -1,5 +1,7 @@
 #include <libotr/privkey.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #define OTRV4_CLIENT_STATE_PRIVATE
 
@@ -26,15 +28,46 @@ INTERNAL otrv4_client_state_t *otrv4_client_state_new(void *client_id) {
   state->protocol_name = NULL;
   state->account_name = NULL;
   state->callbacks = NULL;
+  state->tracer = NULL;
   state->userstate = NULL;
   state->keypair = NULL;
   state->shared_prekey_pair = NULL;
   state->phi = NULL;
   state->heartbeat = set_heartbeat(300);
+  state->auth_nonces_len = 0;
+  state->profile = NULL;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&state->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  memset(state->stats, 0, sizeof(otrv4_stats_t));
 
   return state;
 }
 
+API otrv4_err_t otrv4_client_state_stats(otrv4_stats_t *dst,
+                                         const otrv4_client_state_t *state) {
+#ifdef OTRV4_STATS
+  otrv4_stats_snapshot(dst, state->stats);
+  return SUCCESS;
+#else
+  (void)state;
+  memset(dst, 0, sizeof(otrv4_stats_t));
+  return ERROR;
+#endif
+}
+
+INTERNAL void otrv4_client_state_lock(otrv4_client_state_t *state) {
+  pthread_mutex_lock(&state->lock);
+}
+
+INTERNAL void otrv4_client_state_unlock(otrv4_client_state_t *state) {
+  pthread_mutex_unlock(&state->lock);
+}
+
 INTERNAL void otrv4_client_state_free(otrv4_client_state_t *state) {
   state->client_id = NULL;
   state->userstate = NULL;
@@ -60,10 +93,140 @@ INTERNAL void otrv4_client_state_free(otrv4_client_state_t *state) {
   free(state->heartbeat);
   state->heartbeat = NULL;
 
+  for (int i = 0; i < state->auth_nonces_len; i++)
+    otrv4_snizkpk_nonces_destroy(&state->auth_nonces[i]);
+  state->auth_nonces_len = 0;
+
+  otrv4_user_profile_unref(state->profile);
+  state->profile = NULL;
+
+  pthread_mutex_destroy(&state->lock);
+
   free(state);
   state = NULL;
 }
 
+tstatic otrv4_bool_t profile_expiring(const user_profile_t *profile) {
+  if (difftime(profile->expires, time(NULL)) > OTRV4_PROFILE_REFRESH_SECONDS)
+    return otrv4_false;
+
+  return otrv4_true;
+}
+
+INTERNAL user_profile_t *
+otrv4_client_state_get_user_profile(otrv4_client_state_t *state,
+                                    const string_t versions) {
+  user_profile_t *profile = NULL;
+
+  otrv4_client_state_lock(state);
+  do {
+    if (!state->keypair || !state->shared_prekey_pair)
+      continue;
+
+    if (state->profile && strcmp(state->profile->versions, versions) != 0) {
+      profile = otrv4_user_profile_build(versions, state->keypair,
+                                         state->shared_prekey_pair);
+      continue;
+    }
+
+    if (!state->profile || profile_expiring(state->profile) == otrv4_true) {
+      profile = otrv4_user_profile_build(versions, state->keypair,
+                                         state->shared_prekey_pair);
+      if (!profile)
+        continue;
+
+      otrv4_user_profile_unref(state->profile);
+      state->profile = profile;
+    }
+
+    profile = otrv4_user_profile_ref(state->profile);
+  } while (0);
+  otrv4_client_state_unlock(state);
+
+  return profile;
+}
+
+INTERNAL otrv4_err_t
+otrv4_client_state_refresh_user_profile(otrv4_client_state_t *state) {
+  otrv4_err_t err = SUCCESS;
+
+  otrv4_client_state_lock(state);
+  /* Nothing to refresh until a connection asks for it */
+  if (state->profile && profile_expiring(state->profile) == otrv4_true) {
+    user_profile_t *profile = otrv4_user_profile_build(
+        state->profile->versions, state->keypair, state->shared_prekey_pair);
+    if (profile) {
+      otrv4_user_profile_unref(state->profile);
+      state->profile = profile;
+    } else {
+      err = ERROR;
+    }
+  }
+  otrv4_client_state_unlock(state);
+
+  return err;
+}
+
+INTERNAL otrv4_bool_t
+otrv4_client_state_user_profile_outdated(otrv4_client_state_t *state,
+                                         const user_profile_t *profile) {
+  otrv4_bool_t outdated = profile_expiring(profile);
+
+  otrv4_client_state_lock(state);
+  /* A profile with other versions is not replaced by ours */
+  if (state->profile && state->profile != profile &&
+      strcmp(state->profile->versions, profile->versions) == 0)
+    outdated = otrv4_true;
+  otrv4_client_state_unlock(state);
+
+  return outdated;
+}
+
+INTERNAL int otrv4_client_state_precompute_auth(otrv4_client_state_t *state) {
+  snizkpk_nonces_t nonces[1];
+  int computed = 0;
+
+  /* The lock is not held while computing, so DAKEs can go on meanwhile */
+  while (1) {
+    otrv4_client_state_lock(state);
+    int full = state->auth_nonces_len == OTRV4_AUTH_NONCES;
+    otrv4_client_state_unlock(state);
+
+    if (full)
+      break;
+
+    otrv4_snizkpk_nonces_generate(nonces);
+    computed++;
+
+    otrv4_client_state_lock(state);
+    if (state->auth_nonces_len < OTRV4_AUTH_NONCES)
+      memcpy(&state->auth_nonces[state->auth_nonces_len++], nonces,
+             sizeof(snizkpk_nonces_t));
+    otrv4_client_state_unlock(state);
+
+    otrv4_snizkpk_nonces_destroy(nonces);
+  }
+
+  return computed;
+}
+
+INTERNAL void
+otrv4_client_state_take_auth_nonces(otrv4_client_state_t *state,
+                                    snizkpk_nonces_t *dst) {
+  snizkpk_nonces_t *ready = NULL;
+
+  otrv4_client_state_lock(state);
+  if (state->auth_nonces_len > 0) {
+    ready = &state->auth_nonces[--state->auth_nonces_len];
+    memcpy(dst, ready, sizeof(snizkpk_nonces_t));
+    otrv4_snizkpk_nonces_destroy(ready);
+  }
+  otrv4_client_state_unlock(state);
+
+  if (!ready)
+    otrv4_snizkpk_nonces_generate(dst);
+}
+
 // TODO: There's no API that allows us to simply write all private keys to the
 // file.
 // We might want to extract otrl_privkey_generate_finish_FILEp into 2 functions.
@@ -78,10 +241,14 @@ otrv4_client_state_get_private_key_v4(otrv4_client_state_t *state) {
   if (!state)
     return NULL;
 
+  otrv4_client_state_lock(state);
   if (!state->keypair && state->callbacks && state->callbacks->create_privkey)
     state->callbacks->create_privkey(state->client_id);
 
-  return state->keypair;
+  otrv4_keypair_t *keypair = state->keypair;
+  otrv4_client_state_unlock(state);
+
+  return keypair;
 }
 
 INTERNAL int
@@ -90,15 +257,20 @@ otrv4_client_state_add_private_key_v4(otrv4_client_state_t *state,
   if (!state)
     return 1;
 
-  if (state->keypair)
-    return 0;
-
-  state->keypair = otrv4_keypair_new();
-  if (!state->keypair)
-    return 2;
+  int err = 0;
+  otrv4_client_state_lock(state);
+  if (!state->keypair) {
+    otrv4_keypair_t *keypair = otrv4_keypair_new();
+    if (keypair) {
+      otrv4_keypair_generate(keypair, sym);
+      state->keypair = keypair;
+    } else {
+      err = 2;
+    }
+  }
+  otrv4_client_state_unlock(state);
 
-  otrv4_keypair_generate(state->keypair, sym);
-  return 0;
+  return err;
 }
 
 INTERNAL int
@@ -188,17 +360,26 @@ INTERNAL int otrv4_client_state_add_shared_prekey_v4(
   if (!state)
     return 1;
 
-  if (state->shared_prekey_pair)
-    return 0;
-
-  state->shared_prekey_pair = otrv4_shared_prekey_pair_new();
-  if (!state->shared_prekey_pair)
-    return 2;
+  int err = 0;
+  otrv4_client_state_lock(state);
+  if (!state->shared_prekey_pair) {
+    otrv4_shared_prekey_pair_t *pair = otrv4_shared_prekey_pair_new();
+    if (pair) {
+      otrv4_shared_prekey_pair_generate(pair, sym);
+      state->shared_prekey_pair = pair;
+    } else {
+      err = 2;
+    }
+  }
+  otrv4_client_state_unlock(state);
 
-  otrv4_shared_prekey_pair_generate(state->shared_prekey_pair, sym);
-  return 0;
+  return err;
 }
 
+/* The OTRv3 userstate is shared by every client, and libotr does not guard
+ * its instance tag list. */
+static pthread_mutex_t instag_lock = PTHREAD_MUTEX_INITIALIZER;
+
 tstatic OtrlInsTag *otrl_instance_tag_new(const char *protocol,
                                           const char *account,
                                           unsigned int instag) {
@@ -234,7 +415,9 @@ INTERNAL int otrv4_client_state_add_instance_tag(otrv4_client_state_t *state,
   if (!p)
     return -1;
 
+  pthread_mutex_lock(&instag_lock);
   otrl_userstate_instance_tag_add(state->userstate, p);
+  pthread_mutex_unlock(&instag_lock);
   return 0;
 }
 
@@ -243,12 +426,13 @@ otrv4_client_state_get_instance_tag(otrv4_client_state_t *state) {
   if (!state->userstate)
     return 0;
 
+  pthread_mutex_lock(&instag_lock);
   OtrlInsTag *instag = otrl_instag_find(state->userstate, state->account_name,
                                         state->protocol_name);
-  if (!instag)
-    return 0;
+  unsigned int ret = instag ? instag->instag : 0;
+  pthread_mutex_unlock(&instag_lock);
 
-  return instag->instag;
+  return ret;
 }
 
 API int otrv4_client_state_instance_tag_read_FILEp(otrv4_client_state_t *state,
@@ -256,5 +440,9 @@ API int otrv4_client_state_instance_tag_read_FILEp(otrv4_client_state_t *state,
   if (!state->userstate)
     return 1;
 
-  return otrl_instag_read_FILEp(state->userstate, instag);
+  pthread_mutex_lock(&instag_lock);
+  int err = otrl_instag_read_FILEp(state->userstate, instag);
+  pthread_mutex_unlock(&instag_lock);
+
+  return err;
 }
@@ -1,22 +1,38 @@
 #ifndef OTRV4_CLIENT_STATE_H
 #define OTRV4_CLIENT_STATE_H
 
+#include <pthread.h>
 #include <stdbool.h>
 
 #include <gcrypt.h>
 
 #include <libotr/userstate.h>
 
+#include "auth.h"
 #include "client_callbacks.h"
+#include "include/libotrv4.h"
 #include "keys.h"
 #include "shared.h"
+#include "stats.h"
+#include "trace.h"
+#include "user_profile.h"
+
+/* Our profile is signed again when it has less than this left */
+#ifndef OTRV4_PROFILE_REFRESH_SECONDS
+#define OTRV4_PROFILE_REFRESH_SECONDS (3 * 24 * 60 * 60) /* 3 days */
+#endif
+
+/* Proof nonces kept ready by otrv4_client_state_precompute_auth() */
+#ifndef OTRV4_AUTH_NONCES
+#define OTRV4_AUTH_NONCES 4
+#endif
 
 typedef struct heartbeat_t {
   int time;
   time_t last_msg_sent;
 } heartbeat_t;
 
-typedef struct otrv4_client_state_t {
+struct otrv4_client_state_t {
   void *client_id; /* Data in the messaging application context that represents
                     a client and should map directly to it. For example, in
                     libpurple-based apps (like Pidgin) this could be a
@@ -29,6 +45,9 @@ typedef struct otrv4_client_state_t {
 
   const struct otrv4_client_callbacks_t *callbacks;
 
+  /* Optional. It must be set before any connection is created. */
+  const otrv4_tracer_t *tracer;
+
   // TODO: We could point it directly to the user state and have access to the
   // callback and v3 user state
   OtrlUserState userstate;
@@ -40,10 +59,24 @@ typedef struct otrv4_client_state_t {
   bool pad;  // TODO: this can be replaced by length
   heartbeat_t *heartbeat;
 
+  snizkpk_nonces_t auth_nonces[OTRV4_AUTH_NONCES];
+  int auth_nonces_len;
+
+  /* Our profile, shared by every connection that holds a reference */
+  user_profile_t *profile;
+
+  /* Guards the keys, the profile and the heartbeat, which are shared by
+   * every connection of this client. It is recursive because the
+   * create_privkey callback usually adds the key it creates. */
+  pthread_mutex_t lock;
+
+  /* Only updated if built with OTRV4_STATS. Atomically, not under lock. */
+  otrv4_stats_t stats[1];
+
   // OtrlPrivKey *privkeyv3; // ???
   // otrv4_instag_t *instag; // TODO: Store the instance tag here rather than
   // use OTR3 User State as a store for instance tags
-} otrv4_client_state_t;
+};
 
 API int otrv4_client_state_instance_tag_read_FILEp(otrv4_client_state_t *state,
                                                    FILE *instag);
@@ -76,6 +109,39 @@ INTERNAL int
 otrv4_client_state_add_private_key_v4(otrv4_client_state_t *state,
                                       const uint8_t sym[ED448_PRIVATE_BYTES]);
 
+/*
+ * Returns a reference to our profile, signed with the current keys, which
+ * must exist. Every connection gets the same profile until it is close to
+ * expiring. A connection that allows other versions gets its own.
+ */
+INTERNAL user_profile_t *
+otrv4_client_state_get_user_profile(otrv4_client_state_t *state,
+                                    const string_t versions);
+
+/* Signs our profile again if it is close to expiring. Connections that hold
+ * the previous one take the new one when they start their next DAKE. */
+INTERNAL otrv4_err_t
+otrv4_client_state_refresh_user_profile(otrv4_client_state_t *state);
+
+/* Whether a connection that holds profile should get ours again: it was
+ * signed again since, or profile is close to expiring. */
+INTERNAL otrv4_bool_t
+otrv4_client_state_user_profile_outdated(otrv4_client_state_t *state,
+                                         const user_profile_t *profile);
+
+/* Computes proof nonces until OTRV4_AUTH_NONCES are ready, so the next
+ * DAKEs do not have to. Returns how many were computed. */
+INTERNAL int otrv4_client_state_precompute_auth(otrv4_client_state_t *state);
+
+/* Takes nonces computed beforehand or, if there are none, computes them */
+INTERNAL void
+otrv4_client_state_take_auth_nonces(otrv4_client_state_t *state,
+                                    snizkpk_nonces_t *dst);
+
+INTERNAL void otrv4_client_state_lock(otrv4_client_state_t *state);
+
+INTERNAL void otrv4_client_state_unlock(otrv4_client_state_t *state);
+
 INTERNAL void otrv4_client_state_free(otrv4_client_state_t *);
 
 INTERNAL otrv4_client_state_t *otrv4_client_state_new(void *client_id);
@@ -84,6 +150,8 @@ INTERNAL otrv4_client_state_t *otrv4_client_state_new(void *client_id);
 
 tstatic heartbeat_t *set_heartbeat(int wait);
 
+tstatic otrv4_bool_t profile_expiring(const user_profile_t *profile);
+
 #endif
 
 #endif
@@ -54,19 +54,15 @@ INTERNAL otrv4_err_t otrv4_dake_identity_message_asprintf(
     uint8_t **dst, size_t *nbytes,
     const dake_identity_message_t *identity_message) {
   size_t profile_len = 0;
-  uint8_t *profile = NULL;
-  if (otrv4_user_profile_asprintf(&profile, &profile_len,
-                                  identity_message->profile)) {
+  const uint8_t *profile = NULL;
+  if (otrv4_user_profile_serialized(&profile, &profile_len,
+                                    identity_message->profile))
     return ERROR;
-  }
 
   size_t s = PRE_KEY_MIN_BYTES + profile_len;
   uint8_t *buff = malloc(s);
-  if (!buff) {
-    free(profile);
-    profile = NULL;
+  if (!buff)
     return ERROR;
-  }
 
   uint8_t *cursor = buff;
   cursor += otrv4_serialize_uint16(cursor, VERSION);
@@ -78,9 +74,6 @@ INTERNAL otrv4_err_t otrv4_dake_identity_message_asprintf(
   cursor += otrv4_serialize_bytes_array(cursor, profile, profile_len);
   cursor += otrv4_serialize_ec_point(cursor, identity_message->Y);
 
-  free(profile);
-  profile = NULL;
-
   size_t len = 0;
   otrv4_err_t err =
       otrv4_serialize_dh_public_key(cursor, &len, identity_message->B);
@@ -181,21 +174,16 @@ INTERNAL void otrv4_dake_auth_r_destroy(dake_auth_r_t *auth_r) {
 INTERNAL otrv4_err_t otrv4_dake_auth_r_asprintf(uint8_t **dst, size_t *nbytes,
                                                 const dake_auth_r_t *auth_r) {
   size_t our_profile_len = 0;
-  uint8_t *our_profile = NULL;
-
-  if (otrv4_user_profile_asprintf(&our_profile, &our_profile_len,
-                                  auth_r->profile)) {
+  const uint8_t *our_profile = NULL;
+  if (otrv4_user_profile_serialized(&our_profile, &our_profile_len,
+                                    auth_r->profile))
     return ERROR;
-  }
 
   size_t s = AUTH_R_MIN_BYTES + our_profile_len;
 
   uint8_t *buff = malloc(s);
-  if (!buff) {
-    free(our_profile);
-    our_profile = NULL;
+  if (!buff)
     return ERROR;
-  }
 
   uint8_t *cursor = buff;
   cursor += otrv4_serialize_uint16(cursor, VERSION);
@@ -205,9 +193,6 @@ INTERNAL otrv4_err_t otrv4_dake_auth_r_asprintf(uint8_t **dst, size_t *nbytes,
   cursor += otrv4_serialize_bytes_array(cursor, our_profile, our_profile_len);
   cursor += otrv4_serialize_ec_point(cursor, auth_r->X);
 
-  free(our_profile);
-  our_profile = NULL;
-
   size_t len = 0;
   otrv4_err_t err = otrv4_serialize_dh_public_key(cursor, &len, auth_r->A);
   if (err) {
@@ -424,19 +409,15 @@ INTERNAL otrv4_err_t otrv4_dake_prekey_message_asprintf(
     uint8_t **dst, size_t *nbytes,
     const dake_prekey_message_t *prekey_message) {
   size_t profile_len = 0;
-  uint8_t *profile = NULL;
-  if (otrv4_user_profile_asprintf(&profile, &profile_len,
-                                  prekey_message->profile)) {
+  const uint8_t *profile = NULL;
+  if (otrv4_user_profile_serialized(&profile, &profile_len,
+                                    prekey_message->profile))
     return ERROR;
-  }
 
   size_t s = PRE_KEY_MIN_BYTES + profile_len;
   uint8_t *buff = malloc(s);
-  if (!buff) {
-    free(profile);
-    profile = NULL;
+  if (!buff)
     return ERROR;
-  }
 
   uint8_t *cursor = buff;
   cursor += otrv4_serialize_uint16(cursor, VERSION);
@@ -447,9 +428,6 @@ INTERNAL otrv4_err_t otrv4_dake_prekey_message_asprintf(
   cursor += otrv4_serialize_bytes_array(cursor, profile, profile_len);
   cursor += otrv4_serialize_ec_point(cursor, prekey_message->Y);
 
-  free(profile);
-  profile = NULL;
-
   size_t len = 0;
   otrv4_err_t err =
       otrv4_serialize_dh_public_key(cursor, &len, prekey_message->B);
@@ -562,20 +540,16 @@ INTERNAL otrv4_err_t otrv4_dake_non_interactive_auth_message_asprintf(
         4 + DATA_MSG_NONCE_BYTES + non_interactive_auth->enc_msg_len + 4;
 
   size_t our_profile_len = 0;
-  uint8_t *our_profile = NULL;
-
-  if (otrv4_user_profile_asprintf(&our_profile, &our_profile_len,
-                                  non_interactive_auth->profile))
+  const uint8_t *our_profile = NULL;
+  if (otrv4_user_profile_serialized(&our_profile, &our_profile_len,
+                                    non_interactive_auth->profile))
     return ERROR;
 
   size_t s = NON_INT_AUTH_BYTES + our_profile_len + data_msg_len;
 
   uint8_t *buff = malloc(s);
-  if (!buff) {
-    free(our_profile);
-    our_profile = NULL;
+  if (!buff)
     return ERROR;
-  }
 
   uint8_t *cursor = buff;
   cursor += otrv4_serialize_uint16(cursor, VERSION);
@@ -587,9 +561,6 @@ INTERNAL otrv4_err_t otrv4_dake_non_interactive_auth_message_asprintf(
   cursor += otrv4_serialize_bytes_array(cursor, our_profile, our_profile_len);
   cursor += otrv4_serialize_ec_point(cursor, non_interactive_auth->X);
 
-  free(our_profile);
-  our_profile = NULL;
-
   size_t len = 0;
   otrv4_err_t err =
       otrv4_serialize_dh_public_key(cursor, &len, non_interactive_auth->A);
@@ -747,7 +718,7 @@ INTERNAL otrv4_bool_t otrv4_valid_received_values(
     return otrv4_false;
 
   /* Verify their profile is valid (and not expired). */
-  if (otrv4_user_profile_verify_signature(profile) == otrv4_false)
+  if (otrv4_user_profile_verify_signature_cached(profile) == otrv4_false)
     return otrv4_false;
 
   if (not_expired(profile->expires) == otrv4_false)
@@ -49,13 +49,15 @@ INTERNAL void otrv4_data_message_free(data_message_t *data_msg) {
   data_msg = NULL;
 }
 
-INTERNAL otrv4_err_t otrv4_data_message_body_asprintf(
-    uint8_t **body, size_t *bodylen, const data_message_t *data_msg) {
-  size_t s = DATA_MESSAGE_MIN_BYTES + DH_MPI_BYTES + 4 + data_msg->enc_msg_len;
-  uint8_t *dst = malloc(s);
-  if (!dst)
-    return ERROR;
+INTERNAL size_t
+otrv4_data_message_header_len(const data_message_t *data_msg) {
+  return DATA_MESSAGE_MIN_BYTES + 4 +
+         otrv4_dh_mpi_serialized_len(data_msg->dh) + 4;
+}
 
+INTERNAL size_t
+otrv4_data_message_serialize_header(uint8_t *dst,
+                                    const data_message_t *data_msg) {
   uint8_t *cursor = dst;
   cursor += otrv4_serialize_uint16(cursor, VERSION);
   cursor += otrv4_serialize_uint8(cursor, DATA_MSG_TYPE);
@@ -67,16 +69,35 @@ INTERNAL otrv4_err_t otrv4_data_message_body_asprintf(
 
   // TODO: This could be NULL. We need to test.
   size_t len = 0;
-  if (otrv4_serialize_dh_public_key(cursor, &len, data_msg->dh)) {
+  if (otrv4_serialize_dh_public_key(cursor, &len, data_msg->dh))
+    return 0;
+
+  cursor += len;
+  cursor += otrv4_serialize_bytes_array(cursor, data_msg->nonce,
+                                        DATA_MSG_NONCE_BYTES);
+  cursor += otrv4_serialize_uint32(cursor, data_msg->enc_msg_len);
+
+  return cursor - dst;
+}
+
+INTERNAL otrv4_err_t otrv4_data_message_body_asprintf(
+    uint8_t **body, size_t *bodylen, const data_message_t *data_msg) {
+  size_t s = otrv4_data_message_header_len(data_msg) + data_msg->enc_msg_len;
+  uint8_t *dst = malloc(s);
+  if (!dst)
+    return ERROR;
+
+  uint8_t *cursor = dst;
+  size_t len = otrv4_data_message_serialize_header(cursor, data_msg);
+  if (!len) {
     free(dst);
     dst = NULL;
     return ERROR;
   }
+
   cursor += len;
-  cursor += otrv4_serialize_bytes_array(cursor, data_msg->nonce,
-                                        DATA_MSG_NONCE_BYTES);
-  cursor +=
-      otrv4_serialize_data(cursor, data_msg->enc_msg, data_msg->enc_msg_len);
+  cursor += otrv4_serialize_bytes_array(cursor, data_msg->enc_msg,
+                                        data_msg->enc_msg_len);
 
   if (body)
     *body = dst;
@@ -87,10 +108,13 @@ INTERNAL otrv4_err_t otrv4_data_message_body_asprintf(
   return SUCCESS;
 }
 
-INTERNAL otrv4_err_t otrv4_data_message_deserialize(data_message_t *dst,
-                                                    const uint8_t *buff,
-                                                    size_t bufflen,
-                                                    size_t *nread) {
+/* Reads every field but the encrypted message, which is left pointing into
+ * buff. body_len is set to the number of bytes covered by the MAC. */
+tstatic otrv4_err_t data_message_deserialize_view(data_message_t *dst,
+                                                  const uint8_t *buff,
+                                                  size_t bufflen,
+                                                  const uint8_t **enc_msg,
+                                                  size_t *body_len) {
   const uint8_t *cursor = buff;
   int64_t len = bufflen;
   size_t read = 0;
@@ -167,42 +191,84 @@ INTERNAL otrv4_err_t otrv4_data_message_deserialize(data_message_t *dst,
   cursor += DATA_MSG_NONCE_BYTES;
   len -= DATA_MSG_NONCE_BYTES;
 
-  if (otrv4_deserialize_data(&dst->enc_msg, cursor, len, &read))
+  uint32_t enc_msg_len = 0;
+  if (otrv4_deserialize_uint32(&enc_msg_len, cursor, len, &read))
     return ERROR;
 
-  dst->enc_msg_len = read - 4;
   cursor += read;
   len -= read;
 
+  if (len < enc_msg_len)
+    return ERROR;
+
+  *enc_msg = cursor;
+  dst->enc_msg_len = enc_msg_len;
+  cursor += enc_msg_len;
+  len -= enc_msg_len;
+
+  *body_len = cursor - buff;
+
   return otrv4_deserialize_bytes_array((uint8_t *)&dst->mac, DATA_MSG_MAC_BYTES,
                                        cursor, len);
 }
 
-INTERNAL otrv4_bool_t otrv4_valid_data_message(m_mac_key_t mac_key,
-                                               const data_message_t *data_msg) {
-  uint8_t *body = NULL;
-  size_t bodylen = 0;
+INTERNAL otrv4_err_t otrv4_data_message_deserialize(data_message_t *dst,
+                                                    const uint8_t *buff,
+                                                    size_t bufflen,
+                                                    size_t *nread) {
+  const uint8_t *enc_msg = NULL;
+  size_t body_len = 0;
 
-  if (otrv4_data_message_body_asprintf(&body, &bodylen, data_msg)) {
-    return otrv4_false;
-  }
+  if (data_message_deserialize_view(dst, buff, bufflen, &enc_msg, &body_len))
+    return ERROR;
+
+  if (!dst->enc_msg_len)
+    return SUCCESS;
+
+  dst->enc_msg = malloc(dst->enc_msg_len);
+  if (!dst->enc_msg)
+    return ERROR;
+
+  memcpy(dst->enc_msg, enc_msg, dst->enc_msg_len);
+
+  return SUCCESS;
+}
 
+INTERNAL otrv4_err_t otrv4_data_message_deserialize_in_place(
+    data_message_t *dst, uint8_t *buff, size_t bufflen, size_t *body_len) {
+  const uint8_t *enc_msg = NULL;
+
+  dst->enc_msg = NULL;
+  if (data_message_deserialize_view(dst, buff, bufflen, &enc_msg, body_len))
+    return ERROR;
+
+  /* enc_msg lies within buff, which the caller lets us write to */
+  dst->enc_msg = buff + (enc_msg - buff);
+
+  return SUCCESS;
+}
+
+INTERNAL void otrv4_data_message_in_place_destroy(data_message_t *data_msg) {
+  /* enc_msg is owned by the buffer it was read from */
+  data_msg->enc_msg = NULL;
+  data_message_destroy(data_msg);
+}
+
+INTERNAL otrv4_bool_t otrv4_valid_data_message_body(
+    m_mac_key_t mac_key, const data_message_t *data_msg, const uint8_t *body,
+    size_t bodylen) {
   uint8_t mac_tag[DATA_MSG_MAC_BYTES];
   memset(mac_tag, 0, sizeof mac_tag);
 
   shake_256_mac(mac_tag, sizeof mac_tag, mac_key, sizeof(m_mac_key_t), body,
                 bodylen);
 
-  free(body);
-  body = NULL;
-
   if (otrl_mem_differ(mac_tag, data_msg->mac, sizeof mac_tag) != 0) {
     sodium_memzero(mac_tag, sizeof mac_tag);
     return otrv4_false;
   }
 
-  if (otrv4_ec_point_valid(data_msg->ecdh))
-    return otrv4_false;
-
-  return otrv4_dh_mpi_valid(data_msg->dh);
+  /* The DH key is validated by the key manager, which remembers the last
+   * key it accepted: see otrv4_key_manager_valid_their_dh */
+  return otrv4_ec_point_valid(data_msg->ecdh);
 }
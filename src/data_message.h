@@ -26,6 +26,15 @@ INTERNAL data_message_t *otrv4_data_message_new(void);
 
 INTERNAL void otrv4_data_message_free(data_message_t *data_msg);
 
+/* Length of the body up to (and including) the length of the encrypted
+ * message, which follows it. */
+INTERNAL size_t otrv4_data_message_header_len(const data_message_t *data_msg);
+
+/* Returns the number of bytes written, or 0 on error */
+INTERNAL size_t
+otrv4_data_message_serialize_header(uint8_t *dst,
+                                    const data_message_t *data_msg);
+
 INTERNAL otrv4_err_t otrv4_data_message_body_asprintf(
     uint8_t **body, size_t *bodylen, const data_message_t *data_msg);
 
@@ -34,11 +43,28 @@ INTERNAL otrv4_err_t otrv4_data_message_deserialize(data_message_t *data_msg,
                                                     size_t bufflen,
                                                     size_t *nread);
 
-INTERNAL otrv4_bool_t otrv4_valid_data_message(m_mac_key_t mac_key,
-                                               const data_message_t *data_msg);
+/* Like otrv4_data_message_deserialize, but enc_msg points into buff instead
+ * of being copied, so it can be decrypted in place. body_len is set to the
+ * length of the bytes covered by the MAC. Release with
+ * otrv4_data_message_in_place_destroy. */
+INTERNAL otrv4_err_t otrv4_data_message_deserialize_in_place(
+    data_message_t *dst, uint8_t *buff, size_t bufflen, size_t *body_len);
+
+INTERNAL void otrv4_data_message_in_place_destroy(data_message_t *data_msg);
+
+/* Checks the MAC over the body as received, without serializing it again */
+INTERNAL otrv4_bool_t otrv4_valid_data_message_body(
+    m_mac_key_t mac_key, const data_message_t *data_msg, const uint8_t *body,
+    size_t bodylen);
 
 #ifdef OTRV4_DATA_MESSAGE_PRIVATE
 tstatic void data_message_destroy(data_message_t *data_msg);
+
+tstatic otrv4_err_t data_message_deserialize_view(data_message_t *dst,
+                                                  const uint8_t *buff,
+                                                  size_t bufflen,
+                                                  const uint8_t **enc_msg,
+                                                  size_t *body_len);
 #endif
 
 #endif
@@ -1,8 +1,12 @@
+#include <pthread.h>
+#include <sodium.h>
+
 #define OTRV4_DH_PRIVATE
 
 #include "dh.h"
 #include "random.h"
 #include "shake.h"
+#include "stats.h"
 
 static const char *DH3072_MODULUS_S =
     "0x"
@@ -48,11 +52,167 @@ static gcry_mpi_t DH3072_MODULUS_MINUS_2 = NULL;
 static const char *DH3072_GENERATOR_S = "0x02";
 static gcry_mpi_t DH3072_GENERATOR = NULL;
 
+/* Guards the group parameters, which are set up and released together */
+static pthread_mutex_t dh_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static int dh_initialized = 0;
 
+/*
+ * Fixed-base comb (Lim-Lee, HAC 14.117) for the generator. The exponent is
+ * split into DH_COMB_TEETH rows of DH_COMB_ROW_BITS bits, and the columns are
+ * processed DH_COMB_BLOCKS at a time, so generating a keypair costs
+ * DH_COMB_BLOCK_BITS squarings and DH_COMB_ROW_BITS multiplications instead of
+ * a full exponentiation.
+ */
+#define DH_COMB_EXP_BITS (DH_KEY_SIZE * 8)
+#define DH_COMB_ROW_BITS                                                       \
+  ((DH_COMB_EXP_BITS + DH_COMB_TEETH - 1) / DH_COMB_TEETH)
+#define DH_COMB_BLOCK_BITS                                                     \
+  ((DH_COMB_ROW_BITS + DH_COMB_BLOCKS - 1) / DH_COMB_BLOCKS)
+
+/* Entries are stored as big-endian bytes packed into words, so they can be
+ * selected in constant time a word at a time. */
+#define DH_COMB_WORDS (DH3072_MOD_LEN_BYTES / sizeof(uint64_t))
+
+static uint64_t dh_comb_table[DH_COMB_BLOCKS][DH_COMB_ENTRIES][DH_COMB_WORDS];
+static int dh_comb_ready = 0;
+
+/* The table depends only on the group, so it outlives otrv4_dh_free() and is
+ * built at most once per process. */
+static pthread_once_t dh_comb_once = PTHREAD_ONCE_INIT;
+
+tstatic otrv4_err_t dh_mpi_to_fixed_bytes(uint8_t dst[DH3072_MOD_LEN_BYTES],
+                                          const gcry_mpi_t src) {
+  size_t written = 0;
+  uint8_t buff[DH3072_MOD_LEN_BYTES];
+
+  if (gcry_mpi_print(GCRYMPI_FMT_USG, buff, sizeof(buff), &written, src))
+    return ERROR;
+
+  memset(dst, 0, DH3072_MOD_LEN_BYTES);
+  memcpy(dst + DH3072_MOD_LEN_BYTES - written, buff, written);
+
+  return SUCCESS;
+}
+
+tstatic otrv4_err_t dh_comb_table_build(void) {
+  gcry_mpi_t teeth[DH_COMB_TEETH];
+  gcry_mpi_t entry = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+  gcry_mpi_t exp = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+  otrv4_err_t err = SUCCESS;
+  unsigned int i, k, u;
+
+  /* teeth[i] = g^(2^(i * DH_COMB_ROW_BITS)) */
+  for (i = 0; i < DH_COMB_TEETH; i++) {
+    teeth[i] = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+    gcry_mpi_set_ui(exp, 0);
+    gcry_mpi_set_bit(exp, i * DH_COMB_ROW_BITS);
+    gcry_mpi_powm(teeth[i], DH3072_GENERATOR, exp, DH3072_MODULUS);
+  }
+
+  /* table[k][u] = prod(teeth[i] for each bit i set in u) ^ (2^(k * b)) */
+  for (k = 0; k < DH_COMB_BLOCKS && err == SUCCESS; k++) {
+    gcry_mpi_set_ui(exp, 0);
+    gcry_mpi_set_bit(exp, k * DH_COMB_BLOCK_BITS);
+
+    for (u = 0; u < DH_COMB_ENTRIES && err == SUCCESS; u++) {
+      gcry_mpi_set_ui(entry, 1);
+      for (i = 0; i < DH_COMB_TEETH; i++)
+        if (u & (1u << i))
+          gcry_mpi_mulm(entry, entry, teeth[i], DH3072_MODULUS);
+
+      gcry_mpi_powm(entry, entry, exp, DH3072_MODULUS);
+      err = dh_mpi_to_fixed_bytes((uint8_t *)dh_comb_table[k][u], entry);
+    }
+  }
+
+  for (i = 0; i < DH_COMB_TEETH; i++)
+    gcry_mpi_release(teeth[i]);
+
+  gcry_mpi_release(entry);
+  gcry_mpi_release(exp);
+
+  return err;
+}
+
+/* Copies table[block][index] into dst reading every entry of the block, so
+ * the memory access pattern does not depend on the (secret) index. */
+tstatic void dh_comb_select(uint64_t dst[DH_COMB_WORDS], unsigned int block,
+                            uint32_t index) {
+  unsigned int u, n;
+
+  memset(dst, 0, DH_COMB_WORDS * sizeof(uint64_t));
+
+  for (u = 0; u < DH_COMB_ENTRIES; u++) {
+    uint32_t diff = u ^ index;
+    uint64_t mask = (uint64_t)((diff | (0 - diff)) >> 31) - 1;
+
+    for (n = 0; n < DH_COMB_WORDS; n++)
+      dst[n] |= dh_comb_table[block][u][n] & mask;
+  }
+}
+
+tstatic uint32_t dh_exp_bit(const uint8_t exp[DH_KEY_SIZE], unsigned int n) {
+  if (n >= DH_COMB_EXP_BITS)
+    return 0;
+
+  return (exp[DH_KEY_SIZE - 1 - n / 8] >> (n % 8)) & 1;
+}
+
+tstatic otrv4_err_t dh_generator_powm(gcry_mpi_t dst,
+                                      const uint8_t exp[DH_KEY_SIZE]) {
+  uint64_t entry_buff[DH_COMB_WORDS];
+  gcry_mpi_t entry = NULL;
+  int j;
+  unsigned int i, k;
+
+  gcry_mpi_set_ui(dst, 1);
+
+  for (j = DH_COMB_BLOCK_BITS - 1; j >= 0; j--) {
+    gcry_mpi_mulm(dst, dst, dst, DH3072_MODULUS);
+
+    for (k = 0; k < DH_COMB_BLOCKS; k++) {
+      unsigned int column = k * DH_COMB_BLOCK_BITS + j;
+      uint32_t index = 0;
+
+      if (column >= DH_COMB_ROW_BITS)
+        continue;
+
+      for (i = 0; i < DH_COMB_TEETH; i++)
+        index |= dh_exp_bit(exp, i * DH_COMB_ROW_BITS + column) << i;
+
+      dh_comb_select(entry_buff, k, index);
+      if (gcry_mpi_scan(&entry, GCRYMPI_FMT_USG, entry_buff,
+                        DH3072_MOD_LEN_BYTES, NULL)) {
+        sodium_memzero(entry_buff, sizeof(entry_buff));
+        return ERROR;
+      }
+
+      gcry_mpi_mulm(dst, dst, entry, DH3072_MODULUS);
+      gcry_mpi_release(entry);
+      entry = NULL;
+    }
+  }
+
+  sodium_memzero(entry_buff, sizeof(entry_buff));
+
+  return SUCCESS;
+}
+
+tstatic void dh_generator_powm_generic(gcry_mpi_t dst, const gcry_mpi_t exp) {
+  gcry_mpi_powm(dst, DH3072_GENERATOR, exp, DH3072_MODULUS);
+}
+
+/* If the table can not be built, keypairs fall back to gcry_mpi_powm */
+tstatic void dh_comb_table_init(void) {
+  dh_comb_ready = dh_comb_table_build() == SUCCESS;
+}
+
 INTERNAL void otrv4_dh_init(void) {
-  if (dh_initialized)
+  pthread_mutex_lock(&dh_init_lock);
+  if (dh_initialized) {
+    pthread_mutex_unlock(&dh_init_lock);
     return;
+  }
 
   dh_initialized = 1;
 
@@ -67,9 +227,13 @@ INTERNAL void otrv4_dh_init(void) {
 
   DH3072_MODULUS_MINUS_2 = gcry_mpi_new(DH3072_MOD_LEN_BITS);
   gcry_mpi_sub_ui(DH3072_MODULUS_MINUS_2, DH3072_MODULUS, 2);
+
+  pthread_once(&dh_comb_once, dh_comb_table_init);
+  pthread_mutex_unlock(&dh_init_lock);
 }
 
 INTERNAL void otrv4_dh_free(void) {
+  pthread_mutex_lock(&dh_init_lock);
   gcry_mpi_release(DH3072_MODULUS);
   DH3072_MODULUS = NULL;
 
@@ -83,12 +247,14 @@ INTERNAL void otrv4_dh_free(void) {
   DH3072_MODULUS_MINUS_2 = NULL;
 
   dh_initialized = 0;
+  pthread_mutex_unlock(&dh_init_lock);
 }
 
 INTERNAL otrv4_err_t otrv4_dh_keypair_generate(dh_keypair_t keypair) {
   uint8_t hash[DH_KEY_SIZE];
   gcry_mpi_t privkey = NULL;
   uint8_t *secbuf = NULL;
+  OTRV4_STATS_TIMER_START(start);
 
   secbuf = gcry_random_bytes_secure(DH_KEY_SIZE, GCRY_STRONG_RANDOM);
   shake_256_hash(hash, sizeof(hash), secbuf, DH_KEY_SIZE);
@@ -97,12 +263,20 @@ INTERNAL otrv4_err_t otrv4_dh_keypair_generate(dh_keypair_t keypair) {
       gcry_mpi_scan(&privkey, GCRYMPI_FMT_USG, hash, DH_KEY_SIZE, NULL);
   gcry_free(secbuf);
 
-  if (err)
+  if (err) {
+    sodium_memzero(hash, sizeof(hash));
+    OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_DH);
     return ERROR;
+  }
 
   keypair->priv = privkey;
   keypair->pub = gcry_mpi_new(DH3072_MOD_LEN_BITS);
-  gcry_mpi_powm(keypair->pub, DH3072_GENERATOR, privkey, DH3072_MODULUS);
+
+  if (!dh_comb_ready || dh_generator_powm(keypair->pub, hash))
+    dh_generator_powm_generic(keypair->pub, privkey);
+
+  sodium_memzero(hash, sizeof(hash));
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_DH);
 
   return SUCCESS;
 }
@@ -126,6 +300,7 @@ INTERNAL otrv4_err_t otrv4_dh_shared_secret(uint8_t *shared,
                                             size_t shared_bytes,
                                             const dh_private_key_t our_priv,
                                             const dh_public_key_t their_pub) {
+  OTRV4_STATS_TIMER_START(start);
   gcry_mpi_t secret = gcry_mpi_snew(DH3072_MOD_LEN_BITS);
   gcry_mpi_powm(secret, their_pub, our_priv, DH3072_MODULUS);
   size_t written;
@@ -139,6 +314,7 @@ INTERNAL otrv4_err_t otrv4_dh_shared_secret(uint8_t *shared,
   // TODO: this is memsetting a uint8_t *
   memset(shared, 0, shared_bytes);
   memcpy(shared + shared_bytes - written, buffer, written);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_DH);
 
   if (err)
     return ERROR;
@@ -157,6 +333,10 @@ INTERNAL otrv4_err_t otrv4_dh_mpi_serialize(uint8_t *dst, size_t dst_len,
   return SUCCESS;
 }
 
+INTERNAL size_t otrv4_dh_mpi_serialized_len(const dh_mpi_t src) {
+  return (gcry_mpi_get_nbits(src) + 7) / 8;
+}
+
 INTERNAL otrv4_err_t otrv4_dh_mpi_deserialize(dh_mpi_t *dst,
                                               const uint8_t *buffer,
                                               size_t buflen, size_t *nread) {
@@ -166,25 +346,152 @@ INTERNAL otrv4_err_t otrv4_dh_mpi_deserialize(dh_mpi_t *dst,
   return SUCCESS;
 }
 
-INTERNAL otrv4_bool_t otrv4_dh_mpi_valid(dh_mpi_t mpi) {
-  /* Check that pub is in range */
-  if (mpi == NULL)
-    return otrv4_false;
-
+tstatic otrv4_bool_t dh_mpi_in_range(const dh_mpi_t mpi) {
   /* mpi >= 2 and <= dh_p - 2 */
   if ((gcry_mpi_cmp_ui(mpi, 2) < 0 ||
        gcry_mpi_cmp(mpi, DH3072_MODULUS_MINUS_2) > 0))
     return otrv4_false;
 
-  /* slower: x ^ q mod p
-  gcry_mpi_t tmp = gcry_mpi_new(DH3072_MOD_LEN_BYTES);
-  gcry_mpi_powm(tmp, mpi, DH3072_MODULUS_Q, DH3072_MODULUS);
+  return otrv4_true;
+}
 
-  if (gcry_mpi_cmp_ui(tmp, 1) == 0)
-    return ERROR;
-  */
+/* Little-endian 64-bit limbs, used by the Jacobi symbol below */
+#define DH_LIMBS (DH3072_MOD_LEN_BYTES / sizeof(uint64_t))
 
-  return otrv4_true;
+static void dh_mpi_to_limbs(uint64_t dst[DH_LIMBS], const uint8_t *src) {
+  unsigned int i, n;
+
+  for (i = 0; i < DH_LIMBS; i++) {
+    const uint8_t *p = src + DH3072_MOD_LEN_BYTES - (i + 1) * 8;
+    dst[i] = 0;
+    for (n = 0; n < 8; n++)
+      dst[i] = (dst[i] << 8) | p[n];
+  }
+}
+
+static int dh_limbs_cmp(const uint64_t *a, const uint64_t *b, size_t len) {
+  while (len--) {
+    if (a[len] != b[len])
+      return a[len] > b[len] ? 1 : -1;
+  }
+
+  return 0;
+}
+
+static int dh_limbs_is_zero(const uint64_t *a, size_t len) {
+  uint64_t acc = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    acc |= a[i];
+
+  return acc == 0;
+}
+
+/* a -= b, requires a >= b */
+static void dh_limbs_sub(uint64_t *a, const uint64_t *b, size_t len) {
+  uint64_t borrow = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    uint64_t ai = a[i], bi = b[i];
+    a[i] = ai - bi - borrow;
+    borrow = (ai < bi) | ((ai == bi) & borrow);
+  }
+}
+
+/* Shifts out the trailing zero bits of a (which must be nonzero) and returns
+ * how many were removed. */
+static unsigned int dh_limbs_strip_zeros(uint64_t *a, size_t len) {
+  unsigned int zeros = 0, bits;
+  size_t i, words = 0;
+
+  while (a[words] == 0)
+    words++;
+
+  if (words) {
+    memmove(a, a + words, (len - words) * sizeof(uint64_t));
+    memset(a + len - words, 0, words * sizeof(uint64_t));
+    zeros = words * 64;
+  }
+
+  bits = __builtin_ctzll(a[0]);
+  if (bits) {
+    for (i = 0; i < len - 1; i++)
+      a[i] = (a[i] >> bits) | (a[i + 1] << (64 - bits));
+    a[len - 1] >>= bits;
+  }
+
+  return zeros + bits;
+}
+
+/*
+ * The prime is safe (p = 2q + 1) and p = 7 mod 8, so the subgroup of order q
+ * generated by g = 2 is exactly the set of quadratic residues. Checking that
+ * the Jacobi symbol (x/p) is 1 is therefore equivalent to x^q = 1 mod p, and
+ * much cheaper. The binary algorithm does not run in constant time, which is
+ * fine as it is only applied to public values.
+ */
+tstatic otrv4_bool_t dh_mpi_in_subgroup(const dh_mpi_t mpi) {
+  uint8_t buff[DH3072_MOD_LEN_BYTES];
+  uint64_t x[DH_LIMBS], p[DH_LIMBS];
+  uint64_t *a = x, *n = p, *tmp;
+  size_t len = DH_LIMBS;
+  int t = 1;
+
+  if (dh_mpi_to_fixed_bytes(buff, mpi))
+    return otrv4_false;
+  dh_mpi_to_limbs(a, buff);
+
+  if (dh_mpi_to_fixed_bytes(buff, DH3072_MODULUS))
+    return otrv4_false;
+  dh_mpi_to_limbs(n, buff);
+
+  /* a < n and n is odd */
+  while (1) {
+    while (len > 1 && a[len - 1] == 0 && n[len - 1] == 0)
+      len--;
+
+    if (dh_limbs_is_zero(a, len))
+      break;
+
+    if (dh_limbs_strip_zeros(a, len) & 1) {
+      /* (2/n) = -1 when n = 3 or 5 mod 8 */
+      uint64_t r = n[0] & 7;
+      if (r == 3 || r == 5)
+        t = -t;
+    }
+
+    if (dh_limbs_cmp(a, n, len) < 0) {
+      tmp = a;
+      a = n;
+      n = tmp;
+
+      /* quadratic reciprocity */
+      if ((a[0] & 3) == 3 && (n[0] & 3) == 3)
+        t = -t;
+    }
+
+    dh_limbs_sub(a, n, len);
+  }
+
+  /* gcd(x, p) must be 1, which always holds for a prime p and 0 < x < p */
+  if (len != 1 || n[0] != 1)
+    return otrv4_false;
+
+  return t == 1 ? otrv4_true : otrv4_false;
+}
+
+INTERNAL otrv4_bool_t otrv4_dh_mpi_valid(dh_mpi_t mpi) {
+  /* Check that pub is in range */
+  if (mpi == NULL)
+    return otrv4_false;
+
+  if (dh_mpi_in_range(mpi) == otrv4_false)
+    return otrv4_false;
+
+  /* Check that pub is in the subgroup generated by g */
+  return dh_mpi_in_subgroup(mpi);
 }
 
 INTERNAL dh_mpi_t otrv4_dh_mpi_copy(const dh_mpi_t src) {
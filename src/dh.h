@@ -12,6 +12,11 @@
 #define DH3072_MOD_LEN_BYTES 384
 #define DH_MPI_BYTES (4 + DH3072_MOD_LEN_BYTES)
 
+/* Fixed-base comb parameters for g^x: 2^TEETH entries per block */
+#define DH_COMB_TEETH 6
+#define DH_COMB_BLOCKS 2
+#define DH_COMB_ENTRIES (1 << DH_COMB_TEETH)
+
 typedef gcry_mpi_t dh_mpi_t;
 typedef dh_mpi_t dh_private_key_t, dh_public_key_t;
 
@@ -39,6 +44,9 @@ INTERNAL otrv4_err_t otrv4_dh_mpi_serialize(uint8_t *dst, size_t dst_len,
                                             size_t *written,
                                             const dh_mpi_t src);
 
+/* Number of bytes otrv4_dh_mpi_serialize writes for src */
+INTERNAL size_t otrv4_dh_mpi_serialized_len(const dh_mpi_t src);
+
 INTERNAL otrv4_err_t otrv4_dh_mpi_deserialize(dh_mpi_t *dst,
                                               const uint8_t *buffer,
                                               size_t buflen, size_t *nread);
@@ -53,6 +61,27 @@ INTERNAL void otrv4_dh_mpi_release(dh_mpi_t mpi);
 
 tstatic void dh_pub_key_destroy(dh_keypair_t keypair);
 
+tstatic otrv4_err_t dh_mpi_to_fixed_bytes(uint8_t dst[DH3072_MOD_LEN_BYTES],
+                                          const gcry_mpi_t src);
+
+tstatic otrv4_err_t dh_comb_table_build(void);
+
+tstatic void dh_comb_table_init(void);
+
+tstatic void dh_comb_select(uint64_t dst[DH3072_MOD_LEN_BYTES / 8],
+                            unsigned int block, uint32_t index);
+
+tstatic uint32_t dh_exp_bit(const uint8_t exp[DH_KEY_SIZE], unsigned int n);
+
+tstatic otrv4_err_t dh_generator_powm(gcry_mpi_t dst,
+                                      const uint8_t exp[DH_KEY_SIZE]);
+
+tstatic void dh_generator_powm_generic(gcry_mpi_t dst, const gcry_mpi_t exp);
+
+tstatic otrv4_bool_t dh_mpi_in_range(const dh_mpi_t mpi);
+
+tstatic otrv4_bool_t dh_mpi_in_subgroup(const dh_mpi_t mpi);
+
 #endif
 
 #endif
@@ -4,6 +4,7 @@
 #define OTRV4_ED448_PRIVATE
 
 #include "ed448.h"
+#include "stats.h"
 
 INTERNAL void otrv4_ec_bzero(void *data, size_t size) {
   decaf_bzero(data, size);
@@ -28,6 +29,7 @@ INTERNAL void otrv4_ec_point_destroy(ec_point_t dst) {
 
 INTERNAL void otrv4_ecdh_keypair_generate(ecdh_keypair_t *keypair,
                                           uint8_t sym[ED448_PRIVATE_BYTES]) {
+  OTRV4_STATS_TIMER_START(start);
   otrv4_ec_scalar_derive_from_secret(keypair->priv, sym);
 
   uint8_t pub[ED448_POINT_BYTES];
@@ -36,6 +38,7 @@ INTERNAL void otrv4_ecdh_keypair_generate(ecdh_keypair_t *keypair,
 
   decaf_bzero(sym, ED448_POINT_BYTES);
   decaf_bzero(pub, ED448_POINT_BYTES);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_ECDH);
 }
 
 INTERNAL void otrv4_ecdh_keypair_destroy(ecdh_keypair_t *keypair) {
@@ -60,9 +63,12 @@ INTERNAL void otrv4_ecdh_shared_secret(uint8_t *shared,
                                        const ecdh_keypair_t *our_keypair,
                                        const ec_point_t their_pub) {
   decaf_448_point_t s;
+  OTRV4_STATS_TIMER_START(start);
+
   decaf_448_point_scalarmul(s, their_pub, our_keypair->priv);
 
   otrv4_ec_point_serialize(shared, s);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_ECDH);
 }
 
 /* void ec_public_key_copy(ec_public_key_t dst, const ec_public_key_t src) { */
@@ -3,25 +3,14 @@
 
 #include <stdint.h>
 
+#include "include/libotrv4.h"
 #include "shared.h"
 
 #define ERROR_PREFIX "?OTR Error: "
 #define ERROR_CODE_1 "ERROR_1: "
 #define ERROR_CODE_2 "ERROR_2: "
 
-// needed for comparing with DECAF_TRUE
-typedef uint32_t
-    otrv4_bool_t; /* "Boolean" type, will be set to all-zero or all-one */
-
-static const otrv4_bool_t otrv4_true = 0;
-static const otrv4_bool_t otrv4_false = 1;
-
-typedef enum {
-  SUCCESS = 0,
-  ERROR = 1,
-  STATE_NOT_ENCRYPTED = 0x1001,
-  MSG_NOT_VALID = 0x1011,
-} otrv4_err_t;
+/* otrv4_bool_t and otrv4_err_t are part of the API */
 
 typedef enum {
   ERR_NONE,
@@ -6,7 +6,10 @@
 
 #include "fragment.h"
 
-#define FRAGMENT_FORMAT "?OTR|%08x|%08x,%05x,%05x,%s,"
+#define FRAGMENT_PREFIX_FORMAT "?OTR|%08x|%08x,%05x,%05x,"
+
+/* Where k is written in the prefix */
+#define FRAGMENT_INDEX_OFFSET 23
 
 API otrv4_message_to_send_t *otrv4_message_new() {
   otrv4_message_to_send_t *msg = malloc(sizeof(otrv4_message_to_send_t));
@@ -23,10 +26,6 @@ API void otrv4_message_free(otrv4_message_to_send_t *message) {
   if (!message)
     return;
 
-  int i;
-  for (i = 0; i < message->total; i++)
-    free(message->pieces[i]);
-
   free(message->pieces);
   message->pieces = NULL;
 
@@ -36,27 +35,77 @@ API void otrv4_message_free(otrv4_message_to_send_t *message) {
   message = NULL;
 }
 
+tstatic size_t fragment_key_hash(const void *key) {
+  const fragment_key_t *k = key;
+  uint64_t hash = (uint64_t)k->sender_tag << 32 | k->N;
+
+  hash *= 0x9e3779b97f4a7c15ULL;
+
+  return hash ^ hash >> 32;
+}
+
+tstatic int fragment_key_eq(const void *a, const void *b) {
+  const fragment_key_t *x = a, *y = b;
+  return x->sender_tag == y->sender_tag && x->N == y->N;
+}
+
 INTERNAL fragment_context_t *otrv4_fragment_context_new(void) {
   fragment_context_t *context = malloc(sizeof(fragment_context_t));
-  context->N = 0;
-  context->K = 0;
-  context->fragment = otrv4_strdup("");
-  context->fragment_len = 0;
+  if (!context)
+    return NULL;
+
+  context->head = NULL;
+  context->tail = NULL;
+  otrv4_hashtable_init(context->entries, fragment_key_hash, fragment_key_eq);
+  context->count = 0;
+  context->used = 0;
+  context->budget = OTRV4_FRAGMENT_BUDGET;
   context->status = FRAGMENT_UNFRAGMENTED;
+  context->stats = NULL;
 
   return context;
 }
 
 INTERNAL void otrv4_fragment_context_free(fragment_context_t *context) {
-  context->N = 0;
-  context->K = 0;
+  if (!context)
+    return;
+
+  while (context->head)
+    fragment_entry_free(context, context->head);
+  otrv4_hashtable_destroy(context->entries, NULL);
+
   context->status = FRAGMENT_UNFRAGMENTED;
-  free(context->fragment);
-  context->fragment = NULL;
   free(context);
   context = NULL;
 }
 
+tstatic otrv4_err_t fragment_count(int *total, size_t msg_len, int mms) {
+  if (mms <= FRAGMENT_HEADER_LEN || !msg_len)
+    return ERROR;
+
+  size_t count = (msg_len - 1) / (mms - FRAGMENT_HEADER_LEN) + 1;
+  if (count > 65535)
+    return ERROR;
+
+  *total = count;
+  return SUCCESS;
+}
+
+tstatic void fragment_prefix_set_index(char *prefix, int k) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 4; i >= 0; i--) {
+    prefix[FRAGMENT_INDEX_OFFSET + i] = hex[k & 0xf];
+    k >>= 4;
+  }
+}
+
+/*
+ * Every piece is written to a single allocation, after the array of
+ * pointers to them. The prefix is formatted once, and only k changes from
+ * one piece to the next.
+ */
 INTERNAL otrv4_err_t otrv4_fragment_message(int max_size,
                                             otrv4_message_to_send_t *fragments,
                                             int our_instance,
@@ -64,114 +113,268 @@ INTERNAL otrv4_err_t otrv4_fragment_message(int max_size,
                                             const string_t message) {
   size_t msg_len = strlen(message);
   size_t limit_piece = max_size - FRAGMENT_HEADER_LEN;
-  string_t *pieces;
-  int piece_len = 0;
+  char prefix[FRAGMENT_PREFIX_LEN + 1];
+  int total = 0;
 
-  fragments->total = ((msg_len - 1) / (max_size - FRAGMENT_HEADER_LEN)) + 1;
-  if (fragments->total > 65535)
+  if (fragment_count(&total, msg_len, max_size))
     return ERROR;
 
-  size_t pieces_len = fragments->total * sizeof(string_t);
-  pieces = malloc(pieces_len);
+  string_t *pieces = malloc(total * (sizeof(string_t) + FRAGMENT_HEADER_LEN) +
+                            msg_len);
   if (!pieces)
     return ERROR;
 
+  snprintf(prefix, sizeof prefix, FRAGMENT_PREFIX_FORMAT, our_instance,
+           their_instance, 0, total);
+
+  char *cursor = (char *)(pieces + total);
   int current_frag;
-  for (current_frag = 1; current_frag <= fragments->total; current_frag++) {
-    int index_len = 0;
-    string_t piece = NULL;
-    string_t piece_data = NULL;
-
-    if (msg_len - index_len < limit_piece)
-      piece_len = msg_len - index_len;
-    else
-      piece_len = limit_piece;
-
-    piece_data = malloc(piece_len + 1);
-    if (!piece_data) {
-      int i;
-      for (i = 0; i < fragments->total; i++) {
-        free(pieces[i]);
-      }
-
-      free(pieces);
-      pieces = NULL;
-      return ERROR;
-    }
+  for (current_frag = 1; current_frag <= total; current_frag++) {
+    size_t piece_len = msg_len < limit_piece ? msg_len : limit_piece;
 
-    strncpy(piece_data, message, piece_len);
-    piece_data[piece_len] = 0;
+    pieces[current_frag - 1] = cursor;
 
-    piece = malloc(piece_len + FRAGMENT_HEADER_LEN + 1);
-    if (!piece) {
-      int i;
-      for (i = 0; i < fragments->total; i++) {
-        free(pieces[i]);
-      }
+    memcpy(cursor, prefix, FRAGMENT_PREFIX_LEN);
+    fragment_prefix_set_index(cursor, current_frag);
+    cursor += FRAGMENT_PREFIX_LEN;
 
-      free(piece_data);
-      piece_data = NULL;
-      free(pieces);
-      pieces = NULL;
+    memcpy(cursor, message, piece_len);
+    cursor += piece_len;
+    *cursor++ = ',';
+    *cursor++ = '\0';
 
-      return ERROR;
-    }
+    message += piece_len;
+    msg_len -= piece_len;
+  }
 
-    snprintf(piece, piece_len + FRAGMENT_HEADER_LEN, FRAGMENT_FORMAT,
-             our_instance, their_instance, current_frag, fragments->total,
-             piece_data);
-    piece[piece_len + FRAGMENT_HEADER_LEN] = 0;
+  fragments->pieces = pieces;
+  fragments->total = total;
 
-    pieces[current_frag - 1] = piece;
+  return SUCCESS;
+}
 
-    free(piece_data);
-    piece_data = NULL;
-    index_len += piece_len;
-    message += piece_len;
+INTERNAL otrv4_err_t otrv4_fragment_message_view(otrv4_fragment_view_t **views,
+                                                 int *total, int max_size,
+                                                 int our_instance,
+                                                 int their_instance,
+                                                 const string_t message) {
+  size_t msg_len = strlen(message);
+  size_t limit_piece = max_size - FRAGMENT_HEADER_LEN;
+  int count = 0;
+
+  if (fragment_count(&count, msg_len, max_size))
+    return ERROR;
+
+  otrv4_fragment_view_t *ret = malloc(count * sizeof(otrv4_fragment_view_t));
+  if (!ret)
+    return ERROR;
+
+  snprintf(ret[0].prefix, sizeof ret[0].prefix, FRAGMENT_PREFIX_FORMAT,
+           our_instance, their_instance, 0, count);
+
+  int i;
+  for (i = 0; i < count; i++) {
+    if (i)
+      memcpy(ret[i].prefix, ret[0].prefix, sizeof ret[i].prefix);
+
+    fragment_prefix_set_index(ret[i].prefix, i + 1);
+    ret[i].payload = message;
+    ret[i].payload_len = msg_len < limit_piece ? msg_len : limit_piece;
+
+    message += ret[i].payload_len;
+    msg_len -= ret[i].payload_len;
   }
 
-  fragments->pieces = pieces;
+  *views = ret;
+  *total = count;
 
   return SUCCESS;
 }
 
-tstatic void initialize_fragment_context(fragment_context_t *context) {
-  free(context->fragment);
-  context->fragment = NULL;
-  context->fragment = otrv4_strdup("");
-  context->fragment_len = 0;
+tstatic fragment_entry_t *find_fragment_entry(const fragment_context_t *context,
+                                              uint32_t sender_tag,
+                                              unsigned int n) {
+  fragment_key_t key = {sender_tag, n};
+  return otrv4_hashtable_get(context->entries, &key);
+}
 
-  context->N = 0;
-  context->K = 0;
-  context->status = FRAGMENT_UNFRAGMENTED;
+tstatic void fragment_entry_unlink(fragment_context_t *context,
+                                   fragment_entry_t *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    context->head = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    context->tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+tstatic void fragment_entry_push(fragment_context_t *context,
+                                 fragment_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = context->head;
+
+  if (context->head)
+    context->head->prev = entry;
+  else
+    context->tail = entry;
+
+  context->head = entry;
+}
+
+tstatic void fragment_entry_free(fragment_context_t *context,
+                                 fragment_entry_t *entry) {
+  fragment_entry_unlink(context, entry);
+  otrv4_hashtable_remove(context->entries, &entry->key);
+  context->used -= entry->size;
+  context->count--;
+
+  free(entry->buffer);
+  free(entry->last);
+  free(entry->received);
+  free(entry);
 }
 
-tstatic otrv4_err_t add_first_fragment(const char *msg, int msg_len,
-                                       fragment_context_t *ctx) {
-  char *buff = malloc(msg_len + 1);
-  if (!buff)
+/* Makes room for size more bytes by dropping the least recently updated
+ * messages other than keep. */
+tstatic otrv4_err_t fragment_reserve(fragment_context_t *context,
+                                     fragment_entry_t *keep, size_t size) {
+  if (size > context->budget)
     return ERROR;
 
-  memmove(buff, msg, msg_len);
-  buff[msg_len] = '\0';
-  ctx->fragment_len += msg_len;
-  free(ctx->fragment);
-  ctx->fragment = buff;
+  while (context->used + size > context->budget) {
+    fragment_entry_t *victim = context->tail;
+    if (victim == keep)
+      victim = victim->prev;
+
+    if (!victim)
+      return ERROR;
+
+    fragment_entry_free(context, victim);
+    OTRV4_STATS_INC(context->stats, fragments_dropped);
+  }
+
+  context->used += size;
+  if (keep)
+    keep->size += size;
 
   return SUCCESS;
 }
 
-tstatic otrv4_err_t append_fragment(const char *msg, int msg_len,
-                                    fragment_context_t *ctx) {
-  size_t new_buff_len = ctx->fragment_len + msg_len + 1;
-  char *buff = realloc(ctx->fragment, new_buff_len);
-  if (!buff)
+tstatic fragment_entry_t *fragment_entry_new(fragment_context_t *context,
+                                             uint32_t sender_tag,
+                                             unsigned int n) {
+  size_t cost = FRAGMENT_ENTRY_COST + n;
+
+  if (context->count >= OTRV4_FRAGMENT_MAX_ENTRIES) {
+    fragment_entry_free(context, context->tail);
+    OTRV4_STATS_INC(context->stats, fragments_dropped);
+  }
+
+  if (fragment_reserve(context, NULL, cost))
+    return NULL;
+
+  fragment_entry_t *entry = malloc(sizeof(fragment_entry_t));
+  uint8_t *received = calloc(n, sizeof(uint8_t));
+  if (!entry || !received) {
+    free(entry);
+    free(received);
+    context->used -= cost;
+    return NULL;
+  }
+
+  entry->key.sender_tag = sender_tag;
+  entry->key.N = n;
+  if (otrv4_hashtable_put(context->entries, &entry->key, entry)) {
+    free(entry);
+    free(received);
+    context->used -= cost;
+    return NULL;
+  }
+
+  entry->K = 0;
+  entry->piece_len = 0;
+  entry->last_len = 0;
+  entry->buffer = NULL;
+  entry->last = NULL;
+  entry->received = received;
+  entry->size = cost;
+
+  fragment_entry_push(context, entry);
+  context->count++;
+
+  return entry;
+}
+
+/* Allocates the whole message once the length of the pieces is known */
+tstatic otrv4_err_t fragment_entry_alloc(fragment_context_t *context,
+                                         fragment_entry_t *entry,
+                                         size_t piece_len) {
+  if (piece_len > (context->budget - 1) / entry->key.N)
+    return ERROR;
+
+  size_t size = entry->key.N * piece_len + 1;
+  if (fragment_reserve(context, entry, size))
     return ERROR;
 
-  memmove(buff + ctx->fragment_len, msg, msg_len);
-  ctx->fragment_len += msg_len;
-  buff[ctx->fragment_len] = '\0';
-  ctx->fragment = buff;
+  entry->buffer = malloc(size);
+  if (!entry->buffer)
+    return ERROR;
+
+  entry->piece_len = piece_len;
+
+  if (entry->last) {
+    if (entry->last_len > piece_len)
+      return ERROR;
+
+    memcpy(entry->buffer + (entry->key.N - 1) * piece_len, entry->last,
+           entry->last_len);
+    free(entry->last);
+    entry->last = NULL;
+    entry->size -= entry->last_len;
+    context->used -= entry->last_len;
+  }
+
+  return SUCCESS;
+}
+
+tstatic otrv4_err_t fragment_entry_add(fragment_context_t *context,
+                                       fragment_entry_t *entry, unsigned int k,
+                                       const char *piece, size_t piece_len) {
+  if (k < entry->key.N) {
+    if (!entry->buffer) {
+      if (fragment_entry_alloc(context, entry, piece_len))
+        return ERROR;
+    } else if (piece_len != entry->piece_len) {
+      return ERROR;
+    }
+
+    memcpy(entry->buffer + (k - 1) * entry->piece_len, piece, piece_len);
+  } else if (entry->buffer) {
+    if (piece_len > entry->piece_len)
+      return ERROR;
+
+    memcpy(entry->buffer + (k - 1) * entry->piece_len, piece, piece_len);
+    entry->last_len = piece_len;
+  } else {
+    if (fragment_reserve(context, entry, piece_len))
+      return ERROR;
+
+    entry->last = malloc(piece_len);
+    if (!entry->last)
+      return ERROR;
+
+    memcpy(entry->last, piece, piece_len);
+    entry->last_len = piece_len;
+  }
+
+  entry->received[k - 1] = 1;
+  entry->K++;
 
   return SUCCESS;
 }
@@ -189,7 +392,7 @@ INTERNAL otrv4_err_t otrv4_unfragment_message(char **unfrag_msg,
                                               const int our_instance_tag) {
   if (is_fragment(message)) {
     *unfrag_msg = otrv4_strdup(message);
-    initialize_fragment_context(context);
+    context->status = FRAGMENT_UNFRAGMENTED;
     return SUCCESS;
   }
 
@@ -206,40 +409,60 @@ INTERNAL otrv4_err_t otrv4_unfragment_message(char **unfrag_msg,
     return ERROR;
   }
 
-  if (k == 0 || n == 0 || k > n) {
-    initialize_fragment_context(context);
-    return SUCCESS;
+  if (k <= 0 || n <= 0 || k > n) {
+    context->status = FRAGMENT_UNFRAGMENTED;
+    return ERROR;
   }
 
-  int msg_len = end - start - 1;
-  if (end <= start)
+  if (end <= start) {
+    context->status = FRAGMENT_UNFRAGMENTED;
     return ERROR;
+  }
 
-  otrv4_err_t err;
-  if (k == 1) {
-    err = add_first_fragment(message + start, msg_len, context);
-    if (err != SUCCESS)
-      return err;
+  size_t msg_len = end - start - 1;
 
-    context->N = n;
-    context->K = k;
+  if (n == 1) {
+    *unfrag_msg = otrv4_strndup(message + start, msg_len);
+    context->status = FRAGMENT_COMPLETE;
+    return SUCCESS;
+  }
 
-  } else {
-    if (n == context->N && k == context->K + 1) {
-      err = append_fragment(message + start, msg_len, context);
-      if (err != SUCCESS)
-        return err;
+  fragment_entry_t *entry = find_fragment_entry(context, sender_tag, n);
+
+  /* A piece we already have starts a new message with the same key: the
+   * previous one will never be completed */
+  if (entry && entry->received[k - 1]) {
+    fragment_entry_free(context, entry);
+    OTRV4_STATS_INC(context->stats, fragments_dropped);
+    entry = NULL;
+  }
+
+  if (!entry)
+    entry = fragment_entry_new(context, sender_tag, n);
 
-      context->K = k;
-    } else
-      initialize_fragment_context(context);
+  if (!entry) {
+    context->status = FRAGMENT_UNFRAGMENTED;
+    return ERROR;
   }
 
-  if (context->N == context->K) {
-    *unfrag_msg = otrv4_strdup(context->fragment);
-    free(context->fragment);
-    context->fragment = NULL;
+  if (fragment_entry_add(context, entry, k, message + start, msg_len)) {
+    fragment_entry_free(context, entry);
+    OTRV4_STATS_INC(context->stats, fragments_dropped);
+    context->status = FRAGMENT_UNFRAGMENTED;
+    return ERROR;
+  }
+
+  fragment_entry_unlink(context, entry);
+  fragment_entry_push(context, entry);
+
+  if (entry->K == entry->key.N) {
+    size_t len = (entry->key.N - 1) * entry->piece_len + entry->last_len;
+    entry->buffer[len] = '\0';
+    *unfrag_msg = entry->buffer;
+    entry->buffer = NULL;
+    fragment_entry_free(context, entry);
     context->status = FRAGMENT_COMPLETE;
+    OTRV4_STATS_INC(context->stats, fragments_reassembled);
   }
 
   return SUCCESS;
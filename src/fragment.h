@@ -1,28 +1,92 @@
 #ifndef OTRV4_FRAGMENT_H
 #define OTRV4_FRAGMENT_H
 
+#include <stdint.h>
+
 #include "error.h"
+#include "hashtable.h"
 #include "shared.h"
+#include "stats.h"
 #include "str.h"
 
 #define FRAGMENT_HEADER_LEN 37
 
+/* "?OTR|sender|receiver,k,n," which precedes the payload of a piece. The
+ * payload is followed by a "," */
+#define FRAGMENT_PREFIX_LEN 35
+
+/* Memory a fragment context may hold for partially received messages. When
+ * it is exceeded, the least recently updated messages are dropped. */
+#ifndef OTRV4_FRAGMENT_BUDGET
+#define OTRV4_FRAGMENT_BUDGET (4 * 1024 * 1024)
+#endif
+
+/* Partial messages a fragment context keeps at most, however small they are.
+ * Beyond that, the least recently updated ones are dropped as well. */
+#ifndef OTRV4_FRAGMENT_MAX_ENTRIES
+#define OTRV4_FRAGMENT_MAX_ENTRIES 64
+#endif
+
+/* The pieces share a single allocation, owned by pieces */
 typedef struct {
   string_t *pieces;
   int total;
 } otrv4_message_to_send_t;
 
+/* A piece that references the payload in the original message, for
+ * transports that write the prefix, the payload and the "," without
+ * copying them together */
+typedef struct {
+  char prefix[FRAGMENT_PREFIX_LEN + 1];
+  const char *payload;
+  size_t payload_len;
+} otrv4_fragment_view_t;
+
 typedef enum {
   FRAGMENT_UNFRAGMENTED,
   FRAGMENT_INCOMPLETE,
   FRAGMENT_COMPLETE
 } fragment_status;
 
+/*
+ * A message being reassembled. Every piece but the last has the same length,
+ * so once it is known the whole message is allocated and each piece is copied
+ * straight to its place.
+ */
 typedef struct {
-  unsigned int K, N;
-  string_t fragment;
-  size_t fragment_len;
+  uint32_t sender_tag;
+  unsigned int N; /* Number of pieces */
+} fragment_key_t;
+
+typedef struct fragment_entry_t {
+  fragment_key_t key;
+  unsigned int K; /* Number of pieces received */
+  size_t piece_len;
+  size_t last_len;
+  char *buffer;
+  char *last; /* the last piece, when it arrives before the buffer exists */
+  uint8_t *received;
+  size_t size;
+  struct fragment_entry_t *prev, *next;
+} fragment_entry_t;
+
+/* Estimate of what the allocator keeps for each block */
+#define FRAGMENT_ALLOC_OVERHEAD 16
+
+/* What a partial message is charged on top of its received map and pieces:
+ * the entry itself, and the overhead of its (at most four) allocations */
+#define FRAGMENT_ENTRY_COST                                                    \
+  (sizeof(fragment_entry_t) + 4 * FRAGMENT_ALLOC_OVERHEAD)
+
+/* Partial messages, keyed by sender instance tag and number of pieces, from
+ * the most to the least recently updated. */
+typedef struct {
+  fragment_entry_t *head, *tail;
+  otrv4_hashtable_t entries[1]; /* By key */
+  size_t count;
+  size_t used, budget;
   fragment_status status;
+  otrv4_stats_t *stats; /* Of the client, if any */
 } fragment_context_t;
 
 API otrv4_message_to_send_t *otrv4_message_new(void);
@@ -39,12 +103,32 @@ INTERNAL otrv4_err_t otrv4_fragment_message(int mms,
                                             int their_instance,
                                             const string_t message);
 
+/* Fills *views with total pieces pointing into message, which must outlive
+ * them. Free *views with free(). */
+INTERNAL otrv4_err_t otrv4_fragment_message_view(otrv4_fragment_view_t **views,
+                                                 int *total, int mms,
+                                                 int our_instance,
+                                                 int their_instance,
+                                                 const string_t message);
+
 INTERNAL otrv4_err_t otrv4_unfragment_message(char **unfrag_msg,
                                               fragment_context_t *context,
                                               const string_t message,
                                               const int our_instance_tag);
 
 #ifdef OTRV4_FRAGMENT_PRIVATE
+
+tstatic otrv4_err_t fragment_count(int *total, size_t msg_len, int mms);
+
+tstatic void fragment_prefix_set_index(char *prefix, int k);
+
+tstatic fragment_entry_t *find_fragment_entry(const fragment_context_t *context,
+                                              uint32_t sender_tag,
+                                              unsigned int n);
+
+tstatic void fragment_entry_free(fragment_context_t *context,
+                                 fragment_entry_t *entry);
+
 #endif
 
 #endif
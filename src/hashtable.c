@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OTRV4_HASHTABLE_PRIVATE
+
+#include "hashtable.h"
+
+#define HASHTABLE_MIN_CAPACITY 16
+
+INTERNAL void otrv4_hashtable_init(otrv4_hashtable_t *table,
+                                   otrv4_hash_fn_t hash,
+                                   otrv4_hash_eq_fn_t eq) {
+  table->slots = NULL;
+  table->capacity = 0;
+  table->len = 0;
+  table->hash = hash;
+  table->eq = eq;
+}
+
+INTERNAL void otrv4_hashtable_destroy(otrv4_hashtable_t *table,
+                                      void (*fn)(void *value)) {
+  size_t i;
+
+  if (fn)
+    for (i = 0; i < table->capacity; i++)
+      if (table->slots[i].value)
+        fn(table->slots[i].value);
+
+  free(table->slots);
+  table->slots = NULL;
+  table->capacity = 0;
+  table->len = 0;
+}
+
+/* Returns the slot holding key, or the empty slot where it would go */
+tstatic hashtable_slot_t *hashtable_find(const otrv4_hashtable_t *table,
+                                         const void *key, size_t hash) {
+  size_t mask = table->capacity - 1;
+  size_t i = hash & mask;
+
+  while (table->slots[i].value) {
+    if (table->slots[i].hash == hash && table->eq(table->slots[i].key, key))
+      break;
+
+    i = (i + 1) & mask;
+  }
+
+  return &table->slots[i];
+}
+
+tstatic otrv4_err_t hashtable_grow(otrv4_hashtable_t *table) {
+  size_t capacity = table->capacity ? table->capacity * 2
+                                    : HASHTABLE_MIN_CAPACITY;
+  hashtable_slot_t *old = table->slots;
+  size_t old_capacity = table->capacity;
+  size_t i;
+
+  hashtable_slot_t *slots = calloc(capacity, sizeof(hashtable_slot_t));
+  if (!slots)
+    return ERROR;
+
+  table->slots = slots;
+  table->capacity = capacity;
+
+  for (i = 0; i < old_capacity; i++)
+    if (old[i].value)
+      *hashtable_find(table, old[i].key, old[i].hash) = old[i];
+
+  free(old);
+
+  return SUCCESS;
+}
+
+INTERNAL void *otrv4_hashtable_get(const otrv4_hashtable_t *table,
+                                   const void *key) {
+  if (!table->len)
+    return NULL;
+
+  return hashtable_find(table, key, table->hash(key))->value;
+}
+
+INTERNAL otrv4_err_t otrv4_hashtable_put(otrv4_hashtable_t *table,
+                                         const void *key, void *value) {
+  size_t hash = table->hash(key);
+
+  if (!value)
+    return ERROR;
+
+  /* Keep the load under 3/4 so probes stay short */
+  if (4 * (table->len + 1) > 3 * table->capacity)
+    if (hashtable_grow(table))
+      return ERROR;
+
+  hashtable_slot_t *slot = hashtable_find(table, key, hash);
+  if (!slot->value)
+    table->len++;
+
+  slot->hash = hash;
+  slot->key = key;
+  slot->value = value;
+
+  return SUCCESS;
+}
+
+INTERNAL void *otrv4_hashtable_remove(otrv4_hashtable_t *table,
+                                      const void *key) {
+  if (!table->len)
+    return NULL;
+
+  size_t mask = table->capacity - 1;
+  hashtable_slot_t *slot = hashtable_find(table, key, table->hash(key));
+  void *value = slot->value;
+  if (!value)
+    return NULL;
+
+  /* Shift back the entries that follow, so no probe sequence is broken */
+  size_t hole = slot - table->slots;
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & mask;
+    if (!table->slots[i].value)
+      break;
+
+    size_t home = table->slots[i].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table->slots[hole] = table->slots[i];
+      hole = i;
+    }
+  }
+
+  memset(&table->slots[hole], 0, sizeof(hashtable_slot_t));
+  table->len--;
+
+  return value;
+}
+
+INTERNAL void otrv4_hashtable_foreach(const otrv4_hashtable_t *table,
+                                      void (*fn)(const void *key, void *value,
+                                                 void *context),
+                                      void *context) {
+  size_t i;
+
+  for (i = 0; i < table->capacity; i++)
+    if (table->slots[i].value)
+      fn(table->slots[i].key, table->slots[i].value, context);
+}
+
+INTERNAL void otrv4_sharded_table_init(otrv4_sharded_table_t *table,
+                                       otrv4_hash_fn_t hash,
+                                       otrv4_hash_eq_fn_t eq) {
+  int i;
+
+  for (i = 0; i < OTRV4_HASHTABLE_SHARDS; i++) {
+    otrv4_hashtable_init(table->shards[i].table, hash, eq);
+    pthread_mutex_init(&table->shards[i].lock, NULL);
+  }
+
+  table->hash = hash;
+}
+
+INTERNAL void otrv4_sharded_table_destroy(otrv4_sharded_table_t *table,
+                                          void (*fn)(void *value)) {
+  int i;
+
+  for (i = 0; i < OTRV4_HASHTABLE_SHARDS; i++) {
+    otrv4_hashtable_destroy(table->shards[i].table, fn);
+    pthread_mutex_destroy(&table->shards[i].lock);
+  }
+}
+
+INTERNAL hashtable_shard_t *
+otrv4_sharded_table_shard(otrv4_sharded_table_t *table, const void *key) {
+  /* Tables index slots with the low bits, so shards use the high ones */
+  size_t hash = table->hash(key);
+  return &table->shards[(hash >> 24) % OTRV4_HASHTABLE_SHARDS];
+}
+
+INTERNAL void *otrv4_sharded_table_remove(otrv4_sharded_table_t *table,
+                                          const void *key) {
+  hashtable_shard_t *shard = otrv4_sharded_table_shard(table, key);
+
+  pthread_mutex_lock(&shard->lock);
+  void *value = otrv4_hashtable_remove(shard->table, key);
+  pthread_mutex_unlock(&shard->lock);
+
+  return value;
+}
+
+INTERNAL size_t otrv4_sharded_table_len(otrv4_sharded_table_t *table) {
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < OTRV4_HASHTABLE_SHARDS; i++) {
+    pthread_mutex_lock(&table->shards[i].lock);
+    len += table->shards[i].table->len;
+    pthread_mutex_unlock(&table->shards[i].lock);
+  }
+
+  return len;
+}
+
+/* FNV-1a */
+INTERNAL size_t otrv4_hash_string(const void *key) {
+  const unsigned char *s = key;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (; *s; s++) {
+    hash ^= *s;
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+INTERNAL int otrv4_hash_string_eq(const void *a, const void *b) {
+  return strcmp(a, b) == 0;
+}
+
+/* Pointers are aligned, so their low bits carry little information */
+INTERNAL size_t otrv4_hash_pointer(const void *key) {
+  uint64_t hash = (uintptr_t)key;
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+INTERNAL int otrv4_hash_pointer_eq(const void *a, const void *b) {
+  return a == b;
+}
@@ -0,0 +1,111 @@
+#ifndef OTRV4_HASHTABLE_H
+#define OTRV4_HASHTABLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "error.h"
+#include "shared.h"
+
+/* Returns nonzero if both keys are the same */
+typedef int (*otrv4_hash_eq_fn_t)(const void *a, const void *b);
+
+typedef size_t (*otrv4_hash_fn_t)(const void *key);
+
+/* An empty slot has no value */
+typedef struct {
+  size_t hash;
+  const void *key;
+  void *value;
+} hashtable_slot_t;
+
+/*
+ * Open addressing table with linear probing. It only stores pointers, so
+ * values never move. Keys are not copied and must live as long as their
+ * value is in the table, and a composite key can be used by passing a
+ * pointer to a struct with matching hash and eq functions.
+ */
+typedef struct {
+  hashtable_slot_t *slots;
+  size_t capacity; /* zero, or a power of two */
+  size_t len;
+  otrv4_hash_fn_t hash;
+  otrv4_hash_eq_fn_t eq;
+} otrv4_hashtable_t;
+
+#ifndef OTRV4_HASHTABLE_SHARDS
+#define OTRV4_HASHTABLE_SHARDS 16
+#endif
+
+typedef struct {
+  otrv4_hashtable_t table[1];
+  pthread_mutex_t lock;
+} hashtable_shard_t;
+
+/* A table split in shards, each with its own lock, so threads working on
+ * different keys rarely wait for each other. Callers lock the shard of a
+ * key around any use of its table. */
+typedef struct {
+  hashtable_shard_t shards[OTRV4_HASHTABLE_SHARDS];
+  otrv4_hash_fn_t hash;
+} otrv4_sharded_table_t;
+
+INTERNAL void otrv4_hashtable_init(otrv4_hashtable_t *table,
+                                   otrv4_hash_fn_t hash, otrv4_hash_eq_fn_t eq);
+
+// Free the table and invoke fn to free the values
+INTERNAL void otrv4_hashtable_destroy(otrv4_hashtable_t *table,
+                                      void (*fn)(void *value));
+
+INTERNAL void *otrv4_hashtable_get(const otrv4_hashtable_t *table,
+                                   const void *key);
+
+/* Replaces the value if the key is already present. value can not be NULL. */
+INTERNAL otrv4_err_t otrv4_hashtable_put(otrv4_hashtable_t *table,
+                                         const void *key, void *value);
+
+/* Returns the value that was removed, or NULL */
+INTERNAL void *otrv4_hashtable_remove(otrv4_hashtable_t *table,
+                                      const void *key);
+
+INTERNAL void otrv4_hashtable_foreach(const otrv4_hashtable_t *table,
+                                      void (*fn)(const void *key, void *value,
+                                                 void *context),
+                                      void *context);
+
+INTERNAL void otrv4_sharded_table_init(otrv4_sharded_table_t *table,
+                                       otrv4_hash_fn_t hash,
+                                       otrv4_hash_eq_fn_t eq);
+
+// Free the table and invoke fn to free the values
+INTERNAL void otrv4_sharded_table_destroy(otrv4_sharded_table_t *table,
+                                          void (*fn)(void *value));
+
+INTERNAL hashtable_shard_t *
+otrv4_sharded_table_shard(otrv4_sharded_table_t *table, const void *key);
+
+/* Removes the key under the lock of its shard. Returns the value that was
+ * removed, or NULL */
+INTERNAL void *otrv4_sharded_table_remove(otrv4_sharded_table_t *table,
+                                          const void *key);
+
+INTERNAL size_t otrv4_sharded_table_len(otrv4_sharded_table_t *table);
+
+INTERNAL size_t otrv4_hash_string(const void *key);
+
+INTERNAL int otrv4_hash_string_eq(const void *a, const void *b);
+
+INTERNAL size_t otrv4_hash_pointer(const void *key);
+
+INTERNAL int otrv4_hash_pointer_eq(const void *a, const void *b);
+
+#ifdef OTRV4_HASHTABLE_PRIVATE
+
+tstatic hashtable_slot_t *hashtable_find(const otrv4_hashtable_t *table,
+                                         const void *key, size_t hash);
+
+tstatic otrv4_err_t hashtable_grow(otrv4_hashtable_t *table);
+
+#endif
+
+#endif
@@ -1,4 +1,222 @@
 #ifndef LIBOTRV4_H
 #define LIBOTRV4_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Marker macro for API functions, as in shared.h */
+#ifndef API
+#define API
+#endif
+
+// needed for comparing with DECAF_TRUE
+typedef uint32_t
+    otrv4_bool_t; /* "Boolean" type, will be set to all-zero or all-one */
+
+static const otrv4_bool_t otrv4_true = 0;
+static const otrv4_bool_t otrv4_false = 1;
+
+typedef enum {
+  SUCCESS = 0,
+  ERROR = 1,
+  STATE_NOT_ENCRYPTED = 0x1001,
+  MSG_NOT_VALID = 0x1011,
+} otrv4_err_t;
+
+/* Only used through pointers: their members are private to the library */
+typedef struct otrv4_client_state_t otrv4_client_state_t;
+typedef struct otrv4_client_t otrv4_client_t;
+typedef struct otrv4_userstate_t otrv4_userstate_t;
+
+/* Allocator */
+
+/*
+ * Allocator used for the scratch arenas, the TLVs of the messages sent and
+ * received, and the old MAC keys kept until they are revealed. Memory handed
+ * to the caller (messages to send or display) is always allocated with
+ * malloc(), since the caller frees it, and so are the other objects of the
+ * library.
+ *
+ * The allocator must be set before any client or connection is created.
+ */
+typedef struct {
+  void *(*alloc)(size_t size, void *ctx);
+  void (*dealloc)(void *ptr, void *ctx);
+  void *ctx;
+} otrv4_allocator_t;
+
+/* Passing NULL restores malloc() and free() */
+API void otrv4_allocator_set(const otrv4_allocator_t *allocator);
+
+/* Keypool */
+
+/*
+ * Pool of pre-generated ephemeral keypairs used by the double ratchet.
+ *
+ * The pool is opt-in: once enabled, a background thread keeps up to
+ * `capacity` ECDH and DH keypairs ready, and starts refilling whenever either
+ * stock drops to `low_watermark`. Ratchet steps take keys from the pool and
+ * fall back to generating them inline when it is disabled or empty.
+ *
+ * otrv4_dh_init() must be called before enabling the pool, and the pool must
+ * be disabled before otrv4_dh_free().
+ */
+
+typedef struct {
+  uint64_t ecdh_hits;
+  uint64_t ecdh_misses;
+  uint64_t dh_hits;
+  uint64_t dh_misses;
+  uint64_t refills;         /* keypairs generated by the refill thread */
+  uint64_t refill_ns_total; /* time spent generating them */
+  uint64_t refill_ns_max;
+  size_t ecdh_available;
+  size_t dh_available;
+} otrv4_keypool_stats_t;
+
+API otrv4_err_t otrv4_keypool_enable(size_t capacity, size_t low_watermark);
+
+API void otrv4_keypool_disable(void);
+
+API void otrv4_keypool_get_stats(otrv4_keypool_stats_t *stats);
+
+/* Workers */
+
+/*
+ * Pool of threads that otrv4_client_receive_batch() shares its work with.
+ * The pool is opt-in: until it is enabled, batches are received by the
+ * calling thread alone. Disabling it waits for the threads to finish what
+ * they are receiving.
+ */
+API otrv4_err_t otrv4_workers_enable(unsigned int threads);
+
+API void otrv4_workers_disable(void);
+
+/* Stats */
+
+/*
+ * Counters of what a client did, and the time spent in the expensive
+ * operations. They are only kept when the library is built with OTRV4_STATS
+ * (./configure --enable-stats): otherwise the snapshot fails.
+ */
+
+typedef enum {
+  OTRV4_STATS_MSG_IDENTITY,
+  OTRV4_STATS_MSG_AUTH_R,
+  OTRV4_STATS_MSG_AUTH_I,
+  OTRV4_STATS_MSG_PRE_KEY,
+  OTRV4_STATS_MSG_NON_INT_AUTH,
+  OTRV4_STATS_MSG_DATA,
+  OTRV4_STATS_MSG_OTHER,
+  OTRV4_STATS_MSG_TYPES
+} otrv4_stats_msg_t;
+
+typedef enum {
+  OTRV4_STATS_TIMER_DH,
+  OTRV4_STATS_TIMER_ECDH,
+  OTRV4_STATS_TIMER_SNIZKPK,
+  OTRV4_STATS_TIMER_SMP,
+  OTRV4_STATS_TIMER_BASE64,
+  OTRV4_STATS_TIMERS
+} otrv4_stats_timer_t;
+
+/* Every member is a uint64_t, so a snapshot can copy them one by one */
+typedef struct {
+  uint64_t sent[OTRV4_STATS_MSG_TYPES];
+  uint64_t received[OTRV4_STATS_MSG_TYPES];
+
+  uint64_t dakes_started;
+  uint64_t dakes_completed;
+  uint64_t dakes_failed;
+
+  uint64_t ratchets;
+  uint64_t skipped_keys_stored;
+
+  uint64_t fragments_reassembled;
+  uint64_t fragments_dropped; /* Partial messages that will never complete */
+
+  uint64_t mac_failures; /* Data messages that did not verify */
+  uint64_t decrypt_failures;
+
+  /* Cumulative nanoseconds. These are kept for the whole process, since the
+   * operations they time do not know which client they work for. */
+  uint64_t timer_ns[OTRV4_STATS_TIMERS];
+} otrv4_stats_t;
+
+/* Copies what the client did so far, and the time spent in the expensive
+ * operations, into dst. Fails if the library was built without stats. */
+API otrv4_err_t otrv4_client_state_stats(otrv4_stats_t *dst,
+                                         const otrv4_client_state_t *state);
+
+/* Client */
+
+/*
+ * Encrypts count messages for the recipient. *newmessages points to an array
+ * of the *sent encoded messages, stored in a single allocation which is
+ * released with free(*newmessages).
+ *
+ * If a message cannot be encrypted, the ones after it are not either, and 1
+ * is returned. The ones before it are still returned, and must be sent: they
+ * used up their keys, and the first one reveals old MAC keys.
+ */
+API int otrv4_client_send_batch(char ***newmessages, size_t *sent,
+                                const char **messages, size_t count,
+                                const char *recipient, otrv4_client_t *client);
+
+typedef struct {
+  const char *recipient;
+  const char *message;
+} otrv4_client_inbound_t;
+
+typedef struct {
+  char *to_send;    /* A reply for the recipient, or NULL */
+  char *to_display; /* or NULL */
+  int ignore;       /* As returned by otrv4_client_receive() */
+} otrv4_client_received_t;
+
+/*
+ * Receives count messages, possibly from different recipients, and sets
+ * results[i] for messages[i]. Messages from the same recipient are received
+ * in the order they appear, holding the conversation only once. When workers
+ * is more than 1, up to that many threads (the calling one, and idle threads
+ * of the pool started with otrv4_workers_enable()) receive from different
+ * recipients at the same time.
+ *
+ * The callbacks of the client (gone_secure, the SMP ones and so on) are then
+ * called from those threads, one conversation at a time, and must be safe to
+ * call from any thread.
+ *
+ * A conversation disconnected during the batch is only freed once the batch
+ * is done with it. Messages for it that were not received yet are received
+ * by the closed connection.
+ *
+ * Returns 0 on success, or 1 if the batch could not be received (and no
+ * result is set).
+ */
+API int otrv4_client_receive_batch(otrv4_client_received_t *results,
+                                   const otrv4_client_inbound_t *messages,
+                                   size_t count, unsigned int workers,
+                                   otrv4_client_t *client);
+
+/*
+ * Computes the nonces the next DAKEs will use to authenticate, so they reply
+ * faster. Meant to be called when the application is idle. Returns how many
+ * nonces were computed.
+ */
+API int otrv4_client_precompute_auth(otrv4_client_t *client);
+
+/*
+ * Signs our profile again if it is close to expiring, so no conversation
+ * has to. Meant to be called periodically. Conversations take the new
+ * profile when they start their next DAKE. Returns 0 on success.
+ */
+API int otrv4_client_refresh_profile(otrv4_client_t *client);
+
+/* User state */
+
+/* Frees the state and the client of an account. Returns 0 on success, or 1
+ * if there is no such account. */
+API int otrv4_user_state_remove_account(otrv4_userstate_t *state,
+                                        void *client_id);
+
 #endif
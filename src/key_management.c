@@ -4,22 +4,28 @@
 
 #define OTRV4_KEY_MANAGEMENT_PRIVATE
 
+#include "alloc.h"
 #include "key_management.h"
+#include "keypool.h"
 #include "random.h"
 #include "shake.h"
 
 #include "debug.h"
 
-tstatic void chain_link_free(chain_link_t *head) {
-  chain_link_t *current = head;
-  chain_link_t *next = NULL;
-  while (current) {
-    next = current->next;
+tstatic void chain_init(chain_t *chain) {
+  chain->id = 0;
+  memset(chain->key, 0, sizeof(chain->key));
+  chain->key_used = 0;
+  chain->skipped = NULL;
+}
 
-    sodium_memzero(current->key, sizeof(chain_key_t));
-    free(current);
+tstatic void chain_destroy(chain_t *chain) {
+  sodium_memzero(chain->key, sizeof(chain_key_t));
 
-    current = next;
+  if (chain->skipped) {
+    sodium_memzero(chain->skipped, OTRV4_MAX_SKIP * sizeof(chain_link_t));
+    free(chain->skipped);
+    chain->skipped = NULL;
   }
 }
 
@@ -29,14 +35,8 @@ tstatic ratchet_t *ratchet_new() {
     return NULL;
 
   memset(ratchet->root_key, 0, sizeof(ratchet->root_key));
-
-  ratchet->chain_a->id = 0;
-  memset(ratchet->chain_a->key, 0, sizeof(ratchet->chain_a->key));
-  ratchet->chain_a->next = NULL;
-
-  ratchet->chain_b->id = 0;
-  memset(ratchet->chain_b->key, 0, sizeof(ratchet->chain_b->key));
-  ratchet->chain_b->next = NULL;
+  chain_init(ratchet->chain_a);
+  chain_init(ratchet->chain_b);
 
   return ratchet;
 }
@@ -47,11 +47,8 @@ tstatic void ratchet_free(ratchet_t *ratchet) {
 
   sodium_memzero(ratchet->root_key, sizeof(root_key_t));
 
-  chain_link_free(ratchet->chain_a->next);
-  ratchet->chain_a->next = NULL;
-
-  chain_link_free(ratchet->chain_b->next);
-  ratchet->chain_b->next = NULL;
+  chain_destroy(ratchet->chain_a);
+  chain_destroy(ratchet->chain_b);
 
   free(ratchet);
   ratchet = NULL;
@@ -66,6 +63,7 @@ otrv4_key_manager_init(key_manager_t *manager) // make like ratchet_new?
 
   otrv4_ec_bzero(manager->their_ecdh, ED448_POINT_BYTES);
   manager->their_dh = NULL;
+  manager->their_dh_validated = NULL;
 
   otrv4_ec_bzero(manager->their_shared_prekey, ED448_POINT_BYTES);
   otrv4_ec_bzero(manager->our_shared_prekey, ED448_POINT_BYTES);
@@ -82,6 +80,18 @@ otrv4_key_manager_init(key_manager_t *manager) // make like ratchet_new?
   memset(manager->tmp_key, 0, sizeof(manager->tmp_key));
 
   manager->old_mac_keys = NULL;
+  manager->spare_mac_keys = NULL;
+
+  manager->stats = NULL;
+  manager->tracer = NULL;
+}
+
+tstatic void mac_keys_free(list_element_t *mac_keys) {
+  list_element_t *el;
+  for (el = mac_keys; el; el = el->next)
+    sodium_memzero(el->data, MAC_KEY_BYTES);
+
+  otrv4_list_free(mac_keys, otrv4_dealloc);
 }
 
 INTERNAL void otrv4_key_manager_destroy(key_manager_t *manager) {
@@ -92,6 +102,8 @@ INTERNAL void otrv4_key_manager_destroy(key_manager_t *manager) {
 
   gcry_mpi_release(manager->their_dh);
   manager->their_dh = NULL;
+  gcry_mpi_release(manager->their_dh_validated);
+  manager->their_dh_validated = NULL;
 
   ratchet_free(manager->current);
   manager->current = NULL;
@@ -107,14 +119,26 @@ INTERNAL void otrv4_key_manager_destroy(key_manager_t *manager) {
   // TODO: once ake is finished should be wiped out
   sodium_memzero(manager->tmp_key, sizeof(manager->tmp_key));
 
-  list_element_t *el;
-  for (el = manager->old_mac_keys; el; el = el->next) {
-    free((uint8_t *)el->data);
-    el->data = NULL;
-  }
-
-  otrv4_list_free_full(manager->old_mac_keys);
+  mac_keys_free(manager->old_mac_keys);
   manager->old_mac_keys = NULL;
+  mac_keys_free(manager->spare_mac_keys);
+  manager->spare_mac_keys = NULL;
+}
+
+INTERNAL otrv4_bool_t
+otrv4_key_manager_valid_their_dh(key_manager_t *manager,
+                                 const dh_public_key_t their_dh) {
+  if (their_dh && manager->their_dh_validated &&
+      gcry_mpi_cmp(their_dh, manager->their_dh_validated) == 0)
+    return otrv4_true;
+
+  if (otrv4_dh_mpi_valid(their_dh) == otrv4_false)
+    return otrv4_false;
+
+  otrv4_dh_mpi_release(manager->their_dh_validated);
+  manager->their_dh_validated = otrv4_dh_mpi_copy(their_dh);
+
+  return otrv4_true;
 }
 
 INTERNAL otrv4_err_t
@@ -122,16 +146,21 @@ otrv4_key_manager_generate_ephemeral_keys(key_manager_t *manager) {
   time_t now;
   uint8_t sym[ED448_PRIVATE_BYTES];
   memset(sym, 0, sizeof(sym));
-  random_bytes(sym, ED448_PRIVATE_BYTES);
 
   now = time(NULL);
   otrv4_ec_point_destroy(manager->our_ecdh->pub);
-  otrv4_ecdh_keypair_generate(manager->our_ecdh, sym);
+  if (otrv4_keypool_take_ecdh(manager->our_ecdh) == otrv4_false) {
+    random_bytes(sym, ED448_PRIVATE_BYTES);
+    otrv4_ecdh_keypair_generate(manager->our_ecdh, sym);
+  }
   manager->lastgenerated = now;
 
   if (manager->i % 3 == 0) {
     otrv4_dh_keypair_destroy(manager->our_dh);
 
+    if (otrv4_keypool_take_dh(manager->our_dh) == otrv4_true)
+      return SUCCESS;
+
     if (otrv4_dh_keypair_generate(manager->our_dh)) {
       return ERROR;
     }
@@ -153,28 +182,21 @@ INTERNAL void otrv4_key_manager_prepare_to_ratchet(key_manager_t *manager) {
   manager->j = 0;
 }
 
-tstatic void derive_key_from_shared_secret(uint8_t *key, size_t keylen,
-                                           const uint8_t magic[1],
-                                           const shared_secret_t shared) {
-  shake_256_kdf(key, keylen, magic, shared, sizeof(shared_secret_t));
-}
+/* The root key and both chain keys come from the same shared secret, so
+ * they are derived as one batch */
+tstatic void derive_ratchet_keys(ratchet_t *ratchet,
+                                 const shared_secret_t shared) {
+  const uint8_t magic[3] = {0x1, 0x2, 0x3};
+  shake_kkdf_job_t jobs[3] = {
+      {ratchet->root_key, sizeof(root_key_t), &magic[0], 1, shared,
+       sizeof(shared_secret_t)},
+      {ratchet->chain_a->key, sizeof(chain_key_t), &magic[1], 1, shared,
+       sizeof(shared_secret_t)},
+      {ratchet->chain_b->key, sizeof(chain_key_t), &magic[2], 1, shared,
+       sizeof(shared_secret_t)},
+  };
 
-tstatic void derive_root_key(root_key_t root_key,
-                             const shared_secret_t shared) {
-  uint8_t magic[1] = {0x1};
-  derive_key_from_shared_secret(root_key, sizeof(root_key_t), magic, shared);
-}
-
-tstatic void derive_chain_key_a(chain_key_t chain_key,
-                                const shared_secret_t shared) {
-  uint8_t magic[1] = {0x2};
-  derive_key_from_shared_secret(chain_key, sizeof(chain_key_t), magic, shared);
-}
-
-tstatic void derive_chain_key_b(chain_key_t chain_key,
-                                const shared_secret_t shared) {
-  uint8_t magic[1] = {0x3};
-  derive_key_from_shared_secret(chain_key, sizeof(chain_key_t), magic, shared);
+  shake_kkdf_batch(jobs, 3);
 }
 
 tstatic otrv4_err_t key_manager_new_ratchet(key_manager_t *manager,
@@ -184,16 +206,12 @@ tstatic otrv4_err_t key_manager_new_ratchet(key_manager_t *manager,
     return ERROR;
   }
   if (manager->i == 0) {
-    derive_root_key(ratchet->root_key, shared);
-    derive_chain_key_a(ratchet->chain_a->key, shared);
-    derive_chain_key_b(ratchet->chain_b->key, shared);
+    derive_ratchet_keys(ratchet, shared);
   } else {
     shared_secret_t root_shared;
     shake_kkdf(root_shared, sizeof(shared_secret_t), manager->current->root_key,
                sizeof(root_key_t), shared, sizeof(shared_secret_t));
-    derive_root_key(ratchet->root_key, root_shared);
-    derive_chain_key_a(ratchet->chain_a->key, root_shared);
-    derive_chain_key_b(ratchet->chain_b->key, root_shared);
+    derive_ratchet_keys(ratchet, root_shared);
   }
 
   ratchet_free(manager->current);
@@ -202,116 +220,130 @@ tstatic otrv4_err_t key_manager_new_ratchet(key_manager_t *manager,
   return SUCCESS;
 }
 
-tstatic const chain_link_t *chain_get_last(const chain_link_t *head) {
-  const chain_link_t *cursor = head;
-  while (cursor->next)
-    cursor = cursor->next;
+/* Removes the key for a skipped message from the chain, if it is still
+ * there. The slot for message_id is the only place it can be. */
+tstatic otrv4_err_t chain_take_skipped(chain_key_t dst, int message_id,
+                                       chain_t *chain) {
+  chain_link_t *slot = NULL;
 
-  return cursor;
-}
+  if (!chain->skipped)
+    return ERROR;
 
-tstatic const chain_link_t *chain_get_by_id(int message_id,
-                                            const chain_link_t *head) {
-  const chain_link_t *cursor = head;
-  while (cursor->next && cursor->id != message_id)
-    cursor = cursor->next;
+  slot = &chain->skipped[message_id % OTRV4_MAX_SKIP];
+  if (slot->id != message_id)
+    return ERROR;
 
-  if (cursor->id == message_id) {
-    return cursor;
-  }
+  memcpy(dst, slot->key, sizeof(chain_key_t));
+  sodium_memzero(slot->key, sizeof(chain_key_t));
+  slot->id = -1;
 
-  return NULL;
+  return SUCCESS;
 }
 
-tstatic message_chain_t *decide_between_chain_keys(const ratchet_t *ratchet,
-                                                   const ec_point_t our,
-                                                   const ec_point_t their) {
-  message_chain_t *ret = malloc(sizeof(message_chain_t));
-  if (ret == NULL)
-    return NULL;
+/*
+ * Compares the first sizeof(ec_public_key_t) bytes of both points as
+ * big-endian unsigned integers (which is how they used to be ordered via
+ * gcrypt MPIs), in constant time. Returns 1, 0 or -1.
+ */
+tstatic int ec_point_bytes_cmp(const ec_point_t our, const ec_point_t their) {
+  const uint8_t *a = (const uint8_t *)our;
+  const uint8_t *b = (const uint8_t *)their;
+  uint32_t gt = 0, lt = 0;
+  size_t i;
+
+  for (i = 0; i < sizeof(ec_public_key_t); i++) {
+    uint32_t decided = gt | lt;
+    gt |= (((uint32_t)b[i] - a[i]) >> 31) & ~decided;
+    lt |= (((uint32_t)a[i] - b[i]) >> 31) & ~decided;
+  }
 
-  ret->sending = NULL;
-  ret->receiving = NULL;
+  return (int)gt - (int)lt;
+}
 
-  // TODO: this conversion from point to mpi might be checked.
-  gcry_mpi_t our_mpi = NULL;
-  gcry_mpi_t their_mpi = NULL;
-  if (gcry_mpi_scan(&our_mpi, GCRYMPI_FMT_USG, our, sizeof(ec_public_key_t),
-                    NULL)) {
-    gcry_mpi_release(our_mpi);
-    gcry_mpi_release(their_mpi);
-    return NULL;
-  }
+tstatic otrv4_err_t decide_between_chain_keys(message_chain_t *chain,
+                                              ratchet_t *ratchet,
+                                              const ec_point_t our,
+                                              const ec_point_t their) {
+  int cmp = ec_point_bytes_cmp(our, their);
 
-  if (gcry_mpi_scan(&their_mpi, GCRYMPI_FMT_USG, their, sizeof(ec_public_key_t),
-                    NULL)) {
-    gcry_mpi_release(our_mpi);
-    gcry_mpi_release(their_mpi);
-    return NULL;
-  }
+  chain->sending = NULL;
+  chain->receiving = NULL;
 
-  int cmp = gcry_mpi_cmp(our_mpi, their_mpi);
   if (cmp > 0) {
-    ret->sending = ratchet->chain_a;
-    ret->receiving = ratchet->chain_b;
+    chain->sending = ratchet->chain_a;
+    chain->receiving = ratchet->chain_b;
   } else if (cmp < 0) {
-    ret->sending = ratchet->chain_b;
-    ret->receiving = ratchet->chain_a;
+    chain->sending = ratchet->chain_b;
+    chain->receiving = ratchet->chain_a;
+  } else {
+    return ERROR;
   }
 
-  gcry_mpi_release(our_mpi);
-  gcry_mpi_release(their_mpi);
-
-  return ret;
+  return SUCCESS;
 }
 
 tstatic int key_manager_get_sending_chain_key(chain_key_t sending,
                                               const key_manager_t *manager) {
-  message_chain_t *chain = decide_between_chain_keys(
-      manager->current, manager->our_ecdh->pub, manager->their_ecdh);
-  const chain_link_t *last = chain_get_last(chain->sending);
-  memcpy(sending, last->key, sizeof(chain_key_t));
-  free(chain);
-  chain = NULL;
+  message_chain_t chain[1];
+  if (decide_between_chain_keys(chain, manager->current,
+                                manager->our_ecdh->pub, manager->their_ecdh))
+    return -1;
 
-  return last->id;
+  memcpy(sending, chain->sending->key, sizeof(chain_key_t));
+
+  return chain->sending->id;
 }
 
-tstatic chain_link_t *chain_link_new() {
-  chain_link_t *l = malloc(sizeof(chain_link_t));
-  if (l == NULL)
-    return NULL;
+tstatic void chain_advance(chain_t *chain) {
+  chain_key_t next;
 
-  l->id = 0;
-  l->next = NULL;
+  hash_hash(next, sizeof(chain_key_t), chain->key, sizeof(chain_key_t));
+  memcpy(chain->key, next, sizeof(chain_key_t));
+  sodium_memzero(next, sizeof(chain_key_t));
 
-  return l;
+  chain->id++;
+  chain->key_used = 0;
 }
 
-tstatic chain_link_t *derive_next_chain_link(chain_link_t *previous) {
-  chain_link_t *l = chain_link_new();
-  if (l == NULL)
-    return NULL;
+/* Keeps the current key, unless it was already handed out, so the message
+ * being skipped can still be decrypted if it arrives later. */
+tstatic otrv4_err_t chain_skip_current(chain_t *chain) {
+  chain_link_t *slot = NULL;
+  int i;
 
-  hash_hash(l->key, sizeof(chain_key_t), previous->key, sizeof(chain_key_t));
+  if (chain->key_used)
+    return SUCCESS;
 
-  // TODO: the previous is still needed for the MK
-  sodium_memzero(previous->key, CHAIN_KEY_BYTES);
+  if (!chain->skipped) {
+    chain->skipped = malloc(OTRV4_MAX_SKIP * sizeof(chain_link_t));
+    if (!chain->skipped)
+      return ERROR;
+
+    for (i = 0; i < OTRV4_MAX_SKIP; i++)
+      chain->skipped[i].id = -1;
+  }
 
-  l->id = previous->id + 1;
-  previous->next = l;
-  return l;
+  /* This evicts the key for message (id - OTRV4_MAX_SKIP), if any */
+  slot = &chain->skipped[chain->id % OTRV4_MAX_SKIP];
+  slot->id = chain->id;
+  memcpy(slot->key, chain->key, sizeof(chain_key_t));
+
+  return SUCCESS;
 }
 
-tstatic otrv4_err_t rebuild_chain_keys_up_to(int message_id,
-                                             const chain_link_t *head) {
-  chain_link_t *last = (chain_link_t *)chain_get_last(head);
+tstatic otrv4_err_t rebuild_chain_keys_up_to(int message_id, chain_t *chain,
+                                             otrv4_stats_t *stats) {
+  if (message_id - chain->id > OTRV4_MAX_SKIP)
+    return ERROR;
 
-  int j = 0;
-  for (j = last->id; j < message_id; j++) {
-    last = derive_next_chain_link(last);
-    if (last == NULL)
+  while (chain->id < message_id) {
+    if (chain_skip_current(chain))
       return ERROR;
+
+    if (!chain->key_used)
+      OTRV4_STATS_INC(stats, skipped_keys_stored);
+
+    chain_advance(chain);
   }
 
   return SUCCESS;
@@ -319,24 +351,28 @@ tstatic otrv4_err_t rebuild_chain_keys_up_to(int message_id,
 
 tstatic otrv4_err_t key_manager_get_receiving_chain_key(
     chain_key_t receiving, int message_id, const key_manager_t *manager) {
+  message_chain_t chain[1];
+  chain_t *receiving_chain = NULL;
+  otrv4_err_t err = ERROR;
 
-  message_chain_t *chain = decide_between_chain_keys(
-      manager->current, manager->our_ecdh->pub, manager->their_ecdh);
-  if (rebuild_chain_keys_up_to(message_id, chain->receiving) == ERROR) {
-    free(chain);
-    chain = NULL;
+  if (message_id < 0)
     return ERROR;
-  }
 
-  const chain_link_t *link = chain_get_by_id(message_id, chain->receiving);
-  free(chain);
-  chain = NULL;
+  if (decide_between_chain_keys(chain, manager->current,
+                                manager->our_ecdh->pub, manager->their_ecdh))
+    return ERROR;
+
+  receiving_chain = chain->receiving;
 
-  if (link == NULL)
-    return ERROR; /* message id not found. Should have been generated at
-                        rebuild_chain_keys_up_to */
+  if (message_id < receiving_chain->id)
+    return chain_take_skipped(receiving, message_id, receiving_chain);
 
-  memcpy(receiving, link->key, sizeof(chain_key_t));
+  err = rebuild_chain_keys_up_to(message_id, receiving_chain, manager->stats);
+  if (err)
+    return err;
+
+  memcpy(receiving, receiving_chain->key, sizeof(chain_key_t));
+  receiving_chain->key_used = 1;
 
   return SUCCESS;
 }
@@ -346,18 +382,24 @@ otrv4_ecdh_shared_secret_from_prekey(uint8_t *shared,
                                      otrv4_shared_prekey_pair_t *shared_prekey,
                                      const ec_point_t their_pub) {
   decaf_448_point_t s;
+  OTRV4_STATS_TIMER_START(start);
+
   decaf_448_point_scalarmul(s, their_pub, shared_prekey->priv);
 
   otrv4_ec_point_serialize(shared, s);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_ECDH);
 }
 
 INTERNAL void
 otrv4_ecdh_shared_secret_from_keypair(uint8_t *shared, otrv4_keypair_t *keypair,
                                       const ec_point_t their_pub) {
   decaf_448_point_t s;
+  OTRV4_STATS_TIMER_START(start);
+
   decaf_448_point_scalarmul(s, their_pub, keypair->priv);
 
   otrv4_ec_point_serialize(shared, s);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_ECDH);
 }
 
 tstatic void calculate_shared_secret(shared_secret_t dst, const k_ecdh_t k_ecdh,
@@ -384,19 +426,14 @@ tstatic void calculate_shared_secret_from_tmp_key(shared_secret_t dst,
 }
 
 tstatic otrv4_err_t derive_sending_chain_key(key_manager_t *manager) {
-  message_chain_t *chain = decide_between_chain_keys(
-      manager->current, manager->our_ecdh->pub, manager->their_ecdh);
-  chain_link_t *last = (chain_link_t *)chain_get_last(chain->sending);
-  free(chain);
-  chain = NULL;
-  (void)last;
-
-  // TODO: seems to be wrong
-  chain_link_t *l = derive_next_chain_link(last);
-  if (l == NULL)
+  message_chain_t chain[1];
+  if (decide_between_chain_keys(chain, manager->current,
+                                manager->our_ecdh->pub, manager->their_ecdh))
     return ERROR;
 
-  // TODO: assert l->id == manager->j
+  chain_advance(chain->sending);
+
+  // TODO: assert chain->sending->id == manager->j
   return SUCCESS;
 }
 
@@ -411,17 +448,6 @@ tstatic void calculate_ssid(key_manager_t *manager,
   memcpy(manager->ssid, ssid_buff, sizeof manager->ssid);
 }
 
-tstatic void calculate_extra_key(key_manager_t *manager,
-                                 const chain_key_t chain_key) {
-  uint8_t magic[1] = {0xFF};
-  uint8_t extra_key_buff[HASH_BYTES];
-
-  shake_256_kdf(extra_key_buff, HASH_BYTES, magic, chain_key,
-                sizeof(chain_key_t));
-
-  memcpy(manager->extra_key, extra_key_buff, sizeof manager->extra_key);
-}
-
 tstatic otrv4_err_t calculate_brace_key(key_manager_t *manager) {
   k_dh_t k_dh;
 
@@ -535,7 +561,11 @@ tstatic otrv4_err_t init_ratchet(key_manager_t *manager, bool interactive) {
 
 INTERNAL otrv4_err_t otrv4_key_manager_ratcheting_init(int j, bool interactive,
                                                        key_manager_t *manager) {
-  if (init_ratchet(manager, interactive))
+  OTRV4_TRACE_ENTER(manager->tracer, OTRV4_TRACE_RATCHET_INIT, 0);
+  otrv4_err_t err = init_ratchet(manager, interactive);
+  OTRV4_TRACE_LEAVE(manager->tracer, OTRV4_TRACE_RATCHET_INIT, 0, err);
+
+  if (err)
     return ERROR;
 
   manager->i = 0;
@@ -544,13 +574,21 @@ INTERNAL otrv4_err_t otrv4_key_manager_ratcheting_init(int j, bool interactive,
 }
 
 tstatic otrv4_err_t rotate_keys(key_manager_t *manager) {
+  otrv4_err_t err = ERROR;
+
   manager->i++;
   manager->j = 0;
 
-  if (otrv4_key_manager_generate_ephemeral_keys(manager))
+  OTRV4_TRACE_ENTER(manager->tracer, OTRV4_TRACE_RATCHET_SENDING, 0);
+  if (!otrv4_key_manager_generate_ephemeral_keys(manager))
+    err = enter_new_ratchet(manager);
+  OTRV4_TRACE_LEAVE(manager->tracer, OTRV4_TRACE_RATCHET_SENDING, 0, err);
+
+  if (err)
     return ERROR;
 
-  return enter_new_ratchet(manager);
+  OTRV4_STATS_INC(manager->stats, ratchets);
+  return SUCCESS;
 }
 
 INTERNAL otrv4_err_t
@@ -559,9 +597,16 @@ otrv4_key_manager_ensure_on_ratchet(key_manager_t *manager) {
     return SUCCESS;
 
   manager->i++;
-  if (enter_new_ratchet(manager))
+
+  OTRV4_TRACE_ENTER(manager->tracer, OTRV4_TRACE_RATCHET_RECEIVING, 0);
+  otrv4_err_t err = enter_new_ratchet(manager);
+  OTRV4_TRACE_LEAVE(manager->tracer, OTRV4_TRACE_RATCHET_RECEIVING, 0, err);
+
+  if (err)
     return ERROR;
 
+  OTRV4_STATS_INC(manager->stats, ratchets);
+
   // Securely delete priv keys as no longer needed
   otrv4_ec_scalar_destroy(manager->our_ecdh->priv);
   if (manager->i % 3 == 0) {
@@ -571,15 +616,21 @@ otrv4_key_manager_ensure_on_ratchet(key_manager_t *manager) {
   return SUCCESS;
 }
 
-tstatic void derive_encryption_and_mac_keys(m_enc_key_t enc_key,
-                                            m_mac_key_t mac_key,
-                                            const chain_key_t chain_key) {
-  uint8_t magic1[1] = {0x1};
-  uint8_t magic2[1] = {0x2};
-
-  shake_256_kdf(enc_key, sizeof(m_enc_key_t), magic1, chain_key,
-                sizeof(chain_key_t));
-  shake_256_kdf(mac_key, sizeof(m_mac_key_t), magic2, enc_key,
+/* The encryption key and the extra key both come from the chain key, so
+ * they are derived as one batch. The MAC key comes from the encryption key. */
+tstatic void derive_message_keys(m_enc_key_t enc_key, m_mac_key_t mac_key,
+                                 key_manager_t *manager,
+                                 const chain_key_t chain_key) {
+  const uint8_t magic[3] = {0x1, 0x2, 0xFF};
+  shake_kkdf_job_t jobs[2] = {
+      {enc_key, sizeof(m_enc_key_t), &magic[0], 1, chain_key,
+       sizeof(chain_key_t)},
+      {manager->extra_key, sizeof(manager->extra_key), &magic[2], 1,
+       chain_key, sizeof(chain_key_t)},
+  };
+
+  shake_kkdf_batch(jobs, 2);
+  shake_256_kdf(mac_key, sizeof(m_mac_key_t), &magic[1], enc_key,
                 sizeof(m_enc_key_t));
 }
 
@@ -592,8 +643,7 @@ INTERNAL otrv4_err_t otrv4_key_manager_retrieve_receiving_message_keys(
       ERROR)
     return ERROR;
 
-  derive_encryption_and_mac_keys(enc_key, mac_key, receiving);
-  calculate_extra_key(manager, receiving);
+  derive_message_keys(enc_key, mac_key, manager, receiving);
 
 #ifdef DEBUG
   printf("GOT SENDING KEYS:\n");
@@ -627,8 +677,7 @@ INTERNAL otrv4_err_t otrv4_key_manager_retrieve_sending_message_keys(
   chain_key_t sending;
   int message_id = key_manager_get_sending_chain_key(sending, manager);
 
-  derive_encryption_and_mac_keys(enc_key, mac_key, sending);
-  calculate_extra_key(manager, sending);
+  derive_message_keys(enc_key, mac_key, manager, sending);
 
 #ifdef DEBUG
   printf("GOT SENDING KEYS:\n");
@@ -647,6 +696,22 @@ INTERNAL otrv4_err_t otrv4_key_manager_retrieve_sending_message_keys(
   return ERROR;
 }
 
+INTERNAL size_t
+otrv4_key_manager_old_mac_keys_serialize_into(uint8_t *dst,
+                                              list_element_t *old_mac_keys) {
+  size_t num_mac_keys = otrv4_list_len(old_mac_keys);
+  size_t i = num_mac_keys;
+  list_element_t *current = NULL;
+
+  /* Most recent keys are at the end of the list, and are revealed first */
+  for (current = old_mac_keys; current; current = current->next) {
+    i--;
+    memcpy(dst + i * MAC_KEY_BYTES, current->data, MAC_KEY_BYTES);
+  }
+
+  return num_mac_keys * MAC_KEY_BYTES;
+}
+
 INTERNAL uint8_t *
 otrv4_key_manager_old_mac_keys_serialize(list_element_t *old_mac_keys) {
   uint num_mac_keys = otrv4_list_len(old_mac_keys);
@@ -660,16 +725,73 @@ otrv4_key_manager_old_mac_keys_serialize(list_element_t *old_mac_keys) {
     return NULL;
   }
 
-  for (unsigned int i = 0; i < num_mac_keys; i++) {
-    list_element_t *last = otrv4_list_get_last(old_mac_keys);
-    memcpy(ser_mac_keys + i * MAC_KEY_BYTES, last->data, MAC_KEY_BYTES);
-    old_mac_keys = otrv4_list_remove_element(last, old_mac_keys);
-    otrv4_list_free_full(last);
+  otrv4_key_manager_old_mac_keys_serialize_into(ser_mac_keys, old_mac_keys);
+  mac_keys_free(old_mac_keys);
+
+  return ser_mac_keys;
+}
+
+INTERNAL otrv4_err_t
+otrv4_key_manager_store_old_mac_key(key_manager_t *manager,
+                                    const m_mac_key_t mac_key) {
+  list_element_t *node = manager->spare_mac_keys;
+
+  if (!node) {
+    uint8_t *data = otrv4_alloc(MAC_KEY_BYTES);
+    if (!data)
+      return ERROR;
+
+    memcpy(data, mac_key, MAC_KEY_BYTES);
+    list_element_t *head = otrv4_list_add(data, manager->old_mac_keys);
+    if (!head) {
+      sodium_memzero(data, MAC_KEY_BYTES);
+      otrv4_dealloc(data);
+      return ERROR;
+    }
+
+    manager->old_mac_keys = head;
+    return SUCCESS;
   }
 
-  otrv4_list_free_nodes(old_mac_keys);
+  manager->spare_mac_keys = node->next;
+  node->next = NULL;
+  memcpy(node->data, mac_key, MAC_KEY_BYTES);
 
-  return ser_mac_keys;
+  /* Most recent keys go at the end of the list */
+  list_element_t *last = otrv4_list_get_last(manager->old_mac_keys);
+  if (last)
+    last->next = node;
+  else
+    manager->old_mac_keys = node;
+
+  return SUCCESS;
+}
+
+INTERNAL void
+otrv4_key_manager_release_old_mac_keys(key_manager_t *manager,
+                                       list_element_t *old_mac_keys) {
+  list_element_t *el;
+
+  if (!old_mac_keys)
+    return;
+
+  for (el = old_mac_keys; el; el = el->next)
+    sodium_memzero(el->data, MAC_KEY_BYTES);
+
+  el = otrv4_list_get_last(old_mac_keys);
+  el->next = manager->spare_mac_keys;
+  manager->spare_mac_keys = old_mac_keys;
+}
+
+INTERNAL void
+otrv4_key_manager_restore_old_mac_keys(key_manager_t *manager,
+                                       list_element_t *old_mac_keys) {
+  if (!old_mac_keys)
+    return;
+
+  /* They are older than any key stored since they were taken */
+  otrv4_list_get_last(old_mac_keys)->next = manager->old_mac_keys;
+  manager->old_mac_keys = old_mac_keys;
 }
 
 INTERNAL void otrv4_key_manager_set_their_ecdh(ec_point_t their,
@@ -9,6 +9,8 @@
 #include "keys.h"
 #include "list.h"
 #include "shared.h"
+#include "stats.h"
+#include "trace.h"
 
 typedef uint8_t k_dh_t[384];
 typedef uint8_t brace_key_t[BRACE_KEY_BYTES];
@@ -20,16 +22,33 @@ typedef uint8_t chain_key_t[CHAIN_KEY_BYTES];
 typedef uint8_t m_enc_key_t[32];
 typedef uint8_t m_mac_key_t[MAC_KEY_BYTES];
 
-typedef struct _chain_link {
+/* Maximum number of message keys kept for a chain to decrypt messages that
+ * arrive out of order. Messages further ahead than this are rejected. */
+#ifndef OTRV4_MAX_SKIP
+#define OTRV4_MAX_SKIP 100
+#endif
+
+typedef struct {
   int id;
   chain_key_t key;
-  struct _chain_link *next;
 } chain_link_t;
 
+/*
+ * A chain only keeps its newest key. When receiving skips over message ids,
+ * their keys are kept in a ring of OTRV4_MAX_SKIP links indexed by
+ * id % OTRV4_MAX_SKIP, allocated the first time a message is skipped.
+ */
+typedef struct {
+  int id;
+  chain_key_t key;
+  int key_used;
+  chain_link_t *skipped;
+} chain_t;
+
 typedef struct {
   root_key_t root_key;
-  chain_link_t chain_a[1];
-  chain_link_t chain_b[1];
+  chain_t chain_a[1];
+  chain_t chain_b[1];
 } ratchet_t;
 
 typedef enum {
@@ -44,6 +63,7 @@ typedef struct {
 
   ec_point_t their_ecdh;
   dh_public_key_t their_dh;
+  dh_public_key_t their_dh_validated; /* last DH key that passed validation */
 
   otrv4_shared_prekey_pub_t our_shared_prekey;
   otrv4_shared_prekey_pub_t their_shared_prekey;
@@ -61,12 +81,16 @@ typedef struct {
   uint8_t tmp_key[HASH_BYTES];
 
   list_element_t *old_mac_keys;
+  list_element_t *spare_mac_keys; /* Wiped, to store the next old_mac_keys */
+
+  otrv4_stats_t *stats;          /* Of the client, if any */
+  const otrv4_tracer_t *tracer; /* Of the client, if any */
 
   time_t lastgenerated;
 } key_manager_t;
 
 // clang-format off
-typedef struct { const chain_link_t *sending, *receiving; } message_chain_t;
+typedef struct { chain_t *sending, *receiving; } message_chain_t;
 
 // clang-format on
 
@@ -74,6 +98,12 @@ INTERNAL void otrv4_key_manager_init(key_manager_t *manager);
 
 INTERNAL void otrv4_key_manager_destroy(key_manager_t *manager);
 
+/* Validates their DH public key, skipping the group check when it is the
+ * same key that was validated last time. */
+INTERNAL otrv4_bool_t
+otrv4_key_manager_valid_their_dh(key_manager_t *manager,
+                                 const dh_public_key_t their_dh);
+
 INTERNAL void otrv4_key_manager_set_their_ecdh(ec_point_t their,
                                                key_manager_t *manager);
 
@@ -113,13 +143,46 @@ otrv4_key_manager_prepare_next_chain_key(key_manager_t *manager);
 
 INTERNAL otrv4_err_t otrv4_key_manager_retrieve_sending_message_keys(
     m_enc_key_t enc_key, m_mac_key_t mac_key, key_manager_t *manager);
+
 INTERNAL uint8_t *
 otrv4_key_manager_old_mac_keys_serialize(list_element_t *old_mac_keys);
 
+/* Writes the keys into dst (which must have room for all of them) and
+ * returns the number of bytes written. */
+INTERNAL size_t
+otrv4_key_manager_old_mac_keys_serialize_into(uint8_t *dst,
+                                              list_element_t *old_mac_keys);
+
+/* Keeps mac_key to be revealed in the next message we send. */
+INTERNAL otrv4_err_t
+otrv4_key_manager_store_old_mac_key(key_manager_t *manager,
+                                    const m_mac_key_t mac_key);
+
+/* Wipes old_mac_keys, once taken from the manager and revealed, and keeps
+ * their storage for the next keys to store. */
+INTERNAL void
+otrv4_key_manager_release_old_mac_keys(key_manager_t *manager,
+                                       list_element_t *old_mac_keys);
+
+/* Gives old_mac_keys back to the manager, when the message that was to reveal
+ * them was not sent */
+INTERNAL void
+otrv4_key_manager_restore_old_mac_keys(key_manager_t *manager,
+                                       list_element_t *old_mac_keys);
+
 #ifdef OTRV4_KEY_MANAGEMENT_PRIVATE
+tstatic void mac_keys_free(list_element_t *mac_keys);
+
 tstatic otrv4_err_t key_manager_new_ratchet(key_manager_t *manager,
                                             const shared_secret_t shared);
 
+tstatic int ec_point_bytes_cmp(const ec_point_t our, const ec_point_t their);
+
+tstatic otrv4_err_t decide_between_chain_keys(message_chain_t *chain,
+                                              ratchet_t *ratchet,
+                                              const ec_point_t our,
+                                              const ec_point_t their);
+
 tstatic int key_manager_get_sending_chain_key(chain_key_t sending,
                                               const key_manager_t *manager);
 
@@ -129,6 +192,13 @@ tstatic otrv4_err_t key_manager_get_receiving_chain_key(
 tstatic void calculate_shared_secret(shared_secret_t dst, const k_ecdh_t k_ecdh,
                                      const chain_key_t chain_key);
 
+tstatic void derive_ratchet_keys(ratchet_t *ratchet,
+                                 const shared_secret_t shared);
+
+tstatic void derive_message_keys(m_enc_key_t enc_key, m_mac_key_t mac_key,
+                                 key_manager_t *manager,
+                                 const chain_key_t chain_key);
+
 #endif
 
 #endif
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OTRV4_KEYPOOL_PRIVATE
+
+#include "keypool.h"
+#include "random.h"
+
+static pthread_mutex_t keypool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keypool_low = PTHREAD_COND_INITIALIZER;
+static pthread_t keypool_thread;
+static keypool_t *keypool = NULL;
+
+static uint64_t keypool_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int keypool_needs_refill(const keypool_t *pool) {
+  return pool->ecdh_count <= pool->low_watermark ||
+         pool->dh_count <= pool->low_watermark;
+}
+
+static void keypool_record_refill(keypool_t *pool, uint64_t elapsed) {
+  pool->stats.refills++;
+  pool->stats.refill_ns_total += elapsed;
+  if (elapsed > pool->stats.refill_ns_max)
+    pool->stats.refill_ns_max = elapsed;
+}
+
+/* Generates one keypair of whichever kind is lower, without holding the lock
+ * during the (slow) generation. Returns 0 once both stocks are full or the
+ * generation failed. */
+static int keypool_refill_one(keypool_t *pool) {
+  int want_ecdh = pool->ecdh_count <= pool->dh_count &&
+                  pool->ecdh_count < pool->capacity;
+  int want_dh = !want_ecdh && pool->dh_count < pool->capacity;
+  ecdh_keypair_t ecdh[1];
+  dh_keypair_t dh;
+  uint8_t sym[ED448_PRIVATE_BYTES];
+  uint64_t start;
+  otrv4_err_t err = SUCCESS;
+
+  if (!want_ecdh && !want_dh)
+    return 0;
+
+  pthread_mutex_unlock(&keypool_lock);
+
+  start = keypool_now_ns();
+  if (want_ecdh) {
+    random_bytes(sym, ED448_PRIVATE_BYTES);
+    otrv4_ecdh_keypair_generate(ecdh, sym);
+  } else {
+    err = otrv4_dh_keypair_generate(dh);
+  }
+
+  pthread_mutex_lock(&keypool_lock);
+
+  if (err)
+    return 0;
+
+  keypool_record_refill(pool, keypool_now_ns() - start);
+
+  if (want_ecdh) {
+    memcpy(&pool->ecdh[pool->ecdh_count++], ecdh, sizeof(ecdh_keypair_t));
+    sodium_memzero(ecdh, sizeof(ecdh_keypair_t));
+  } else {
+    pool->dh[pool->dh_count][0] = dh[0];
+    pool->dh_count++;
+  }
+
+  return 1;
+}
+
+tstatic void *keypool_refill_worker(void *data) {
+  keypool_t *pool = data;
+
+  pthread_mutex_lock(&keypool_lock);
+  while (!pool->stopping) {
+    if (keypool_needs_refill(pool))
+      while (!pool->stopping && keypool_refill_one(pool))
+        ;
+
+    if (!pool->stopping)
+      pthread_cond_wait(&keypool_low, &keypool_lock);
+  }
+  pthread_mutex_unlock(&keypool_lock);
+
+  return NULL;
+}
+
+static void keypool_free(keypool_t *pool) {
+  size_t i;
+
+  for (i = 0; i < pool->ecdh_count; i++)
+    otrv4_ecdh_keypair_destroy(&pool->ecdh[i]);
+
+  for (i = 0; i < pool->dh_count; i++)
+    otrv4_dh_keypair_destroy(pool->dh[i]);
+
+  free(pool->ecdh);
+  free(pool->dh);
+  free(pool);
+}
+
+API otrv4_err_t otrv4_keypool_enable(size_t capacity, size_t low_watermark) {
+  keypool_t *pool = NULL;
+
+  if (!capacity || low_watermark >= capacity)
+    return ERROR;
+
+  pool = malloc(sizeof(keypool_t));
+  if (!pool)
+    return ERROR;
+
+  memset(pool, 0, sizeof(keypool_t));
+  pool->capacity = capacity;
+  pool->low_watermark = low_watermark;
+  pool->ecdh = malloc(capacity * sizeof(ecdh_keypair_t));
+  pool->dh = malloc(capacity * sizeof(dh_keypair_t));
+  if (!pool->ecdh || !pool->dh) {
+    keypool_free(pool);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&keypool_lock);
+  if (keypool) {
+    pthread_mutex_unlock(&keypool_lock);
+    keypool_free(pool);
+    return ERROR;
+  }
+
+  if (pthread_create(&keypool_thread, NULL, keypool_refill_worker, pool)) {
+    pthread_mutex_unlock(&keypool_lock);
+    keypool_free(pool);
+    return ERROR;
+  }
+
+  keypool = pool;
+  pthread_mutex_unlock(&keypool_lock);
+
+  return SUCCESS;
+}
+
+API void otrv4_keypool_disable(void) {
+  keypool_t *pool = NULL;
+
+  pthread_mutex_lock(&keypool_lock);
+  pool = keypool;
+  keypool = NULL;
+  if (pool) {
+    pool->stopping = 1;
+    pthread_cond_signal(&keypool_low);
+  }
+  pthread_mutex_unlock(&keypool_lock);
+
+  if (!pool)
+    return;
+
+  pthread_join(keypool_thread, NULL);
+  keypool_free(pool);
+}
+
+API void otrv4_keypool_get_stats(otrv4_keypool_stats_t *stats) {
+  memset(stats, 0, sizeof(otrv4_keypool_stats_t));
+
+  pthread_mutex_lock(&keypool_lock);
+  if (keypool) {
+    *stats = keypool->stats;
+    stats->ecdh_available = keypool->ecdh_count;
+    stats->dh_available = keypool->dh_count;
+  }
+  pthread_mutex_unlock(&keypool_lock);
+}
+
+INTERNAL otrv4_bool_t otrv4_keypool_take_ecdh(ecdh_keypair_t *dst) {
+  otrv4_bool_t taken = otrv4_false;
+
+  pthread_mutex_lock(&keypool_lock);
+  if (keypool) {
+    if (keypool->ecdh_count) {
+      ecdh_keypair_t *src = &keypool->ecdh[--keypool->ecdh_count];
+      memcpy(dst, src, sizeof(ecdh_keypair_t));
+      sodium_memzero(src, sizeof(ecdh_keypair_t));
+      keypool->stats.ecdh_hits++;
+      taken = otrv4_true;
+    } else {
+      keypool->stats.ecdh_misses++;
+    }
+
+    if (keypool_needs_refill(keypool))
+      pthread_cond_signal(&keypool_low);
+  }
+  pthread_mutex_unlock(&keypool_lock);
+
+  return taken;
+}
+
+INTERNAL otrv4_bool_t otrv4_keypool_take_dh(dh_keypair_t dst) {
+  otrv4_bool_t taken = otrv4_false;
+
+  pthread_mutex_lock(&keypool_lock);
+  if (keypool) {
+    if (keypool->dh_count) {
+      keypool->dh_count--;
+      dst[0] = keypool->dh[keypool->dh_count][0];
+      keypool->dh[keypool->dh_count]->pub = NULL;
+      keypool->dh[keypool->dh_count]->priv = NULL;
+      keypool->stats.dh_hits++;
+      taken = otrv4_true;
+    } else {
+      keypool->stats.dh_misses++;
+    }
+
+    if (keypool_needs_refill(keypool))
+      pthread_cond_signal(&keypool_low);
+  }
+  pthread_mutex_unlock(&keypool_lock);
+
+  return taken;
+}
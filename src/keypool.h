@@ -0,0 +1,36 @@
+#ifndef OTRV4_KEYPOOL_H
+#define OTRV4_KEYPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dh.h"
+#include "ed448.h"
+#include "error.h"
+#include "include/libotrv4.h"
+#include "shared.h"
+
+/* The pool and its stats are described in include/libotrv4.h */
+
+INTERNAL otrv4_bool_t otrv4_keypool_take_ecdh(ecdh_keypair_t *dst);
+
+INTERNAL otrv4_bool_t otrv4_keypool_take_dh(dh_keypair_t dst);
+
+#ifdef OTRV4_KEYPOOL_PRIVATE
+
+typedef struct {
+  ecdh_keypair_t *ecdh;
+  dh_keypair_t *dh;
+  size_t ecdh_count;
+  size_t dh_count;
+  size_t capacity;
+  size_t low_watermark;
+  int stopping;
+  otrv4_keypool_stats_t stats;
+} keypool_t;
+
+tstatic void *keypool_refill_worker(void *data);
+
+#endif
+
+#endif
@@ -10,8 +10,10 @@ otrv4_user_state_new(const otrv4_client_callbacks_t *cb) {
   if (!state)
     return NULL;
 
-  state->states = NULL;
-  state->clients = NULL;
+  otrv4_sharded_table_init(state->states, otrv4_hash_pointer,
+                           otrv4_hash_pointer_eq);
+  otrv4_sharded_table_init(state->clients, otrv4_hash_pointer,
+                           otrv4_hash_pointer_eq);
   state->callbacks = cb;
 
   state->userstate_v3 = otrl_userstate_create();
@@ -27,11 +29,9 @@ API void otrv4_user_state_free(otrv4_userstate_t *state) {
   if (!state)
     return;
 
-  otrv4_list_free(state->states, free_client_state);
-  state->states = NULL;
-
-  otrv4_list_free(state->clients, free_client);
-  state->clients = NULL;
+  /* Clients refer to their states, so they go first */
+  otrv4_sharded_table_destroy(state->clients, free_client);
+  otrv4_sharded_table_destroy(state->states, free_client_state);
 
   state->callbacks = NULL;
 
@@ -42,18 +42,9 @@ API void otrv4_user_state_free(otrv4_userstate_t *state) {
   state = NULL;
 }
 
-tstatic int find_state_by_client_id(const void *current, const void *wanted) {
-  const otrv4_client_state_t *s = current;
-  return s->client_id == wanted;
-}
-
-tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
-                                               void *client_id) {
-  list_element_t *el =
-      otrv4_list_get(client_id, state->states, find_state_by_client_id);
-  if (el)
-    return el->data;
-
+tstatic otrv4_client_state_t *create_client_state(otrv4_userstate_t *state,
+                                                  otrv4_hashtable_t *table,
+                                                  void *client_id) {
   otrv4_client_state_t *s = otrv4_client_state_new(client_id);
   if (!s)
     return NULL;
@@ -61,15 +52,43 @@ tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
   s->callbacks = state->callbacks;
   s->userstate = state->userstate_v3;
 
-  state->states = otrv4_list_add(s, state->states);
+  if (otrv4_hashtable_put(table, s->client_id, s)) {
+    otrv4_client_state_free(s);
+    return NULL;
+  }
+
   return s;
 }
 
-/* tstatic int find_client_by_client_id(const void *current, const void *wanted)
- * { */
-/*   const otrv4_client_t *s = current; */
-/*   return s && s->state && s->state->client_id == wanted; */
-/* } */
+tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
+                                               void *client_id) {
+  hashtable_shard_t *shard =
+      otrv4_sharded_table_shard(state->states, client_id);
+
+  pthread_mutex_lock(&shard->lock);
+  otrv4_client_state_t *s = otrv4_hashtable_get(shard->table, client_id);
+  if (!s)
+    s = create_client_state(state, shard->table, client_id);
+  pthread_mutex_unlock(&shard->lock);
+
+  return s;
+}
+
+API int otrv4_user_state_remove_account(otrv4_userstate_t *state,
+                                        void *client_id) {
+  otrv4_client_t *client =
+      otrv4_sharded_table_remove(state->clients, client_id);
+  otrv4_client_state_t *s =
+      otrv4_sharded_table_remove(state->states, client_id);
+
+  otrv4_client_free(client);
+
+  if (!s)
+    return !client;
+
+  otrv4_client_state_free(s);
+  return 0;
+}
 
 /* tstatic otr4_messaging_client_t *otr4_messaging_client_new(otrv4_userstate_t
  * *state, */
@@ -78,11 +97,10 @@ tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
 /*     return NULL; */
 /*   } */
 
-/*   list_element_t *e = */
-/*       otrv4_list_get(client_id, state->clients, find_client_by_client_id); */
+/*   otrv4_client_t *c = otrv4_hashtable_get(state->clients, client_id); */
 
-/*   if (e) { */
-/*     return e->data; */
+/*   if (c) { */
+/*     return c; */
 /*   } else { */
 /*     otrv4_client_state_t *s = get_client_state(state, client_id); */
 /*     if (!s) */
@@ -92,7 +110,7 @@ tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
 /*     if (!c) */
 /*       return NULL; */
 
-/*     state->clients = otrv4_list_add(c, state->clients); */
+/*     otrv4_hashtable_put(state->clients, s->client_id, c); */
 
 /*     return c; */
 /*   } */
@@ -101,10 +119,9 @@ tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
 /* otr4_messaging_client_t *otr4_messaging_client_get(otrv4_userstate_t *state,
  */
 /*                                                    void *client_id) { */
-/*   list_element_t *el = */
-/*       otrv4_list_get(client_id, state->clients, find_client_by_client_id); */
-/*   if (el) */
-/*     return el->data; */
+/*   otrv4_client_t *c = otrv4_hashtable_get(state->clients, client_id); */
+/*   if (c) */
+/*     return c; */
 
 /*   return otr4_messaging_client_new(state, client_id); */
 /* } */
@@ -142,10 +159,10 @@ otrv4_user_state_get_private_key_v4(otrv4_userstate_t *state, void *client_id) {
       get_client_state(state, client_id));
 }
 
-/* tstatic void add_private_key_v4_to_FILEp(list_element_t *node, void *context)
- * { */
+/* tstatic void add_private_key_v4_to_FILEp(const void *key, void *value, */
+/*                                          void *context) { */
 /*   FILE *privf = context; */
-/*   otrv4_client_state_t *state = node->data; */
+/*   otrv4_client_state_t *state = value; */
 /*   otr4_client_state_private_key_v4_write_FILEp(state, privf); */
 /* } */
 
@@ -155,7 +172,8 @@ otrv4_user_state_get_private_key_v4(otrv4_userstate_t *state, void *client_id) {
 /*   if (!privf) */
 /*     return -1; */
 
-/*   otrv4_list_foreach(state->states, add_private_key_v4_to_FILEp, privf); */
+/*   otrv4_hashtable_foreach(state->states, add_private_key_v4_to_FILEp, privf);
+ */
 /*   return 0; */
 /* } */
 
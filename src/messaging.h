@@ -22,20 +22,50 @@
  * otr4_messaging_client_receiving(client, alice_talking_to_bob);
  */
 
+/*
+ * Concurrency model
+ *
+ * The library can be used from several threads once OTRV4_INIT has returned
+ * (it is safe to call it from many threads, too).
+ *
+ * - The accounts of a userstate and the conversations of a client are kept
+ *   in tables split into OTRV4_HASHTABLE_SHARDS shards, each one with its own
+ *   lock, so threads working on different accounts or recipients rarely wait
+ *   for each other.
+ * - Every connection (otrv4_t) has a mutex, which the client API holds while
+ *   it sends, receives, queries or closes. Calls for the same recipient are
+ *   serialized; calls for different recipients run in parallel.
+ * - The keys and the heartbeat of an account (otrv4_client_state_t) are
+ *   shared by its connections and guarded by a recursive lock.
+ *
+ * Locks are taken in this order: connection, client state, then a table
+ * shard. A shard lock is never held while waiting for a connection, nor
+ * while a new connection is created.
+ *
+ * A conversation must not be disconnected, nor an account removed, while
+ * another thread is using it. The exception is a batch being received
+ * (otrv4_client_receive_batch()), which holds a reference to each
+ * conversation it receives for. Reading keys and instance tags from files is
+ * meant to happen before the accounts are used. The OTRv3 state inside
+ * libotr is not thread-safe, so OTRv3 conversations must be driven from a
+ * single thread.
+ */
+
 #include "client.h"
-#include "list.h"
+#include "hashtable.h"
+#include "include/libotrv4.h"
 #include "shared.h"
 
 // TODO: Remove?
 typedef otrv4_client_t otr4_messaging_client_t;
 
-typedef struct {
-  list_element_t *states;
-  list_element_t *clients;
+struct otrv4_userstate_t {
+  otrv4_sharded_table_t states[1];  /* by client_id */
+  otrv4_sharded_table_t clients[1]; /* by client_id */
 
   const otrv4_client_callbacks_t *callbacks;
   void *userstate_v3; /* OtrlUserState */
-} otrv4_userstate_t;
+};
 
 /* int otr4_user_state_private_key_v3_generate_FILEp(otrv4_userstate_t *state,
  */
@@ -83,6 +113,13 @@ API void otrv4_user_state_free(otrv4_userstate_t *);
 
 #ifdef OTRV4_MESSAGING_PRIVATE
 
+tstatic otrv4_client_state_t *create_client_state(otrv4_userstate_t *state,
+                                                  otrv4_hashtable_t *table,
+                                                  void *client_id);
+
+tstatic otrv4_client_state_t *get_client_state(otrv4_userstate_t *state,
+                                               void *client_id);
+
 /* tstatic otr4_messaging_client_t *otr4_messaging_client_new(otrv4_userstate_t
  * *state, */
 /*                                                    void *client_id); */
@@ -1,4 +1,3 @@
-#include <libotr/b64.h>
 #include <libotr/mem.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +6,7 @@
 
 #define OTRV4_OTRV4_PRIVATE
 
+#include "base64.h"
 #include "constants.h"
 #include "dake.h"
 #include "data_message.h"
@@ -26,6 +26,8 @@
 #define THEIR_DH(s) s->keys->their_dh
 
 #define HEARTBEAT(s) s->conversation->client->heartbeat
+#define STATS(s) s->conversation->client->stats
+#define TRACER(s) s->conversation->client->tracer
 
 #define QUERY_MESSAGE_TAG_BYTES 5
 #define WHITESPACE_TAG_BASE_BYTES 16
@@ -150,12 +152,12 @@ tstatic void allowed_versions(string_t dst, const otrv4_t *otr) {
   *dst = 0;
 }
 
-tstatic const user_profile_t *get_my_user_profile(otrv4_t *otr) {
-  if (otr->profile)
-    return otr->profile;
-
+tstatic const user_profile_t *take_my_user_profile(otrv4_t *otr) {
   char versions[3] = {0};
   allowed_versions(versions, otr);
+
+  /* Other connections of this client may be creating the same keys */
+  otrv4_client_state_lock(otr->conversation->client);
   maybe_create_keys(otr->conversation);
 
   // This is a temporary measure for the pidgin plugin to work
@@ -163,12 +165,40 @@ tstatic const user_profile_t *get_my_user_profile(otrv4_t *otr) {
   uint8_t sym_key[ED448_PRIVATE_BYTES] = {0x01};
   otrv4_client_state_add_shared_prekey_v4(otr->conversation->client, sym_key);
 
-  otr->profile =
-      otrv4_user_profile_build(versions, otr->conversation->client->keypair,
-                               otr->conversation->client->shared_prekey_pair);
+  /* Shared with the other connections, so it is signed only once */
+  user_profile_t *profile =
+      otrv4_client_state_get_user_profile(otr->conversation->client, versions);
+  otrv4_client_state_unlock(otr->conversation->client);
+
+  if (profile) {
+    otrv4_user_profile_unref(otr->profile);
+    otr->profile = profile;
+  }
+
   return otr->profile;
 }
 
+/* The profile a DAKE in progress was started with, so it is verified with
+ * the same one */
+tstatic const user_profile_t *get_my_user_profile(otrv4_t *otr) {
+  if (otr->profile)
+    return otr->profile;
+
+  return take_my_user_profile(otr);
+}
+
+/* Called when we send the first message of our side of a DAKE. A profile
+ * signed again since the last one, by otrv4_client_refresh_profile() or
+ * another connection, is taken then. */
+tstatic const user_profile_t *refresh_my_user_profile(otrv4_t *otr) {
+  if (otr->profile && otrv4_client_state_user_profile_outdated(
+                          otr->conversation->client, otr->profile) ==
+                          otrv4_false)
+    return otr->profile;
+
+  return take_my_user_profile(otr);
+}
+
 INTERNAL otrv4_t *otrv4_new(otrv4_client_state_t *state,
                             otrv4_policy_t policy) {
   otrv4_t *otr = malloc(sizeof(otrv4_t));
@@ -197,11 +227,22 @@ INTERNAL otrv4_t *otrv4_new(otrv4_client_state_t *state,
   }
 
   otrv4_key_manager_init(otr->keys);
+  otr->keys->stats = state->stats;
+  otr->keys->tracer = state->tracer;
   otrv4_smp_context_init(otr->smp);
 
   otr->frag_ctx = otrv4_fragment_context_new();
+  if (otr->frag_ctx)
+    otr->frag_ctx->stats = state->stats;
   otr->otr3_conn = NULL;
 
+  otr->decode_buf = NULL;
+  otr->decode_cap = 0;
+
+  otrv4_arena_init(otr->scratch);
+
+  pthread_mutex_init(&otr->lock, NULL);
+
   return otr;
 }
 
@@ -217,7 +258,7 @@ tstatic void otrv4_destroy(/*@only@ */ otrv4_t *otr) {
   free(otr->keys);
   otr->keys = NULL;
 
-  otrv4_user_profile_free(otr->profile);
+  otrv4_user_profile_unref(otr->profile);
   otr->profile = NULL;
 
   otrv4_user_profile_free(otr->their_profile);
@@ -227,6 +268,14 @@ tstatic void otrv4_destroy(/*@only@ */ otrv4_t *otr) {
 
   otrv4_fragment_context_free(otr->frag_ctx);
 
+  if (otr->decode_buf)
+    sodium_memzero(otr->decode_buf, otr->decode_cap);
+  free(otr->decode_buf);
+  otr->decode_buf = NULL;
+  otr->decode_cap = 0;
+
+  otrv4_arena_destroy(otr->scratch);
+
   otrv4_v3_conn_free(otr->otr3_conn);
   otr->otr3_conn = NULL;
 }
@@ -237,6 +286,7 @@ INTERNAL void otrv4_free(/*@only@ */ otrv4_t *otr) {
   }
 
   otrv4_destroy(otr);
+  pthread_mutex_destroy(&otr->lock);
   free(otr);
   otr = NULL;
 }
@@ -438,6 +488,18 @@ tstatic void receive_plaintext(otrv4_response_t *response,
     response->warning = OTRV4_WARN_RECEIVED_UNENCRYPTED;
 }
 
+/* Encodes buff as an OTR message, in a new string */
+tstatic char *otr_encode(const uint8_t *buff, size_t len) {
+  char *encoded = malloc(OTRV4_OTR_ENCODED_LEN(len));
+  if (!encoded)
+    return NULL;
+
+  OTRV4_STATS_TIMER_START(start);
+  otrv4_otr_encode(encoded, buff, len);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_BASE64);
+  return encoded;
+}
+
 tstatic otrv4_err_t serialize_and_encode_prekey_message(
     string_t *dst, const dake_prekey_message_t *m) {
   uint8_t *buff = NULL;
@@ -446,7 +508,7 @@ tstatic otrv4_err_t serialize_and_encode_prekey_message(
   if (otrv4_dake_prekey_message_asprintf(&buff, &len, m))
     return ERROR;
 
-  *dst = otrl_base64_otr_encode(buff, len);
+  *dst = otr_encode(buff, len);
 
   free(buff);
   buff = NULL;
@@ -459,7 +521,7 @@ tstatic otrv4_err_t otrv4_build_prekey_message(otrv4_server_t *server,
   dake_prekey_message_t *m = NULL;
   otrv4_err_t err = ERROR;
 
-  m = otrv4_dake_prekey_message_new(get_my_user_profile(otr));
+  m = otrv4_dake_prekey_message_new(refresh_my_user_profile(otr));
   if (!m)
     return err;
 
@@ -475,6 +537,7 @@ tstatic otrv4_err_t otrv4_build_prekey_message(otrv4_server_t *server,
   }
 
   otrv4_dake_prekey_message_free(m);
+  OTRV4_STATS_INC(STATS(otr), sent[OTRV4_STATS_MSG_PRE_KEY]);
 
   return SUCCESS;
 }
@@ -497,7 +560,7 @@ tstatic otrv4_err_t serialize_and_encode_identity_message(
   if (otrv4_dake_identity_message_asprintf(&buff, &len, m))
     return ERROR;
 
-  *dst = otrl_base64_otr_encode(buff, len);
+  *dst = otr_encode(buff, len);
 
   free(buff);
   buff = NULL;
@@ -510,7 +573,7 @@ tstatic otrv4_err_t reply_with_identity_msg(otrv4_response_t *response,
   dake_identity_message_t *m = NULL;
   otrv4_err_t err = ERROR;
 
-  m = otrv4_dake_identity_message_new(get_my_user_profile(otr));
+  m = otrv4_dake_identity_message_new(refresh_my_user_profile(otr));
   if (!m)
     return err;
 
@@ -526,6 +589,7 @@ tstatic otrv4_err_t reply_with_identity_msg(otrv4_response_t *response,
   }
 
   otrv4_dake_identity_message_free(m);
+  OTRV4_STATS_INC(STATS(otr), sent[OTRV4_STATS_MSG_IDENTITY]);
 
   return SUCCESS;
 }
@@ -536,6 +600,7 @@ tstatic otrv4_err_t start_dake(otrv4_response_t *response, otrv4_t *otr) {
 
   otr->state = OTRV4_STATE_WAITING_AUTH_R;
   maybe_create_keys(otr->conversation);
+  OTRV4_STATS_INC(STATS(otr), dakes_started);
   return reply_with_identity_msg(response, otr);
 }
 
@@ -546,6 +611,7 @@ API otrv4_err_t otrv4_start_non_interactive_dake(otrv4_server_t *server,
 
   otr->state = OTRV4_STATE_START; // needed?
   maybe_create_keys(otr->conversation);
+  OTRV4_STATS_INC(STATS(otr), dakes_started);
 
   return reply_with_prekey_msg_to_server(server, otr);
 }
@@ -604,8 +670,6 @@ tstatic otrv4_err_t build_auth_message(
     const user_profile_t *i_profile, const user_profile_t *r_profile,
     const ec_point_t i_ecdh, const ec_point_t r_ecdh, const dh_mpi_t i_dh,
     const dh_mpi_t r_dh, char *phi) {
-  uint8_t *ser_i_profile = NULL, *ser_r_profile = NULL;
-  size_t ser_i_profile_len, ser_r_profile_len = 0;
   uint8_t ser_i_ecdh[ED448_POINT_BYTES], ser_r_ecdh[ED448_POINT_BYTES];
   uint8_t ser_i_dh[DH3072_MOD_LEN_BYTES], ser_r_dh[DH3072_MOD_LEN_BYTES];
   size_t ser_i_dh_len = 0, ser_r_dh_len = 0;
@@ -623,12 +687,10 @@ tstatic otrv4_err_t build_auth_message(
     return ERROR;
 
   do {
-    if (otrv4_user_profile_asprintf(&ser_i_profile, &ser_i_profile_len,
-                                    i_profile))
+    if (otrv4_user_profile_hash(hash_ser_i_profile, i_profile))
       continue;
 
-    if (otrv4_user_profile_asprintf(&ser_r_profile, &ser_r_profile_len,
-                                    r_profile))
+    if (otrv4_user_profile_hash(hash_ser_r_profile, r_profile))
       continue;
 
     char *phi_val = NULL;
@@ -639,10 +701,6 @@ tstatic otrv4_err_t build_auth_message(
     if (!phi_val)
       return ERROR;
 
-    shake_256_hash(hash_ser_i_profile, sizeof(hash_ser_i_profile),
-                   ser_i_profile, ser_i_profile_len);
-    shake_256_hash(hash_ser_r_profile, sizeof(hash_ser_r_profile),
-                   ser_r_profile, ser_r_profile_len);
     shake_256_hash(hash_phi, sizeof(hash_phi), (uint8_t *)phi_val,
                    strlen(phi_val) + 1);
 
@@ -685,11 +743,6 @@ tstatic otrv4_err_t build_auth_message(
     *msg_len = len;
   } while (0);
 
-  free(ser_i_profile);
-  ser_i_profile = NULL;
-  free(ser_r_profile);
-  ser_r_profile = NULL;
-
   sodium_memzero(ser_i_ecdh, ED448_POINT_BYTES);
   sodium_memzero(ser_r_ecdh, ED448_POINT_BYTES);
   sodium_memzero(ser_i_dh, DH3072_MOD_LEN_BYTES);
@@ -698,6 +751,19 @@ tstatic otrv4_err_t build_auth_message(
   return SUCCESS;
 }
 
+/* sigma = Auth(g^X, X, {g^X, A2, A3}, msg), where (g^X, X) is our long-term
+ * keypair. Uses nonces the client state computed beforehand, if any. */
+tstatic void authenticate(snizkpk_proof_t *sigma, const snizkpk_pubkey_t A2,
+                          const snizkpk_pubkey_t A3, const unsigned char *msg,
+                          size_t msglen, otrv4_t *otr) {
+  snizkpk_nonces_t nonces[1];
+
+  otrv4_client_state_take_auth_nonces(otr->conversation->client, nonces);
+  otrv4_snizkpk_authenticate_with_nonces(sigma, nonces,
+                                         otr->conversation->client->keypair,
+                                         A2, A3, msg, msglen);
+}
+
 tstatic otrv4_err_t serialize_and_encode_auth_r(string_t *dst,
                                                 const dake_auth_r_t *m) {
   uint8_t *buff = NULL;
@@ -706,7 +772,7 @@ tstatic otrv4_err_t serialize_and_encode_auth_r(string_t *dst,
   if (otrv4_dake_auth_r_asprintf(&buff, &len, m))
     return ERROR;
 
-  *dst = otrl_base64_otr_encode(buff, len);
+  *dst = otr_encode(buff, len);
 
   free(buff);
   buff = NULL;
@@ -720,7 +786,7 @@ tstatic otrv4_err_t reply_with_auth_r_msg(string_t *dst, otrv4_t *otr) {
   msg->sender_instance_tag = otr->our_instance_tag;
   msg->receiver_instance_tag = otr->their_instance_tag;
 
-  otrv4_user_profile_copy(msg->profile, get_my_user_profile(otr));
+  otrv4_user_profile_copy(msg->profile, refresh_my_user_profile(otr));
 
   otrv4_ec_point_copy(msg->X, OUR_ECDH(otr));
   msg->A = otrv4_dh_mpi_copy(OUR_DH(otr));
@@ -735,17 +801,18 @@ tstatic otrv4_err_t reply_with_auth_r_msg(string_t *dst, otrv4_t *otr) {
     return ERROR;
 
   /* sigma = Auth(g^R, R, {g^I, g^R, g^i}, msg) */
-  otrv4_snizkpk_authenticate(msg->sigma,
-                             otr->conversation->client->keypair, /* g^R and R */
-                             otr->their_profile->pub_key,        /* g^I */
-                             THEIR_ECDH(otr),                    /* g^i -- Y */
-                             t, t_len);
+  authenticate(msg->sigma,
+               otr->their_profile->pub_key, /* g^I */
+               THEIR_ECDH(otr),             /* g^i -- Y */
+               t, t_len, otr);
 
   free(t);
   t = NULL;
 
   otrv4_err_t err = serialize_and_encode_auth_r(dst, msg);
   otrv4_dake_auth_r_destroy(msg);
+  if (!err)
+    OTRV4_STATS_INC(STATS(otr), sent[OTRV4_STATS_MSG_AUTH_R]);
 
   return err;
 }
@@ -806,8 +873,6 @@ tstatic otrv4_err_t build_non_interactive_auth_message(
     const user_profile_t *r_profile, const ec_point_t i_ecdh,
     const ec_point_t r_ecdh, const dh_mpi_t i_dh, const dh_mpi_t r_dh,
     const otrv4_shared_prekey_pub_t r_shared_prekey, char *phi) {
-  uint8_t *ser_i_profile = NULL, *ser_r_profile = NULL;
-  size_t ser_i_profile_len, ser_r_profile_len = 0;
   uint8_t ser_i_ecdh[ED448_POINT_BYTES], ser_r_ecdh[ED448_POINT_BYTES];
   uint8_t ser_i_dh[DH3072_MOD_LEN_BYTES], ser_r_dh[DH3072_MOD_LEN_BYTES];
   size_t ser_i_dh_len = 0, ser_r_dh_len = 0;
@@ -830,12 +895,10 @@ tstatic otrv4_err_t build_non_interactive_auth_message(
   otrv4_err_t err = ERROR;
 
   do {
-    if (otrv4_user_profile_asprintf(&ser_i_profile, &ser_i_profile_len,
-                                    i_profile))
+    if (otrv4_user_profile_hash(hash_ser_i_profile, i_profile))
       continue;
 
-    if (otrv4_user_profile_asprintf(&ser_r_profile, &ser_r_profile_len,
-                                    r_profile))
+    if (otrv4_user_profile_hash(hash_ser_r_profile, r_profile))
       continue;
 
     uint8_t *phi_val = NULL;
@@ -846,12 +909,6 @@ tstatic otrv4_err_t build_non_interactive_auth_message(
 
     stpcpy((char *)phi_val, phi);
 
-    shake_256_hash(hash_ser_i_profile, sizeof(hash_ser_i_profile),
-                   ser_i_profile, ser_i_profile_len);
-
-    shake_256_hash(hash_ser_r_profile, sizeof(hash_ser_r_profile),
-                   ser_r_profile, ser_r_profile_len);
-
     shake_256_hash(hash_phi, sizeof(hash_phi), phi_val, phi_len);
     free(phi_val);
     phi_val = NULL;
@@ -894,11 +951,6 @@ tstatic otrv4_err_t build_non_interactive_auth_message(
     err = SUCCESS;
   } while (0);
 
-  free(ser_i_profile);
-  ser_i_profile = NULL;
-  free(ser_r_profile);
-  ser_r_profile = NULL;
-
   sodium_memzero(ser_i_ecdh, ED448_POINT_BYTES);
   sodium_memzero(ser_r_ecdh, ED448_POINT_BYTES);
   sodium_memzero(ser_i_dh, DH3072_MOD_LEN_BYTES);
@@ -916,7 +968,7 @@ tstatic otrv4_err_t serialize_and_encode_non_interactive_auth(
   if (otrv4_dake_non_interactive_auth_message_asprintf(&buff, &len, m))
     return ERROR;
 
-  *dst = otrl_base64_otr_encode(buff, len);
+  *dst = otr_encode(buff, len);
 
   free(buff);
   buff = NULL;
@@ -924,57 +976,6 @@ tstatic otrv4_err_t serialize_and_encode_non_interactive_auth(
   return SUCCESS;
 }
 
-tstatic data_message_t *generate_data_msg(const otrv4_t *otr) {
-  data_message_t *data_msg = otrv4_data_message_new();
-  if (!data_msg)
-    return NULL;
-
-  data_msg->sender_instance_tag = otr->our_instance_tag;
-  data_msg->receiver_instance_tag = otr->their_instance_tag;
-  data_msg->message_id = otr->keys->j;
-  otrv4_ec_point_copy(data_msg->ecdh, OUR_ECDH(otr));
-  data_msg->dh = otrv4_dh_mpi_copy(OUR_DH(otr));
-
-  return data_msg;
-}
-
-tstatic otrv4_err_t encrypt_data_message(data_message_t *data_msg,
-                                         const uint8_t *message,
-                                         size_t message_len,
-                                         const m_enc_key_t enc_key) {
-  int err = 0;
-  uint8_t *c = NULL;
-
-  random_bytes(data_msg->nonce, sizeof(data_msg->nonce));
-
-  c = malloc(message_len);
-  if (!c)
-    return ERROR;
-
-  // TODO: message is an UTF-8 string. Is there any problem to cast
-  // it to (unsigned char *)
-  err = crypto_stream_xor(c, message, message_len, data_msg->nonce, enc_key);
-  if (err) {
-    free(c);
-    c = NULL;
-    return ERROR;
-  }
-
-  data_msg->enc_msg_len = message_len;
-  data_msg->enc_msg = c;
-
-#ifdef DEBUG
-  printf("nonce = ");
-  otrv4_memdump(data_msg->nonce, DATA_MSG_NONCE_BYTES);
-  printf("msg = ");
-  otrv4_memdump(message, message_len);
-  printf("cipher = ");
-  otrv4_memdump(c, message_len);
-#endif
-
-  return SUCCESS;
-}
-
 tstatic otrv4_err_t encrypt_msg_on_non_interactive_auth(
     dake_non_interactive_auth_message_t *auth, uint8_t *message,
     size_t message_len, uint8_t nonce[DATA_MSG_NONCE_BYTES], otrv4_t *otr) {
@@ -1066,7 +1067,7 @@ tstatic otrv4_err_t reply_with_non_interactive_auth_msg(string_t *dst,
   auth->sender_instance_tag = otr->our_instance_tag;
   auth->receiver_instance_tag = otr->their_instance_tag;
 
-  otrv4_user_profile_copy(auth->profile, get_my_user_profile(otr));
+  otrv4_user_profile_copy(auth->profile, refresh_my_user_profile(otr));
 
   otrv4_ec_point_copy(auth->X, OUR_ECDH(otr));
   auth->A = otrv4_dh_mpi_copy(OUR_DH(otr));
@@ -1096,11 +1097,10 @@ tstatic otrv4_err_t reply_with_non_interactive_auth_msg(string_t *dst,
   }
 
   /* sigma = Auth(g^R, R, {g^I, g^R, g^i}, msg) */
-  otrv4_snizkpk_authenticate(auth->sigma,
-                             otr->conversation->client->keypair, /* g^R and R */
-                             otr->their_profile->pub_key,        /* g^I */
-                             THEIR_ECDH(otr),                    /* g^i -- Y */
-                             t, t_len);
+  authenticate(auth->sigma,
+               otr->their_profile->pub_key, /* g^I */
+               THEIR_ECDH(otr),             /* g^i -- Y */
+               t, t_len, otr);
 
   sodium_memzero(auth->nonce, DATA_MSG_NONCE_BYTES);
 
@@ -1159,6 +1159,8 @@ tstatic otrv4_err_t reply_with_non_interactive_auth_msg(string_t *dst,
     auth->enc_msg = NULL;
   }
   otrv4_dake_non_interactive_auth_message_destroy(auth);
+  if (!err)
+    OTRV4_STATS_INC(STATS(otr), sent[OTRV4_STATS_MSG_NON_INT_AUTH]);
 
   return err;
 }
@@ -1269,6 +1271,7 @@ tstatic otrv4_err_t double_ratcheting_init(int j, bool interactive,
     return ERROR;
 
   otr->state = OTRV4_STATE_ENCRYPTED_MESSAGES;
+  OTRV4_STATS_INC(STATS(otr), dakes_completed);
   gone_secure_cb_v4(otr->conversation);
 
   return SUCCESS;
@@ -1296,6 +1299,7 @@ tstatic otrv4_err_t receive_prekey_message(string_t *dst, const uint8_t *buff,
   }
 
   received_instance_tag(m->sender_instance_tag, otr);
+  OTRV4_STATS_INC(STATS(otr), dakes_started);
 
   if (otrv4_valid_received_values(m->Y, m->B, m->profile)) {
     otrv4_dake_prekey_message_destroy(m);
@@ -1468,14 +1472,8 @@ tstatic otrv4_bool_t verify_non_interactive_auth_message(
     plain = NULL;
     sodium_memzero(enc_key, sizeof(enc_key));
 
-    uint8_t *to_store_mac = malloc(MAC_KEY_BYTES);
-    if (to_store_mac == NULL) {
+    if (otrv4_key_manager_store_old_mac_key(otr->keys, mac_key))
       return otrv4_false;
-    }
-
-    memcpy(to_store_mac, mac_key, MAC_KEY_BYTES);
-    otr->keys->old_mac_keys =
-        otrv4_list_add(to_store_mac, otr->keys->old_mac_keys);
   } else {
     /* auth_mac_k = KDF_2(0x01 || tmp_k */
     uint8_t magic[1] = {0x01};
@@ -1563,6 +1561,7 @@ tstatic otrv4_err_t receive_non_interactive_auth_message(
 
 tstatic otrv4_err_t receive_identity_message_on_state_start(
     string_t *dst, dake_identity_message_t *identity_message, otrv4_t *otr) {
+  OTRV4_STATS_INC(STATS(otr), dakes_started);
 
   otr->their_profile = malloc(sizeof(user_profile_t));
   if (!otr->their_profile)
@@ -1585,6 +1584,8 @@ tstatic otrv4_err_t receive_identity_message_on_state_start(
 tstatic void forget_our_keys(otrv4_t *otr) {
   otrv4_key_manager_destroy(otr->keys);
   otrv4_key_manager_init(otr->keys);
+  otr->keys->stats = STATS(otr);
+  otr->keys->tracer = TRACER(otr);
 }
 
 tstatic otrv4_err_t receive_identity_message_on_waiting_auth_r(
@@ -1656,7 +1657,7 @@ tstatic otrv4_err_t serialize_and_encode_auth_i(string_t *dst,
   if (otrv4_dake_auth_i_asprintf(&buff, &len, m))
     return ERROR;
 
-  *dst = otrl_base64_otr_encode(buff, len);
+  *dst = otr_encode(buff, len);
 
   free(buff);
   buff = NULL;
@@ -1679,13 +1680,14 @@ tstatic otrv4_err_t reply_with_auth_i_msg(string_t *dst,
                          THEIR_DH(otr), otr->conversation->client->phi))
     return ERROR;
 
-  otrv4_snizkpk_authenticate(msg->sigma, otr->conversation->client->keypair,
-                             their->pub_key, THEIR_ECDH(otr), t, t_len);
+  authenticate(msg->sigma, their->pub_key, THEIR_ECDH(otr), t, t_len, otr);
   free(t);
   t = NULL;
 
   otrv4_err_t err = serialize_and_encode_auth_i(dst, msg);
   otrv4_dake_auth_i_destroy(msg);
+  if (!err)
+    OTRV4_STATS_INC(STATS(otr), sent[OTRV4_STATS_MSG_AUTH_I]);
 
   return err;
 }
@@ -1826,7 +1828,8 @@ INTERNAL otrv4_err_t otrv4_expire_session(string_t *to_send, otrv4_t *otr) {
   return err;
 }
 
-tstatic void extract_tlvs(tlv_t **tlvs, const uint8_t *src, size_t len) {
+tstatic void extract_tlvs(tlv_t **tlvs, const uint8_t *src, size_t len,
+                          otrv4_arena_t *scratch) {
   if (!tlvs)
     return;
 
@@ -1836,14 +1839,18 @@ tstatic void extract_tlvs(tlv_t **tlvs, const uint8_t *src, size_t len) {
     return;
 
   size_t tlvs_len = len - (tlvs_start + 1 - src);
-  *tlvs = otrv4_parse_tlvs(tlvs_start + 1, tlvs_len);
+  *tlvs = otrv4_parse_tlvs_in(scratch, tlvs_start + 1, tlvs_len);
 }
 
+/* Decrypts msg->enc_msg in place. Only to_display is allocated, the TLVs
+ * are parsed into scratch. */
 tstatic otrv4_err_t decrypt_data_msg(otrv4_response_t *response,
                                      const m_enc_key_t enc_key,
-                                     const data_message_t *msg) {
+                                     data_message_t *msg,
+                                     otrv4_arena_t *scratch) {
   string_t *dst = &response->to_display;
   tlv_t **tlvs = &response->tlvs;
+  uint8_t *plain = msg->enc_msg;
 
 #ifdef DEBUG
   printf("DECRYPTING\n");
@@ -1853,28 +1860,18 @@ tstatic otrv4_err_t decrypt_data_msg(otrv4_response_t *response,
   otrv4_memdump(msg->nonce, DATA_MSG_NONCE_BYTES);
 #endif
 
-  uint8_t *plain = malloc(msg->enc_msg_len);
-  if (!plain)
+  if (crypto_stream_xor(plain, msg->enc_msg, msg->enc_msg_len, msg->nonce,
+                        enc_key))
     return ERROR;
 
-  int err = crypto_stream_xor(plain, msg->enc_msg, msg->enc_msg_len, msg->nonce,
-                              enc_key);
-
   if (strnlen((string_t)plain, msg->enc_msg_len))
     *dst = otrv4_strndup((char *)plain, msg->enc_msg_len);
 
-  extract_tlvs(tlvs, plain, msg->enc_msg_len);
+  extract_tlvs(tlvs, plain, msg->enc_msg_len, scratch);
 
-  free(plain);
-  plain = NULL;
+  sodium_memzero(plain, msg->enc_msg_len);
 
-  if (err == 0) {
-    return SUCCESS;
-  }
-
-  // TODO: correctly free
-  otrv4_tlv_free(*tlvs);
-  return ERROR;
+  return SUCCESS;
 }
 
 tstatic tlv_t *otrv4_process_smp(otrv4_smp_event_t event, smp_context_t smp,
@@ -1960,7 +1957,9 @@ tstatic tlv_t *process_tlv(const tlv_t *tlv, otrv4_t *otr) {
   }
 
   otrv4_smp_event_t event = OTRV4_SMPEVENT_NONE;
+  OTRV4_STATS_TIMER_START(start);
   tlv_t *out = otrv4_process_smp(event, otr->smp, tlv);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_SMP);
   handle_smp_event_cb_v4(event, otr->smp->progress,
                          otr->smp->msg1 ? otr->smp->msg1->question : NULL,
                          otr->conversation);
@@ -2007,10 +2006,11 @@ tstatic otrv4_err_t get_receiving_msg_keys(m_enc_key_t enc_key,
   return SUCCESS;
 }
 
+/* buff is decrypted in place */
 tstatic otrv4_err_t otrv4_receive_data_message(otrv4_response_t *response,
-                                               const uint8_t *buff,
-                                               size_t buflen, otrv4_t *otr) {
-  data_message_t *msg = otrv4_data_message_new();
+                                               uint8_t *buff, size_t buflen,
+                                               otrv4_t *otr) {
+  data_message_t msg[1];
   m_enc_key_t enc_key;
   m_mac_key_t mac_key;
 
@@ -2020,14 +2020,14 @@ tstatic otrv4_err_t otrv4_receive_data_message(otrv4_response_t *response,
   // TODO: check this case with Nik on otr3
   if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES) {
     otrv4_error_message(&response->to_send, ERR_MSG_NOT_PRIVATE);
-    free(msg);
-    msg = NULL;
     return ERROR;
   }
 
-  size_t read = 0;
-  if (otrv4_data_message_deserialize(msg, buff, buflen, &read)) {
-    otrv4_data_message_free(msg);
+  memset(msg, 0, sizeof(data_message_t));
+
+  size_t body_len = 0;
+  if (otrv4_data_message_deserialize_in_place(msg, buff, buflen, &body_len)) {
+    otrv4_data_message_in_place_destroy(msg);
     return ERROR;
   }
 
@@ -2038,45 +2038,49 @@ tstatic otrv4_err_t otrv4_receive_data_message(otrv4_response_t *response,
   do {
     if (msg->receiver_instance_tag != otr->our_instance_tag) {
       response->to_display = NULL;
-      otrv4_data_message_free(msg);
+      otrv4_data_message_in_place_destroy(msg);
 
       return SUCCESS;
     }
 
-    if (get_receiving_msg_keys(enc_key, mac_key, msg, otr))
+    if (get_receiving_msg_keys(enc_key, mac_key, msg, otr)) {
+      OTRV4_STATS_INC(STATS(otr), decrypt_failures);
       continue;
+    }
 
-    if (otrv4_valid_data_message(mac_key, msg)) {
+    if (otrv4_valid_data_message_body(mac_key, msg, buff, body_len) ||
+        otrv4_key_manager_valid_their_dh(otr->keys, msg->dh)) {
+      OTRV4_STATS_INC(STATS(otr), mac_failures);
       sodium_memzero(enc_key, sizeof(enc_key));
       sodium_memzero(mac_key, sizeof(mac_key));
       response->to_display = NULL;
-      otrv4_data_message_free(msg);
+      otrv4_data_message_in_place_destroy(msg);
 
       response->warning = OTRV4_WARN_RECEIVED_NOT_VALID;
       return MSG_NOT_VALID;
     }
 
-    if (decrypt_data_msg(response, enc_key, msg)) {
+    if (decrypt_data_msg(response, enc_key, msg, otr->scratch)) {
+      OTRV4_STATS_INC(STATS(otr), decrypt_failures);
       if (msg->flags != MSGFLAGS_IGNORE_UNREADABLE) {
         otrv4_error_message(&response->to_send, ERR_MSG_UNDECRYPTABLE);
         sodium_memzero(enc_key, sizeof(enc_key));
         sodium_memzero(mac_key, sizeof(mac_key));
         response->to_display = NULL;
-        otrv4_data_message_free(msg);
+        otrv4_data_message_in_place_destroy(msg);
 
         return ERROR;
       } else if (msg->flags == MSGFLAGS_IGNORE_UNREADABLE) {
         sodium_memzero(enc_key, sizeof(enc_key));
         sodium_memzero(mac_key, sizeof(mac_key));
         response->to_display = NULL;
-        otrv4_data_message_free(msg);
+        otrv4_data_message_in_place_destroy(msg);
 
         return ERROR;
       }
     }
 
     sodium_memzero(enc_key, sizeof(enc_key));
-    sodium_memzero(mac_key, sizeof(mac_key));
 
     // TODO: Securely delete receiving chain keys older than message_id-1.
     if (receive_tlvs(&reply_tlv, response, otr))
@@ -2084,29 +2088,23 @@ tstatic otrv4_err_t otrv4_receive_data_message(otrv4_response_t *response,
 
     otrv4_key_manager_prepare_to_ratchet(otr->keys);
 
+    /* Not a call of its own: the response still uses the scratch arena */
     if (reply_tlv) {
-      if (otrv4_prepare_to_send_message(&response->to_send, "", &reply_tlv,
-                                        MSGFLAGS_IGNORE_UNREADABLE, otr))
+      if (prepare_to_send_message(&response->to_send, "", &reply_tlv,
+                                  MSGFLAGS_IGNORE_UNREADABLE, otr))
         continue;
     }
 
-    uint8_t *to_store_mac = malloc(MAC_KEY_BYTES);
-    if (to_store_mac == NULL) {
-      response->to_display = NULL;
-      otrv4_data_message_free(msg);
-      return ERROR;
-    }
-
-    memcpy(to_store_mac, mac_key, MAC_KEY_BYTES);
-    otr->keys->old_mac_keys =
-        otrv4_list_add(to_store_mac, otr->keys->old_mac_keys);
+    otrv4_err_t err = otrv4_key_manager_store_old_mac_key(otr->keys, mac_key);
+    sodium_memzero(mac_key, sizeof(mac_key));
 
-    otrv4_data_message_free(msg);
+    otrv4_data_message_in_place_destroy(msg);
     otrv4_tlv_free(reply_tlv);
-    return SUCCESS;
+    return err;
   } while (0);
 
-  otrv4_data_message_free(msg);
+  sodium_memzero(mac_key, sizeof(mac_key));
+  otrv4_data_message_in_place_destroy(msg);
   otrv4_tlv_free(reply_tlv);
 
   return ERROR;
@@ -2141,7 +2139,7 @@ tstatic otrv4_err_t extract_header(otrv4_header_t *dst, const uint8_t *buffer,
 }
 
 tstatic otrv4_err_t receive_decoded_message(otrv4_response_t *response,
-                                            const uint8_t *decoded,
+                                            uint8_t *decoded,
                                             size_t dec_len, otrv4_t *otr) {
   otrv4_header_t header;
   if (extract_header(&header, decoded, dec_len))
@@ -2161,47 +2159,102 @@ tstatic otrv4_err_t receive_decoded_message(otrv4_response_t *response,
   response->to_send = NULL;
   otrv4_err_t err;
 
+  OTRV4_STATS_RECEIVED(STATS(otr), header.type);
+  OTRV4_TRACE_ENTER(TRACER(otr), otrv4_trace_message_stage(header.type),
+                    dec_len);
+
   switch (header.type) {
   case IDENTITY_MSG_TYPE:
     otr->running_version = OTRV4_VERSION_4;
-    return receive_identity_message(&response->to_send, decoded, dec_len, otr);
+    err = receive_identity_message(&response->to_send, decoded, dec_len, otr);
+    break;
   case AUTH_R_MSG_TYPE:
     err = receive_auth_r(&response->to_send, decoded, dec_len, otr);
     if (otr->state == OTRV4_STATE_ENCRYPTED_MESSAGES) {
       otrv4_dh_priv_key_destroy(otr->keys->our_dh);
       otrv4_ec_scalar_destroy(otr->keys->our_ecdh->priv);
     }
-    return err;
+    break;
   case AUTH_I_MSG_TYPE:
-    return receive_auth_i(decoded, dec_len, otr);
+    err = receive_auth_i(decoded, dec_len, otr);
+    break;
   case PRE_KEY_MSG_TYPE:
-    return receive_prekey_message(&response->to_send, decoded, dec_len, otr);
+    err = receive_prekey_message(&response->to_send, decoded, dec_len, otr);
+    break;
   case NON_INT_AUTH_MSG_TYPE:
-    return receive_non_interactive_auth_message(response, decoded, dec_len,
-                                                otr);
+    err = receive_non_interactive_auth_message(response, decoded, dec_len,
+                                               otr);
+    break;
   case DATA_MSG_TYPE:
-    return otrv4_receive_data_message(response, decoded, dec_len, otr);
+    err = otrv4_receive_data_message(response, decoded, dec_len, otr);
+    break;
   default:
     /* error. bad message type */
+    OTRV4_TRACE_LEAVE(TRACER(otr), OTRV4_TRACE_MSG_UNKNOWN, 0, ERROR);
     return ERROR;
   }
 
-  return ERROR;
+  OTRV4_TRACE_LEAVE(TRACER(otr), otrv4_trace_message_stage(header.type),
+                    response->to_send ? strlen(response->to_send) : 0, err);
+
+  /* Every other message is part of a DAKE */
+  if (err && header.type != DATA_MSG_TYPE)
+    OTRV4_STATS_INC(STATS(otr), dakes_failed);
+
+  return err;
+}
+
+/* Grows the decode buffer of the connection to at least len bytes */
+tstatic otrv4_err_t decode_buf_reserve(otrv4_t *otr, size_t len) {
+  if (len <= otr->decode_cap)
+    return SUCCESS;
+
+  size_t cap = otr->decode_cap ? otr->decode_cap : 1024;
+  while (cap < len)
+    cap *= 2;
+
+  uint8_t *buf = malloc(cap);
+  if (!buf)
+    return ERROR;
+
+  /* The old buffer may still hold decrypted messages */
+  if (otr->decode_buf)
+    sodium_memzero(otr->decode_buf, otr->decode_cap);
+  free(otr->decode_buf);
+
+  otr->decode_buf = buf;
+  otr->decode_cap = cap;
+  return SUCCESS;
 }
 
 tstatic otrv4_err_t receive_encoded_message(otrv4_response_t *response,
                                             const string_t message,
                                             otrv4_t *otr) {
-  size_t dec_len = 0;
-  uint8_t *decoded = NULL;
-  if (otrl_base64_otr_decode(message, &decoded, &dec_len))
+  const char *start = strstr(message, otr_header);
+  if (!start)
     return ERROR;
 
-  otrv4_err_t err = receive_decoded_message(response, decoded, dec_len, otr);
-  free(decoded);
-  decoded = NULL;
+  start += strlen(otr_header);
+  const char *end = strchr(start, '.');
+  if (!end)
+    return ERROR;
 
-  return err;
+  /* Decodes into the buffer of the connection, so receiving does not
+   * allocate once it is large enough */
+  size_t b64len = end - start;
+  if (decode_buf_reserve(otr, OTRV4_BASE64_DECODE_LEN(b64len)))
+    return ERROR;
+
+  size_t dec_len = 0;
+  OTRV4_STATS_TIMER_START(decode_start);
+  otrv4_err_t err =
+      otrv4_base64_decode(otr->decode_buf, &dec_len, start, b64len);
+  OTRV4_STATS_TIMER_STOP(decode_start, OTRV4_STATS_TIMER_BASE64);
+
+  if (err)
+    return ERROR;
+
+  return receive_decoded_message(response, otr->decode_buf, dec_len, otr);
 }
 
 // TODO: only display the human readable part
@@ -2262,14 +2315,15 @@ tstatic otrv4_err_t receive_message_v4_only(otrv4_response_t *response,
   return SUCCESS;
 }
 
-/* Receive a possibly OTR message. */
-INTERNAL otrv4_err_t otrv4_receive_message(otrv4_response_t *response,
-                                           const string_t message,
-                                           otrv4_t *otr) {
-
+/* Receive a possibly OTR message. The TLVs of a data message are left in the
+ * scratch arena. */
+tstatic otrv4_err_t receive_message(otrv4_response_t *response,
+                                    const string_t message, otrv4_t *otr) {
   if (!message || !response)
     return ERROR;
 
+  otrv4_arena_reset(otr->scratch);
+
   response->to_display = otrv4_strndup(NULL, 0);
 
   /* A DH-Commit sets our running version to 3 */
@@ -2289,209 +2343,411 @@ INTERNAL otrv4_err_t otrv4_receive_message(otrv4_response_t *response,
   return SUCCESS;
 }
 
-tstatic otrv4_err_t serialize_and_encode_data_msg(
-    string_t *dst, const m_mac_key_t mac_key, uint8_t *to_reveal_mac_keys,
-    size_t to_reveal_mac_keys_len, const data_message_t *data_msg) {
-  uint8_t *body = NULL;
-  size_t bodylen = 0;
+INTERNAL otrv4_err_t otrv4_receive_message(otrv4_response_t *response,
+                                           const string_t message,
+                                           otrv4_t *otr) {
+  otrv4_err_t err = receive_message(response, message, otr);
 
-  if (otrv4_data_message_body_asprintf(&body, &bodylen, data_msg))
-    return ERROR;
+  /* OTRv3 does not use the arena */
+  if (!response || !response->tlvs ||
+      otr->running_version == OTRV4_VERSION_3)
+    return err;
 
-  size_t serlen = bodylen + MAC_KEY_BYTES + to_reveal_mac_keys_len;
-  uint8_t *ser = malloc(serlen);
-  if (!ser) {
-    free(body);
-    body = NULL;
+  /* The response owns its TLVs, so they outlive the next call */
+  response->tlvs = otrv4_tlvs_copy(response->tlvs);
+  if (!response->tlvs)
     return ERROR;
+
+  return err;
+}
+
+INTERNAL otrv4_err_t otrv4_receive_message_borrowing_tlvs(
+    otrv4_response_t *response, const tlv_t **tlvs, const string_t message,
+    otrv4_t *otr) {
+  otrv4_err_t err = receive_message(response, message, otr);
+
+  *tlvs = NULL;
+  if (response && otr->running_version != OTRV4_VERSION_3) {
+    *tlvs = response->tlvs;
+    response->tlvs = NULL;
   }
 
-  memcpy(ser, body, bodylen);
-  free(body);
-  body = NULL;
+  return err;
+}
 
-  shake_256_mac(ser + bodylen, MAC_KEY_BYTES, mac_key, sizeof(m_mac_key_t), ser,
-                bodylen);
+tstatic size_t tlvs_serialized_len(const tlv_t *tlvs) {
+  const tlv_t *current = tlvs;
+  size_t len = 0;
 
-  otrv4_serialize_bytes_array(ser + bodylen + DATA_MSG_MAC_BYTES,
-                              to_reveal_mac_keys, to_reveal_mac_keys_len);
+  for (; current; current = current->next)
+    len += current->len + 4;
 
-  *dst = otrl_base64_otr_encode(ser, serlen);
-  free(ser);
-  ser = NULL;
+  return len;
+}
 
-  return SUCCESS;
+tstatic size_t serialize_tlvs(uint8_t *dst, const tlv_t *tlvs) {
+  const tlv_t *current = tlvs;
+  uint8_t *cursor = dst;
+
+  for (; current; current = current->next) {
+    cursor += otrv4_serialize_uint16(cursor, current->type);
+    cursor += otrv4_serialize_uint16(cursor, current->len);
+    cursor += otrv4_serialize_bytes_array(cursor, current->data, current->len);
+  }
+
+  return cursor - dst;
 }
 
-tstatic otrv4_err_t send_data_message(string_t *to_send, const uint8_t *message,
-                                      size_t message_len, otrv4_t *otr,
-                                      int isHeartbeat, unsigned char flags) {
-  data_message_t *data_msg = NULL;
+/* Length of the encoded data message carrying plain_len bytes of plaintext
+ * and revealing mac_keys_len bytes of MAC keys, when the DH key has its
+ * maximum size. */
+tstatic size_t encoded_data_message_len(size_t plain_len,
+                                        size_t mac_keys_len) {
+  return OTRV4_OTR_ENCODED_LEN(DATA_MESSAGE_MIN_BYTES + DH_MPI_BYTES + 4 +
+                               plain_len + DATA_MSG_MAC_BYTES + mac_keys_len);
+}
 
-  size_t serlen = otrv4_list_len(otr->keys->old_mac_keys) * MAC_KEY_BYTES;
+/* Upper bound for the encoded data message carrying plain_len bytes of
+ * plaintext. The DH key may rotate before sending, so its maximum size is
+ * assumed. */
+tstatic size_t data_message_max_len(size_t plain_len, const otrv4_t *otr) {
+  size_t mac_keys_len =
+      otrv4_list_len(otr->keys->old_mac_keys) * MAC_KEY_BYTES;
 
-  uint8_t *ser_mac_keys =
-      otrv4_key_manager_old_mac_keys_serialize(otr->keys->old_mac_keys);
-  otr->keys->old_mac_keys = NULL;
+  return encoded_data_message_len(plain_len, mac_keys_len);
+}
+
+/*
+ * Builds the data message at the end of dst: header, then the plaintext
+ * (message, NUL, TLVs and padding_len bytes of padding, if any) which is
+ * encrypted in place, the MAC and the revealed MAC keys. It is then base64
+ * encoded in place, so the only buffer used is dst.
+ */
+tstatic otrv4_err_t write_data_message(char *dst, size_t dstlen,
+                                       size_t *written, const string_t message,
+                                       const tlv_t *tlvs, size_t padding_len,
+                                       data_message_t *data_msg,
+                                       const m_enc_key_t enc_key,
+                                       const m_mac_key_t mac_key,
+                                       list_element_t *old_mac_keys) {
+  size_t message_len = strlen(message) + 1;
+  size_t tlvs_len = tlvs_serialized_len(tlvs);
+  size_t plain_len = message_len + tlvs_len;
+  size_t mac_keys_len = otrv4_list_len(old_mac_keys) * MAC_KEY_BYTES;
+  uint8_t *bin = NULL, *plain = NULL;
+
+  if (padding_len)
+    plain_len += 4 + padding_len;
+
+  random_bytes(data_msg->nonce, sizeof(data_msg->nonce));
+  data_msg->enc_msg = NULL;
+  data_msg->enc_msg_len = plain_len;
 
-  if (otrv4_key_manager_prepare_next_chain_key(otr->keys)) {
-    free(ser_mac_keys);
-    ser_mac_keys = NULL;
+  size_t body_len = otrv4_data_message_header_len(data_msg) + plain_len;
+  size_t bin_len = body_len + DATA_MSG_MAC_BYTES + mac_keys_len;
+  size_t encoded_len = OTRV4_OTR_ENCODED_LEN(bin_len);
+  if (encoded_len > dstlen)
     return ERROR;
+
+  bin = (uint8_t *)dst + encoded_len - bin_len;
+  plain = bin + otrv4_data_message_serialize_header(bin, data_msg);
+  if (plain == bin)
+    return ERROR;
+
+  // TODO: message is an UTF-8 string. Is there any problem to cast
+  // it to (unsigned char *)
+  memcpy(plain, message, message_len);
+  serialize_tlvs(plain + message_len, tlvs);
+
+  if (padding_len) {
+    uint8_t *padding = plain + message_len + tlvs_len;
+    padding += otrv4_serialize_uint16(padding, OTRV4_TLV_PADDING);
+    padding += otrv4_serialize_uint16(padding, padding_len);
+    random_bytes(padding, padding_len);
   }
 
+  if (crypto_stream_xor(plain, plain, plain_len, data_msg->nonce, enc_key))
+    return ERROR;
+
+  shake_256_mac(bin + body_len, DATA_MSG_MAC_BYTES, mac_key,
+                sizeof(m_mac_key_t), bin, body_len);
+
+  otrv4_key_manager_old_mac_keys_serialize_into(
+      bin + body_len + DATA_MSG_MAC_BYTES, old_mac_keys);
+
+  /* bin is at the end of dst, so it can be encoded in place */
+  OTRV4_STATS_TIMER_START(encode_start);
+  *written = otrv4_otr_encode(dst, bin, bin_len);
+  OTRV4_STATS_TIMER_STOP(encode_start, OTRV4_STATS_TIMER_BASE64);
+  return SUCCESS;
+}
+
+tstatic void data_message_init_for(data_message_t *data_msg, otrv4_t *otr,
+                                   unsigned char flags) {
+  /* Keys are borrowed from the key manager, so this is never freed */
+  data_msg->sender_instance_tag = otr->our_instance_tag;
+  data_msg->receiver_instance_tag = otr->their_instance_tag;
+  data_msg->flags = flags;
+  data_msg->message_id = 0;
+  otrv4_ec_point_copy(data_msg->ecdh, OUR_ECDH(otr));
+  data_msg->dh = OUR_DH(otr);
+}
+
+tstatic void update_last_msg_sent(otrv4_t *otr) {
+  otrv4_client_state_lock(otr->conversation->client);
+  HEARTBEAT(otr)->last_msg_sent = time(0);
+  otrv4_client_state_unlock(otr->conversation->client);
+}
+
+tstatic size_t padding_len_for(const string_t message, const otrv4_t *otr) {
+  if (!otr->conversation->client->pad)
+    return 0;
+
+  return otrv4_padding_len(strlen(message));
+}
+
+// TODO: due to the addition of the flag to the tlvs, this will
+// make the extra sym key, the disconneted and smp, a heartbeat
+// msg as it is right now
+tstatic unsigned char data_message_flags_for(const string_t message,
+                                             unsigned char flags,
+                                             const otrv4_t *otr) {
+  if (strlen(message) == 0 && otr->smp->state == SMPSTATE_EXPECT1)
+    return MSGFLAGS_IGNORE_UNREADABLE; /* A heartbeat */
+
+  return flags;
+}
+
+/* Derives the keys of the next message and writes it, revealing
+ * old_mac_keys, if any. j only moves on when the message was written. */
+tstatic otrv4_err_t write_next_data_message(
+    char *dst, size_t dstlen, size_t *written, const string_t message,
+    const tlv_t *tlvs, size_t padding_len, list_element_t *old_mac_keys,
+    unsigned char flags, otrv4_t *otr) {
+  data_message_t data_msg[1];
   m_enc_key_t enc_key;
   m_mac_key_t mac_key;
+
   memset(enc_key, 0, sizeof enc_key);
   memset(mac_key, 0, sizeof mac_key);
 
-  if (otrv4_key_manager_retrieve_sending_message_keys(enc_key, mac_key,
+  if (otrv4_key_manager_prepare_next_chain_key(otr->keys) ||
+      otrv4_key_manager_retrieve_sending_message_keys(enc_key, mac_key,
                                                       otr->keys)) {
-    free(ser_mac_keys);
-    ser_mac_keys = NULL;
-    return ERROR;
-  }
-
-  data_msg = generate_data_msg(otr);
-  if (!data_msg) {
     sodium_memzero(enc_key, sizeof(m_enc_key_t));
     sodium_memzero(mac_key, sizeof(m_mac_key_t));
-    free(ser_mac_keys);
-    ser_mac_keys = NULL;
     return ERROR;
   }
 
-  data_msg->flags = flags;
+  data_message_init_for(data_msg, otr,
+                        data_message_flags_for(message, flags, otr));
+  data_msg->message_id = otr->keys->j;
 
-  if (isHeartbeat) {
-    data_msg->flags = MSGFLAGS_IGNORE_UNREADABLE;
+  otrv4_err_t err =
+      write_data_message(dst, dstlen, written, message, tlvs, padding_len,
+                         data_msg, enc_key, mac_key, old_mac_keys);
+  if (!err) {
+    // TODO: Change the spec to say this should be incremented after the
+    // message is sent.
+    otr->keys->j++;
   }
 
-  data_msg->sender_instance_tag = otr->our_instance_tag;
-  data_msg->receiver_instance_tag = otr->their_instance_tag;
+  sodium_memzero(enc_key, sizeof(m_enc_key_t));
+  sodium_memzero(mac_key, sizeof(m_mac_key_t));
+  otrv4_ec_point_destroy(data_msg->ecdh);
 
-  otrv4_err_t err = ERROR;
+  return err;
+}
 
-  if (encrypt_data_message(data_msg, message, message_len, enc_key) ==
-          SUCCESS &&
-      serialize_and_encode_data_msg(to_send, mac_key, ser_mac_keys, serlen,
-                                    data_msg) == SUCCESS) {
+tstatic otrv4_err_t send_data_message(char *dst, size_t dstlen,
+                                      size_t *written, const string_t message,
+                                      const tlv_t *tlvs, size_t padding_len,
+                                      otrv4_t *otr, unsigned char flags) {
+  list_element_t *old_mac_keys = otr->keys->old_mac_keys;
+  otr->keys->old_mac_keys = NULL;
 
-    // TODO: Change the spec to say this should be incremented after the message
-    // is sent.
-    otr->keys->j++;
-    HEARTBEAT(otr)->last_msg_sent = time(0);
-    err = SUCCESS;
+  otrv4_err_t err =
+      write_next_data_message(dst, dstlen, written, message, tlvs,
+                              padding_len, old_mac_keys, flags, otr);
+  if (err) {
+    /* They were not revealed */
+    otrv4_key_manager_restore_old_mac_keys(otr->keys, old_mac_keys);
+    return err;
   }
 
-  sodium_memzero(enc_key, sizeof(m_enc_key_t));
-  sodium_memzero(mac_key, sizeof(m_mac_key_t));
-  free(ser_mac_keys);
-  ser_mac_keys = NULL;
-  otrv4_data_message_free(data_msg);
+  otrv4_key_manager_release_old_mac_keys(otr->keys, old_mac_keys);
+  update_last_msg_sent(otr);
+  OTRV4_STATS_INC(STATS(otr), sent[OTRV4_STATS_MSG_DATA]);
 
-  return err;
+  return SUCCESS;
 }
 
-tstatic otrv4_err_t serialize_tlvs(uint8_t **dst, size_t *dstlen,
-                                   const tlv_t *tlvs) {
-  const tlv_t *current = tlvs;
-  uint8_t *cursor = NULL;
+tstatic otrv4_err_t otrv4_prepare_to_send_data_message(
+    char *dst, size_t dstlen, size_t *written, const string_t message,
+    const tlv_t *tlvs, size_t padding_len, otrv4_t *otr, unsigned char flags) {
+  if (otr->state == OTRV4_STATE_FINISHED)
+    return ERROR; // Should restart
 
-  *dst = NULL;
-  *dstlen = 0;
+  if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES) {
+    return STATE_NOT_ENCRYPTED; // TODO: queue message
+  }
 
-  if (!tlvs)
-    return SUCCESS;
+  return send_data_message(dst, dstlen, written, message, tlvs, padding_len,
+                           otr, flags);
+}
 
-  for (*dstlen = 0; current; current = current->next)
-    *dstlen += current->len + 4;
+tstatic otrv4_err_t otrv4_prepare_to_send_data_message_alloc(
+    string_t *to_send, const string_t message, const tlv_t *tlvs,
+    otrv4_t *otr, unsigned char flags) {
+  size_t padding_len = padding_len_for(message, otr);
+  size_t plain_len = strlen(message) + 1 + tlvs_serialized_len(tlvs);
+  size_t written = 0;
+  char *dst = NULL;
 
-  *dst = malloc(*dstlen);
-  if (!*dst)
+  if (padding_len)
+    plain_len += 4 + padding_len;
+
+  if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES)
+    return otrv4_prepare_to_send_data_message(NULL, 0, &written, message,
+                                              tlvs, 0, otr, flags);
+
+  size_t len = data_message_max_len(plain_len, otr);
+  dst = malloc(len);
+  if (!dst)
     return ERROR;
 
-  cursor = *dst;
-  for (current = tlvs; current; current = current->next) {
-    cursor += otrv4_serialize_uint16(cursor, current->type);
-    cursor += otrv4_serialize_uint16(cursor, current->len);
-    cursor += otrv4_serialize_bytes_array(cursor, current->data, current->len);
+  otrv4_err_t err = otrv4_prepare_to_send_data_message(
+      dst, len, &written, message, tlvs, padding_len, otr, flags);
+  if (err) {
+    free(dst);
+    dst = NULL;
   }
 
-  return SUCCESS;
+  *to_send = dst;
+  return err;
 }
 
-tstatic otrv4_err_t append_tlvs(uint8_t **dst, size_t *dstlen,
-                                const string_t message, const tlv_t *tlvs) {
-  uint8_t *ser = NULL;
-  size_t len = 0;
+INTERNAL size_t otrv4_prepare_to_send_message_len(const string_t message,
+                                                  const tlv_t *tlvs,
+                                                  const otrv4_t *otr) {
+  size_t plain_len = strlen(message) + 1 + tlvs_serialized_len(tlvs);
+
+  if (!otr || otr->running_version != OTRV4_VERSION_4)
+    return 0;
+
+  size_t padding_len = padding_len_for(message, otr);
+  if (padding_len)
+    plain_len += 4 + padding_len;
 
-  if (serialize_tlvs(&ser, &len, tlvs))
+  return data_message_max_len(plain_len, otr);
+}
+
+INTERNAL otrv4_err_t otrv4_prepare_to_send_message_into(
+    char *dst, size_t dstlen, size_t *written, const string_t message,
+    tlv_t **tlvs, uint8_t flags, otrv4_t *otr) {
+  if (!otr || otr->running_version != OTRV4_VERSION_4)
     return ERROR;
 
-  *dstlen = strlen(message) + 1 + len;
-  *dst = malloc(*dstlen);
-  if (!*dst) {
-    free(ser);
-    ser = NULL;
+  otrv4_arena_reset(otr->scratch);
+
+  /* Fail before the keys are touched */
+  if (dstlen < otrv4_prepare_to_send_message_len(
+                   message, tlvs ? *tlvs : NULL, otr))
     return ERROR;
-  }
 
-  memcpy(stpcpy((char *)*dst, message) + 1, ser, len);
+  return otrv4_prepare_to_send_data_message(
+      dst, dstlen, written, message, tlvs ? *tlvs : NULL,
+      padding_len_for(message, otr), otr, flags);
+}
 
-  free(ser);
-  ser = NULL;
-  return SUCCESS;
+tstatic size_t batch_message_len(const string_t message, size_t mac_keys_len,
+                                 const otrv4_t *otr) {
+  size_t plain_len = strlen(message) + 1;
+  size_t padding_len = padding_len_for(message, otr);
+
+  if (padding_len)
+    plain_len += 4 + padding_len;
+
+  return encoded_data_message_len(plain_len, mac_keys_len);
 }
 
-tstatic otrv4_err_t otrv4_prepare_to_send_data_message(string_t *to_send,
-                                                       const string_t message,
-                                                       const tlv_t *tlvs,
-                                                       otrv4_t *otr,
-                                                       unsigned char flags) {
-  uint8_t *msg = NULL;
-  size_t msg_len = 0;
+INTERNAL size_t otrv4_prepare_to_send_messages_len(const string_t *messages,
+                                                   size_t count,
+                                                   const otrv4_t *otr) {
+  size_t mac_keys_len = 0, len = 0, i;
 
-  if (otr->state == OTRV4_STATE_FINISHED)
-    return ERROR; // Should restart
+  if (!otr || otr->running_version != OTRV4_VERSION_4)
+    return 0;
 
-  if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES) {
-    return STATE_NOT_ENCRYPTED; // TODO: queue message
-  }
+  /* Only the first message reveals the old MAC keys */
+  mac_keys_len = otrv4_list_len(otr->keys->old_mac_keys) * MAC_KEY_BYTES;
+  for (i = 0; i < count; i++)
+    len += batch_message_len(messages[i], i ? 0 : mac_keys_len, otr);
 
-  if (append_tlvs(&msg, &msg_len, message, tlvs))
+  return len;
+}
+
+INTERNAL otrv4_err_t otrv4_prepare_to_send_messages_into(
+    char *dst, size_t dstlen, char **to_send, size_t *sent,
+    const string_t *messages, size_t count, uint8_t flags, otrv4_t *otr) {
+  otrv4_err_t err = SUCCESS;
+  size_t i;
+
+  *sent = 0;
+  if (!otr || otr->running_version != OTRV4_VERSION_4)
     return ERROR;
 
-  // TODO: due to the addition of the flag to the tlvs, this will
-  // make the extra sym key, the disconneted and smp, a heartbeat
-  // msg as it is right now
-  int is_heartbeat =
-      strlen(message) == 0 && otr->smp->state == SMPSTATE_EXPECT1 ? 1 : 0;
+  if (otr->state == OTRV4_STATE_FINISHED)
+    return ERROR;
 
-  otrv4_err_t err =
-      send_data_message(to_send, msg, msg_len, otr, is_heartbeat, flags);
-  free(msg);
-  msg = NULL;
+  if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES)
+    return STATE_NOT_ENCRYPTED;
 
-  return err;
-}
+  otrv4_arena_reset(otr->scratch);
 
-INTERNAL otrv4_err_t otrv4_prepare_to_send_message(string_t *to_send,
-                                                   const string_t message,
-                                                   tlv_t **tlvs, uint8_t flags,
-                                                   otrv4_t *otr) {
-  if (!otr)
+  /* Fail before the keys are touched */
+  if (dstlen < otrv4_prepare_to_send_messages_len(messages, count, otr))
     return ERROR;
 
-  // Optional. Client might want or not to disguise the length of
-  // message
+  /* Only the first message reveals them */
+  list_element_t *old_mac_keys = otr->keys->old_mac_keys;
+  otr->keys->old_mac_keys = NULL;
 
-  // TODO if we need to pad, merge the padding tlv and the user's tlvs to send
-  if (otr->conversation->client->pad) {
-    if (otrv4_append_padding_tlv(tlvs, strlen(message)))
-      return ERROR;
+  /* The keys of each message are derived just before it is written, so a
+   * failure does not use up the ids of the messages after it */
+  for (i = 0; i < count; i++) {
+    size_t written = 0;
+
+    err = write_next_data_message(dst, dstlen, &written, messages[i], NULL,
+                                  padding_len_for(messages[i], otr),
+                                  i ? NULL : old_mac_keys, flags, otr);
+    if (err)
+      break;
+
+    to_send[i] = dst;
+    dst += written + 1;
+    dstlen -= written + 1;
   }
 
+  if (i == 0) {
+    otrv4_key_manager_restore_old_mac_keys(otr->keys, old_mac_keys);
+    return err;
+  }
+
+  otrv4_key_manager_release_old_mac_keys(otr->keys, old_mac_keys);
+  update_last_msg_sent(otr);
+  OTRV4_STATS_ADD(STATS(otr), sent[OTRV4_STATS_MSG_DATA], i);
+
+  *sent = i;
+  return err;
+}
+
+/* Optionally, the client might want to disguise the length of the message:
+ * the padding is then written after the TLVs, without touching them. */
+tstatic otrv4_err_t prepare_to_send_message(string_t *to_send,
+                                            const string_t message,
+                                            tlv_t **tlvs, uint8_t flags,
+                                            otrv4_t *otr) {
   const tlv_t *const_tlvs = NULL;
   if (tlvs)
     const_tlvs = *tlvs;
@@ -2500,8 +2756,8 @@ INTERNAL otrv4_err_t otrv4_prepare_to_send_message(string_t *to_send,
   case OTRV4_VERSION_3:
     return otrv4_v3_send_message(to_send, message, const_tlvs, otr->otr3_conn);
   case OTRV4_VERSION_4:
-    return otrv4_prepare_to_send_data_message(to_send, message, const_tlvs, otr,
-                                              flags);
+    return otrv4_prepare_to_send_data_message_alloc(to_send, message,
+                                                    const_tlvs, otr, flags);
   case OTRV4_VERSION_NONE:
     return ERROR;
   }
@@ -2509,6 +2765,18 @@ INTERNAL otrv4_err_t otrv4_prepare_to_send_message(string_t *to_send,
   return SUCCESS;
 }
 
+INTERNAL otrv4_err_t otrv4_prepare_to_send_message(string_t *to_send,
+                                                   const string_t message,
+                                                   tlv_t **tlvs, uint8_t flags,
+                                                   otrv4_t *otr) {
+  if (!otr)
+    return ERROR;
+
+  otrv4_arena_reset(otr->scratch);
+
+  return prepare_to_send_message(to_send, message, tlvs, flags, otr);
+}
+
 tstatic otrv4_err_t otrv4_close_v4(string_t *to_send, otrv4_t *otr) {
   if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES)
     return SUCCESS;
@@ -2682,9 +2950,11 @@ INTERNAL otrv4_err_t otrv4_smp_start(string_t *to_send, const string_t question,
     if (otr->state != OTRV4_STATE_ENCRYPTED_MESSAGES)
       return ERROR;
 
+    OTRV4_STATS_TIMER_START(start);
     smp_start_tlv = otrv4_smp_initiate(
         get_my_user_profile(otr), otr->their_profile, question, q_len, secret,
         secretlen, otr->keys->ssid, otr->smp, otr->conversation);
+    OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_SMP);
     if (otrv4_prepare_to_send_message(to_send, "", &smp_start_tlv,
                                       MSGFLAGS_IGNORE_UNREADABLE, otr)) {
       otrv4_tlv_free(smp_start_tlv);
@@ -2729,9 +2999,11 @@ tstatic otrv4_err_t smp_continue_otrv4(string_t *to_send, const uint8_t *secret,
     return err;
 
   otrv4_smp_event_t event = OTRV4_SMPEVENT_NONE;
+  OTRV4_STATS_TIMER_START(start);
   smp_reply = otrv4_smp_provide_secret(
       &event, otr->smp, get_my_user_profile(otr), otr->their_profile,
       otr->keys->ssid, secret, secretlen);
+  OTRV4_STATS_TIMER_STOP(start, OTRV4_STATS_TIMER_SMP);
 
   if (!event)
     event = OTRV4_SMPEVENT_IN_PROGRESS;
@@ -2793,21 +3065,23 @@ API otrv4_err_t otrv4_smp_abort(string_t *to_send, otrv4_t *otr) {
 }
 
 API otrv4_err_t otrv4_heartbeat_checker(string_t *to_send, otrv4_t *otr) {
-  if (difftime(time(0), HEARTBEAT(otr)->last_msg_sent) >=
-      HEARTBEAT(otr)->time) {
+  otrv4_client_state_lock(otr->conversation->client);
+  int expired = difftime(time(0), HEARTBEAT(otr)->last_msg_sent) >=
+                HEARTBEAT(otr)->time;
+  otrv4_client_state_unlock(otr->conversation->client);
+
+  if (expired) {
     const string_t heartbeat_msg = "";
     return otrv4_prepare_to_send_message(to_send, heartbeat_msg, NULL, 0, otr);
   }
   return SUCCESS;
 }
 
-static int otrl_initialized = 0;
-API void otrv4_v3_init(void) {
-  if (otrl_initialized)
-    return;
+static pthread_once_t otrl_init_once = PTHREAD_ONCE_INIT;
 
+tstatic void otrl_init_v3(void) {
   if (otrl_init(OTRL_VERSION_MAJOR, OTRL_VERSION_MINOR, OTRL_VERSION_SUB))
     exit(1);
-
-  otrl_initialized = 1;
 }
+
+API void otrv4_v3_init(void) { pthread_once(&otrl_init_once, otrl_init_v3); }
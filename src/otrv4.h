@@ -1,6 +1,9 @@
 #ifndef OTRV4_OTRV4_H
 #define OTRV4_OTRV4_H
 
+#include <pthread.h>
+
+#include "alloc.h"
 #include "client_state.h"
 #include "fragment.h"
 #include "key_management.h"
@@ -22,6 +25,7 @@
 #define OTRV4_FREE                                                             \
   do {                                                                         \
     otrv4_dh_free();                                                           \
+    otrv4_user_profile_cache_clear();                                          \
   } while (0);
 
 // TODO: how is this type chosen?
@@ -84,7 +88,7 @@ struct connection {
   uint32_t our_instance_tag;
   uint32_t their_instance_tag;
 
-  user_profile_t *profile;
+  user_profile_t *profile; /* A reference to the profile of the client */
   user_profile_t *their_profile;
 
   otrv4_version_t running_version;
@@ -93,6 +97,18 @@ struct connection {
   smp_context_t smp;
 
   fragment_context_t *frag_ctx;
+
+  /* Reused to decode the messages received */
+  uint8_t *decode_buf;
+  size_t decode_cap;
+
+  /* Transient objects of the call being processed. It is wiped when the next
+   * call starts, so what a call returns borrowed from it stays valid until
+   * then. */
+  otrv4_arena_t scratch[1];
+
+  /* Held by the client API while it uses this connection */
+  pthread_mutex_t lock;
 }; /* otrv4_t */
 
 // clang-format off
@@ -146,11 +162,49 @@ INTERNAL otrv4_err_t otrv4_receive_message(otrv4_response_t *response,
                                            const string_t message,
                                            otrv4_t *otr);
 
+/*
+ * Like otrv4_receive_message(), but the TLVs are not copied into the
+ * response: *tlvs points to them in the scratch arena of the connection, and
+ * is only valid until the next call on it. response->tlvs is left NULL.
+ */
+INTERNAL otrv4_err_t otrv4_receive_message_borrowing_tlvs(
+    otrv4_response_t *response, const tlv_t **tlvs, const string_t message,
+    otrv4_t *otr);
+
 INTERNAL otrv4_err_t otrv4_prepare_to_send_message(string_t *to_send,
                                                    const string_t message,
                                                    tlv_t **tlvs, uint8_t flags,
                                                    otrv4_t *otr);
 
+/* Upper bound for the buffer otrv4_prepare_to_send_message_into needs. Only
+ * OTRv4 conversations are supported. */
+INTERNAL size_t otrv4_prepare_to_send_message_len(const string_t message,
+                                                  const tlv_t *tlvs,
+                                                  const otrv4_t *otr);
+
+INTERNAL otrv4_err_t otrv4_prepare_to_send_message_into(
+    char *dst, size_t dstlen, size_t *written, const string_t message,
+    tlv_t **tlvs, uint8_t flags, otrv4_t *otr);
+
+/* Bytes needed by otrv4_prepare_to_send_messages_into() */
+INTERNAL size_t otrv4_prepare_to_send_messages_len(const string_t *messages,
+                                                   size_t count,
+                                                   const otrv4_t *otr);
+
+/*
+ * Encrypts count messages into dst, one after the other, and points
+ * to_send[i] to the i-th one (a NUL-terminated string). The old MAC keys are
+ * revealed by the first message only. If a message cannot be written, the
+ * ones after it are not either, and their to_send entries are left untouched.
+ *
+ * sent is set to the number of messages written, even on error: they used
+ * up their keys, and the first one reveals the old MAC keys, so they must be
+ * sent. Only OTRv4 conversations are supported.
+ */
+INTERNAL otrv4_err_t otrv4_prepare_to_send_messages_into(
+    char *dst, size_t dstlen, char **to_send, size_t *sent,
+    const string_t *messages, size_t count, uint8_t flags, otrv4_t *otr);
+
 INTERNAL otrv4_err_t otrv4_close(string_t *to_send, otrv4_t *otr);
 
 INTERNAL otrv4_err_t otrv4_smp_start(string_t *to_send, const string_t question,
@@ -193,6 +247,21 @@ API void otrv4_v3_init(void);
 
 tstatic void otrv4_destroy(otrv4_t *otr);
 
+tstatic const user_profile_t *take_my_user_profile(otrv4_t *otr);
+
+tstatic const user_profile_t *get_my_user_profile(otrv4_t *otr);
+
+tstatic const user_profile_t *refresh_my_user_profile(otrv4_t *otr);
+
+tstatic void otrl_init_v3(void);
+
+tstatic otrv4_err_t decode_buf_reserve(otrv4_t *otr, size_t len);
+
+tstatic otrv4_err_t prepare_to_send_message(string_t *to_send,
+                                            const string_t message,
+                                            tlv_t **tlvs, uint8_t flags,
+                                            otrv4_t *otr);
+
 tstatic otrv4_in_message_type_t get_message_type(const string_t message);
 
 tstatic otrv4_err_t extract_header(otrv4_header_t *dst, const uint8_t *buffer,
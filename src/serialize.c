@@ -72,22 +72,15 @@ INTERNAL size_t otrv4_serialize_ec_scalar(uint8_t *dst,
 
 INTERNAL otrv4_err_t otrv4_serialize_dh_public_key(uint8_t *dst, size_t *len,
                                                    const dh_public_key_t pub) {
-  /* From gcrypt MPI */
-  uint8_t buf[DH3072_MOD_LEN_BYTES] = {0};
-  memset(buf, 0, DH3072_MOD_LEN_BYTES);
+  /* From gcrypt MPI to OTR MPI, written straight after its length */
   size_t written = 0;
   otrv4_err_t err =
-      otrv4_dh_mpi_serialize(buf, DH3072_MOD_LEN_BYTES, &written, pub);
+      otrv4_dh_mpi_serialize(dst + 4, DH3072_MOD_LEN_BYTES, &written, pub);
   if (err)
     return err;
 
-  // To OTR MPI
-  // TODO: Maybe gcrypt MPI already has some API for this.
-  // gcry_mpi_print with a different format, maybe?
-  otrv4_mpi_t mpi;
-  otrv4_mpi_set(mpi, buf, written);
-  *len = otrv4_serialize_mpi(dst, mpi);
-  otrv4_mpi_free(mpi);
+  otrv4_serialize_uint32(dst, written);
+  *len = 4 + written;
 
   return SUCCESS;
 }
@@ -0,0 +1,20 @@
+#include <pthread.h>
+
+#include "shake.h"
+
+/* The state after absorbing the domain. It is built once, and never
+ * changed after that, so it can be copied from any thread. */
+static decaf_shake256_ctx_t dom_hash;
+static pthread_once_t dom_hash_once = PTHREAD_ONCE_INIT;
+
+static void dom_hash_init(void) {
+  const char *dom_s = "OTR4";
+
+  hash_init(dom_hash);
+  hash_update(dom_hash, (const unsigned char *)dom_s, strlen(dom_s));
+}
+
+INTERNAL void otrv4_shake_init_with_dom(decaf_shake256_ctx_t hash) {
+  pthread_once(&dom_hash_once, dom_hash_init);
+  memcpy(hash, dom_hash, sizeof(decaf_shake256_ctx_t));
+}
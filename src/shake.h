@@ -1,6 +1,8 @@
 #ifndef OTRV4_SHAKE_H
 #define OTRV4_SHAKE_H
 
+#include <string.h>
+
 #include "decaf/shake.h"
 #include "shared.h"
 
@@ -10,11 +12,11 @@
 #define hash_destroy decaf_shake256_destroy
 #define hash_hash decaf_shake256_hash
 
-static void hash_init_with_dom(decaf_shake256_ctx_t hash) {
-  hash_init(hash);
+/* Starts hash as if "OTR4" was absorbed, by copying a state where it was */
+INTERNAL void otrv4_shake_init_with_dom(decaf_shake256_ctx_t hash);
 
-  const char *dom_s = "OTR4";
-  hash_update(hash, (const unsigned char *)dom_s, strlen(dom_s));
+static void hash_init_with_dom(decaf_shake256_ctx_t hash) {
+  otrv4_shake_init_with_dom(hash);
 }
 
 static void shake_kkdf(uint8_t *dst, size_t dstlen, const uint8_t *key,
@@ -29,6 +31,38 @@ static void shake_kkdf(uint8_t *dst, size_t dstlen, const uint8_t *key,
   hash_destroy(hd);
 }
 
+/* One of the KKDFs of a batch: dst = KKDF(key || secret) */
+typedef struct {
+  uint8_t *dst;
+  size_t dstlen;
+  const uint8_t *key;
+  size_t keylen;
+  const uint8_t *secret;
+  size_t secretlen;
+} shake_kkdf_job_t;
+
+/*
+ * Runs n independent KKDFs. They only share the absorbed domain, which is
+ * copied once for the batch. No dst may be the key or the secret of another
+ * job, so they could also be hashed in parallel.
+ */
+static inline void shake_kkdf_batch(const shake_kkdf_job_t *jobs, size_t n) {
+  decaf_shake256_ctx_t dom, hd;
+  size_t i;
+
+  hash_init_with_dom(dom);
+
+  for (i = 0; i < n; i++) {
+    memcpy(hd, dom, sizeof(decaf_shake256_ctx_t));
+    hash_update(hd, jobs[i].key, jobs[i].keylen);
+    hash_update(hd, jobs[i].secret, jobs[i].secretlen);
+    hash_final(hd, jobs[i].dst, jobs[i].dstlen);
+  }
+
+  hash_destroy(hd);
+  hash_destroy(dom);
+}
+
 static inline void shake_256_mac(uint8_t *dst, size_t dstlen,
                                  const uint8_t *key, size_t keylen,
                                  const uint8_t *msg, size_t msglen) {
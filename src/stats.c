@@ -0,0 +1,55 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "constants.h"
+#include "stats.h"
+
+static uint64_t timers[OTRV4_STATS_TIMERS];
+
+INTERNAL uint64_t otrv4_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+INTERNAL void otrv4_stats_add_time(otrv4_stats_timer_t timer, uint64_t ns) {
+  __atomic_add_fetch(&timers[timer], ns, __ATOMIC_RELAXED);
+}
+
+INTERNAL otrv4_stats_msg_t otrv4_stats_msg_type(uint8_t type) {
+  switch (type) {
+  case IDENTITY_MSG_TYPE:
+    return OTRV4_STATS_MSG_IDENTITY;
+  case AUTH_R_MSG_TYPE:
+    return OTRV4_STATS_MSG_AUTH_R;
+  case AUTH_I_MSG_TYPE:
+    return OTRV4_STATS_MSG_AUTH_I;
+  case PRE_KEY_MSG_TYPE:
+    return OTRV4_STATS_MSG_PRE_KEY;
+  case NON_INT_AUTH_MSG_TYPE:
+    return OTRV4_STATS_MSG_NON_INT_AUTH;
+  case DATA_MSG_TYPE:
+    return OTRV4_STATS_MSG_DATA;
+  default:
+    return OTRV4_STATS_MSG_OTHER;
+  }
+}
+
+INTERNAL void otrv4_stats_snapshot(otrv4_stats_t *dst,
+                                   const otrv4_stats_t *src) {
+  const uint64_t *from = (const uint64_t *)src;
+  uint64_t *to = (uint64_t *)dst;
+  size_t counters = offsetof(otrv4_stats_t, timer_ns) / sizeof(uint64_t);
+  size_t i;
+
+  memset(dst, 0, sizeof(otrv4_stats_t));
+
+  /* The counters may be updated by other threads while they are copied */
+  if (src)
+    for (i = 0; i < counters; i++)
+      to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+
+  for (i = 0; i < OTRV4_STATS_TIMERS; i++)
+    dst->timer_ns[i] = __atomic_load_n(&timers[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,54 @@
+#ifndef OTRV4_STATS_H
+#define OTRV4_STATS_H
+
+#include <stdint.h>
+
+#include "include/libotrv4.h"
+#include "shared.h"
+
+/*
+ * Hooks that update the counters of a client (otrv4_stats_t, part of the
+ * API). They expand to nothing unless the library is built with OTRV4_STATS
+ * (./configure --enable-stats).
+ */
+
+#ifdef OTRV4_STATS
+
+/* stats may be NULL, for objects that are not used by a client */
+#define OTRV4_STATS_ADD(stats, counter, n)                                     \
+  do {                                                                         \
+    if (stats)                                                                 \
+      __atomic_add_fetch(&(stats)->counter, (n), __ATOMIC_RELAXED);            \
+  } while (0)
+
+#define OTRV4_STATS_TIMER_START(start) uint64_t start = otrv4_stats_now()
+
+#define OTRV4_STATS_TIMER_STOP(start, timer)                                   \
+  otrv4_stats_add_time((timer), otrv4_stats_now() - (start))
+
+#else
+
+#define OTRV4_STATS_ADD(stats, counter, n) ((void)0)
+#define OTRV4_STATS_TIMER_START(start)
+#define OTRV4_STATS_TIMER_STOP(start, timer) ((void)0)
+
+#endif
+
+#define OTRV4_STATS_INC(stats, counter) OTRV4_STATS_ADD(stats, counter, 1)
+
+#define OTRV4_STATS_RECEIVED(stats, type)                                      \
+  OTRV4_STATS_INC(stats, received[otrv4_stats_msg_type(type)])
+
+/* Monotonic time, in nanoseconds */
+INTERNAL uint64_t otrv4_stats_now(void);
+
+INTERNAL void otrv4_stats_add_time(otrv4_stats_timer_t timer, uint64_t ns);
+
+/* Maps the type in the header of a message to the counter for it */
+INTERNAL otrv4_stats_msg_t otrv4_stats_msg_type(uint8_t type);
+
+/* Copies the counters of src, and the timers, into dst */
+INTERNAL void otrv4_stats_snapshot(otrv4_stats_t *dst,
+                                   const otrv4_stats_t *src);
+
+#endif
@@ -0,0 +1,44 @@
+#define OTRV4_DH_PRIVATE
+#define OTRV4_KEY_MANAGEMENT_PRIVATE
+
+#include "../otrv4.h"
+
+#include "bench_helpers.h"
+
+#include "bench_auth.c"
+#include "bench_base64.c"
+#include "bench_dake.c"
+#include "bench_data_message.c"
+#include "bench_dh.c"
+#include "bench_ed448.c"
+#include "bench_fragment.c"
+#include "bench_key_management.c"
+#include "bench_smp.c"
+
+int main(int argc, char **argv) {
+  if (!gcry_check_version(GCRYPT_VERSION))
+    return 2;
+
+  /* Set to quick random so we don't wait on /dev/random. */
+  gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+
+  OTRV4_INIT;
+
+  /* Only the cases whose name contains the argument are run, if given */
+  if (argc > 1)
+    bench_filter = argv[1];
+
+  bench_dh();
+  bench_ed448();
+  bench_auth();
+  bench_dake();
+  bench_data_message();
+  bench_base64();
+  bench_fragment();
+  bench_smp();
+  bench_key_management();
+
+  OTRV4_FREE;
+
+  return 0;
+}
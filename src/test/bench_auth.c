@@ -0,0 +1,98 @@
+#include "../auth.h"
+
+#define BENCH_AUTH_BATCH 16
+
+typedef struct {
+  snizkpk_keypair_t pairs[3][1];
+  snizkpk_proof_t proof[1];
+  snizkpk_nonces_t nonces[1];
+  snizkpk_verification_t items[BENCH_AUTH_BATCH];
+} bench_auth_ctx_t;
+
+static const unsigned char bench_auth_msg[] = "a message to authenticate";
+
+/* How proofs were verified before: six variable-base scalar multiplications.
+ * Kept here as a baseline. */
+static void bench_auth_verify_scalarmul(void *data) {
+  bench_auth_ctx_t *ctx = data;
+  const snizkpk_proof_t *src = ctx->proof;
+  snizkpk_pubkey_t gr1, gr2, gr3, A1c1, A2c2, A3c3;
+
+  decaf_448_point_scalarmul(gr1, decaf_448_point_base, src->r1);
+  decaf_448_point_scalarmul(gr2, decaf_448_point_base, src->r2);
+  decaf_448_point_scalarmul(gr3, decaf_448_point_base, src->r3);
+
+  decaf_448_point_scalarmul(A1c1, ctx->pairs[0]->pub, src->c1);
+  decaf_448_point_scalarmul(A2c2, ctx->pairs[1]->pub, src->c2);
+  decaf_448_point_scalarmul(A3c3, ctx->pairs[2]->pub, src->c3);
+
+  decaf_448_point_add(A1c1, A1c1, gr1);
+  decaf_448_point_add(A2c2, A2c2, gr2);
+  decaf_448_point_add(A3c3, A3c3, gr3);
+}
+
+static void bench_auth_verify(void *data) {
+  bench_auth_ctx_t *ctx = data;
+  otrv4_snizkpk_verify(ctx->proof, ctx->pairs[0]->pub, ctx->pairs[1]->pub,
+                       ctx->pairs[2]->pub, bench_auth_msg,
+                       sizeof(bench_auth_msg));
+}
+
+static void bench_auth_verify_batch(void *data) {
+  bench_auth_ctx_t *ctx = data;
+  otrv4_snizkpk_verify_batch(NULL, ctx->items, BENCH_AUTH_BATCH);
+}
+
+static void bench_auth_authenticate(void *data) {
+  bench_auth_ctx_t *ctx = data;
+  snizkpk_proof_t proof[1];
+
+  otrv4_snizkpk_authenticate(proof, ctx->pairs[0], ctx->pairs[1]->pub,
+                             ctx->pairs[2]->pub, bench_auth_msg,
+                             sizeof(bench_auth_msg));
+}
+
+/* What a reply costs once the nonces were computed while idle. The same
+ * nonces are reused on every run, which is fine only for measuring. */
+static void bench_auth_authenticate_precomputed(void *data) {
+  bench_auth_ctx_t *ctx = data;
+  snizkpk_proof_t proof[1];
+  snizkpk_nonces_t nonces[1];
+
+  memcpy(nonces, ctx->nonces, sizeof(snizkpk_nonces_t));
+  otrv4_snizkpk_authenticate_with_nonces(
+      proof, nonces, ctx->pairs[0], ctx->pairs[1]->pub, ctx->pairs[2]->pub,
+      bench_auth_msg, sizeof(bench_auth_msg));
+}
+
+void bench_auth(void) {
+  bench_auth_ctx_t ctx[1];
+  int i;
+
+  for (i = 0; i < 3; i++)
+    otrv4_snizkpk_keypair_generate(ctx->pairs[i]);
+
+  otrv4_snizkpk_authenticate(ctx->proof, ctx->pairs[0], ctx->pairs[1]->pub,
+                             ctx->pairs[2]->pub, bench_auth_msg,
+                             sizeof(bench_auth_msg));
+  otrv4_snizkpk_nonces_generate(ctx->nonces);
+
+  for (i = 0; i < BENCH_AUTH_BATCH; i++) {
+    ctx->items[i].proof = ctx->proof;
+    otrv4_ec_point_copy(ctx->items[i].A1, ctx->pairs[0]->pub);
+    otrv4_ec_point_copy(ctx->items[i].A2, ctx->pairs[1]->pub);
+    otrv4_ec_point_copy(ctx->items[i].A3, ctx->pairs[2]->pub);
+    ctx->items[i].msg = bench_auth_msg;
+    ctx->items[i].msglen = sizeof(bench_auth_msg);
+  }
+
+  bench_run("auth/snizkpk_authenticate", bench_auth_authenticate, ctx);
+  bench_run("auth/snizkpk_authenticate/precomputed",
+            bench_auth_authenticate_precomputed, ctx);
+  bench_run("auth/snizkpk_verify/points/scalarmul",
+            bench_auth_verify_scalarmul, ctx);
+  bench_run("auth/snizkpk_verify", bench_auth_verify, ctx);
+  bench_run("auth/snizkpk_verify_batch/16", bench_auth_verify_batch, ctx);
+
+  otrv4_snizkpk_nonces_destroy(ctx->nonces);
+}
@@ -0,0 +1,64 @@
+#include <libotr/b64.h>
+
+#include "../base64.h"
+
+typedef struct {
+  uint8_t *bin;
+  size_t bin_len;
+  char *encoded; /* OTR encoded bin */
+  size_t encoded_len;
+  uint8_t *decoded;
+} bench_base64_ctx_t;
+
+/* How messages were encoded before, as a baseline */
+static void bench_base64_encode_libotr(void *data) {
+  bench_base64_ctx_t *ctx = data;
+  free(otrl_base64_otr_encode(ctx->bin, ctx->bin_len));
+}
+
+static void bench_base64_encode(void *data) {
+  bench_base64_ctx_t *ctx = data;
+  otrv4_otr_encode(ctx->encoded, ctx->bin, ctx->bin_len);
+}
+
+static void bench_base64_decode_libotr(void *data) {
+  bench_base64_ctx_t *ctx = data;
+  otrl_base64_decode(ctx->decoded, ctx->encoded + 5, ctx->encoded_len - 6);
+}
+
+static void bench_base64_decode(void *data) {
+  bench_base64_ctx_t *ctx = data;
+  size_t written = 0;
+  otrv4_base64_decode(ctx->decoded, &written, ctx->encoded + 5,
+                      ctx->encoded_len - 6);
+}
+
+void bench_base64(void) {
+  const size_t sizes[] = {1024, 64 * 1024};
+  char name[64];
+
+  for (int i = 0; i < 2; i++) {
+    bench_base64_ctx_t ctx[1];
+    ctx->bin_len = sizes[i];
+    ctx->bin = malloc(ctx->bin_len);
+    ctx->encoded = malloc(OTRV4_OTR_ENCODED_LEN(ctx->bin_len));
+    ctx->decoded = malloc(ctx->bin_len);
+
+    for (size_t j = 0; j < ctx->bin_len; j++)
+      ctx->bin[j] = j * 31;
+    ctx->encoded_len = otrv4_otr_encode(ctx->encoded, ctx->bin, ctx->bin_len);
+
+    snprintf(name, sizeof name, "base64/%zuk/encode_libotr", sizes[i] / 1024);
+    bench_run(name, bench_base64_encode_libotr, ctx);
+    snprintf(name, sizeof name, "base64/%zuk/encode", sizes[i] / 1024);
+    bench_run(name, bench_base64_encode, ctx);
+    snprintf(name, sizeof name, "base64/%zuk/decode_libotr", sizes[i] / 1024);
+    bench_run(name, bench_base64_decode_libotr, ctx);
+    snprintf(name, sizeof name, "base64/%zuk/decode", sizes[i] / 1024);
+    bench_run(name, bench_base64_decode, ctx);
+
+    free(ctx->bin);
+    free(ctx->encoded);
+    free(ctx->decoded);
+  }
+}
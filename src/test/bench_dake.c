@@ -0,0 +1,114 @@
+#include "../otrv4.h"
+
+#define BENCH_ALICE "alice@localhost"
+#define BENCH_BOB "bob@localhost"
+
+typedef struct {
+  otrv4_client_state_t *alice_state, *bob_state;
+  otrv4_t *alice, *bob;
+} bench_conversation_t;
+
+static void bench_client_state_set_up(otrv4_client_state_t *state,
+                                      const char *account_name, int byte) {
+  uint8_t sym_key[ED448_PRIVATE_BYTES] = {byte};
+
+  state->userstate = otrl_userstate_create();
+  state->account_name = otrv4_strdup(account_name);
+  state->protocol_name = otrv4_strdup("otr");
+  state->phi = otrv4_strdup(BENCH_ALICE "/" BENCH_BOB);
+  state->pad = false;
+
+  otrv4_client_state_add_private_key_v4(state, sym_key);
+  otrv4_client_state_add_shared_prekey_v4(state, sym_key);
+  otrv4_client_state_add_instance_tag(state, 0x100 + byte);
+}
+
+/* New connections between the clients, which are not encrypted yet */
+static void bench_conversation_restart(bench_conversation_t *conv) {
+  otrv4_policy_t policy = {.allows = OTRV4_ALLOW_V4};
+
+  if (conv->alice)
+    otrv4_free(conv->alice);
+  if (conv->bob)
+    otrv4_free(conv->bob);
+
+  conv->alice = otrv4_new(conv->alice_state, policy);
+  conv->bob = otrv4_new(conv->bob_state, policy);
+}
+
+static void bench_conversation_new(bench_conversation_t *conv) {
+  conv->alice_state = otrv4_client_state_new("alice");
+  conv->bob_state = otrv4_client_state_new("bob");
+  bench_client_state_set_up(conv->alice_state, BENCH_ALICE, 1);
+  bench_client_state_set_up(conv->bob_state, BENCH_BOB, 2);
+
+  conv->alice = NULL;
+  conv->bob = NULL;
+  bench_conversation_restart(conv);
+}
+
+static void bench_conversation_free(bench_conversation_t *conv) {
+  otrv4_free(conv->alice);
+  otrv4_free(conv->bob);
+  otrl_userstate_free(conv->alice_state->userstate);
+  otrl_userstate_free(conv->bob_state->userstate);
+  otrv4_client_state_free(conv->alice_state);
+  otrv4_client_state_free(conv->bob_state);
+}
+
+/* Delivers message to `to`, and the replies back and forth until there are
+ * none. message is freed. */
+static void bench_relay(string_t message, otrv4_t *to, otrv4_t *from) {
+  while (message) {
+    otrv4_response_t *response = otrv4_response_new();
+    otrv4_receive_message(response, message, to);
+    free(message);
+    message = response->to_send;
+    response->to_send = NULL;
+    otrv4_response_free(response);
+
+    otrv4_t *next = from;
+    from = to;
+    to = next;
+  }
+}
+
+static void bench_dake_interactive(void *data) {
+  bench_conversation_t *conv = data;
+  string_t query = NULL;
+
+  otrv4_build_query_message(&query, "", conv->alice);
+  bench_relay(query, conv->bob, conv->alice);
+}
+
+static void bench_dake_non_interactive(void *data) {
+  bench_conversation_t *conv = data;
+  otrv4_server_t server[1] = {{NULL}};
+  otrv4_response_t *response = otrv4_response_new();
+  string_t auth = NULL;
+
+  otrv4_start_non_interactive_dake(server, conv->alice);
+  otrv4_reply_with_prekey_msg_from_server(server, response);
+  bench_relay(response->to_send, conv->bob, conv->alice);
+  response->to_send = NULL;
+  otrv4_response_free(response);
+
+  otrv4_send_non_interactive_auth_msg(&auth, conv->bob, "");
+  bench_relay(auth, conv->alice, conv->bob);
+}
+
+static void bench_dake_restart(void *data) {
+  bench_conversation_restart(data);
+}
+
+void bench_dake(void) {
+  bench_conversation_t conv[1];
+  bench_conversation_new(conv);
+
+  bench_run_prepared("dake/interactive", bench_dake_restart,
+                     bench_dake_interactive, conv);
+  bench_run_prepared("dake/non_interactive", bench_dake_restart,
+                     bench_dake_non_interactive, conv);
+
+  bench_conversation_free(conv);
+}
@@ -0,0 +1,93 @@
+typedef struct {
+  bench_conversation_t *conv;
+  char *message;
+  char *buffer;
+  size_t buffer_len;
+} bench_data_message_ctx_t;
+
+/* Bob never replies, so his MAC keys are revealed as his next message would */
+static void bench_data_message_reveal(otrv4_t *otr) {
+  list_element_t *revealed = otr->keys->old_mac_keys;
+  otr->keys->old_mac_keys = NULL;
+  otrv4_key_manager_release_old_mac_keys(otr->keys, revealed);
+}
+
+static void bench_data_message_send_receive(void *data) {
+  bench_data_message_ctx_t *ctx = data;
+  otrv4_response_t *response = otrv4_response_new();
+  const tlv_t *tlvs = NULL;
+  string_t to_send = NULL;
+
+  otrv4_prepare_to_send_message(&to_send, ctx->message, NULL, 0,
+                                ctx->conv->alice);
+  otrv4_receive_message_borrowing_tlvs(response, &tlvs, to_send,
+                                       ctx->conv->bob);
+  bench_data_message_reveal(ctx->conv->bob);
+
+  otrv4_response_free(response);
+  free(to_send);
+}
+
+static void bench_data_message_send_receive_into(void *data) {
+  bench_data_message_ctx_t *ctx = data;
+  otrv4_response_t response[1] = {{NULL, NULL, NULL, OTRV4_WARN_NONE}};
+  const tlv_t *tlvs = NULL;
+  size_t written = 0;
+
+  otrv4_prepare_to_send_message_into(ctx->buffer, ctx->buffer_len, &written,
+                                     ctx->message, NULL, 0, ctx->conv->alice);
+  otrv4_receive_message_borrowing_tlvs(response, &tlvs, ctx->buffer,
+                                       ctx->conv->bob);
+  bench_data_message_reveal(ctx->conv->bob);
+
+  free(response->to_display);
+}
+
+static void bench_data_message_sizes(bench_data_message_ctx_t *ctx, int pad) {
+  const size_t sizes[] = {16, 1024, 16 * 1024};
+  char name[64];
+  int i;
+
+  ctx->conv->alice_state->pad = pad;
+
+  for (i = 0; i < 3; i++) {
+    /* Padding only matters for short messages */
+    if (pad && sizes[i] > 16)
+      break;
+
+    ctx->message = malloc(sizes[i] + 1);
+    memset(ctx->message, 'A', sizes[i]);
+    ctx->message[sizes[i]] = 0;
+    ctx->buffer_len =
+        otrv4_prepare_to_send_message_len(ctx->message, NULL, ctx->conv->alice);
+    ctx->buffer = malloc(ctx->buffer_len);
+
+    snprintf(name, sizeof name, "data_message/send_receive/%zub%s", sizes[i],
+             pad ? "/padded" : "");
+    bench_run(name, bench_data_message_send_receive, ctx);
+    snprintf(name, sizeof name, "data_message/send_receive_into/%zub%s",
+             sizes[i], pad ? "/padded" : "");
+    bench_run(name, bench_data_message_send_receive_into, ctx);
+
+    free(ctx->buffer);
+    free(ctx->message);
+  }
+
+  ctx->conv->alice_state->pad = false;
+}
+
+void bench_data_message(void) {
+  bench_conversation_t conv[1];
+  bench_data_message_ctx_t ctx[1];
+  string_t query = NULL;
+
+  bench_conversation_new(conv);
+  otrv4_build_query_message(&query, "", conv->alice);
+  bench_relay(query, conv->bob, conv->alice);
+  ctx->conv = conv;
+
+  bench_data_message_sizes(ctx, 0);
+  bench_data_message_sizes(ctx, 1);
+
+  bench_conversation_free(conv);
+}
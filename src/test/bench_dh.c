@@ -0,0 +1,84 @@
+#include "../dh.h"
+#include "../key_management.h"
+
+typedef struct {
+  uint8_t exp[DH_KEY_SIZE];
+  dh_mpi_t exp_mpi;
+  dh_mpi_t out;
+  dh_keypair_t ours, theirs;
+} bench_dh_ctx_t;
+
+static void bench_dh_generator_comb(void *data) {
+  bench_dh_ctx_t *ctx = data;
+  dh_generator_powm(ctx->out, ctx->exp);
+}
+
+static void bench_dh_generator_generic(void *data) {
+  bench_dh_ctx_t *ctx = data;
+  dh_generator_powm_generic(ctx->out, ctx->exp_mpi);
+}
+
+static void bench_dh_keypair_generate(void *data) {
+  dh_keypair_t keypair;
+  (void)data;
+
+  otrv4_dh_keypair_generate(keypair);
+  otrv4_dh_keypair_destroy(keypair);
+}
+
+static void bench_dh_shared_secret(void *data) {
+  bench_dh_ctx_t *ctx = data;
+  k_dh_t shared;
+
+  otrv4_dh_shared_secret(shared, sizeof(shared), ctx->ours->priv,
+                         ctx->theirs->pub);
+}
+
+static void bench_dh_mpi_in_range(void *data) {
+  bench_dh_ctx_t *ctx = data;
+  dh_mpi_in_range(ctx->out);
+}
+
+static void bench_dh_mpi_in_subgroup(void *data) {
+  bench_dh_ctx_t *ctx = data;
+  dh_mpi_in_subgroup(ctx->out);
+}
+
+static void bench_dh_mpi_valid_cached(void *data) {
+  key_manager_t *manager = data;
+  otrv4_key_manager_valid_their_dh(manager, manager->their_dh);
+}
+
+void bench_dh(void) {
+  bench_dh_ctx_t ctx[1];
+
+  gcry_randomize(ctx->exp, sizeof(ctx->exp), GCRY_WEAK_RANDOM);
+  gcry_mpi_scan(&ctx->exp_mpi, GCRYMPI_FMT_USG, ctx->exp, sizeof(ctx->exp),
+                NULL);
+  ctx->out = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+
+  bench_run("dh/generator/comb", bench_dh_generator_comb, ctx);
+  bench_run("dh/generator/powm", bench_dh_generator_generic, ctx);
+  bench_run("dh/keypair_generate", bench_dh_keypair_generate, NULL);
+
+  otrv4_dh_keypair_generate(ctx->ours);
+  otrv4_dh_keypair_generate(ctx->theirs);
+  bench_run("dh/shared_secret", bench_dh_shared_secret, ctx);
+  otrv4_dh_keypair_destroy(ctx->ours);
+  otrv4_dh_keypair_destroy(ctx->theirs);
+
+  /* Validation of a received public key: out holds a valid g^x */
+  key_manager_t manager[1];
+  otrv4_key_manager_init(manager);
+  manager->their_dh = otrv4_dh_mpi_copy(ctx->out);
+
+  bench_run("dh/mpi_valid/range", bench_dh_mpi_in_range, ctx);
+  bench_run("dh/mpi_valid/subgroup", bench_dh_mpi_in_subgroup, ctx);
+  bench_run("dh/mpi_valid/key_manager_cached", bench_dh_mpi_valid_cached,
+            manager);
+
+  otrv4_key_manager_destroy(manager);
+
+  gcry_mpi_release(ctx->exp_mpi);
+  gcry_mpi_release(ctx->out);
+}
@@ -0,0 +1,40 @@
+#include "../ed448.h"
+#include "../random.h"
+
+typedef struct {
+  ecdh_keypair_t ours[1];
+  ecdh_keypair_t theirs[1];
+} bench_ecdh_ctx_t;
+
+static void bench_ecdh_keypair_generate(void *data) {
+  ecdh_keypair_t keypair[1];
+  uint8_t sym[ED448_PRIVATE_BYTES];
+  (void)data;
+
+  random_bytes(sym, sizeof(sym));
+  otrv4_ecdh_keypair_generate(keypair, sym);
+  otrv4_ecdh_keypair_destroy(keypair);
+}
+
+static void bench_ecdh_shared_secret(void *data) {
+  bench_ecdh_ctx_t *ctx = data;
+  k_ecdh_t shared;
+
+  otrv4_ecdh_shared_secret(shared, ctx->ours, ctx->theirs->pub);
+}
+
+void bench_ed448(void) {
+  bench_ecdh_ctx_t ctx[1];
+  uint8_t sym[ED448_PRIVATE_BYTES];
+
+  random_bytes(sym, sizeof(sym));
+  otrv4_ecdh_keypair_generate(ctx->ours, sym);
+  random_bytes(sym, sizeof(sym));
+  otrv4_ecdh_keypair_generate(ctx->theirs, sym);
+
+  bench_run("ecdh/keypair_generate", bench_ecdh_keypair_generate, NULL);
+  bench_run("ecdh/shared_secret", bench_ecdh_shared_secret, ctx);
+
+  otrv4_ecdh_keypair_destroy(ctx->ours);
+  otrv4_ecdh_keypair_destroy(ctx->theirs);
+}
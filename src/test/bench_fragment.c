@@ -0,0 +1,82 @@
+#include "../fragment.h"
+
+typedef struct {
+  string_t message;
+  int mms;
+} bench_fragment_ctx_t;
+
+/* How messages were fragmented before: two allocations and a snprintf per
+ * piece. Kept here as a baseline. */
+static void bench_fragment_per_piece(void *data) {
+  bench_fragment_ctx_t *ctx = data;
+  const char *message = ctx->message;
+  size_t msg_len = strlen(message);
+  size_t limit_piece = ctx->mms - FRAGMENT_HEADER_LEN;
+  int total = (msg_len - 1) / limit_piece + 1;
+  string_t *pieces = malloc(total * sizeof(string_t));
+
+  for (int i = 0; i < total; i++) {
+    size_t piece_len = msg_len < limit_piece ? msg_len : limit_piece;
+    char *piece_data = malloc(piece_len + 1);
+    strncpy(piece_data, message, piece_len);
+    piece_data[piece_len] = 0;
+
+    pieces[i] = malloc(piece_len + FRAGMENT_HEADER_LEN + 1);
+    snprintf(pieces[i], piece_len + FRAGMENT_HEADER_LEN,
+             "?OTR|%08x|%08x,%05x,%05x,%s,", 1, 2, i + 1, total, piece_data);
+
+    free(piece_data);
+    message += piece_len;
+    msg_len -= piece_len;
+  }
+
+  for (int i = 0; i < total; i++)
+    free(pieces[i]);
+  free(pieces);
+}
+
+static void bench_fragment_contiguous(void *data) {
+  bench_fragment_ctx_t *ctx = data;
+  otrv4_message_to_send_t *fragments = otrv4_message_new();
+
+  otrv4_fragment_message(ctx->mms, fragments, 1, 2, ctx->message);
+  otrv4_message_free(fragments);
+}
+
+static void bench_fragment_view(void *data) {
+  bench_fragment_ctx_t *ctx = data;
+  otrv4_fragment_view_t *views = NULL;
+  int total = 0;
+
+  otrv4_fragment_message_view(&views, &total, ctx->mms, 1, 2, ctx->message);
+  free(views);
+}
+
+void bench_fragment(void) {
+  const size_t sizes[] = {64 * 1024, 1024 * 1024};
+  const int mmss[] = {256, 1024};
+  char name[64];
+
+  for (int i = 0; i < 2; i++) {
+    bench_fragment_ctx_t ctx[1];
+    ctx->message = malloc(sizes[i] + 1);
+    memset(ctx->message, 'A', sizes[i]);
+    ctx->message[sizes[i]] = 0;
+
+    for (int j = 0; j < 2; j++) {
+      ctx->mms = mmss[j];
+
+      snprintf(name, sizeof name, "fragment/%zuk/mms%d/per_piece",
+               sizes[i] / 1024, mmss[j]);
+      bench_run(name, bench_fragment_per_piece, ctx);
+      snprintf(name, sizeof name, "fragment/%zuk/mms%d/contiguous",
+               sizes[i] / 1024, mmss[j]);
+      bench_run(name, bench_fragment_contiguous, ctx);
+      snprintf(name, sizeof name, "fragment/%zuk/mms%d/view", sizes[i] / 1024,
+               mmss[j]);
+      bench_run(name, bench_fragment_view, ctx);
+    }
+
+    free(ctx->message);
+  }
+}
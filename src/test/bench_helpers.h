@@ -0,0 +1,168 @@
+#ifndef OTRV4_BENCH_HELPERS_H
+#define OTRV4_BENCH_HELPERS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Every case is reported as one JSON object per line:
+ *
+ *   {"name": "dh/keypair_generate", "ops": 1200, "ops_per_s": 1195.3,
+ *    "p50_ns": 833012.0, "p99_ns": 901554.0, "allocs_per_op": 14.00}
+ *
+ * Latencies are those of single operations, or of batches of quick ones
+ * divided by the batch size. allocs_per_op is null where allocations cannot
+ * be counted.
+ */
+
+/* Each case runs for at least this long, counting the untimed preparation of
+ * its operations, in at most this many samples */
+#define BENCH_MIN_SECONDS 1.0
+#define BENCH_MAX_SAMPLES 10000
+
+/* Quick operations are timed in batches at least this long, so the clock
+ * does not dominate them */
+#define BENCH_MIN_BATCH_SECONDS 1e-5
+
+typedef void (*bench_fn_t)(void *ctx);
+
+/* Only the cases whose name contains it are run, if set */
+static const char *bench_filter = NULL;
+
+static double bench_samples[BENCH_MAX_SAMPLES];
+
+/* Every allocation made through malloc() is counted, which includes the ones
+ * made by the libraries we use. Only glibc lets us wrap it. */
+#ifdef __GLIBC__
+#define BENCH_COUNTS_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long bench_allocs = 0;
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+#else
+#define BENCH_COUNTS_ALLOCS 0
+
+static unsigned long bench_allocs = 0;
+#endif
+
+static inline double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline unsigned long bench_allocs_now(void) {
+  return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+
+static inline int bench_cmp_samples(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static inline int bench_selected(const char *name) {
+  return !bench_filter || strstr(name, bench_filter);
+}
+
+/* Finds how many operations take at least BENCH_MIN_BATCH_SECONDS. This
+ * also warms up caches and lazily initialized state. */
+static inline unsigned long bench_batch_size(bench_fn_t fn, void *ctx) {
+  unsigned long batch = 1, i;
+
+  for (;;) {
+    double start = bench_now();
+    for (i = 0; i < batch; i++)
+      fn(ctx);
+
+    if (bench_now() - start >= BENCH_MIN_BATCH_SECONDS || batch >= 1 << 20)
+      return batch;
+
+    batch *= 2;
+  }
+}
+
+static inline void bench_report(const char *name, unsigned long ops,
+                                double elapsed, size_t samples,
+                                unsigned long allocs) {
+  qsort(bench_samples, samples, sizeof(double), bench_cmp_samples);
+
+  printf("{\"name\": \"%s\", \"ops\": %lu, \"ops_per_s\": %.1f, "
+         "\"p50_ns\": %.1f, \"p99_ns\": %.1f, ",
+         name, ops, ops / elapsed, bench_samples[samples / 2] * 1e9,
+         bench_samples[samples * 99 / 100] * 1e9);
+
+  if (BENCH_COUNTS_ALLOCS)
+    printf("\"allocs_per_op\": %.2f}\n", (double)allocs / ops);
+  else
+    printf("\"allocs_per_op\": null}\n");
+
+  fflush(stdout);
+}
+
+/*
+ * Runs fn repeatedly. If prepare is set, it runs (untimed, and its
+ * allocations uncounted) before every operation, which is then timed alone.
+ * The case still stops after BENCH_MIN_SECONDS of wall time, so an expensive
+ * preparation does not make it run for much longer.
+ */
+static inline void bench_run_prepared(const char *name, bench_fn_t prepare,
+                                      bench_fn_t fn, void *ctx) {
+  unsigned long batch = 1, ops = 0, allocs = 0, before, i;
+  double elapsed = 0, wall, start, spent;
+  size_t samples = 0;
+
+  if (!bench_selected(name))
+    return;
+
+  if (prepare) {
+    prepare(ctx);
+    fn(ctx);
+  } else {
+    batch = bench_batch_size(fn, ctx);
+  }
+
+  wall = bench_now();
+  do {
+    if (prepare)
+      prepare(ctx);
+
+    before = bench_allocs_now();
+    start = bench_now();
+    for (i = 0; i < batch; i++)
+      fn(ctx);
+    spent = bench_now() - start;
+    allocs += bench_allocs_now() - before;
+
+    bench_samples[samples++] = spent / batch;
+    elapsed += spent;
+    ops += batch;
+  } while (bench_now() - wall < BENCH_MIN_SECONDS &&
+           samples < BENCH_MAX_SAMPLES);
+
+  bench_report(name, ops, elapsed, samples, allocs);
+}
+
+static inline void bench_run(const char *name, bench_fn_t fn, void *ctx) {
+  bench_run_prepared(name, NULL, fn, ctx);
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include "../key_management.h"
+
+/* How the chain ordering was decided before: allocating and comparing
+ * gcrypt MPIs on every message. Kept here as a baseline. */
+static message_chain_t *bench_decide_with_mpis(ratchet_t *ratchet,
+                                               const ec_point_t our,
+                                               const ec_point_t their) {
+  message_chain_t *ret = malloc(sizeof(message_chain_t));
+  gcry_mpi_t our_mpi = NULL;
+  gcry_mpi_t their_mpi = NULL;
+
+  ret->sending = NULL;
+  ret->receiving = NULL;
+
+  gcry_mpi_scan(&our_mpi, GCRYMPI_FMT_USG, our, sizeof(ec_public_key_t), NULL);
+  gcry_mpi_scan(&their_mpi, GCRYMPI_FMT_USG, their, sizeof(ec_public_key_t),
+                NULL);
+
+  if (gcry_mpi_cmp(our_mpi, their_mpi) > 0) {
+    ret->sending = ratchet->chain_a;
+    ret->receiving = ratchet->chain_b;
+  } else {
+    ret->sending = ratchet->chain_b;
+    ret->receiving = ratchet->chain_a;
+  }
+
+  gcry_mpi_release(our_mpi);
+  gcry_mpi_release(their_mpi);
+
+  return ret;
+}
+
+static void bench_key_management_decide_mpi(void *data) {
+  key_manager_t *manager = data;
+  free(bench_decide_with_mpis(manager->current, manager->our_ecdh->pub,
+                              manager->their_ecdh));
+}
+
+static void bench_key_management_decide(void *data) {
+  key_manager_t *manager = data;
+  message_chain_t chain[1];
+  decide_between_chain_keys(chain, manager->current, manager->our_ecdh->pub,
+                            manager->their_ecdh);
+}
+
+static void bench_key_management_sending_keys(void *data) {
+  key_manager_t *manager = data;
+  m_enc_key_t enc_key;
+  m_mac_key_t mac_key;
+
+  otrv4_key_manager_retrieve_sending_message_keys(enc_key, mac_key, manager);
+}
+
+static void bench_key_management_receiving_keys(void *data) {
+  key_manager_t *manager = data;
+  m_enc_key_t enc_key;
+  m_mac_key_t mac_key;
+
+  otrv4_key_manager_retrieve_receiving_message_keys(enc_key, mac_key, 0,
+                                                    manager);
+}
+
+void bench_key_management(void) {
+  key_manager_t manager[1];
+  otrv4_key_manager_init(manager);
+  otrv4_key_manager_generate_ephemeral_keys(manager);
+  memset(manager->their_ecdh, 1, sizeof(manager->their_ecdh));
+
+  bench_run("key_management/decide_chain/mpi",
+            bench_key_management_decide_mpi, manager);
+  bench_run("key_management/decide_chain/bytes", bench_key_management_decide,
+            manager);
+  bench_run("key_management/sending_message_keys",
+            bench_key_management_sending_keys, manager);
+  bench_run("key_management/receiving_message_keys",
+            bench_key_management_receiving_keys, manager);
+
+  otrv4_key_manager_destroy(manager);
+}
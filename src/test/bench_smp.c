@@ -0,0 +1,86 @@
+typedef struct {
+  bench_conversation_t *conv;
+  string_t pending; /* The last SMP message sent, not received yet */
+  int step;
+} bench_smp_ctx_t;
+
+static const uint8_t bench_smp_secret[] = "secret";
+
+/* Receives the pending message, which is replaced by the reply */
+static void bench_smp_deliver(bench_smp_ctx_t *ctx, otrv4_t *to) {
+  otrv4_response_t *response = otrv4_response_new();
+
+  otrv4_receive_message(response, ctx->pending, to);
+  free(ctx->pending);
+  ctx->pending = response->to_send;
+  response->to_send = NULL;
+  otrv4_response_free(response);
+}
+
+static void bench_smp_run_step(bench_smp_ctx_t *ctx, int step) {
+  otrv4_t *alice = ctx->conv->alice, *bob = ctx->conv->bob;
+
+  switch (step) {
+  case 1:
+    otrv4_smp_start(&ctx->pending, NULL, 0, (uint8_t *)bench_smp_secret,
+                    sizeof(bench_smp_secret), alice);
+    break;
+  case 2:
+    bench_smp_deliver(ctx, bob);
+    otrv4_smp_continue(&ctx->pending, (uint8_t *)bench_smp_secret,
+                       sizeof(bench_smp_secret), bob);
+    break;
+  case 3:
+    bench_smp_deliver(ctx, alice);
+    break;
+  case 4:
+    /* Bob replies with the last message, which Alice verifies */
+    bench_smp_deliver(ctx, bob);
+    bench_smp_deliver(ctx, alice);
+    break;
+  }
+}
+
+/* Starts over and runs the steps before the one measured */
+static void bench_smp_prepare(void *data) {
+  bench_smp_ctx_t *ctx = data;
+  int i;
+
+  free(ctx->pending);
+  ctx->pending = NULL;
+
+  otrv4_smp_destroy(ctx->conv->alice->smp);
+  otrv4_smp_context_init(ctx->conv->alice->smp);
+  otrv4_smp_destroy(ctx->conv->bob->smp);
+  otrv4_smp_context_init(ctx->conv->bob->smp);
+
+  for (i = 1; i < ctx->step; i++)
+    bench_smp_run_step(ctx, i);
+}
+
+static void bench_smp_step(void *data) {
+  bench_smp_ctx_t *ctx = data;
+  bench_smp_run_step(ctx, ctx->step);
+}
+
+void bench_smp(void) {
+  bench_conversation_t conv[1];
+  bench_smp_ctx_t ctx[1];
+  string_t query = NULL;
+  char name[32];
+
+  bench_conversation_new(conv);
+  otrv4_build_query_message(&query, "", conv->alice);
+  bench_relay(query, conv->bob, conv->alice);
+
+  ctx->conv = conv;
+  ctx->pending = NULL;
+
+  for (ctx->step = 1; ctx->step <= 4; ctx->step++) {
+    snprintf(name, sizeof name, "smp/step%d", ctx->step);
+    bench_run_prepared(name, bench_smp_prepare, bench_smp_step, ctx);
+  }
+
+  free(ctx->pending);
+  bench_conversation_free(conv);
+}
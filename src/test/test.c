@@ -1,5 +1,8 @@
 #include <glib.h>
 
+#define OTRV4_CLIENT_PRIVATE
+#define OTRV4_DH_PRIVATE
+#define OTRV4_FRAGMENT_PRIVATE
 #define OTRV4_KEY_MANAGEMENT_PRIVATE
 #define OTRV4_USER_PROFILE_PRIVATE
 #define OTRV4_LIST_PRIVATE
@@ -13,16 +16,20 @@
 #include "test_fixtures.h"
 // clang-format on
 
+#include "test_alloc.c"
 #include "test_api.c"
+#include "test_base64.c"
 #include "test_client.c"
 #include "test_dake.c"
 #include "test_data_message.c"
 #include "test_dh.c"
 #include "test_ed448.c"
 #include "test_fragment.c"
+#include "test_hashtable.c"
 #include "test_identity_message.c"
 #include "test_instance_tag.c"
 #include "test_key_management.c"
+#include "test_keypool.c"
 #include "test_list.c"
 #include "test_non_interactive_messages.c"
 #include "test_otrv4.c"
@@ -30,6 +37,7 @@
 #include "test_smp.c"
 #include "test_tlv.c"
 #include "test_user_profile.c"
+#include "test_workers.c"
 #include "test_messaging.c"
 
 int main(int argc, char **argv) {
@@ -53,6 +61,7 @@ int main(int argc, char **argv) {
                   test_instance_tag_generates_tag_when_file_is_full);
 
   g_test_add_func("/user_state/key_management", test_userstate_key_management);
+  g_test_add_func("/user_state/remove_account", test_userstate_remove_account);
 
   g_test_add_func("/edwards448/api", ed448_test_ecdh);
   g_test_add_func("/edwards448/eddsa_serialization",
@@ -62,14 +71,31 @@ int main(int argc, char **argv) {
                   ed448_test_scalar_serialization);
 
   g_test_add_func("/dake/snizkpk", test_snizkpk_auth);
+  g_test_add_func("/dake/snizkpk_precomputed_nonces",
+                  test_snizkpk_precomputed_nonces);
+  g_test_add_func("/dake/snizkpk_verify_batch", test_snizkpk_verify_batch);
+  g_test_add_func("/alloc/arena", test_otrv4_arena_alloc);
+  g_test_add_func("/alloc/arena_steady_state", test_otrv4_arena_steady_state);
+
   g_test_add_func("/list/add", test_otrv4_list_add);
   g_test_add_func("/list/get", test_otrv4_list_get_last);
   g_test_add_func("/list/length", test_otrv4_list_len);
   g_test_add_func("/list/empty_size", test_list_empty_size);
 
+  g_test_add_func("/hashtable/put_get", test_otrv4_hashtable_put_get);
+  g_test_add_func("/hashtable/remove", test_otrv4_hashtable_remove);
+
   g_test_add_func("/dh/api", dh_test_api);
   g_test_add_func("/dh/serialize", dh_test_serialize);
   g_test_add_func("/dh/destroy", dh_test_keypair_destroy);
+  g_test_add_func("/dh/generator_fixed_base",
+                  dh_test_generator_fixed_base);
+  g_test_add_func("/dh/mpi_valid", dh_test_mpi_valid);
+
+  g_test_add_func("/keypool/take", test_keypool_take);
+  g_test_add_func("/keypool/feeds_ratchet", test_keypool_feeds_ratchet);
+
+  g_test_add_func("/workers/run", test_workers_run);
 
   g_test_add_func("/serialize_and_deserialize/uint", test_ser_deser_uint);
   g_test_add_func("/serialize_and_deserialize/data",
@@ -93,6 +119,10 @@ int main(int argc, char **argv) {
                   test_user_profile_signs_and_verify);
   g_test_add_func("/user_profile/build_user_profile",
                   test_otrv4_user_profile_build);
+  g_test_add_func("/user_profile/serialized_once",
+                  test_user_profile_serialized_once);
+  g_test_add_func("/user_profile/verify_signature_cached",
+                  test_user_profile_verify_signature_cached);
 
   WITH_FIXTURE("/dake/identity_message/serializes",
                test_dake_identity_message_serializes,
@@ -113,26 +143,57 @@ int main(int argc, char **argv) {
   g_test_add_func("/data_message/serialize", test_data_message_serializes);
   g_test_add_func("/data_message/deserialize",
                   test_otrv4_data_message_deserializes);
+  g_test_add_func("/data_message/deserialize_in_place",
+                  test_otrv4_data_message_deserializes_in_place);
+
+  g_test_add_func("/base64/encode", test_base64_encode);
+  g_test_add_func("/base64/encode_in_chunks", test_base64_encode_in_chunks);
+  g_test_add_func("/base64/otr_encode_matches_libotr",
+                  test_otr_encode_matches_libotr);
+  g_test_add_func("/base64/decode", test_base64_decode);
+  g_test_add_func("/base64/decode_fails_for_invalid_input",
+                  test_base64_decode_fails_for_invalid_input);
 
   g_test_add_func("/fragment/create_fragments", test_create_fragments);
+  g_test_add_func("/fragment/create_fragment_views",
+                  test_create_fragment_views);
   g_test_add_func("/fragment/defragment_message",
                   test_defragment_valid_message);
   g_test_add_func("/fragment/defragment_single_fragment",
                   test_defragment_single_fragment);
   g_test_add_func("/fragment/defragment_fails_without_comma",
                   test_defragment_without_comma_fails);
+  g_test_add_func("/fragment/defragment_out_of_order",
+                  test_defragment_out_of_order);
+  g_test_add_func("/fragment/defragment_multiple_senders",
+                  test_defragment_multiple_senders);
+  g_test_add_func("/fragment/defragment_evicts_stale_messages",
+                  test_defragment_evicts_stale_messages);
+  g_test_add_func("/fragment/defragment_limits_entries",
+                  test_defragment_limits_entries);
   g_test_add_func("/fragment/fails_for_invalid_tag",
                   test_defragment_fails_for_invalid_tag);
 
   g_test_add_func("/key_management/derive_ratchet_keys",
                   test_derive_ratchet_keys);
+  g_test_add_func("/key_management/derive_message_keys",
+                  test_derive_message_keys);
   g_test_add_func("/key_management/destroy", test_otrv4_key_manager_destroy);
+  g_test_add_func("/key_management/decide_between_chain_keys",
+                  test_otrv4_key_manager_decide_between_chain_keys);
+  g_test_add_func("/key_management/skipped_chain_keys",
+                  test_otrv4_key_manager_skipped_chain_keys);
+  g_test_add_func("/key_management/valid_their_dh",
+                  test_otrv4_key_manager_valid_their_dh);
+  g_test_add_func("/key_management/old_mac_keys",
+                  test_otrv4_key_manager_old_mac_keys);
 
   g_test_add_func("/smp/state_machine", test_smp_state_machine);
   g_test_add_func("/smp/generate_secret", test_otrv4_generate_smp_secret);
   g_test_add_func("/smp/msg_1_asprintf_null_question",
                   test_otrv4_smp_msg_1_asprintf_null_question);
   g_test_add_func("/tlv/parse", test_tlv_parse);
+  g_test_add_func("/tlv/parse_in_arena", test_tlv_parse_in_arena);
   g_test_add_func("/tlv/append", test_otrv4_append_tlv);
   g_test_add_func("/tlv/append_padding", test_otrv4_append_padding_tlv);
 
@@ -181,6 +242,7 @@ int main(int argc, char **argv) {
              test_otrv4_receives_identity_message_validates_instance_tag,
              otrv4_fixture_teardown);
   g_test_add_func("/otrv4/destroy", test_otrv4_destroy);
+  g_test_add_func("/otrv4/shares_user_profile", test_otrv4_shares_user_profile);
 
   g_test_add_func("/api/interactive_conversation/v4",
                   test_api_interactive_conversation);
@@ -202,6 +264,9 @@ int main(int argc, char **argv) {
                   test_ecdh_priv_keys_destroyed_early);
   g_test_add_func("/api/unreadable", test_unreadable_flag);
   g_test_add_func("/api/heartbeat", test_heartbeat_messages);
+  g_test_add_func("/api/send_message_into", test_api_send_message_into);
+  g_test_add_func("/api/stats", test_api_stats);
+  g_test_add_func("/api/trace", test_api_trace);
 
   g_test_add_func("/client/conversation_api", test_client_conversation_api);
   g_test_add_func("/client/api", test_client_api);
@@ -213,6 +278,10 @@ int main(int argc, char **argv) {
                   test_client_sends_fragmented_message);
   g_test_add_func("/client/receives_fragments",
                   test_client_receives_fragmented_message);
+  g_test_add_func("/client/concurrent_conversations",
+                  test_client_concurrent_conversations);
+  g_test_add_func("/client/receive_batch", test_client_receive_batch);
+  g_test_add_func("/client/send_batch", test_client_send_batch);
 
   g_test_add_func("/client/conversation_data_message_multiple_locations",
                   test_conversation_with_multiple_locations);
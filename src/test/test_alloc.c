@@ -0,0 +1,78 @@
+#include "../alloc.h"
+
+typedef struct {
+  int allocs;
+  int live;
+} counting_allocator_t;
+
+static void *counting_alloc(size_t size, void *ctx) {
+  counting_allocator_t *counter = ctx;
+  counter->allocs++;
+  counter->live++;
+  return malloc(size);
+}
+
+static void counting_dealloc(void *ptr, void *ctx) {
+  counting_allocator_t *counter = ctx;
+  counter->live--;
+  free(ptr);
+}
+
+void test_otrv4_arena_alloc() {
+  otrv4_arena_t arena[1];
+  otrv4_arena_init(arena);
+
+  uint8_t *a = otrv4_arena_alloc(arena, 3);
+  uint8_t *b = otrv4_arena_alloc(arena, 5);
+  otrv4_assert(a);
+  otrv4_assert(b);
+
+  /* Allocations are aligned and do not overlap */
+  g_assert_cmpint((uintptr_t)a % 16, ==, 0);
+  g_assert_cmpint((uintptr_t)b % 16, ==, 0);
+  otrv4_assert(b >= a + 3);
+
+  /* Reset wipes what was used and hands it out again */
+  memset(a, 0xff, 3);
+  otrv4_arena_reset(arena);
+  otrv4_assert_zero(a, 3);
+  otrv4_assert(otrv4_arena_alloc(arena, 3) == a);
+
+  /* Bigger than a chunk */
+  uint8_t *big = otrv4_arena_alloc(arena, 2 * OTRV4_ARENA_CHUNK_SIZE);
+  otrv4_assert(big);
+  memset(big, 0xff, 2 * OTRV4_ARENA_CHUNK_SIZE);
+
+  otrv4_arena_destroy(arena);
+  otrv4_assert(!arena->chunks);
+}
+
+void test_otrv4_arena_steady_state() {
+  counting_allocator_t counter[1] = {{0, 0}};
+  otrv4_allocator_t allocator = {counting_alloc, counting_dealloc, counter};
+  otrv4_allocator_set(&allocator);
+
+  otrv4_arena_t arena[1];
+  otrv4_arena_init(arena);
+
+  int i, round;
+  for (round = 0; round < 3; round++) {
+    for (i = 0; i < 10; i++)
+      otrv4_assert(otrv4_arena_alloc(arena, OTRV4_ARENA_CHUNK_SIZE / 2));
+
+    if (round == 0)
+      g_assert_cmpint(counter->allocs, ==, 5);
+    else
+      /* The chunks were coalesced into one that fits everything */
+      g_assert_cmpint(counter->allocs, ==, 6);
+
+    otrv4_arena_reset(arena);
+  }
+
+  g_assert_cmpint(counter->live, ==, 1);
+
+  otrv4_arena_destroy(arena);
+  g_assert_cmpint(counter->live, ==, 0);
+
+  otrv4_allocator_set(NULL);
+}
@@ -95,7 +95,7 @@ void test_api_interactive_conversation(void) {
   for (message_id = 2; message_id < 5; message_id++) {
     err = otrv4_prepare_to_send_message(&to_send, "hi", &tlvs, 0, alice);
     assert_msg_sent(err, to_send);
-    otrv4_assert(tlvs);
+    otrv4_assert(!tlvs); // Padding does not touch the TLVs
     otrv4_assert(!alice->keys->old_mac_keys);
 
     // This is a follow up message.
@@ -210,7 +210,7 @@ void test_api_interactive_conversation_bob(void) {
   for (message_id = 2; message_id < 5; message_id++) {
     err = otrv4_prepare_to_send_message(&to_send, "hi", &tlvs, 0, bob);
     assert_msg_sent(err, to_send);
-    otrv4_assert(tlvs);
+    otrv4_assert(!tlvs);
     otrv4_assert(!bob->keys->old_mac_keys);
 
     // This is a follow up message.
@@ -640,7 +640,7 @@ void test_api_conversation_errors(void) {
 
   err = otrv4_prepare_to_send_message(&to_send, "hi", &tlvs, 0, alice);
   assert_msg_sent(err, to_send);
-  otrv4_assert(tlvs);
+  otrv4_assert(!tlvs);
   otrv4_assert(!alice->keys->old_mac_keys);
 
   // This is a follow up message.
@@ -679,7 +679,7 @@ void test_api_conversation_errors(void) {
   // Alice sends another data message
   err = otrv4_prepare_to_send_message(&to_send, "hi", &tlvs, 0, alice);
   assert_msg_sent(err, to_send);
-  otrv4_assert(tlvs);
+  otrv4_assert(!tlvs);
   otrv4_assert(!alice->keys->old_mac_keys);
 
   bob->state = OTRV4_STATE_ENCRYPTED_MESSAGES;
@@ -1565,3 +1565,241 @@ void test_heartbeat_messages() {
 
   OTRV4_FREE;
 }
+
+void test_api_send_message_into() {
+  OTRV4_INIT;
+
+  otrv4_client_state_t *alice_state = otrv4_client_state_new(NULL);
+  otrv4_client_state_t *bob_state = otrv4_client_state_new(NULL);
+
+  otrv4_t *alice = set_up_otr(alice_state, ALICE_IDENTITY, PHI, 1);
+  otrv4_t *bob = set_up_otr(bob_state, BOB_IDENTITY, PHI, 3);
+
+  // DAKE has finished
+  do_dake_fixture(alice, bob);
+
+  size_t len = otrv4_prepare_to_send_message_len("hi", NULL, alice);
+  char *buffer = malloc(len);
+  size_t written = 0;
+  otrv4_err_t err;
+
+  // A buffer too small is rejected before any key is used
+  int j = alice->keys->j;
+  err = otrv4_prepare_to_send_message_into(buffer, len - 1, &written, "hi",
+                                           NULL, 0, alice);
+  otrv4_assert(err == ERROR);
+  g_assert_cmpint(alice->keys->j, ==, j);
+
+  err = otrv4_prepare_to_send_message_into(buffer, len, &written, "hi", NULL,
+                                           0, alice);
+  otrv4_assert(err == SUCCESS);
+  otrv4_assert(written < len);
+  g_assert_cmpint(written, ==, strlen(buffer));
+  otrv4_assert_cmpmem("?OTR:AAQD", buffer, 9);
+
+  // Bob receives the msg
+  otrv4_response_t *response_to_alice = otrv4_response_new();
+  err = otrv4_receive_message(response_to_alice, buffer, bob);
+  assert_msg_rec(err, "hi", response_to_alice);
+  otrv4_response_free(response_to_alice);
+
+  // The buffer can be reused, and padding is accounted for
+  alice_state->pad = true;
+  tlv_t *tlv = NULL;
+  otrv4_assert(otrv4_prepare_to_send_message_len("hi", NULL, alice) > len);
+  free(buffer);
+  len = otrv4_prepare_to_send_message_len("hi", NULL, alice);
+  buffer = malloc(len);
+
+  err = otrv4_prepare_to_send_message_into(buffer, len, &written, "hi", &tlv,
+                                           0, alice);
+  otrv4_assert(err == SUCCESS);
+  otrv4_tlv_free(tlv);
+
+  response_to_alice = otrv4_response_new();
+  err = otrv4_receive_message(response_to_alice, buffer, bob);
+  assert_msg_rec(err, "hi", response_to_alice);
+  otrv4_response_free(response_to_alice);
+
+  free(buffer);
+  buffer = NULL;
+
+  otrv4_userstate_free_all(alice_state->userstate, bob_state->userstate);
+  otrv4_client_state_free_all(alice_state, bob_state);
+  otrv4_free_all(alice, bob);
+
+  OTRV4_FREE;
+}
+
+void test_api_stats() {
+  OTRV4_INIT;
+
+  otrv4_client_state_t *alice_state = otrv4_client_state_new(NULL);
+  otrv4_client_state_t *bob_state = otrv4_client_state_new(NULL);
+
+  otrv4_t *alice = set_up_otr(alice_state, ALICE_IDENTITY, PHI, 1);
+  otrv4_t *bob = set_up_otr(bob_state, BOB_IDENTITY, PHI, 3);
+
+  // DAKE has finished
+  do_dake_fixture(alice, bob);
+
+  string_t first = NULL;
+  string_t second = NULL;
+  otrv4_assert(otrv4_prepare_to_send_message(&first, "one", NULL, 0, alice) ==
+               SUCCESS);
+  otrv4_assert(otrv4_prepare_to_send_message(&second, "two", NULL, 0,
+                                             alice) == SUCCESS);
+
+  // Bob receives them out of order
+  otrv4_response_t *response_to_alice = otrv4_response_new();
+  otrv4_err_t err = otrv4_receive_message(response_to_alice, second, bob);
+  assert_msg_rec(err, "two", response_to_alice);
+  otrv4_response_free(response_to_alice);
+
+  response_to_alice = otrv4_response_new();
+  err = otrv4_receive_message(response_to_alice, first, bob);
+  assert_msg_rec(err, "one", response_to_alice);
+  otrv4_response_free(response_to_alice);
+
+  free(first);
+  free(second);
+
+  otrv4_stats_t stats[1];
+
+#ifdef OTRV4_STATS
+  otrv4_assert(otrv4_client_state_stats(stats, alice_state) == SUCCESS);
+  g_assert_cmpint(stats->dakes_started, ==, 1);
+  g_assert_cmpint(stats->dakes_completed, ==, 1);
+  g_assert_cmpint(stats->dakes_failed, ==, 0);
+  g_assert_cmpint(stats->received[OTRV4_STATS_MSG_IDENTITY], ==, 1);
+  g_assert_cmpint(stats->sent[OTRV4_STATS_MSG_AUTH_R], ==, 1);
+  g_assert_cmpint(stats->received[OTRV4_STATS_MSG_AUTH_I], ==, 1);
+  g_assert_cmpint(stats->sent[OTRV4_STATS_MSG_DATA], ==, 2);
+  otrv4_assert(stats->timer_ns[OTRV4_STATS_TIMER_DH] > 0);
+  otrv4_assert(stats->timer_ns[OTRV4_STATS_TIMER_SNIZKPK] > 0);
+
+  otrv4_assert(otrv4_client_state_stats(stats, bob_state) == SUCCESS);
+  g_assert_cmpint(stats->dakes_started, ==, 1);
+  g_assert_cmpint(stats->dakes_completed, ==, 1);
+  g_assert_cmpint(stats->sent[OTRV4_STATS_MSG_IDENTITY], ==, 1);
+  g_assert_cmpint(stats->sent[OTRV4_STATS_MSG_AUTH_I], ==, 1);
+  g_assert_cmpint(stats->received[OTRV4_STATS_MSG_DATA], ==, 2);
+  g_assert_cmpint(stats->skipped_keys_stored, ==, 1);
+  g_assert_cmpint(stats->mac_failures, ==, 0);
+  g_assert_cmpint(stats->decrypt_failures, ==, 0);
+#else
+  // Nothing is counted
+  otrv4_assert(otrv4_client_state_stats(stats, bob_state) == ERROR);
+  g_assert_cmpint(stats->received[OTRV4_STATS_MSG_DATA], ==, 0);
+#endif
+
+  otrv4_userstate_free_all(alice_state->userstate, bob_state->userstate);
+  otrv4_client_state_free_all(alice_state, bob_state);
+  otrv4_free_all(alice, bob);
+
+  OTRV4_FREE;
+}
+
+typedef struct {
+  otrv4_trace_event_t events[64];
+  int len;
+} trace_recorder_t;
+
+static void record_trace_event(const otrv4_trace_event_t *event, void *ctx) {
+  trace_recorder_t *recorder = ctx;
+
+  otrv4_assert(recorder->len < 64);
+  recorder->events[recorder->len++] = *event;
+}
+
+static otrv4_bool_t trace_has_stage(const trace_recorder_t *recorder,
+                                    otrv4_trace_stage_t stage) {
+  for (int i = 0; i < recorder->len; i++)
+    if (recorder->events[i].stage == stage)
+      return otrv4_true;
+
+  return otrv4_false;
+}
+
+// Every stage left is the last one entered, and time never goes back
+static void assert_trace_nested(const trace_recorder_t *recorder) {
+  otrv4_trace_stage_t entered[64];
+  int depth = 0;
+
+  for (int i = 0; i < recorder->len; i++) {
+    const otrv4_trace_event_t *event = &recorder->events[i];
+    if (i > 0)
+      otrv4_assert(event->ns >= recorder->events[i - 1].ns);
+
+    if (event->phase == OTRV4_TRACE_PHASE_ENTER) {
+      entered[depth++] = event->stage;
+      continue;
+    }
+
+    otrv4_assert(depth > 0);
+    g_assert_cmpint(entered[--depth], ==, event->stage);
+    otrv4_assert(event->err == SUCCESS);
+  }
+
+  g_assert_cmpint(depth, ==, 0);
+}
+
+void test_api_trace() {
+  OTRV4_INIT;
+
+  trace_recorder_t alice_events[1] = {{.len = 0}};
+  trace_recorder_t bob_events[1] = {{.len = 0}};
+  otrv4_tracer_t alice_tracer[1] = {{record_trace_event, alice_events}};
+  otrv4_tracer_t bob_tracer[1] = {{record_trace_event, bob_events}};
+
+  otrv4_client_state_t *alice_state = otrv4_client_state_new(NULL);
+  otrv4_client_state_t *bob_state = otrv4_client_state_new(NULL);
+  alice_state->tracer = alice_tracer;
+  bob_state->tracer = bob_tracer;
+
+  otrv4_t *alice = set_up_otr(alice_state, ALICE_IDENTITY, PHI, 1);
+  otrv4_t *bob = set_up_otr(bob_state, BOB_IDENTITY, PHI, 3);
+
+  // DAKE has finished
+  do_dake_fixture(alice, bob);
+
+  otrv4_assert(trace_has_stage(alice_events, OTRV4_TRACE_MSG_IDENTITY) ==
+               otrv4_true);
+  otrv4_assert(trace_has_stage(alice_events, OTRV4_TRACE_MSG_AUTH_I) ==
+               otrv4_true);
+  otrv4_assert(trace_has_stage(alice_events, OTRV4_TRACE_RATCHET_INIT) ==
+               otrv4_true);
+  otrv4_assert(trace_has_stage(bob_events, OTRV4_TRACE_MSG_AUTH_R) ==
+               otrv4_true);
+  otrv4_assert(trace_has_stage(bob_events, OTRV4_TRACE_RATCHET_INIT) ==
+               otrv4_true);
+  otrv4_assert(trace_has_stage(alice_events, OTRV4_TRACE_MSG_DATA) ==
+               otrv4_false);
+
+  // Bob received the Auth-R, so his first message starts a new ratchet
+  string_t to_send = NULL;
+  otrv4_assert(otrv4_prepare_to_send_message(&to_send, "hi", NULL, 0, bob) ==
+               SUCCESS);
+  otrv4_assert(trace_has_stage(bob_events, OTRV4_TRACE_RATCHET_SENDING) ==
+               otrv4_true);
+
+  otrv4_response_t *response_to_bob = otrv4_response_new();
+  otrv4_err_t err = otrv4_receive_message(response_to_bob, to_send, alice);
+  assert_msg_rec(err, "hi", response_to_bob);
+  otrv4_response_free(response_to_bob);
+  free(to_send);
+
+  otrv4_assert(trace_has_stage(alice_events, OTRV4_TRACE_MSG_DATA) ==
+               otrv4_true);
+  otrv4_assert(trace_has_stage(alice_events, OTRV4_TRACE_RATCHET_RECEIVING) ==
+               otrv4_true);
+
+  assert_trace_nested(alice_events);
+  assert_trace_nested(bob_events);
+
+  otrv4_userstate_free_all(alice_state->userstate, bob_state->userstate);
+  otrv4_client_state_free_all(alice_state, bob_state);
+  otrv4_free_all(alice, bob);
+
+  OTRV4_FREE;
+}
@@ -0,0 +1,118 @@
+#include <glib.h>
+#include <libotr/b64.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../base64.h"
+
+void test_base64_encode(void) {
+  // From RFC 4648
+  const char *vectors[][2] = {
+      {"", ""},         {"f", "Zg=="},         {"fo", "Zm8="},
+      {"foo", "Zm9v"},  {"foob", "Zm9vYg=="},  {"fooba", "Zm9vYmE="},
+      {"foobar", "Zm9vYmFy"},
+  };
+  char dst[16];
+
+  for (int i = 0; i < 7; i++) {
+    size_t len = strlen(vectors[i][0]);
+    size_t written =
+        otrv4_base64_encode(dst, (const uint8_t *)vectors[i][0], len);
+    g_assert_cmpint(written, ==, OTRV4_BASE64_ENCODE_LEN(len));
+    dst[written] = '\0';
+    g_assert_cmpstr(dst, ==, vectors[i][1]);
+  }
+}
+
+void test_base64_encode_in_chunks(void) {
+  uint8_t src[100];
+  char whole[OTRV4_BASE64_ENCODE_LEN(100)];
+  char chunked[OTRV4_BASE64_ENCODE_LEN(100)];
+
+  for (int i = 0; i < 100; i++)
+    src[i] = i * 7;
+
+  size_t whole_len = otrv4_base64_encode(whole, src, 100);
+
+  // Every chunk size, including the ones that split the groups
+  for (size_t chunk = 1; chunk <= 7; chunk++) {
+    otrv4_base64_encoder_t encoder[1];
+    size_t written = 0;
+
+    otrv4_base64_encoder_init(encoder);
+    for (size_t i = 0; i < 100; i += chunk) {
+      size_t len = i + chunk < 100 ? chunk : 100 - i;
+      written +=
+          otrv4_base64_encode_update(chunked + written, encoder, src + i, len);
+    }
+    written += otrv4_base64_encode_final(chunked + written, encoder);
+
+    g_assert_cmpint(written, ==, whole_len);
+    otrv4_assert_cmpmem(whole, chunked, whole_len);
+  }
+}
+
+void test_otr_encode_matches_libotr(void) {
+  uint8_t src[64];
+
+  for (int i = 0; i < 64; i++)
+    src[i] = 255 - i;
+
+  for (size_t len = 0; len <= 64; len++) {
+    char *expected = otrl_base64_otr_encode(src, len);
+    char *encoded = malloc(OTRV4_OTR_ENCODED_LEN(len));
+
+    g_assert_cmpint(otrv4_otr_encode(encoded, src, len), ==,
+                    strlen(expected));
+    g_assert_cmpstr(encoded, ==, expected);
+
+    // The same, with the bytes at the end of the output
+    uint8_t *in_place =
+        (uint8_t *)encoded + OTRV4_OTR_ENCODED_LEN(len) - len;
+    memcpy(in_place, src, len);
+    otrv4_otr_encode(encoded, in_place, len);
+    g_assert_cmpstr(encoded, ==, expected);
+
+    free(encoded);
+    free(expected);
+  }
+}
+
+void test_base64_decode(void) {
+  const char *encoded = "Zm9vYmE=";
+  uint8_t dst[OTRV4_BASE64_DECODE_LEN(8)];
+  size_t written = 0;
+
+  otrv4_assert(otrv4_base64_decode(dst, &written, encoded, 8) == SUCCESS);
+  g_assert_cmpint(written, ==, 5);
+  otrv4_assert_cmpmem("fooba", dst, 5);
+
+  // Every chunk size, including the ones that split the groups
+  for (size_t chunk = 1; chunk <= 5; chunk++) {
+    otrv4_base64_decoder_t decoder[1];
+    size_t total = 0;
+
+    otrv4_base64_decoder_init(decoder);
+    for (size_t i = 0; i < 8; i += chunk) {
+      size_t len = i + chunk < 8 ? chunk : 8 - i;
+      otrv4_assert(otrv4_base64_decode_update(dst + total, &written, decoder,
+                                              encoded + i, len) == SUCCESS);
+      total += written;
+    }
+
+    otrv4_assert(otrv4_base64_decode_final(decoder) == SUCCESS);
+    g_assert_cmpint(total, ==, 5);
+    otrv4_assert_cmpmem("fooba", dst, 5);
+  }
+}
+
+void test_base64_decode_fails_for_invalid_input(void) {
+  const char *invalid[] = {"Zm9", "Zm9v*mE=", "Z===", "Zm=v", "Zg==Zg==",
+                           "Zm9v Zg=="};
+  uint8_t dst[OTRV4_BASE64_DECODE_LEN(16)];
+  size_t written = 0;
+
+  for (int i = 0; i < 6; i++)
+    otrv4_assert(otrv4_base64_decode(dst, &written, invalid[i],
+                                     strlen(invalid[i])) == ERROR);
+}
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 
 #include "../client.h"
@@ -22,14 +23,14 @@ void test_client_conversation_api() {
   otrv4_client_state_t *alice_state = otrv4_client_state_new(NULL);
 
   otrv4_client_t *alice = set_up_client(alice_state, ALICE_IDENTITY, PHI, 1);
-  otrv4_assert(!alice->conversations);
+  g_assert_cmpint(otrv4_sharded_table_len(alice->conversations), ==, 0);
 
   otrv4_conversation_t *alice_to_bob =
       otrv4_client_get_conversation(!FORCE_CREATE_CONVO, BOB_IDENTITY, alice);
   otrv4_conversation_t *alice_to_charlie = otrv4_client_get_conversation(
       !FORCE_CREATE_CONVO, CHARLIE_IDENTITY, alice);
 
-  otrv4_assert(!alice->conversations);
+  g_assert_cmpint(otrv4_sharded_table_len(alice->conversations), ==, 0);
   otrv4_assert(!alice_to_bob);
   otrv4_assert(!alice_to_charlie);
 
@@ -988,3 +989,296 @@ void test_client_sends_fragmented_message(void) {
 
   OTRV4_FREE;
 }
+
+// Alice (known to Bob as alice_name) starts a DAKE with Bob (bob_name)
+static void client_do_dake(otrv4_client_t *alice, const char *alice_name,
+                           otrv4_client_t *bob, const char *bob_name) {
+  char *from_alice = NULL, *frombob = NULL, *todisplay = NULL;
+
+  from_alice =
+      otrv4_client_query_message(bob_name, "Hi", alice, OTRV4_ALLOW_V4);
+  otrv4_client_receive(&frombob, &todisplay, from_alice, alice_name, bob);
+  free(from_alice);
+  from_alice = NULL;
+
+  otrv4_client_receive(&from_alice, &todisplay, frombob, bob_name, alice);
+  free(frombob);
+  frombob = NULL;
+
+  otrv4_client_receive(&frombob, &todisplay, from_alice, alice_name, bob);
+  free(from_alice);
+  from_alice = NULL;
+
+  otrv4_client_receive(&from_alice, &todisplay, frombob, bob_name, alice);
+  free(frombob);
+  frombob = NULL;
+
+  free(from_alice);
+}
+
+#define STRESS_THREADS 8
+#define STRESS_MESSAGES 16
+
+typedef struct {
+  otrv4_client_t *alice;
+  otrv4_client_t *bob;
+  otrv4_userstate_t *userstate;
+  int id;
+} stress_ctx_t;
+
+static void *stress_conversation(void *data) {
+  stress_ctx_t *ctx = data;
+  char bob_name[32], alice_name[32], message[32];
+  char *from_alice = NULL, *frombob = NULL, *todisplay = NULL;
+  int i;
+
+  snprintf(bob_name, sizeof(bob_name), "bob%d@localhost", ctx->id);
+  snprintf(alice_name, sizeof(alice_name), "alice%d@localhost", ctx->id);
+
+  // Every thread uses its own account, and all of them use a shared one
+  for (i = 0; i < STRESS_MESSAGES; i++) {
+    otrv4_assert(otrv4_user_state_get_private_key_v4(ctx->userstate,
+                                                     ctx->userstate));
+    otrv4_assert(
+        otrv4_user_state_get_private_key_v4(ctx->userstate, &ctx->id));
+  }
+
+  client_do_dake(ctx->alice, alice_name, ctx->bob, bob_name);
+
+  otrv4_conversation_t *conv =
+      otrv4_client_get_conversation(!FORCE_CREATE_CONVO, bob_name, ctx->alice);
+  otrv4_assert(conv);
+  otrv4_assert(conv->conn->state == OTRV4_STATE_ENCRYPTED_MESSAGES);
+
+  for (i = 0; i < STRESS_MESSAGES; i++) {
+    snprintf(message, sizeof(message), "%d from %d", i, ctx->id);
+
+    g_assert_cmpint(
+        otrv4_client_send(&frombob, message, alice_name, ctx->bob), ==, 0);
+    otrv4_assert(!otrv4_client_receive(&from_alice, &todisplay, frombob,
+                                       bob_name, ctx->alice));
+    free(frombob);
+    frombob = NULL;
+
+    g_assert_cmpstr(todisplay, ==, message);
+    free(todisplay);
+    todisplay = NULL;
+
+    free(from_alice);
+    from_alice = NULL;
+  }
+
+  otrv4_assert(!otrv4_client_disconnect(&from_alice, bob_name, ctx->alice));
+  otrv4_client_receive(&frombob, &todisplay, from_alice, alice_name,
+                       ctx->bob);
+  free(from_alice);
+  free(frombob);
+
+  return NULL;
+}
+
+static otrv4_userstate_t *stress_state = NULL;
+
+static void stress_create_privkey_cb(void *client_id) {
+  const uint8_t sym[ED448_PRIVATE_BYTES] = {1};
+  otrv4_user_state_add_private_key_v4(stress_state, client_id, sym);
+}
+
+static otrv4_client_callbacks_t stress_callbacks = {
+    stress_create_privkey_cb, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+};
+
+void test_client_concurrent_conversations() {
+  OTRV4_INIT;
+
+  otrv4_client_state_t *alice_state = otrv4_client_state_new("alice");
+  otrv4_client_state_t *bob_state = otrv4_client_state_new("bob");
+
+  otrv4_client_t *alice = set_up_client(alice_state, ALICE_IDENTITY, PHI, 1);
+  otrv4_client_t *bob = set_up_client(bob_state, BOB_IDENTITY, PHI, 2);
+
+  stress_state = otrv4_user_state_new(&stress_callbacks);
+
+  pthread_t threads[STRESS_THREADS];
+  stress_ctx_t ctx[STRESS_THREADS];
+  int i;
+
+  for (i = 0; i < STRESS_THREADS; i++) {
+    ctx[i].alice = alice;
+    ctx[i].bob = bob;
+    ctx[i].userstate = stress_state;
+    ctx[i].id = i;
+    g_assert_cmpint(
+        pthread_create(&threads[i], NULL, stress_conversation, &ctx[i]), ==,
+        0);
+  }
+
+  for (i = 0; i < STRESS_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  g_assert_cmpint(otrv4_sharded_table_len(alice->conversations), ==, 0);
+  g_assert_cmpint(otrv4_sharded_table_len(bob->conversations), ==,
+                  STRESS_THREADS);
+  g_assert_cmpint(otrv4_sharded_table_len(stress_state->states), ==,
+                  STRESS_THREADS + 1);
+
+  otrv4_user_state_free(stress_state);
+  stress_state = NULL;
+
+  otrv4_userstate_free_all(alice_state->userstate, bob_state->userstate);
+  otrv4_client_state_free_all(alice_state, bob_state);
+  otrv4_client_free_all(alice, bob);
+
+  OTRV4_FREE
+}
+
+void test_client_receive_batch() {
+  OTRV4_INIT;
+
+  otrv4_client_state_t *alice_state = otrv4_client_state_new("alice");
+  otrv4_client_state_t *bob_state = otrv4_client_state_new("bob");
+  otrv4_client_state_t *charlie_state = otrv4_client_state_new("charlie");
+
+  otrv4_client_t *alice = set_up_client(alice_state, ALICE_IDENTITY, PHI, 1);
+  otrv4_client_t *bob = set_up_client(bob_state, BOB_IDENTITY, PHI, 2);
+  otrv4_client_t *charlie =
+      set_up_client(charlie_state, CHARLIE_IDENTITY, PHI, 3);
+
+  client_do_dake(alice, ALICE_IDENTITY, bob, BOB_IDENTITY);
+  client_do_dake(alice, ALICE_IDENTITY, charlie, CHARLIE_IDENTITY);
+
+  const char *sent[] = {"one", "two", "three", "four", "five"};
+  const char *from[] = {BOB_IDENTITY, CHARLIE_IDENTITY, BOB_IDENTITY,
+                        BOB_IDENTITY, CHARLIE_IDENTITY};
+  otrv4_client_inbound_t inbound[6];
+  otrv4_client_received_t received[6];
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    char *to_send = NULL;
+    otrv4_client_t *sender = strcmp(from[i], BOB_IDENTITY) ? charlie : bob;
+    otrv4_client_send(&to_send, sent[i], ALICE_IDENTITY, sender);
+    otrv4_assert(to_send);
+
+    inbound[i].recipient = from[i];
+    inbound[i].message = to_send;
+  }
+
+  inbound[5].recipient = BOB_IDENTITY;
+  inbound[5].message = NULL;
+
+  otrv4_assert(otrv4_workers_enable(2) == SUCCESS);
+  g_assert_cmpint(otrv4_client_receive_batch(received, inbound, 6, 2, alice),
+                  ==, 0);
+  otrv4_workers_disable();
+
+  for (i = 0; i < 5; i++) {
+    otrv4_assert(!received[i].ignore);
+    otrv4_assert(!received[i].to_send);
+    g_assert_cmpstr(received[i].to_display, ==, sent[i]);
+
+    free(received[i].to_display);
+    free((char *)inbound[i].message);
+  }
+
+  otrv4_assert(received[5].ignore);
+  otrv4_assert(!received[5].to_display);
+
+  // An empty batch
+  g_assert_cmpint(otrv4_client_receive_batch(received, NULL, 0, 4, alice), ==,
+                  0);
+
+  // A conversation held by a batch outlives its disconnection
+  otrv4_conversation_t *held = hold_conversation_with(BOB_IDENTITY, alice);
+  otrv4_assert(held);
+  char *last = NULL;
+  g_assert_cmpint(otrv4_client_disconnect(&last, BOB_IDENTITY, alice), ==, 0);
+  free(last);
+  otrv4_assert(!otrv4_client_get_conversation(0, BOB_IDENTITY, alice));
+  g_assert_cmpint(held->refs, ==, 1);
+  g_assert_cmpstr(held->recipient, ==, BOB_IDENTITY);
+  conversation_release(held);
+
+  otrv4_userstate_free_all(alice_state->userstate, bob_state->userstate,
+                           charlie_state->userstate);
+  otrv4_client_state_free_all(alice_state, bob_state, charlie_state);
+  otrv4_client_free_all(alice, bob, charlie);
+
+  OTRV4_FREE
+}
+
+void test_client_send_batch() {
+  OTRV4_INIT;
+
+  otrv4_client_state_t *alice_state = otrv4_client_state_new("alice");
+  otrv4_client_state_t *bob_state = otrv4_client_state_new("bob");
+
+  otrv4_client_t *alice = set_up_client(alice_state, ALICE_IDENTITY, PHI, 1);
+  otrv4_client_t *bob = set_up_client(bob_state, BOB_IDENTITY, PHI, 2);
+  bob_state->pad = true;
+
+  const char *messages[20];
+  char **to_send = NULL, *todisplay = NULL, *fromalice = NULL;
+  char buff[20][16];
+  size_t sent = 0;
+  int i;
+
+  for (i = 0; i < 20; i++) {
+    snprintf(buff[i], sizeof(buff[i]), "message %d", i);
+    messages[i] = buff[i];
+  }
+
+  // Not encrypted yet
+  g_assert_cmpint(otrv4_client_send_batch(&to_send, &sent, messages, 20,
+                                          ALICE_IDENTITY, bob),
+                  ==, CLIENT_ERROR_NOT_ENCRYPTED);
+  otrv4_assert(!to_send);
+  g_assert_cmpint(sent, ==, 0);
+
+  client_do_dake(alice, ALICE_IDENTITY, bob, BOB_IDENTITY);
+
+  // Alice replies, so Bob has MAC keys to reveal and will ratchet
+  char *frombob = NULL;
+  otrv4_client_send(&fromalice, "hi", BOB_IDENTITY, alice);
+  otrv4_client_receive(&frombob, &todisplay, fromalice, ALICE_IDENTITY, bob);
+  free(fromalice);
+  free(todisplay);
+  todisplay = NULL;
+  free(frombob);
+  frombob = NULL;
+
+  // The first message ratchets and reveals the MAC keys
+  g_assert_cmpint(otrv4_client_send_batch(&to_send, &sent, messages, 20,
+                                          ALICE_IDENTITY, bob),
+                  ==, 0);
+  otrv4_assert(to_send);
+  g_assert_cmpint(sent, ==, 20);
+
+  for (i = 0; i < 20; i++) {
+    fromalice = NULL;
+    otrv4_assert(!otrv4_client_receive(&fromalice, &todisplay, to_send[i],
+                                       BOB_IDENTITY, alice));
+    g_assert_cmpstr(todisplay, ==, messages[i]);
+    otrv4_assert(!fromalice);
+    free(todisplay);
+    todisplay = NULL;
+  }
+
+  free(to_send);
+  to_send = NULL;
+
+  // Messages sent one by one follow the batch
+  otrv4_client_send(&frombob, "after", ALICE_IDENTITY, bob);
+  otrv4_assert(!otrv4_client_receive(&fromalice, &todisplay, frombob,
+                                     BOB_IDENTITY, alice));
+  g_assert_cmpstr(todisplay, ==, "after");
+  free(frombob);
+  free(todisplay);
+  free(fromalice);
+
+  otrv4_userstate_free_all(alice_state->userstate, bob_state->userstate);
+  otrv4_client_state_free_all(alice_state, bob_state);
+  otrv4_client_free_all(alice, bob);
+
+  OTRV4_FREE
+}
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "../auth.h"
+#include "../client_state.h"
 #include "../dake.h"
 #include "../serialize.h"
 
@@ -38,3 +39,97 @@ void test_snizkpk_auth() {
                                     (unsigned char *)msg,
                                     strlen(msg)) == SUCCESS);
 }
+
+void test_snizkpk_precomputed_nonces() {
+  snizkpk_proof_t dst[1];
+  snizkpk_keypair_t pair1[1], pair2[1], pair3[1];
+  snizkpk_nonces_t nonces[1];
+  const char *msg = "hi";
+
+  otrv4_snizkpk_keypair_generate(pair1);
+  otrv4_snizkpk_keypair_generate(pair2);
+  otrv4_snizkpk_keypair_generate(pair3);
+
+  otrv4_snizkpk_nonces_generate(nonces);
+  otrv4_snizkpk_authenticate_with_nonces(dst, nonces, pair1, pair2->pub,
+                                         pair3->pub, (unsigned char *)msg,
+                                         strlen(msg));
+
+  /* Nonces are used only once */
+  otrv4_assert_zero(nonces, sizeof(snizkpk_nonces_t));
+  otrv4_assert(otrv4_snizkpk_verify(dst, pair1->pub, pair2->pub, pair3->pub,
+                                    (unsigned char *)msg,
+                                    strlen(msg)) == SUCCESS);
+
+  otrv4_client_state_t *state = otrv4_client_state_new(NULL);
+  g_assert_cmpint(otrv4_client_state_precompute_auth(state), ==,
+                  OTRV4_AUTH_NONCES);
+  g_assert_cmpint(otrv4_client_state_precompute_auth(state), ==, 0);
+
+  for (int i = 0; i <= OTRV4_AUTH_NONCES; i++) {
+    otrv4_client_state_take_auth_nonces(state, nonces);
+    otrv4_snizkpk_authenticate_with_nonces(dst, nonces, pair1, pair2->pub,
+                                           pair3->pub, (unsigned char *)msg,
+                                           strlen(msg));
+    otrv4_assert(otrv4_snizkpk_verify(dst, pair1->pub, pair2->pub,
+                                      pair3->pub, (unsigned char *)msg,
+                                      strlen(msg)) == SUCCESS);
+  }
+
+  g_assert_cmpint(state->auth_nonces_len, ==, 0);
+  otrv4_client_state_free(state);
+}
+
+void test_snizkpk_verify_batch() {
+  snizkpk_keypair_t pairs[3][1];
+  snizkpk_proof_t proofs[4][1];
+  snizkpk_verification_t items[4];
+  otrv4_bool_t results[4];
+  const char *msgs[4] = {"one", "two", "three", "four"};
+  int i;
+
+  for (i = 0; i < 3; i++)
+    otrv4_snizkpk_keypair_generate(pairs[i]);
+
+  // Each proof is made by a different member of the ring
+  for (i = 0; i < 4; i++) {
+    int a = i % 3, b = (i + 1) % 3, c = (i + 2) % 3;
+    otrv4_snizkpk_authenticate(proofs[i], pairs[a], pairs[b]->pub,
+                               pairs[c]->pub, (unsigned char *)msgs[i],
+                               strlen(msgs[i]));
+
+    items[i].proof = proofs[i];
+    otrv4_ec_point_copy(items[i].A1, pairs[a]->pub);
+    otrv4_ec_point_copy(items[i].A2, pairs[b]->pub);
+    otrv4_ec_point_copy(items[i].A3, pairs[c]->pub);
+    items[i].msg = (unsigned char *)msgs[i];
+    items[i].msglen = strlen(msgs[i]);
+
+    otrv4_assert(otrv4_snizkpk_verify(proofs[i], pairs[a]->pub, pairs[b]->pub,
+                                      pairs[c]->pub, (unsigned char *)msgs[i],
+                                      strlen(msgs[i])) == otrv4_true);
+  }
+
+  otrv4_assert(otrv4_snizkpk_verify_batch(results, items, 4) == otrv4_true);
+  for (i = 0; i < 4; i++)
+    otrv4_assert(results[i] == otrv4_true);
+
+  // A proof for another message
+  items[2].msg = (unsigned char *)msgs[3];
+  items[2].msglen = strlen(msgs[3]);
+
+  otrv4_assert(otrv4_snizkpk_verify_batch(results, items, 4) == otrv4_false);
+  otrv4_assert(results[0] == otrv4_true);
+  otrv4_assert(results[1] == otrv4_true);
+  otrv4_assert(results[2] == otrv4_false);
+  otrv4_assert(results[3] == otrv4_true);
+
+  // A proof with the wrong key
+  items[2].msg = (unsigned char *)msgs[2];
+  items[2].msglen = strlen(msgs[2]);
+  otrv4_ec_point_copy(items[1].A1, pairs[0]->pub);
+
+  otrv4_assert(otrv4_snizkpk_verify_batch(NULL, items, 4) == otrv4_false);
+  otrv4_assert(otrv4_snizkpk_verify_batch(results, items + 2, 2) ==
+               otrv4_true);
+}
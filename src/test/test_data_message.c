@@ -169,3 +169,57 @@ void test_otrv4_data_message_deserializes() {
   free(serialized);
   serialized = NULL;
 }
+
+void test_otrv4_data_message_deserializes_in_place() {
+  OTRV4_INIT;
+
+  data_message_t *data_msg = set_up_data_msg();
+
+  uint8_t *serialized = NULL;
+  size_t serlen = 0;
+  otrv4_assert(otrv4_data_message_body_asprintf(&serialized, &serlen,
+                                                data_msg) == SUCCESS);
+
+  m_mac_key_t mac_key;
+  memset(mac_key, 0x2a, sizeof(m_mac_key_t));
+  shake_256_mac(data_msg->mac, DATA_MSG_MAC_BYTES, mac_key,
+                sizeof(m_mac_key_t), serialized, serlen);
+  serialized = realloc(serialized, serlen + DATA_MSG_MAC_BYTES);
+  memcpy(serialized + serlen, data_msg->mac, DATA_MSG_MAC_BYTES);
+
+  data_message_t deserialized[1];
+  memset(deserialized, 0, sizeof(data_message_t));
+  size_t body_len = 0;
+  otrv4_assert(otrv4_data_message_deserialize_in_place(
+                   deserialized, serialized, serlen + DATA_MSG_MAC_BYTES,
+                   &body_len) == SUCCESS);
+
+  g_assert_cmpint(body_len, ==, serlen);
+  otrv4_assert(deserialized->enc_msg > serialized);
+  otrv4_assert(deserialized->enc_msg < serialized + serlen);
+  otrv4_assert(data_msg->enc_msg_len == deserialized->enc_msg_len);
+  otrv4_assert_cmpmem(data_msg->enc_msg, deserialized->enc_msg,
+                      data_msg->enc_msg_len);
+  otrv4_assert(otrv4_valid_data_message_body(mac_key, deserialized,
+                                             serialized, body_len) ==
+               otrv4_true);
+
+  serialized[0] ^= 1;
+  otrv4_assert(otrv4_valid_data_message_body(mac_key, deserialized,
+                                             serialized, body_len) ==
+               otrv4_false);
+  serialized[0] ^= 1;
+
+  /* A truncated encrypted message is rejected */
+  otrv4_data_message_in_place_destroy(deserialized);
+  memset(deserialized, 0, sizeof(data_message_t));
+  otrv4_assert(otrv4_data_message_deserialize_in_place(
+                   deserialized, serialized, serlen - 1, &body_len) == ERROR);
+
+  otrv4_data_message_in_place_destroy(deserialized);
+  otrv4_data_message_free(data_msg);
+  free(serialized);
+  serialized = NULL;
+
+  OTRV4_FREE;
+}
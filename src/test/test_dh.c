@@ -63,3 +63,67 @@ void dh_test_keypair_destroy() {
 
   otrv4_dh_free();
 }
+
+void dh_test_generator_fixed_base() {
+  OTRV4_INIT;
+
+  uint8_t exp[DH_KEY_SIZE];
+  dh_mpi_t exp_mpi = NULL;
+  dh_mpi_t comb = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+  dh_mpi_t generic = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+
+  for (int i = 0; i < 8; i++) {
+    if (i == 0)
+      memset(exp, 0, sizeof(exp));
+    else if (i == 1)
+      memset(exp, 0xff, sizeof(exp));
+    else
+      gcry_randomize(exp, sizeof(exp), GCRY_WEAK_RANDOM);
+
+    otrv4_assert(!gcry_mpi_scan(&exp_mpi, GCRYMPI_FMT_USG, exp, sizeof(exp),
+                                NULL));
+
+    otrv4_assert(dh_generator_powm(comb, exp) == SUCCESS);
+    dh_generator_powm_generic(generic, exp_mpi);
+    otrv4_assert(gcry_mpi_cmp(comb, generic) == 0);
+
+    gcry_mpi_release(exp_mpi);
+    exp_mpi = NULL;
+  }
+
+  gcry_mpi_release(comb);
+  gcry_mpi_release(generic);
+  otrv4_dh_free();
+}
+
+void dh_test_mpi_valid() {
+  OTRV4_INIT;
+
+  dh_keypair_t alice;
+  dh_mpi_t mpi = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+
+  otrv4_assert(otrv4_dh_mpi_valid(NULL) == otrv4_false);
+
+  gcry_mpi_set_ui(mpi, 1);
+  otrv4_assert(otrv4_dh_mpi_valid(mpi) == otrv4_false);
+
+  /* 2 is the generator, and 4 = g^2 */
+  gcry_mpi_set_ui(mpi, 2);
+  otrv4_assert(otrv4_dh_mpi_valid(mpi) == otrv4_true);
+  gcry_mpi_set_ui(mpi, 4);
+  otrv4_assert(otrv4_dh_mpi_valid(mpi) == otrv4_true);
+
+  /* 5 and 7 are not quadratic residues, so they are outside the subgroup */
+  gcry_mpi_set_ui(mpi, 5);
+  otrv4_assert(dh_mpi_in_range(mpi) == otrv4_true);
+  otrv4_assert(otrv4_dh_mpi_valid(mpi) == otrv4_false);
+  gcry_mpi_set_ui(mpi, 7);
+  otrv4_assert(otrv4_dh_mpi_valid(mpi) == otrv4_false);
+
+  otrv4_dh_keypair_generate(alice);
+  otrv4_assert(otrv4_dh_mpi_valid(alice->pub) == otrv4_true);
+
+  otrv4_dh_keypair_destroy(alice);
+  gcry_mpi_release(mpi);
+  otrv4_dh_free();
+}
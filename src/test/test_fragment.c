@@ -28,6 +28,30 @@ void test_create_fragments(void) {
   otrv4_message_free(frag_message);
 }
 
+void test_create_fragment_views(void) {
+  char *message = "one two tree";
+  otrv4_fragment_view_t *views = NULL;
+  int total = 0;
+
+  otrv4_assert(otrv4_fragment_message_view(&views, &total, 40, 1, 2,
+                                           message) == SUCCESS);
+  g_assert_cmpint(total, ==, 4);
+
+  g_assert_cmpstr(views[0].prefix, ==, "?OTR|00000001|00000002,00001,00004,");
+  g_assert_cmpstr(views[3].prefix, ==, "?OTR|00000001|00000002,00004,00004,");
+
+  /* Payloads point into the message */
+  otrv4_assert(views[0].payload == message);
+  g_assert_cmpint(views[0].payload_len, ==, 3);
+  otrv4_assert(views[3].payload == message + 9);
+  g_assert_cmpint(views[3].payload_len, ==, 3);
+
+  free(views);
+
+  otrv4_assert(otrv4_fragment_message_view(&views, &total, FRAGMENT_HEADER_LEN,
+                                           1, 2, message) == ERROR);
+}
+
 void test_defragment_valid_message(void) {
   string_t fragments[2];
   fragments[0] = "?OTR|00000001|00000002,00001,00002,one ,";
@@ -40,19 +64,19 @@ void test_defragment_valid_message(void) {
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[0], 2) ==
                SUCCESS);
 
-  g_assert_cmpint(context->N, ==, 2);
-  g_assert_cmpint(context->K, ==, 1);
-  g_assert_cmpstr(context->fragment, ==, "one ");
-  g_assert_cmpint(context->fragment_len, ==, 4);
+  g_assert_cmpint(context->count, ==, 1);
+  g_assert_cmpint(context->head->key.N, ==, 2);
+  g_assert_cmpint(context->head->K, ==, 1);
+  g_assert_cmpint(context->head->piece_len, ==, 4);
+  otrv4_assert_cmpmem(context->head->buffer, "one ", 4);
   otrv4_assert(!unfrag);
   otrv4_assert(context->status == FRAGMENT_INCOMPLETE);
 
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[1], 2) ==
                SUCCESS);
 
-  g_assert_cmpint(context->N, ==, 2);
-  g_assert_cmpint(context->K, ==, 2);
-  g_assert_cmpint(context->fragment_len, ==, 8);
+  g_assert_cmpint(context->count, ==, 0);
+  g_assert_cmpint(context->used, ==, 0);
   g_assert_cmpstr(unfrag, ==, "one more");
   otrv4_assert(context->status == FRAGMENT_COMPLETE);
 
@@ -70,9 +94,7 @@ void test_defragment_single_fragment(void) {
   char *unfrag = NULL;
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, msg, 2) == SUCCESS);
 
-  g_assert_cmpint(context->N, ==, 1);
-  g_assert_cmpint(context->K, ==, 1);
-  g_assert_cmpint(context->fragment_len, ==, 9);
+  g_assert_cmpint(context->count, ==, 0);
   g_assert_cmpstr(unfrag, ==, "small lol");
   otrv4_assert(context->status == FRAGMENT_COMPLETE);
 
@@ -89,9 +111,8 @@ void test_defragment_without_comma_fails(void) {
 
   char *unfrag = NULL;
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, msg, 2) == ERROR);
-  g_assert_cmpint(context->N, ==, 0);
-  g_assert_cmpint(context->K, ==, 0);
-  g_assert_cmpint(context->fragment_len, ==, 0);
+  g_assert_cmpint(context->count, ==, 0);
+  g_assert_cmpint(context->used, ==, 0);
   g_assert_cmpstr(unfrag, ==, NULL);
 
   free(unfrag);
@@ -99,7 +120,7 @@ void test_defragment_without_comma_fails(void) {
   otrv4_fragment_context_free(context);
 }
 
-void test_defragment_clean_context_for_frag_out_of_order(void) {
+void test_defragment_out_of_order(void) {
   string_t fragments[3];
   fragments[0] = "?OTR|00000001|00000002,00001,00003,one more ,";
   fragments[1] = "?OTR|00000001|00000002,00003,00003,send,";
@@ -109,33 +130,136 @@ void test_defragment_clean_context_for_frag_out_of_order(void) {
   context = otrv4_fragment_context_new();
 
   char *unfrag = NULL;
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[1], 2) ==
+               SUCCESS);
+  otrv4_assert(context->status == FRAGMENT_INCOMPLETE);
+  otrv4_assert(!unfrag);
+  otrv4_assert(!context->head->buffer);
+  g_assert_cmpint(context->head->K, ==, 1);
+
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[0], 2) ==
                SUCCESS);
   otrv4_assert(context->status == FRAGMENT_INCOMPLETE);
   otrv4_assert(!unfrag);
-  g_assert_cmpint(context->N, ==, 3);
-  g_assert_cmpint(context->K, ==, 1);
-  g_assert_cmpstr(context->fragment, ==, "one more ");
-  g_assert_cmpint(context->fragment_len, ==, 9);
+  g_assert_cmpint(context->head->K, ==, 2);
+  g_assert_cmpint(context->head->piece_len, ==, 9);
+
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[2], 2) ==
+               SUCCESS);
+  otrv4_assert(context->status == FRAGMENT_COMPLETE);
+  g_assert_cmpstr(unfrag, ==, "one more fragment send");
+  g_assert_cmpint(context->count, ==, 0);
+  g_assert_cmpint(context->used, ==, 0);
+
+  free(unfrag);
+  unfrag = NULL;
+  otrv4_fragment_context_free(context);
+}
+
+void test_defragment_multiple_senders(void) {
+  string_t fragments[4];
+  fragments[0] = "?OTR|00000001|00000002,00001,00002,one ,";
+  fragments[1] = "?OTR|00000003|00000002,00002,00002,two,";
+  fragments[2] = "?OTR|00000003|00000002,00001,00002,two ,";
+  fragments[3] = "?OTR|00000001|00000002,00002,00002,one,";
 
+  fragment_context_t *context;
+  context = otrv4_fragment_context_new();
+
+  char *unfrag = NULL;
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[0], 2) ==
+               SUCCESS);
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[1], 2) ==
                SUCCESS);
-  otrv4_assert(context->status == FRAGMENT_UNFRAGMENTED);
+  g_assert_cmpint(context->count, ==, 2);
   otrv4_assert(!unfrag);
-  g_assert_cmpstr(context->fragment, ==, "");
-  g_assert_cmpint(context->N, ==, 0);
-  g_assert_cmpint(context->K, ==, 0);
 
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[2], 2) ==
                SUCCESS);
-  otrv4_assert(context->status == FRAGMENT_UNFRAGMENTED);
-  otrv4_assert(!unfrag);
-  g_assert_cmpstr(context->fragment, ==, "");
-  g_assert_cmpint(context->N, ==, 0);
-  g_assert_cmpint(context->K, ==, 0);
+  g_assert_cmpstr(unfrag, ==, "two two");
+  free(unfrag);
+  unfrag = NULL;
 
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[3], 2) ==
+               SUCCESS);
+  g_assert_cmpstr(unfrag, ==, "one one");
   free(unfrag);
   unfrag = NULL;
+
+  g_assert_cmpint(context->count, ==, 0);
+  otrv4_fragment_context_free(context);
+}
+
+void test_defragment_evicts_stale_messages(void) {
+  string_t fragments[3];
+  fragments[0] = "?OTR|00000001|00000002,00001,00002,aaaa,";
+  fragments[1] = "?OTR|00000003|00000002,00001,00002,bbbb,";
+  fragments[2] = "?OTR|00000001|00000002,00002,00002,aa,";
+
+  fragment_context_t *context;
+  context = otrv4_fragment_context_new();
+
+  /* Room for a single partial message: the entry, 2 pieces of 4 bytes, the
+   * NUL and the received map */
+  context->budget = FRAGMENT_ENTRY_COST + 2 * 4 + 1 + 2;
+
+  char *unfrag = NULL;
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[0], 2) ==
+               SUCCESS);
+  g_assert_cmpint(context->used, ==, context->budget);
+
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[1], 2) ==
+               SUCCESS);
+  g_assert_cmpint(context->count, ==, 1);
+  g_assert_cmpint(context->head->key.sender_tag, ==, 3);
+
+  /* The first message was dropped, so this piece starts a new one */
+  otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragments[2], 2) ==
+               SUCCESS);
+  otrv4_assert(!unfrag);
+  g_assert_cmpint(context->head->key.sender_tag, ==, 1);
+  otrv4_assert(context->used <= context->budget);
+
+  /* A message larger than the budget is rejected */
+  otrv4_assert(otrv4_unfragment_message(
+                   &unfrag, context,
+                   "?OTR|00000005|00000002,00001,00002,too long,", 2) == ERROR);
+  otrv4_assert(!unfrag);
+  otrv4_assert(context->used <= context->budget);
+
+  otrv4_fragment_context_free(context);
+}
+
+void test_defragment_limits_entries(void) {
+  fragment_context_t *context = otrv4_fragment_context_new();
+  char fragment[64];
+  char *unfrag = NULL;
+
+  /* Every partial message is charged for its entry, however small */
+  otrv4_assert(otrv4_unfragment_message(
+                   &unfrag, context, "?OTR|00000001|00000002,00002,00002,x,",
+                   2) == SUCCESS);
+  otrv4_assert(context->used >= sizeof(fragment_entry_t) + 2 + 1);
+
+  for (int i = 2; i <= OTRV4_FRAGMENT_MAX_ENTRIES + 1; i++) {
+    snprintf(fragment, sizeof fragment, "?OTR|%08x|00000002,00002,00002,x,",
+             i);
+    otrv4_assert(otrv4_unfragment_message(&unfrag, context, fragment, 2) ==
+                 SUCCESS);
+  }
+
+  /* The first message was dropped to make room for the last one */
+  g_assert_cmpint(context->count, ==, OTRV4_FRAGMENT_MAX_ENTRIES);
+  otrv4_assert(!find_fragment_entry(context, 1, 2));
+  otrv4_assert(find_fragment_entry(context, 2, 2));
+  otrv4_assert(find_fragment_entry(context, OTRV4_FRAGMENT_MAX_ENTRIES + 1, 2));
+
+  otrv4_assert(otrv4_unfragment_message(
+                   &unfrag, context, "?OTR|00000002|00000002,00001,00002,x,",
+                   2) == SUCCESS);
+  g_assert_cmpstr(unfrag, ==, "xx");
+  free(unfrag);
+
   otrv4_fragment_context_free(context);
 }
 
@@ -148,9 +272,7 @@ void test_defragment_fails_for_invalid_tag(void) {
   char *unfrag = NULL;
   otrv4_assert(otrv4_unfragment_message(&unfrag, context, msg, 1) == ERROR);
 
-  g_assert_cmpint(context->N, ==, 0);
-  g_assert_cmpint(context->K, ==, 0);
-  g_assert_cmpint(context->fragment_len, ==, 0);
+  g_assert_cmpint(context->count, ==, 0);
   g_assert_cmpstr(unfrag, ==, NULL);
   otrv4_assert(context->status == FRAGMENT_COMPLETE);
 
@@ -0,0 +1,66 @@
+#include "../hashtable.h"
+
+void test_otrv4_hashtable_put_get() {
+  otrv4_hashtable_t table[1];
+  otrv4_hashtable_init(table, otrv4_hash_string, otrv4_hash_string_eq);
+
+  int one = 1, two = 2;
+  otrv4_assert(!otrv4_hashtable_get(table, "alice"));
+
+  otrv4_assert(otrv4_hashtable_put(table, "alice", &one) == SUCCESS);
+  otrv4_assert(otrv4_hashtable_put(table, "bob", &two) == SUCCESS);
+  g_assert_cmpint(table->len, ==, 2);
+
+  /* Keys are compared by value */
+  char key[] = "alice";
+  otrv4_assert(otrv4_hashtable_get(table, key) == &one);
+  otrv4_assert(otrv4_hashtable_get(table, "bob") == &two);
+  otrv4_assert(!otrv4_hashtable_get(table, "charlie"));
+
+  otrv4_assert(otrv4_hashtable_put(table, "alice", &two) == SUCCESS);
+  g_assert_cmpint(table->len, ==, 2);
+  otrv4_assert(otrv4_hashtable_get(table, "alice") == &two);
+
+  otrv4_assert(otrv4_hashtable_put(table, "charlie", NULL) == ERROR);
+
+  otrv4_hashtable_destroy(table, NULL);
+  g_assert_cmpint(table->len, ==, 0);
+}
+
+static void count_values(const void *key, void *value, void *context) {
+  (void)key;
+  *(int *)context += *(int *)value;
+}
+
+void test_otrv4_hashtable_remove() {
+  otrv4_hashtable_t table[1];
+  otrv4_hashtable_init(table, otrv4_hash_pointer, otrv4_hash_pointer_eq);
+
+  /* Enough entries to grow the table and collide */
+  int values[1000];
+  for (int i = 0; i < 1000; i++) {
+    values[i] = 1;
+    otrv4_assert(otrv4_hashtable_put(table, &values[i], &values[i]) ==
+                 SUCCESS);
+  }
+  g_assert_cmpint(table->len, ==, 1000);
+
+  for (int i = 0; i < 1000; i += 2)
+    otrv4_assert(otrv4_hashtable_remove(table, &values[i]) == &values[i]);
+
+  otrv4_assert(!otrv4_hashtable_remove(table, &values[0]));
+  g_assert_cmpint(table->len, ==, 500);
+
+  for (int i = 0; i < 1000; i++) {
+    if (i % 2)
+      otrv4_assert(otrv4_hashtable_get(table, &values[i]) == &values[i]);
+    else
+      otrv4_assert(!otrv4_hashtable_get(table, &values[i]));
+  }
+
+  int total = 0;
+  otrv4_hashtable_foreach(table, count_values, &total);
+  g_assert_cmpint(total, ==, 500);
+
+  otrv4_hashtable_destroy(table, NULL);
+}
@@ -56,6 +56,45 @@ void test_derive_ratchet_keys() {
   manager = NULL;
 }
 
+void test_derive_message_keys() {
+  key_manager_t *manager = malloc(sizeof(key_manager_t));
+  otrv4_key_manager_init(manager);
+
+  chain_key_t chain_key;
+  memset(chain_key, 0x42, sizeof chain_key);
+
+  m_enc_key_t enc_key;
+  m_mac_key_t mac_key;
+  derive_message_keys(enc_key, mac_key, manager, chain_key);
+
+  m_enc_key_t expected_enc_key;
+  m_mac_key_t expected_mac_key;
+  uint8_t expected_extra_key[HASH_BYTES];
+
+  // Absorbs the domain from scratch, rather than copying it
+  uint8_t magic[3] = {0x01, 0x02, 0xFF};
+  decaf_shake256_ctx_t hd;
+  hash_init(hd);
+  hash_update(hd, (const uint8_t *)"OTR4", 4);
+  hash_update(hd, &magic[0], 1);
+  hash_update(hd, chain_key, sizeof(chain_key_t));
+  hash_final(hd, expected_enc_key, sizeof(m_enc_key_t));
+  hash_destroy(hd);
+
+  shake_256_kdf(expected_mac_key, sizeof(m_mac_key_t), &magic[1],
+                expected_enc_key, sizeof(m_enc_key_t));
+  shake_256_kdf(expected_extra_key, HASH_BYTES, &magic[2], chain_key,
+                sizeof(chain_key_t));
+
+  otrv4_assert_cmpmem(expected_enc_key, enc_key, sizeof(m_enc_key_t));
+  otrv4_assert_cmpmem(expected_mac_key, mac_key, sizeof(m_mac_key_t));
+  otrv4_assert_cmpmem(expected_extra_key, manager->extra_key, HASH_BYTES);
+
+  otrv4_key_manager_destroy(manager);
+  free(manager);
+  manager = NULL;
+}
+
 void test_otrv4_key_manager_destroy() {
   OTRV4_INIT;
 
@@ -93,3 +132,166 @@ void test_otrv4_key_manager_destroy() {
 
   OTRV4_FREE;
 }
+
+void test_otrv4_key_manager_valid_their_dh() {
+  OTRV4_INIT;
+
+  key_manager_t *manager = malloc(sizeof(key_manager_t));
+  otrv4_key_manager_init(manager);
+
+  dh_keypair_t alice;
+  otrv4_dh_keypair_generate(alice);
+
+  dh_mpi_t invalid = gcry_mpi_new(DH3072_MOD_LEN_BITS);
+  gcry_mpi_set_ui(invalid, 5);
+
+  otrv4_assert(otrv4_key_manager_valid_their_dh(manager, NULL) ==
+               otrv4_false);
+  otrv4_assert(otrv4_key_manager_valid_their_dh(manager, invalid) ==
+               otrv4_false);
+  otrv4_assert(!manager->their_dh_validated);
+
+  otrv4_assert(otrv4_key_manager_valid_their_dh(manager, alice->pub) ==
+               otrv4_true);
+  otrv4_assert(gcry_mpi_cmp(manager->their_dh_validated, alice->pub) == 0);
+
+  /* A different key is always checked */
+  otrv4_assert(otrv4_key_manager_valid_their_dh(manager, invalid) ==
+               otrv4_false);
+  otrv4_assert(otrv4_key_manager_valid_their_dh(manager, alice->pub) ==
+               otrv4_true);
+
+  gcry_mpi_release(invalid);
+  otrv4_dh_keypair_destroy(alice);
+  otrv4_key_manager_destroy(manager);
+  otrv4_assert(!manager->their_dh_validated);
+  free(manager);
+
+  OTRV4_FREE;
+}
+
+void test_otrv4_key_manager_skipped_chain_keys() {
+  key_manager_t *manager = malloc(sizeof(key_manager_t));
+  otrv4_key_manager_init(manager);
+
+  /* our_ecdh is zero, so chain_a is the receiving chain */
+  memset(manager->their_ecdh, 1, sizeof(manager->their_ecdh));
+
+  chain_key_t expected[4], got;
+  memcpy(expected[0], manager->current->chain_a->key, sizeof(chain_key_t));
+  for (int i = 1; i < 4; i++)
+    hash_hash(expected[i], sizeof(chain_key_t), expected[i - 1],
+              sizeof(chain_key_t));
+
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 3, manager) ==
+               SUCCESS);
+  otrv4_assert_chain_key_eq(got, expected[3]);
+  g_assert_cmpint(manager->current->chain_a->id, ==, 3);
+
+  /* Messages that arrive late use the skipped keys, only once */
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 1, manager) ==
+               SUCCESS);
+  otrv4_assert_chain_key_eq(got, expected[1]);
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 1, manager) == ERROR);
+
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 0, manager) ==
+               SUCCESS);
+  otrv4_assert_chain_key_eq(got, expected[0]);
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 2, manager) ==
+               SUCCESS);
+  otrv4_assert_chain_key_eq(got, expected[2]);
+
+  /* The current key can be retrieved again */
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 3, manager) ==
+               SUCCESS);
+  otrv4_assert_chain_key_eq(got, expected[3]);
+
+  /* Skipping more than OTRV4_MAX_SKIP messages is rejected */
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 4 + OTRV4_MAX_SKIP,
+                                                   manager) == ERROR);
+  g_assert_cmpint(manager->current->chain_a->id, ==, 3);
+
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 3 + OTRV4_MAX_SKIP,
+                                                   manager) == SUCCESS);
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 4, manager) ==
+               SUCCESS);
+  otrv4_assert(key_manager_get_receiving_chain_key(got, 3, manager) == ERROR);
+
+  otrv4_key_manager_destroy(manager);
+  free(manager);
+}
+
+void test_otrv4_key_manager_decide_between_chain_keys() {
+  ratchet_t ratchet[1];
+  message_chain_t chain[1];
+  ec_point_t our, their;
+
+  memset(our, 0, sizeof(ec_point_t));
+  memset(their, 0, sizeof(ec_point_t));
+
+  otrv4_assert(decide_between_chain_keys(chain, ratchet, our, their) ==
+               ERROR);
+
+  /* Points are ordered by their first bytes, big-endian */
+  ((uint8_t *)our)[sizeof(ec_public_key_t) - 1] = 0xff;
+  ((uint8_t *)their)[0] = 0x01;
+  g_assert_cmpint(ec_point_bytes_cmp(our, their), ==, -1);
+  g_assert_cmpint(ec_point_bytes_cmp(their, our), ==, 1);
+
+  otrv4_assert(decide_between_chain_keys(chain, ratchet, our, their) ==
+               SUCCESS);
+  otrv4_assert(chain->sending == ratchet->chain_b);
+  otrv4_assert(chain->receiving == ratchet->chain_a);
+
+  otrv4_assert(decide_between_chain_keys(chain, ratchet, their, our) ==
+               SUCCESS);
+  otrv4_assert(chain->sending == ratchet->chain_a);
+  otrv4_assert(chain->receiving == ratchet->chain_b);
+}
+
+void test_otrv4_key_manager_old_mac_keys() {
+  key_manager_t *manager = malloc(sizeof(key_manager_t));
+  otrv4_key_manager_init(manager);
+
+  m_mac_key_t mac_key_1, mac_key_2;
+  memset(mac_key_1, 1, sizeof(m_mac_key_t));
+  memset(mac_key_2, 2, sizeof(m_mac_key_t));
+
+  otrv4_assert(otrv4_key_manager_store_old_mac_key(manager, mac_key_1) ==
+               SUCCESS);
+  otrv4_assert(otrv4_key_manager_store_old_mac_key(manager, mac_key_2) ==
+               SUCCESS);
+  g_assert_cmpint(otrv4_list_len(manager->old_mac_keys), ==, 2);
+  otrv4_assert_cmpmem(manager->old_mac_keys->data, mac_key_1, MAC_KEY_BYTES);
+  otrv4_assert_cmpmem(manager->old_mac_keys->next->data, mac_key_2,
+                      MAC_KEY_BYTES);
+
+  /* Keys taken for a message that was not sent are given back unchanged */
+  list_element_t *taken = manager->old_mac_keys;
+  manager->old_mac_keys = NULL;
+  otrv4_key_manager_restore_old_mac_keys(manager, taken);
+  g_assert_cmpint(otrv4_list_len(manager->old_mac_keys), ==, 2);
+  otrv4_assert_cmpmem(manager->old_mac_keys->data, mac_key_1, MAC_KEY_BYTES);
+  otrv4_assert_cmpmem(manager->old_mac_keys->next->data, mac_key_2,
+                      MAC_KEY_BYTES);
+
+  /* Revealed keys are wiped, and their storage is reused */
+  list_element_t *revealed = manager->old_mac_keys;
+  uint8_t *stored = revealed->data;
+  manager->old_mac_keys = NULL;
+  otrv4_key_manager_release_old_mac_keys(manager, revealed);
+  otrv4_assert_zero(stored, MAC_KEY_BYTES);
+  g_assert_cmpint(otrv4_list_len(manager->spare_mac_keys), ==, 2);
+
+  otrv4_assert(otrv4_key_manager_store_old_mac_key(manager, mac_key_2) ==
+               SUCCESS);
+  otrv4_assert(manager->old_mac_keys == revealed);
+  otrv4_assert(!manager->old_mac_keys->next);
+  otrv4_assert_cmpmem(manager->old_mac_keys->data, mac_key_2, MAC_KEY_BYTES);
+  g_assert_cmpint(otrv4_list_len(manager->spare_mac_keys), ==, 1);
+
+  otrv4_key_manager_destroy(manager);
+  otrv4_assert(!manager->old_mac_keys);
+  otrv4_assert(!manager->spare_mac_keys);
+  free(manager);
+}
@@ -0,0 +1,76 @@
+#include "../keypool.h"
+
+static void keypool_wait_until_full(size_t capacity) {
+  otrv4_keypool_stats_t stats[1];
+
+  for (int i = 0; i < 1000; i++) {
+    otrv4_keypool_get_stats(stats);
+    if (stats->ecdh_available == capacity && stats->dh_available == capacity)
+      return;
+
+    g_usleep(10000);
+  }
+}
+
+void test_keypool_take() {
+  OTRV4_INIT;
+
+  otrv4_keypool_stats_t stats[1];
+  ecdh_keypair_t ecdh[1];
+  dh_keypair_t dh;
+
+  otrv4_assert(otrv4_keypool_enable(0, 0) == ERROR);
+  otrv4_assert(otrv4_keypool_enable(2, 2) == ERROR);
+
+  otrv4_assert(otrv4_keypool_enable(3, 1) == SUCCESS);
+  otrv4_assert(otrv4_keypool_enable(3, 1) == ERROR);
+
+  keypool_wait_until_full(3);
+  otrv4_keypool_get_stats(stats);
+  g_assert_cmpint(stats->ecdh_available, ==, 3);
+  g_assert_cmpint(stats->dh_available, ==, 3);
+  g_assert_cmpint(stats->refills, ==, 6);
+
+  otrv4_assert(otrv4_keypool_take_ecdh(ecdh) == otrv4_true);
+  otrv4_assert(otrv4_ec_point_valid(ecdh->pub) == otrv4_true);
+  otrv4_assert(otrv4_keypool_take_dh(dh) == otrv4_true);
+  otrv4_assert(otrv4_dh_mpi_valid(dh->pub) == otrv4_true);
+
+  otrv4_keypool_get_stats(stats);
+  g_assert_cmpint(stats->ecdh_hits, ==, 1);
+  g_assert_cmpint(stats->dh_hits, ==, 1);
+
+  otrv4_ecdh_keypair_destroy(ecdh);
+  otrv4_dh_keypair_destroy(dh);
+
+  otrv4_keypool_disable();
+
+  otrv4_assert(otrv4_keypool_take_ecdh(ecdh) == otrv4_false);
+  otrv4_assert(otrv4_keypool_take_dh(dh) == otrv4_false);
+  otrv4_keypool_get_stats(stats);
+  g_assert_cmpint(stats->ecdh_hits, ==, 0);
+
+  OTRV4_FREE;
+}
+
+void test_keypool_feeds_ratchet() {
+  OTRV4_INIT;
+
+  otrv4_keypool_stats_t stats[1];
+  key_manager_t *manager = malloc(sizeof(key_manager_t));
+  otrv4_key_manager_init(manager);
+
+  otrv4_assert(otrv4_keypool_enable(2, 0) == SUCCESS);
+  keypool_wait_until_full(2);
+
+  otrv4_assert(otrv4_key_manager_generate_ephemeral_keys(manager) == SUCCESS);
+  otrv4_keypool_get_stats(stats);
+  g_assert_cmpint(stats->ecdh_hits, ==, 1);
+  g_assert_cmpint(stats->dh_hits, ==, 1);
+
+  otrv4_keypool_disable();
+  otrv4_key_manager_destroy(manager);
+  free(manager);
+
+  OTRV4_FREE;
+}
@@ -46,6 +46,31 @@ void test_userstate_key_management(void) {
   otrv4_user_state_free(state);
 }
 
+void test_userstate_remove_account(void) {
+  OTRV4_INIT;
+
+  const uint8_t alice_sym[ED448_PRIVATE_BYTES] = {1};
+  const uint8_t bob_sym[ED448_PRIVATE_BYTES] = {2};
+
+  otrv4_userstate_t *state = otrv4_user_state_new(NULL);
+  otrv4_user_state_add_private_key_v4(state, alice_account, alice_sym);
+  otrv4_user_state_add_private_key_v4(state, bob_account, bob_sym);
+  g_assert_cmpint(otrv4_sharded_table_len(state->states), ==, 2);
+
+  g_assert_cmpint(otrv4_user_state_remove_account(state, alice_account), ==,
+                  0);
+  g_assert_cmpint(otrv4_sharded_table_len(state->states), ==, 1);
+  g_assert_cmpint(otrv4_user_state_remove_account(state, alice_account), ==,
+                  1);
+  g_assert_cmpint(otrv4_user_state_remove_account(state, charlie_account), ==,
+                  1);
+
+  otrv4_assert(!otrv4_user_state_get_private_key_v4(state, alice_account));
+  otrv4_assert(otrv4_user_state_get_private_key_v4(state, bob_account));
+
+  otrv4_user_state_free(state);
+}
+
 /*
  * Create callbacks for testing the callbacks API
  */
@@ -216,3 +216,50 @@ void test_otrv4_destroy() {
   free(otr);
   otrv4_client_state_free(state);
 }
+
+void test_otrv4_shares_user_profile() {
+  otrv4_client_state_t *state = otrv4_client_state_new(NULL);
+  uint8_t sym[ED448_PRIVATE_BYTES] = {1};
+  otrv4_client_state_add_private_key_v4(state, sym);
+
+  otrv4_policy_t policy = {.allows = OTRV4_ALLOW_V4};
+  otrv4_t *alice = otrv4_new(state, policy);
+  otrv4_t *bob = otrv4_new(state, policy);
+
+  const user_profile_t *profile = get_my_user_profile(alice);
+  otrv4_assert(profile);
+  otrv4_assert(get_my_user_profile(bob) == profile);
+  otrv4_assert(state->profile == profile);
+  g_assert_cmpint(profile->refs, ==, 3);
+
+  /* It is far from expiring */
+  otrv4_assert(otrv4_client_state_refresh_user_profile(state) == SUCCESS);
+  otrv4_assert(state->profile == profile);
+
+  /* Nor does a connection take it again */
+  otrv4_assert(refresh_my_user_profile(alice) == profile);
+
+  /* Once it is close, it is signed again. A DAKE in progress keeps the one
+   * it started with, and live connections switch over with their next DAKE */
+  state->profile->expires = time(NULL) + 60;
+  otrv4_assert(otrv4_client_state_refresh_user_profile(state) == SUCCESS);
+  otrv4_assert(state->profile != profile);
+  g_assert_cmpint(profile->refs, ==, 2);
+  otrv4_assert(get_my_user_profile(alice) == profile);
+
+  otrv4_assert(refresh_my_user_profile(alice) == state->profile);
+  otrv4_assert(get_my_user_profile(alice) == state->profile);
+  g_assert_cmpint(profile->refs, ==, 1);
+  otrv4_assert(refresh_my_user_profile(bob) == state->profile);
+  g_assert_cmpint(state->profile->refs, ==, 3);
+
+  otrv4_t *charlie = otrv4_new(state, policy);
+  otrv4_assert(get_my_user_profile(charlie) == state->profile);
+  otrv4_assert(otrv4_user_profile_verify_signature(state->profile) ==
+               otrv4_true);
+
+  otrv4_free(alice);
+  otrv4_free(bob);
+  otrv4_free(charlie);
+  otrv4_client_state_free(state);
+}
@@ -33,6 +33,26 @@ void test_tlv_parse() {
   otrv4_tlv_free(tlv);
 }
 
+void test_tlv_parse_in_arena() {
+  uint8_t msg[11] = {0x00, 0x06, 0x00, 0x03, 0x08, 0x05,
+                     0x09, 0x00, 0x01, 0x00, 0x00};
+  uint8_t data[3] = {0x08, 0x05, 0x09};
+
+  otrv4_arena_t arena[1];
+  otrv4_arena_init(arena);
+
+  tlv_t *tlv = otrv4_parse_tlvs_in(arena, msg, sizeof(msg));
+  assert_tlv_structure(tlv, OTRV4_TLV_SMP_ABORT, sizeof(data), data, true);
+  assert_tlv_structure(tlv->next, OTRV4_TLV_DISCONNECTED, 0, data, false);
+
+  /* The TLVs are wiped with the arena, rather than freed */
+  uint8_t *parsed = tlv->data;
+  otrv4_arena_reset(arena);
+  otrv4_assert_zero(parsed, sizeof(data));
+
+  otrv4_arena_destroy(arena);
+}
+
 void test_otrv4_append_tlv() {
   uint8_t smp2_data[2] = {0x03, 0x04};
   uint8_t smp3_data[3] = {0x05, 0x04, 0x03};
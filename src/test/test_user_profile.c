@@ -4,6 +4,7 @@
 #include <time.h>
 
 #include "../serialize.h"
+#include "../shake.h"
 #include "../user_profile.h"
 
 void test_user_profile_create() {
@@ -188,3 +189,117 @@ void test_otrv4_user_profile_build() {
 
   otrv4_user_profile_free(profile);
 }
+
+void test_user_profile_verify_signature_cached() {
+  otrv4_keypair_t keypair[1];
+  uint8_t sym[ED448_PRIVATE_BYTES] = {1};
+  otrv4_keypair_generate(keypair, sym);
+
+  otrv4_shared_prekey_pair_t shared_prekey[1];
+  otrv4_shared_prekey_pair_generate(shared_prekey, sym);
+
+  user_profile_t *profile =
+      otrv4_user_profile_build("4", keypair, shared_prekey);
+
+  size_t written = 0;
+  uint8_t *serialized = NULL;
+  otrv4_assert(otrv4_user_profile_asprintf(&serialized, &written, profile) ==
+               SUCCESS);
+
+  uint8_t expected[HASH_BYTES], hash[HASH_BYTES];
+  shake_256_hash(expected, HASH_BYTES, serialized, written);
+  otrv4_assert(otrv4_user_profile_hash(hash, profile) == SUCCESS);
+  otrv4_assert_cmpmem(expected, hash, HASH_BYTES);
+
+  /* A received profile keeps the hash of the bytes it was read from */
+  user_profile_t received[1];
+  otrv4_assert(otrv4_user_profile_deserialize(received, serialized, written,
+                                              NULL) == SUCCESS);
+  otrv4_assert(received->serialized);
+  otrv4_assert_cmpmem(expected, received->hash, HASH_BYTES);
+
+  otrv4_user_profile_cache_clear();
+  otrv4_assert(otrv4_user_profile_verify_signature_cached(received) ==
+               otrv4_true);
+  g_assert_cmpint(otrv4_user_profile_cache_len(), ==, 1);
+
+  /* The same profile from another connection is found in the cache */
+  otrv4_assert(otrv4_user_profile_verify_signature_cached(profile) ==
+               otrv4_true);
+  g_assert_cmpint(otrv4_user_profile_cache_len(), ==, 1);
+
+  /* A different signature is a different profile */
+  memset(profile->signature, 0, sizeof(profile->signature));
+  user_profile_forget_serialized(profile);
+  otrv4_assert(otrv4_user_profile_verify_signature_cached(profile) ==
+               otrv4_false);
+  g_assert_cmpint(otrv4_user_profile_cache_len(), ==, 1);
+
+  /* Expired profiles are not remembered */
+  profile->expires = time(NULL) - 1;
+  user_profile_sign(profile, keypair);
+  otrv4_assert(otrv4_user_profile_verify_signature_cached(profile) ==
+               otrv4_true);
+  g_assert_cmpint(otrv4_user_profile_cache_len(), ==, 1);
+
+  otrv4_user_profile_cache_clear();
+  g_assert_cmpint(otrv4_user_profile_cache_len(), ==, 0);
+
+  free(serialized);
+  serialized = NULL;
+  otrv4_user_profile_destroy(received);
+  otrv4_user_profile_free(profile);
+}
+
+void test_user_profile_serialized_once() {
+  otrv4_keypair_t keypair[1];
+  uint8_t sym[ED448_PRIVATE_BYTES] = {1};
+  otrv4_keypair_generate(keypair, sym);
+
+  otrv4_shared_prekey_pair_t shared_prekey[1];
+  otrv4_shared_prekey_pair_generate(shared_prekey, sym);
+
+  user_profile_t *profile =
+      otrv4_user_profile_build("4", keypair, shared_prekey);
+  otrv4_assert(profile->serialized);
+
+  size_t written = 0;
+  uint8_t *expected = NULL;
+  otrv4_assert(otrv4_user_profile_asprintf(&expected, &written, profile) ==
+               SUCCESS);
+
+  const uint8_t *serialized = NULL;
+  size_t len = 0;
+  otrv4_assert(otrv4_user_profile_serialized(&serialized, &len, profile) ==
+               SUCCESS);
+  g_assert_cmpint(len, ==, written);
+  otrv4_assert_cmpmem(expected, serialized, written);
+
+  /* It is built once */
+  const uint8_t *again = NULL;
+  otrv4_assert(otrv4_user_profile_serialized(&again, NULL, profile) ==
+               SUCCESS);
+  otrv4_assert(again == serialized);
+
+  user_profile_t copy[1];
+  otrv4_user_profile_copy(copy, profile);
+  otrv4_assert(copy->serialized != profile->serialized);
+  g_assert_cmpint(copy->serialized_len, ==, written);
+  otrv4_assert_cmpmem(expected, copy->serialized, written);
+  otrv4_assert_cmpmem(profile->hash, copy->hash, HASH_BYTES);
+  otrv4_user_profile_destroy(copy);
+  otrv4_assert(!copy->serialized);
+
+  /* Signing again builds it again */
+  profile->expires++;
+  otrv4_assert(user_profile_sign(profile, keypair) == SUCCESS);
+  otrv4_assert(!profile->serialized);
+  otrv4_assert(otrv4_user_profile_serialized(&serialized, &len, profile) ==
+               SUCCESS);
+  g_assert_cmpint(len, ==, written);
+  otrv4_assert(memcmp(expected, serialized, written) != 0);
+
+  free(expected);
+  expected = NULL;
+  otrv4_user_profile_free(profile);
+}
@@ -0,0 +1,68 @@
+#include <pthread.h>
+
+#include "../workers.h"
+
+typedef struct {
+  pthread_mutex_t lock;
+  int remaining; /* Units of work left */
+  int threads;   /* That took part */
+} counting_job_t;
+
+static void count_down(void *data) {
+  counting_job_t *counter = data;
+  int took_part = 0;
+
+  while (1) {
+    pthread_mutex_lock(&counter->lock);
+    int left = counter->remaining > 0 ? counter->remaining-- : 0;
+    if (left && !took_part)
+      counter->threads++;
+    pthread_mutex_unlock(&counter->lock);
+
+    if (!left)
+      return;
+
+    took_part = 1;
+    g_usleep(1000);
+  }
+}
+
+void test_workers_run() {
+  counting_job_t counter[1];
+  otrv4_workers_job_t job[1] = {{count_down, counter}};
+
+  pthread_mutex_init(&counter->lock, NULL);
+
+  // Without a pool, the calling thread does everything
+  counter->remaining = 20;
+  counter->threads = 0;
+  otrv4_workers_run(job, 4);
+  g_assert_cmpint(counter->remaining, ==, 0);
+  g_assert_cmpint(counter->threads, ==, 1);
+
+  otrv4_assert(otrv4_workers_enable(0) == ERROR);
+  otrv4_assert(otrv4_workers_enable(3) == SUCCESS);
+  otrv4_assert(otrv4_workers_enable(3) == ERROR);
+
+  counter->remaining = 200;
+  counter->threads = 0;
+  otrv4_workers_run(job, 4);
+  g_assert_cmpint(counter->remaining, ==, 0);
+  g_assert_cmpint(counter->threads, >=, 1);
+  g_assert_cmpint(counter->threads, <=, 4);
+
+  // A single thread is asked for
+  counter->remaining = 20;
+  counter->threads = 0;
+  otrv4_workers_run(job, 1);
+  g_assert_cmpint(counter->remaining, ==, 0);
+  g_assert_cmpint(counter->threads, ==, 1);
+
+  otrv4_workers_disable();
+  otrv4_workers_disable();
+
+  otrv4_assert(otrv4_workers_enable(1) == SUCCESS);
+  otrv4_workers_disable();
+
+  pthread_mutex_destroy(&counter->lock);
+}
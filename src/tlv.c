@@ -3,6 +3,7 @@
 
 #define OTRV4_TLV_PRIVATE
 
+#include "alloc.h"
 #include "deserialize.h"
 #include "random.h"
 #include "tlv.h"
@@ -22,7 +23,15 @@ INTERNAL void set_tlv_type(tlv_t *tlv, uint16_t tlv_type) {
   tlv->type = type;
 }
 
-tstatic tlv_t *extract_tlv(const uint8_t *src, size_t len, size_t *written) {
+tstatic void *tlv_alloc(otrv4_arena_t *arena, size_t size) {
+  if (arena)
+    return otrv4_arena_alloc(arena, size);
+
+  return otrv4_alloc(size);
+}
+
+tstatic tlv_t *extract_tlv(otrv4_arena_t *arena, const uint8_t *src,
+                           size_t len, size_t *written) {
   size_t w = 0;
   tlv_t *tlv = NULL;
   uint16_t tlv_type = -1;
@@ -31,7 +40,7 @@ tstatic tlv_t *extract_tlv(const uint8_t *src, size_t len, size_t *written) {
 
   do {
 
-    tlv = malloc(sizeof(tlv_t));
+    tlv = tlv_alloc(arena, sizeof(tlv_t));
     if (!tlv)
       continue;
 
@@ -52,7 +61,7 @@ tstatic tlv_t *extract_tlv(const uint8_t *src, size_t len, size_t *written) {
     if (len < tlv->len)
       continue;
 
-    tlv->data = malloc(tlv->len);
+    tlv->data = tlv_alloc(arena, tlv->len);
     if (!tlv->data)
       continue;
 
@@ -67,7 +76,8 @@ tstatic tlv_t *extract_tlv(const uint8_t *src, size_t len, size_t *written) {
     return tlv;
   } while (0);
 
-  free(tlv);
+  if (!arena)
+    otrv4_dealloc(tlv);
   tlv = NULL;
 
   return NULL;
@@ -89,6 +99,11 @@ INTERNAL tlv_t *otrv4_append_tlv(tlv_t *head, tlv_t *tlv) {
 }
 
 INTERNAL tlv_t *otrv4_parse_tlvs(const uint8_t *src, size_t len) {
+  return otrv4_parse_tlvs_in(NULL, src, len);
+}
+
+INTERNAL tlv_t *otrv4_parse_tlvs_in(otrv4_arena_t *arena, const uint8_t *src,
+                                    size_t len) {
   size_t written = 0;
   tlv_t *tlv = NULL, *ret = NULL;
 
@@ -96,7 +111,7 @@ INTERNAL tlv_t *otrv4_parse_tlvs(const uint8_t *src, size_t len) {
 
   while (data_to_parse > 0) {
 
-    tlv = extract_tlv(src, data_to_parse, &written);
+    tlv = extract_tlv(arena, src, data_to_parse, &written);
     if (!tlv)
       break;
 
@@ -113,9 +128,9 @@ tstatic void tlv_foreach(tlv_t *head) {
   while (current) {
     tlv_t *next = current->next;
 
-    free(current->data);
+    otrv4_dealloc(current->data);
     current->data = NULL;
-    free(current);
+    otrv4_dealloc(current);
 
     current = next;
   }
@@ -124,7 +139,7 @@ tstatic void tlv_foreach(tlv_t *head) {
 INTERNAL void otrv4_tlv_free(tlv_t *tlv) { tlv_foreach(tlv); }
 
 INTERNAL tlv_t *otrv4_tlv_new(uint16_t type, uint16_t len, uint8_t *data) {
-  tlv_t *tlv = malloc(sizeof(tlv_t));
+  tlv_t *tlv = otrv4_alloc(sizeof(tlv_t));
   if (!tlv)
     return NULL;
 
@@ -134,7 +149,7 @@ INTERNAL tlv_t *otrv4_tlv_new(uint16_t type, uint16_t len, uint8_t *data) {
   tlv->data = NULL;
 
   if (len != 0) {
-    tlv->data = malloc(tlv->len);
+    tlv->data = otrv4_alloc(tlv->len);
     if (!tlv->data) {
       otrv4_tlv_free(tlv);
       return NULL;
@@ -145,6 +160,23 @@ INTERNAL tlv_t *otrv4_tlv_new(uint16_t type, uint16_t len, uint8_t *data) {
   return tlv;
 }
 
+INTERNAL tlv_t *otrv4_tlvs_copy(const tlv_t *tlvs) {
+  tlv_t *copy = NULL;
+  const tlv_t *current = tlvs;
+
+  for (; current; current = current->next) {
+    tlv_t *tlv = otrv4_tlv_new(current->type, current->len, current->data);
+    if (!tlv) {
+      otrv4_tlv_free(copy);
+      return NULL;
+    }
+
+    copy = otrv4_append_tlv(copy, tlv);
+  }
+
+  return copy;
+}
+
 INTERNAL tlv_t *otrv4_disconnected_tlv_new(void) {
   return otrv4_tlv_new(OTRV4_TLV_DISCONNECTED, 0, NULL);
 }
@@ -162,16 +194,17 @@ INTERNAL tlv_t *otrv4_padding_tlv_new(size_t len) {
   return tlv;
 }
 
-INTERNAL otrv4_err_t otrv4_append_padding_tlv(tlv_t **tlvs, int message_len) {
+INTERNAL size_t otrv4_padding_len(int message_len) {
   int padding_granularity = 256;
   int header_len = 4;
   int nul_byte_len = 1;
 
-  int padding =
-      padding_granularity -
-      ((message_len + header_len + nul_byte_len) % padding_granularity);
+  return padding_granularity -
+         ((message_len + header_len + nul_byte_len) % padding_granularity);
+}
 
-  tlv_t *padding_tlv = otrv4_padding_tlv_new(padding);
+INTERNAL otrv4_err_t otrv4_append_padding_tlv(tlv_t **tlvs, int message_len) {
+  tlv_t *padding_tlv = otrv4_padding_tlv_new(otrv4_padding_len(message_len));
   if (!padding_tlv)
     return ERROR;
 
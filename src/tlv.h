@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "alloc.h"
 #include "shared.h"
 
 typedef enum {
@@ -29,15 +30,30 @@ INTERNAL void otrv4_tlv_free(tlv_t *tlv);
 
 INTERNAL tlv_t *otrv4_tlv_new(uint16_t type, uint16_t len, uint8_t *data);
 
+/* Copies the TLVs, out of an arena for example */
+INTERNAL tlv_t *otrv4_tlvs_copy(const tlv_t *tlvs);
+
 INTERNAL tlv_t *otrv4_disconnected_tlv_new(void);
 
 INTERNAL tlv_t *otrv4_parse_tlvs(const uint8_t *src, size_t len);
 
+/* Parses the TLVs into arena, which owns them: they must not be freed. */
+INTERNAL tlv_t *otrv4_parse_tlvs_in(otrv4_arena_t *arena, const uint8_t *src,
+                                    size_t len);
+
 INTERNAL tlv_t *otrv4_append_tlv(tlv_t *tlvs, tlv_t *new_tlv);
 
+INTERNAL size_t otrv4_padding_len(int message_len);
+
 INTERNAL otrv4_err_t otrv4_append_padding_tlv(tlv_t **tlvs, int message_len);
 
 #ifdef OTRV4_TLV_PRIVATE
+
+tstatic void *tlv_alloc(otrv4_arena_t *arena, size_t size);
+
+tstatic tlv_t *extract_tlv(otrv4_arena_t *arena, const uint8_t *src,
+                           size_t len, size_t *written);
+
 #endif
 
 #endif
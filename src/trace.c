@@ -0,0 +1,37 @@
+#include "constants.h"
+#include "stats.h"
+#include "trace.h"
+
+INTERNAL void otrv4_trace_emit(const otrv4_tracer_t *tracer,
+                               otrv4_trace_stage_t stage,
+                               otrv4_trace_phase_t phase, size_t bytes,
+                               otrv4_err_t err) {
+  otrv4_trace_event_t event[1];
+
+  event->stage = stage;
+  event->phase = phase;
+  event->ns = otrv4_stats_now();
+  event->bytes = bytes;
+  event->err = err;
+
+  tracer->event(event, tracer->ctx);
+}
+
+INTERNAL otrv4_trace_stage_t otrv4_trace_message_stage(uint8_t type) {
+  switch (type) {
+  case IDENTITY_MSG_TYPE:
+    return OTRV4_TRACE_MSG_IDENTITY;
+  case AUTH_R_MSG_TYPE:
+    return OTRV4_TRACE_MSG_AUTH_R;
+  case AUTH_I_MSG_TYPE:
+    return OTRV4_TRACE_MSG_AUTH_I;
+  case PRE_KEY_MSG_TYPE:
+    return OTRV4_TRACE_MSG_PRE_KEY;
+  case NON_INT_AUTH_MSG_TYPE:
+    return OTRV4_TRACE_MSG_NON_INT_AUTH;
+  case DATA_MSG_TYPE:
+    return OTRV4_TRACE_MSG_DATA;
+  default:
+    return OTRV4_TRACE_MSG_UNKNOWN;
+  }
+}
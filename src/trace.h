@@ -0,0 +1,75 @@
+#ifndef OTRV4_TRACE_H
+#define OTRV4_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "shared.h"
+
+/*
+ * Optional tracing of the stages a received message goes through, and of
+ * the ratchet steps, for applications that feed them to their own tracer as
+ * spans. Every stage is reported when it is entered and when it is left.
+ * When no tracer is set, each event costs a single branch.
+ */
+
+typedef enum {
+  OTRV4_TRACE_MSG_IDENTITY,
+  OTRV4_TRACE_MSG_AUTH_R,
+  OTRV4_TRACE_MSG_AUTH_I,
+  OTRV4_TRACE_MSG_PRE_KEY,
+  OTRV4_TRACE_MSG_NON_INT_AUTH,
+  OTRV4_TRACE_MSG_DATA,
+  OTRV4_TRACE_MSG_UNKNOWN,
+  OTRV4_TRACE_RATCHET_INIT,
+  OTRV4_TRACE_RATCHET_SENDING,
+  OTRV4_TRACE_RATCHET_RECEIVING,
+} otrv4_trace_stage_t;
+
+typedef enum {
+  OTRV4_TRACE_PHASE_ENTER,
+  OTRV4_TRACE_PHASE_LEAVE,
+} otrv4_trace_phase_t;
+
+typedef struct {
+  otrv4_trace_stage_t stage;
+  otrv4_trace_phase_t phase;
+  uint64_t ns; /* Monotonic clock, in nanoseconds */
+
+  /* For messages: the decoded length when entering, and the length of the
+   * reply (if any) when leaving. Zero for ratchet steps. */
+  size_t bytes;
+
+  otrv4_err_t err; /* When leaving */
+} otrv4_trace_event_t;
+
+/* event is called on the thread that processes the message */
+typedef struct otrv4_tracer_t {
+  void (*event)(const otrv4_trace_event_t *event, void *ctx);
+  void *ctx;
+} otrv4_tracer_t;
+
+#define OTRV4_TRACE_ENTER(tracer, stage, bytes)                                \
+  do {                                                                         \
+    if (tracer)                                                                \
+      otrv4_trace_emit((tracer), (stage), OTRV4_TRACE_PHASE_ENTER, (bytes),    \
+                       SUCCESS);                                               \
+  } while (0)
+
+#define OTRV4_TRACE_LEAVE(tracer, stage, bytes, err)                           \
+  do {                                                                         \
+    if (tracer)                                                                \
+      otrv4_trace_emit((tracer), (stage), OTRV4_TRACE_PHASE_LEAVE, (bytes),    \
+                       (err));                                                 \
+  } while (0)
+
+INTERNAL void otrv4_trace_emit(const otrv4_tracer_t *tracer,
+                               otrv4_trace_stage_t stage,
+                               otrv4_trace_phase_t phase, size_t bytes,
+                               otrv4_err_t err);
+
+/* Maps the type in the header of a message to its stage */
+INTERNAL otrv4_trace_stage_t otrv4_trace_message_stage(uint8_t type);
+
+#endif
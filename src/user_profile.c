@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <sodium.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,9 +8,81 @@
 #define OTRV4_DESERIALIZE_PRIVATE
 
 #include "deserialize.h"
+#include "hashtable.h"
 #include "serialize.h"
+#include "shake.h"
 #include "user_profile.h"
 
+tstatic size_t profile_cache_hash(const void *key) {
+  /* The key is already a hash */
+  size_t hash;
+  memcpy(&hash, key, sizeof(size_t));
+  return hash;
+}
+
+tstatic int profile_cache_eq(const void *a, const void *b) {
+  return memcmp(a, b, HASH_BYTES) == 0;
+}
+
+/* Verified profiles by the hash of their serialization. Entries are also
+ * kept in a list from the most (head) to the least (tail) recently used. */
+static otrv4_hashtable_t profile_cache[1] = {
+    {NULL, 0, 0, profile_cache_hash, profile_cache_eq}};
+static profile_cache_entry_t *profile_cache_head = NULL;
+static profile_cache_entry_t *profile_cache_tail = NULL;
+static pthread_mutex_t profile_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+tstatic void profile_cache_unlink(profile_cache_entry_t *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    profile_cache_head = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    profile_cache_tail = entry->prev;
+
+  entry->prev = entry->next = NULL;
+}
+
+tstatic void profile_cache_push(profile_cache_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = profile_cache_head;
+  if (profile_cache_head)
+    profile_cache_head->prev = entry;
+  else
+    profile_cache_tail = entry;
+
+  profile_cache_head = entry;
+}
+
+tstatic void profile_cache_drop(profile_cache_entry_t *entry) {
+  profile_cache_unlink(entry);
+  otrv4_hashtable_remove(profile_cache, entry->hash);
+  free(entry);
+}
+
+tstatic void user_profile_forget_serialized(user_profile_t *profile) {
+  free(profile->serialized);
+  profile->serialized = NULL;
+  profile->serialized_len = 0;
+}
+
+tstatic otrv4_err_t user_profile_serialize_once(user_profile_t *profile) {
+  if (profile->serialized)
+    return SUCCESS;
+
+  if (otrv4_user_profile_asprintf(&profile->serialized,
+                                  &profile->serialized_len, profile))
+    return ERROR;
+
+  shake_256_hash(profile->hash, HASH_BYTES, profile->serialized,
+                 profile->serialized_len);
+
+  return SUCCESS;
+}
+
 tstatic user_profile_t *user_profile_new(const string_t versions) {
   if (!versions)
     return NULL;
@@ -24,6 +97,9 @@ tstatic user_profile_t *user_profile_new(const string_t versions) {
   otrv4_ec_bzero(profile->shared_prekey, ED448_POINT_BYTES);
   memset(profile->signature, 0, sizeof(profile->signature));
   otrv4_mpi_init(profile->transitional_signature);
+  profile->serialized = NULL;
+  profile->serialized_len = 0;
+  profile->refs = 1;
 
   return profile;
 }
@@ -41,6 +117,21 @@ INTERNAL void otrv4_user_profile_copy(user_profile_t *dst,
 
   memcpy(dst->signature, src->signature, sizeof(eddsa_signature_t));
   otrv4_mpi_copy(dst->transitional_signature, src->transitional_signature);
+
+  dst->refs = 1;
+  dst->serialized = NULL;
+  dst->serialized_len = 0;
+  if (!src->serialized)
+    return;
+
+  /* If it fails, the copy serializes itself when needed */
+  dst->serialized = malloc(src->serialized_len);
+  if (!dst->serialized)
+    return;
+
+  memcpy(dst->serialized, src->serialized, src->serialized_len);
+  dst->serialized_len = src->serialized_len;
+  memcpy(dst->hash, src->hash, HASH_BYTES);
 }
 
 INTERNAL void otrv4_user_profile_destroy(user_profile_t *profile) {
@@ -53,6 +144,7 @@ INTERNAL void otrv4_user_profile_destroy(user_profile_t *profile) {
   sodium_memzero(profile->signature, ED448_SIGNATURE_BYTES);
   otrv4_ec_point_destroy(profile->shared_prekey);
   otrv4_mpi_free(profile->transitional_signature);
+  user_profile_forget_serialized(profile);
 }
 
 INTERNAL void otrv4_user_profile_free(user_profile_t *profile) {
@@ -61,6 +153,21 @@ INTERNAL void otrv4_user_profile_free(user_profile_t *profile) {
   profile = NULL;
 }
 
+INTERNAL user_profile_t *otrv4_user_profile_ref(user_profile_t *profile) {
+  if (profile)
+    __atomic_add_fetch(&profile->refs, 1, __ATOMIC_RELAXED);
+
+  return profile;
+}
+
+INTERNAL void otrv4_user_profile_unref(user_profile_t *profile) {
+  if (!profile)
+    return;
+
+  if (__atomic_sub_fetch(&profile->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    otrv4_user_profile_free(profile);
+}
+
 tstatic int user_profile_body_serialize(uint8_t *dst,
                                         const user_profile_t *profile) {
   uint8_t *target = dst;
@@ -139,6 +246,10 @@ INTERNAL otrv4_err_t otrv4_user_profile_deserialize(user_profile_t *target,
   if (!target)
     return ERROR;
 
+  target->serialized = NULL;
+  target->serialized_len = 0;
+  target->refs = 1;
+
   otrv4_err_t ok = ERROR;
   do {
     if (otrv4_deserialize_otrv4_public_key(target->pub_key, buffer, buflen,
@@ -179,6 +290,15 @@ INTERNAL otrv4_err_t otrv4_user_profile_deserialize(user_profile_t *target,
 
     walked += read;
 
+    /* These are the bytes the peer signed and hashed, so they are kept */
+    target->serialized = malloc(walked);
+    if (!target->serialized)
+      continue;
+
+    memcpy(target->serialized, buffer, walked);
+    target->serialized_len = walked;
+    shake_256_hash(target->hash, HASH_BYTES, buffer, walked);
+
     ok = SUCCESS;
   } while (0);
 
@@ -194,6 +314,7 @@ tstatic otrv4_err_t user_profile_sign(user_profile_t *profile,
   size_t bodylen = 0;
 
   otrv4_ec_point_copy(profile->pub_key, keypair->pub);
+  user_profile_forget_serialized(profile);
   if (user_profile_body_asprintf(&body, &bodylen, profile))
     return ERROR;
 
@@ -237,6 +358,97 @@ otrv4_user_profile_verify_signature(const user_profile_t *profile) {
   return valid;
 }
 
+INTERNAL otrv4_err_t otrv4_user_profile_serialized(
+    const uint8_t **dst, size_t *nbytes, const user_profile_t *profile) {
+  /* Only the cached serialization changes, not the profile */
+  if (user_profile_serialize_once((user_profile_t *)profile))
+    return ERROR;
+
+  *dst = profile->serialized;
+  if (nbytes)
+    *nbytes = profile->serialized_len;
+
+  return SUCCESS;
+}
+
+INTERNAL otrv4_err_t otrv4_user_profile_hash(uint8_t dst[HASH_BYTES],
+                                             const user_profile_t *profile) {
+  if (user_profile_serialize_once((user_profile_t *)profile))
+    return ERROR;
+
+  memcpy(dst, profile->hash, HASH_BYTES);
+  return SUCCESS;
+}
+
+INTERNAL otrv4_bool_t
+otrv4_user_profile_verify_signature_cached(const user_profile_t *profile) {
+  uint8_t hash[HASH_BYTES];
+  if (otrv4_user_profile_hash(hash, profile))
+    return otrv4_false;
+
+  /* The hash covers the whole profile, signature included, so a hit means
+   * these exact bytes were verified before */
+  uint64_t now = time(NULL);
+  pthread_mutex_lock(&profile_cache_lock);
+  profile_cache_entry_t *entry = otrv4_hashtable_get(profile_cache, hash);
+  if (entry && entry->expires > now) {
+    profile_cache_unlink(entry);
+    profile_cache_push(entry);
+    pthread_mutex_unlock(&profile_cache_lock);
+    return otrv4_true;
+  }
+
+  if (entry)
+    profile_cache_drop(entry);
+  pthread_mutex_unlock(&profile_cache_lock);
+
+  if (otrv4_user_profile_verify_signature(profile) == otrv4_false)
+    return otrv4_false;
+
+  /* Expired profiles are not worth remembering */
+  if (profile->expires <= now)
+    return otrv4_true;
+
+  entry = malloc(sizeof(profile_cache_entry_t));
+  if (!entry)
+    return otrv4_true;
+
+  memcpy(entry->hash, hash, HASH_BYTES);
+  entry->expires = profile->expires;
+
+  pthread_mutex_lock(&profile_cache_lock);
+  /* Another thread may have verified it meanwhile */
+  if (otrv4_hashtable_get(profile_cache, hash)) {
+    free(entry);
+  } else {
+    if (profile_cache->len >= OTRV4_PROFILE_CACHE_SIZE)
+      profile_cache_drop(profile_cache_tail);
+
+    if (otrv4_hashtable_put(profile_cache, entry->hash, entry))
+      free(entry);
+    else
+      profile_cache_push(entry);
+  }
+  pthread_mutex_unlock(&profile_cache_lock);
+
+  return otrv4_true;
+}
+
+INTERNAL void otrv4_user_profile_cache_clear(void) {
+  pthread_mutex_lock(&profile_cache_lock);
+  otrv4_hashtable_destroy(profile_cache, free);
+  profile_cache_head = profile_cache_tail = NULL;
+  pthread_mutex_unlock(&profile_cache_lock);
+}
+
+INTERNAL size_t otrv4_user_profile_cache_len(void) {
+  pthread_mutex_lock(&profile_cache_lock);
+  size_t len = profile_cache->len;
+  pthread_mutex_unlock(&profile_cache_lock);
+
+  return len;
+}
+
 INTERNAL user_profile_t *
 otrv4_user_profile_build(const string_t versions, otrv4_keypair_t *keypair,
                          otrv4_shared_prekey_pair_t *shared_prekey_pair) {
@@ -251,7 +463,8 @@ otrv4_user_profile_build(const string_t versions, otrv4_keypair_t *keypair,
   memcpy(profile->shared_prekey, shared_prekey_pair->pub,
          sizeof(otrv4_shared_prekey_pub_t));
 
-  if (user_profile_sign(profile, keypair)) {
+  if (user_profile_sign(profile, keypair) ||
+      user_profile_serialize_once(profile)) {
     otrv4_user_profile_free(profile);
     return NULL;
   }
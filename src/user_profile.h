@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+#include "constants.h"
 #include "keys.h"
 #include "mpi.h"
 #include "shared.h"
@@ -15,11 +16,58 @@ typedef struct {
   otrv4_shared_prekey_pub_t shared_prekey;
   eddsa_signature_t signature;
   otrv4_mpi_t transitional_signature; // TODO: this should be a signature type
+
+  /* The serialization this profile was signed with or read from, and its
+   * hash. See otrv4_user_profile_serialized() */
+  uint8_t *serialized;
+  size_t serialized_len;
+  uint8_t hash[HASH_BYTES];
+
+  /* References to a profile that is shared, see otrv4_user_profile_ref() */
+  int refs;
 } user_profile_t;
 
+typedef struct profile_cache_entry_s {
+  uint8_t hash[HASH_BYTES];
+  uint64_t expires;
+  struct profile_cache_entry_s *prev, *next;
+} profile_cache_entry_t;
+
+/* How many verified profiles are remembered, see
+ * otrv4_user_profile_verify_signature_cached() */
+#ifndef OTRV4_PROFILE_CACHE_SIZE
+#define OTRV4_PROFILE_CACHE_SIZE 256
+#endif
+
 INTERNAL otrv4_bool_t
 otrv4_user_profile_verify_signature(const user_profile_t *profile);
 
+/*
+ * Like otrv4_user_profile_verify_signature(), but remembers which profiles
+ * were valid (until they expire) by the hash of their serialization, so
+ * a peer that comes back with the same profile is not verified again.
+ */
+INTERNAL otrv4_bool_t
+otrv4_user_profile_verify_signature_cached(const user_profile_t *profile);
+
+INTERNAL void otrv4_user_profile_cache_clear(void);
+
+INTERNAL size_t otrv4_user_profile_cache_len(void);
+
+/*
+ * The serialized profile, built once and kept until it is signed again, so
+ * messages embed it with a copy. A profile changed by hand must be signed
+ * again. The first call may build it, so a profile is serialized before
+ * being used from several threads.
+ */
+INTERNAL otrv4_err_t
+otrv4_user_profile_serialized(const uint8_t **dst, size_t *nbytes,
+                              const user_profile_t *profile);
+
+/* Hash of the serialized profile, as used to authenticate the DAKE */
+INTERNAL otrv4_err_t otrv4_user_profile_hash(uint8_t dst[HASH_BYTES],
+                                             const user_profile_t *profile);
+
 INTERNAL void otrv4_user_profile_copy(user_profile_t *dst,
                                       const user_profile_t *src);
 
@@ -27,6 +75,13 @@ INTERNAL void otrv4_user_profile_destroy(user_profile_t *profile);
 
 INTERNAL void otrv4_user_profile_free(user_profile_t *profile);
 
+/* Takes one more reference to a profile from user_profile_new() or
+ * otrv4_user_profile_build(). Returns the profile. */
+INTERNAL user_profile_t *otrv4_user_profile_ref(user_profile_t *profile);
+
+/* Drops a reference, and frees the profile with the last one */
+INTERNAL void otrv4_user_profile_unref(user_profile_t *profile);
+
 INTERNAL otrv4_err_t otrv4_user_profile_deserialize(user_profile_t *target,
                                                     const uint8_t *buffer,
                                                     size_t buflen,
@@ -49,6 +104,20 @@ tstatic otrv4_err_t user_profile_sign(user_profile_t *profile,
 tstatic otrv4_err_t user_profile_body_asprintf(uint8_t **dst, size_t *nbytes,
                                                const user_profile_t *profile);
 
+tstatic void user_profile_forget_serialized(user_profile_t *profile);
+
+tstatic otrv4_err_t user_profile_serialize_once(user_profile_t *profile);
+
+tstatic size_t profile_cache_hash(const void *key);
+
+tstatic int profile_cache_eq(const void *a, const void *b);
+
+tstatic void profile_cache_unlink(profile_cache_entry_t *entry);
+
+tstatic void profile_cache_push(profile_cache_entry_t *entry);
+
+tstatic void profile_cache_drop(profile_cache_entry_t *entry);
+
 #endif
 
 #endif
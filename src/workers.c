@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#define OTRV4_WORKERS_PRIVATE
+
+#include "workers.h"
+
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *workers_threads = NULL;
+static unsigned int workers_len = 0;
+static int workers_stopping = 0;
+
+/* Jobs that still want threads, oldest first */
+static otrv4_workers_job_t *workers_queue = NULL;
+
+static void workers_enqueue(otrv4_workers_job_t *job) {
+  otrv4_workers_job_t **last = &workers_queue;
+  while (*last)
+    last = &(*last)->next;
+
+  job->next = NULL;
+  *last = job;
+}
+
+static void workers_dequeue(otrv4_workers_job_t *job) {
+  otrv4_workers_job_t **it = &workers_queue;
+  while (*it && *it != job)
+    it = &(*it)->next;
+
+  if (*it)
+    *it = job->next;
+
+  job->next = NULL;
+}
+
+tstatic void *workers_thread(void *data) {
+  (void)data;
+
+  pthread_mutex_lock(&workers_lock);
+  while (!workers_stopping) {
+    otrv4_workers_job_t *job = workers_queue;
+    if (!job) {
+      pthread_cond_wait(&workers_queued, &workers_lock);
+      continue;
+    }
+
+    if (--job->wanted == 0)
+      workers_dequeue(job);
+    job->running++;
+    pthread_mutex_unlock(&workers_lock);
+
+    job->run(job->data);
+
+    pthread_mutex_lock(&workers_lock);
+    job->running--;
+    pthread_cond_broadcast(&workers_done);
+  }
+  pthread_mutex_unlock(&workers_lock);
+
+  return NULL;
+}
+
+API otrv4_err_t otrv4_workers_enable(unsigned int threads) {
+  pthread_t *started = NULL;
+  unsigned int i;
+
+  if (!threads)
+    return ERROR;
+
+  started = malloc(threads * sizeof(pthread_t));
+  if (!started)
+    return ERROR;
+
+  pthread_mutex_lock(&workers_lock);
+  if (workers_threads) {
+    pthread_mutex_unlock(&workers_lock);
+    free(started);
+    return ERROR;
+  }
+
+  workers_threads = started;
+  workers_stopping = 0;
+  for (i = 0; i < threads; i++)
+    if (pthread_create(&started[i], NULL, workers_thread, NULL))
+      break;
+  workers_len = i;
+  pthread_mutex_unlock(&workers_lock);
+
+  if (i < threads) {
+    otrv4_workers_disable();
+    return ERROR;
+  }
+
+  return SUCCESS;
+}
+
+API void otrv4_workers_disable(void) {
+  pthread_t *threads = NULL;
+  unsigned int i, len = 0;
+
+  pthread_mutex_lock(&workers_lock);
+  if (!workers_threads || workers_stopping) {
+    pthread_mutex_unlock(&workers_lock);
+    return;
+  }
+
+  /* Threads finish the job they are running, but take no other */
+  workers_stopping = 1;
+  pthread_cond_broadcast(&workers_queued);
+  threads = workers_threads;
+  len = workers_len;
+  pthread_mutex_unlock(&workers_lock);
+
+  for (i = 0; i < len; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_lock(&workers_lock);
+  workers_threads = NULL;
+  workers_len = 0;
+  workers_stopping = 0;
+  pthread_mutex_unlock(&workers_lock);
+
+  free(threads);
+}
+
+INTERNAL void otrv4_workers_run(otrv4_workers_job_t *job,
+                                unsigned int threads) {
+  job->wanted = 0;
+  job->running = 0;
+  job->next = NULL;
+
+  pthread_mutex_lock(&workers_lock);
+  if (threads > 1 && workers_threads && !workers_stopping) {
+    job->wanted = threads - 1 < workers_len ? threads - 1 : workers_len;
+    workers_enqueue(job);
+    pthread_cond_broadcast(&workers_queued);
+  }
+  pthread_mutex_unlock(&workers_lock);
+
+  job->run(job->data);
+
+  /* Threads that did not take the job yet are not needed anymore */
+  pthread_mutex_lock(&workers_lock);
+  if (job->wanted)
+    workers_dequeue(job);
+  job->wanted = 0;
+
+  while (job->running)
+    pthread_cond_wait(&workers_done, &workers_lock);
+  pthread_mutex_unlock(&workers_lock);
+}
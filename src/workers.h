@@ -0,0 +1,38 @@
+#ifndef OTRV4_WORKERS_H
+#define OTRV4_WORKERS_H
+
+#include "error.h"
+#include "include/libotrv4.h"
+#include "shared.h"
+
+/* The pool itself, otrv4_workers_enable() and otrv4_workers_disable(), are
+ * described in include/libotrv4.h */
+
+/*
+ * Work that can be shared by several threads. run() is called by each of
+ * them with data, and must return once there is nothing left to do.
+ */
+typedef struct otrv4_workers_job_t {
+  void (*run)(void *data);
+  void *data;
+
+  /* Owned by the pool */
+  unsigned int wanted;  /* Threads of the pool still wanted */
+  unsigned int running; /* Threads of the pool working on it */
+  struct otrv4_workers_job_t *next;
+} otrv4_workers_job_t;
+
+/*
+ * Runs the job on the calling thread and on up to threads - 1 threads of the
+ * pool that are idle, and returns once all of them are done with it. Without
+ * a pool, only the calling thread runs it.
+ */
+INTERNAL void otrv4_workers_run(otrv4_workers_job_t *job, unsigned int threads);
+
+#ifdef OTRV4_WORKERS_PRIVATE
+
+tstatic void *workers_thread(void *data);
+
+#endif
+
+#endif